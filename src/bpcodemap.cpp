@@ -0,0 +1,146 @@
+#include "bpcodemap.h"
+#include "bpsymtable.h"
+
+#include <algorithm>
+#include <string.h>
+
+// Largest bitmap, in bits; 1MB of memory
+static const uint64_t kMaxGranules = uint64_t(1) << 23;
+// Smallest granule, a page
+static const unsigned int kMinGranuleShift = 12;
+// Intervals closer than this are merged. The padding between functions
+// never holds a return address, so this costs no precision in practice and
+// keeps the intervals of large modules down.
+static const uint64_t kMergeGap = 64;
+
+BpCodeMap::BpCodeMap()
+  : mLow(0)
+  , mNumGranules(0)
+  , mGranuleShift(kMinGranuleShift)
+{
+}
+
+void
+BpCodeMap::AddModule(uint64_t aBase, uint64_t aSize,
+                     const BpSymbolTable* aTable)
+{
+  if (!aTable) {
+    mStarts.push_back(aBase);
+    mEnds.push_back(aBase + aSize);
+    return;
+  }
+
+  // PUBLIC records have no size; like FindSymbol, let them run up to the
+  // next symbol, or to the end of the module.
+  const BpArray<uint32_t>& rvas = aTable->SymbolRvas();
+  const BpArray<uint32_t>& sizes = aTable->SymbolSizes();
+  for (size_t i = 0; i < rvas.size(); ++i) {
+    uint64_t end = sizes[i] ? uint64_t(rvas[i]) + sizes[i] :
+                   i + 1 < rvas.size() ? rvas[i + 1] : aSize;
+    if (end > rvas[i]) {
+      mStarts.push_back(aBase + rvas[i]);
+      mEnds.push_back(aBase + end);
+    }
+  }
+}
+
+void
+BpCodeMap::Finish()
+{
+  std::vector<size_t> order(mStarts.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [this](size_t aLeft, size_t aRight) {
+    return mStarts[aLeft] < mStarts[aRight];
+  });
+
+  std::vector<uint64_t> starts, ends;
+  starts.reserve(order.size());
+  ends.reserve(order.size());
+  for (size_t i : order) {
+    if (!starts.empty() && mStarts[i] <= ends.back() + kMergeGap) {
+      ends.back() = std::max(ends.back(), mEnds[i]);
+      continue;
+    }
+    starts.push_back(mStarts[i]);
+    ends.push_back(mEnds[i]);
+  }
+  starts.shrink_to_fit();
+  ends.shrink_to_fit();
+  mStarts.swap(starts);
+  mEnds.swap(ends);
+
+  mBitmap.clear();
+  mNumGranules = 0;
+  if (mStarts.empty()) {
+    return;
+  }
+
+  // Pick the smallest granule that keeps the bitmap within bounds
+  mLow = mStarts.front();
+  const uint64_t span = mEnds.back() - mLow;
+  mGranuleShift = kMinGranuleShift;
+  while ((span >> mGranuleShift) >= kMaxGranules) {
+    ++mGranuleShift;
+  }
+  mNumGranules = (span >> mGranuleShift) + 1;
+  mBitmap.assign((mNumGranules + 63) / 64, 0);
+  for (size_t i = 0; i < mStarts.size(); ++i) {
+    const uint64_t first = (mStarts[i] - mLow) >> mGranuleShift;
+    const uint64_t last = (mEnds[i] - 1 - mLow) >> mGranuleShift;
+    for (uint64_t granule = first; granule <= last; ++granule) {
+      mBitmap[granule / 64] |= uint64_t(1) << (granule % 64);
+    }
+  }
+}
+
+bool
+BpCodeMap::FindInterval(uint64_t aAddress) const
+{
+  auto itr = std::upper_bound(mStarts.begin(), mStarts.end(), aAddress);
+  if (itr == mStarts.begin()) {
+    return false;
+  }
+  return aAddress < mEnds[itr - mStarts.begin() - 1];
+}
+
+size_t
+BpCodeMap::HeapSize() const
+{
+  return (mStarts.capacity() + mEnds.capacity() + mBitmap.capacity()) *
+         sizeof(uint64_t);
+}
+
+template <typename PointerT>
+static void
+ScanSlots(const BpCodeMap& aCodeMap, const uint8_t* aStack, size_t aSize,
+          uint64_t aStackAddress, std::vector<uint64_t>& aSlots,
+          std::vector<uint64_t>& aValues)
+{
+  // Slots are aligned in the target, not necessarily in aStack
+  size_t offset = (sizeof(PointerT) - aStackAddress % sizeof(PointerT)) %
+                  sizeof(PointerT);
+  for (; offset + sizeof(PointerT) <= aSize; offset += sizeof(PointerT)) {
+    PointerT value;
+    memcpy(&value, aStack + offset, sizeof(value));
+    if (aCodeMap.Contains(value)) {
+      aSlots.push_back(aStackAddress + offset);
+      aValues.push_back(value);
+    }
+  }
+}
+
+void
+BpScanStack(const BpCodeMap& aCodeMap, const uint8_t* aStack, size_t aSize,
+            uint64_t aStackAddress, size_t aPointerSize,
+            std::vector<uint64_t>& aSlots, std::vector<uint64_t>& aValues)
+{
+  if (aPointerSize == 8) {
+    ScanSlots<uint64_t>(aCodeMap, aStack, aSize, aStackAddress, aSlots,
+                        aValues);
+  } else {
+    ScanSlots<uint32_t>(aCodeMap, aStack, aSize, aStackAddress, aSlots,
+                        aValues);
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef __BPCODEMAP_H
+#define __BPCODEMAP_H
+
+// Set of the code addresses of a process, for telling return addresses apart
+// from other values on the stack. Platform-neutral.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class BpSymbolTable;
+
+/**
+ * The address ranges of a process that hold code, as sorted, disjoint
+ * intervals. A bitmap with one bit per granule of the span of all intervals
+ * sits in front of them: most values on a stack are not code addresses and
+ * are rejected by a single bit test, and only the rest are looked up in the
+ * intervals.
+ */
+class BpCodeMap
+{
+public:
+  BpCodeMap();
+
+  // Adds the functions of aTable, the symbols of a module of aSize bytes
+  // loaded at aBase. If aTable is null the whole module counts as code.
+  void AddModule(uint64_t aBase, uint64_t aSize, const BpSymbolTable* aTable);
+  // Merges the intervals and builds the bitmap. Must be called after the
+  // last AddModule and before the first Contains.
+  void Finish();
+
+  bool Contains(uint64_t aAddress) const
+  {
+    const uint64_t granule = (aAddress - mLow) >> mGranuleShift;
+    if (granule >= mNumGranules ||
+        !((mBitmap[granule / 64] >> (granule % 64)) & 1)) {
+      return false;
+    }
+    return FindInterval(aAddress);
+  }
+
+  size_t NumIntervals() const { return mStarts.size(); }
+  size_t HeapSize() const;
+
+private:
+  bool FindInterval(uint64_t aAddress) const;
+
+  // [mStarts[i], mEnds[i])
+  std::vector<uint64_t> mStarts;
+  std::vector<uint64_t> mEnds;
+  std::vector<uint64_t> mBitmap;
+  uint64_t              mLow;
+  uint64_t              mNumGranules;
+  unsigned int          mGranuleShift;
+};
+
+/**
+ * Scans the aSize bytes at aStack, a copy of the stack memory at
+ * aStackAddress, for pointer-sized, aligned values that point into code.
+ * Appends the address of each such slot to aSlots and its value to aValues,
+ * from the lowest address up.
+ */
+void
+BpScanStack(const BpCodeMap& aCodeMap, const uint8_t* aStack, size_t aSize,
+            uint64_t aStackAddress, size_t aPointerSize,
+            std::vector<uint64_t>& aSlots, std::vector<uint64_t>& aValues);
+
+#endif // __BPCODEMAP_H
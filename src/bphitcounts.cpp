@@ -0,0 +1,108 @@
+#include "bphitcounts.h"
+
+#include <algorithm>
+#include <map>
+
+void
+BpHitCounts::Track(uint32_t aId, uint64_t aAddress)
+{
+  if (aId >= mCounters.size()) {
+    mCounters.resize(size_t(aId) + 1);
+  }
+  Counter& counter = mCounters[aId];
+  counter = Counter();
+  counter.mTracked = true;
+  counter.mAddress = aAddress;
+}
+
+void
+BpHitCounts::Untrack(uint32_t aId)
+{
+  if (aId < mCounters.size()) {
+    mCounters[aId] = Counter();
+  }
+}
+
+void
+BpHitCounts::ResetCounts()
+{
+  for (auto&& counter : mCounters) {
+    counter.mHits = 0;
+    counter.mCallers.clear();
+  }
+}
+
+size_t
+BpHitCounts::NumTracked() const
+{
+  return std::count_if(mCounters.begin(), mCounters.end(),
+                       [](const Counter& aCounter) {
+    return aCounter.mTracked;
+  });
+}
+
+void
+BpHitCounts::AddCallerSample(uint32_t aId, uint64_t aCaller)
+{
+  if (aId < mCounters.size() && mCounters[aId].mTracked) {
+    ++mCounters[aId].mCallers[aCaller];
+  }
+}
+
+void
+BpHitCounts::GetTop(size_t aCount, size_t aNumCallers,
+                    std::vector<Summary>& aTop) const
+{
+  // Ordered maps keep the output the same from run to run
+  std::map<uint64_t, Summary> byAddress;
+  std::map<uint64_t, std::map<uint64_t, uint64_t>> callers;
+  for (auto&& counter : mCounters) {
+    if (!counter.mTracked || !counter.mHits) {
+      continue;
+    }
+    Summary& summary = byAddress[counter.mAddress];
+    summary.mAddress = counter.mAddress;
+    summary.mHits += counter.mHits;
+    for (auto&& caller : counter.mCallers) {
+      callers[counter.mAddress][caller.first] += caller.second;
+    }
+  }
+
+  aTop.clear();
+  for (auto&& entry : byAddress) {
+    aTop.push_back(std::move(entry.second));
+  }
+  std::stable_sort(aTop.begin(), aTop.end(),
+                   [](const Summary& aLeft, const Summary& aRight) {
+    return aLeft.mHits > aRight.mHits;
+  });
+  if (aTop.size() > aCount) {
+    aTop.resize(aCount);
+  }
+
+  for (auto&& summary : aTop) {
+    auto itr = callers.find(summary.mAddress);
+    if (itr == callers.end()) {
+      continue;
+    }
+    summary.mCallers.assign(itr->second.begin(), itr->second.end());
+    std::stable_sort(summary.mCallers.begin(), summary.mCallers.end(),
+                     [](const std::pair<uint64_t, uint64_t>& aLeft,
+                        const std::pair<uint64_t, uint64_t>& aRight) {
+      return aLeft.second > aRight.second;
+    });
+    if (summary.mCallers.size() > aNumCallers) {
+      summary.mCallers.resize(aNumCallers);
+    }
+  }
+}
+
+uint64_t
+BpHitCounts::TotalHits() const
+{
+  uint64_t total = 0;
+  for (auto&& counter : mCounters) {
+    total += counter.mTracked ? counter.mHits : 0;
+  }
+  return total;
+}
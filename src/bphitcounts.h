@@ -0,0 +1,104 @@
+#ifndef __BPHITCOUNTS_H
+#define __BPHITCOUNTS_H
+
+// Hit counts of breakpoints that count rather than stop. Platform-neutral.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Hit counters for breakpoints, indexed directly by the engine's breakpoint
+ * ids, which are small and handed out in increasing order. Recording a hit is
+ * an array access and an increment. Breakpoint events and extension commands
+ * both run on the engine thread, so nothing here needs a lock.
+ *
+ * Optionally every aInterval-th hit of each breakpoint also samples the
+ * address that the function was called from.
+ */
+class BpHitCounts
+{
+public:
+  struct Summary
+  {
+    uint64_t mAddress;
+    uint64_t mHits;
+    // Sampled callers, most frequent first, as (address, samples)
+    std::vector<std::pair<uint64_t, uint64_t>> mCallers;
+  };
+
+  BpHitCounts()
+    : mSampleInterval(0)
+  {
+  }
+
+  // 0 turns caller sampling off
+  void SetSampleInterval(uint32_t aInterval) { mSampleInterval = aInterval; }
+  uint32_t SampleInterval() const { return mSampleInterval; }
+
+  // Starts counting the hits of breakpoint aId, which is at aAddress.
+  void Track(uint32_t aId, uint64_t aAddress);
+  // Stops counting breakpoint aId and forgets its hits, as when it has been
+  // cleared.
+  void Untrack(uint32_t aId);
+  void ResetCounts();
+  size_t NumTracked() const;
+
+  // Calls aFn(id, address) for every tracked breakpoint, in order of id.
+  template <typename Fn>
+  void ForEachTracked(Fn aFn) const
+  {
+    for (size_t i = 0; i < mCounters.size(); ++i) {
+      if (mCounters[i].mTracked) {
+        aFn(uint32_t(i), mCounters[i].mAddress);
+      }
+    }
+  }
+
+  // Records a hit of breakpoint aId at aAddress. Returns false if aId isn't
+  // tracked, or now belongs to a breakpoint elsewhere because the engine
+  // reused the id of a cleared one. Callers must tell a reused id at the
+  // same address apart themselves. Otherwise sets aSampleCaller when the
+  // caller of this hit should be passed to AddCallerSample.
+  bool Hit(uint32_t aId, uint64_t aAddress, bool& aSampleCaller)
+  {
+    if (aId >= mCounters.size() || !mCounters[aId].mTracked ||
+        mCounters[aId].mAddress != aAddress) {
+      return false;
+    }
+    Counter& counter = mCounters[aId];
+    ++counter.mHits;
+    aSampleCaller = mSampleInterval &&
+                    counter.mHits % mSampleInterval == 1 % mSampleInterval;
+    return true;
+  }
+  void AddCallerSample(uint32_t aId, uint64_t aCaller);
+
+  // Stores the aCount addresses with the most hits in aTop, most hits first,
+  // with up to aNumCallers callers each. Breakpoints at the same address are
+  // counted together.
+  void GetTop(size_t aCount, size_t aNumCallers,
+              std::vector<Summary>& aTop) const;
+  uint64_t TotalHits() const;
+
+private:
+  struct Counter
+  {
+    Counter()
+      : mTracked(false)
+      , mAddress(0)
+      , mHits(0)
+    {
+    }
+    bool                                   mTracked;
+    uint64_t                               mAddress;
+    uint64_t                               mHits;
+    std::unordered_map<uint64_t, uint64_t> mCallers;
+  };
+
+  std::vector<Counter> mCounters;
+  uint32_t             mSampleInterval;
+};
+
+#endif // __BPHITCOUNTS_H
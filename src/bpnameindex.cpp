@@ -0,0 +1,615 @@
+#include "bpnameindex.h"
+#include "bpsymtable.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+static inline unsigned char
+FoldCase(char aChar)
+{
+  unsigned char c = static_cast<unsigned char>(aChar);
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Compares at most aLength characters of aName with aFolded, which must
+// already be lowercased, the way strncmp would after lowercasing both.
+static int
+CompareFolded(const char* aName, const char* aFolded, size_t aLength)
+{
+  for (size_t i = 0; i < aLength; ++i) {
+    unsigned char left = FoldCase(aName[i]);
+    unsigned char right = static_cast<unsigned char>(aFolded[i]);
+    if (left != right || !left) {
+      return int(left) - int(right);
+    }
+  }
+  return 0;
+}
+
+static bool
+LessFolded(const char* aLeft, const char* aRight)
+{
+  for (;; ++aLeft, ++aRight) {
+    // Names mostly differ late, after long runs of identical characters
+    unsigned char left = static_cast<unsigned char>(*aLeft);
+    unsigned char right = static_cast<unsigned char>(*aRight);
+    if (left == right) {
+      if (!left) {
+        return false;
+      }
+      continue;
+    }
+    left = FoldCase(char(left));
+    right = FoldCase(char(right));
+    if (left != right) {
+      return left < right;
+    }
+  }
+}
+
+BpGlob::BpGlob(const char* aPattern)
+{
+  std::string literal;
+  bool inPrefix = true;
+  auto endLiteral = [&]() -> void {
+    inPrefix = false;
+    if (!literal.empty()) {
+      mLiterals.push_back(literal);
+      literal.clear();
+    }
+  };
+
+  for (const char* c = aPattern; *c; ++c) {
+    Token token;
+    switch (*c) {
+      case '*':
+        endLiteral();
+        token.mKind = eStar;
+        token.mValue = 0;
+        mTokens.push_back(token);
+        continue;
+      case '+':
+        endLiteral();
+        token.mKind = eAny;
+        token.mValue = 0;
+        mTokens.push_back(token);
+        token.mKind = eStar;
+        mTokens.push_back(token);
+        continue;
+      case '?':
+        endLiteral();
+        token.mKind = eAny;
+        token.mValue = 0;
+        mTokens.push_back(token);
+        continue;
+      case '[': {
+        const char* begin = c + 1;
+        bool negate = *begin == '^' || *begin == '!';
+        if (negate) {
+          ++begin;
+        }
+        // A ']' right at the start is part of the set
+        const char* end = *begin == ']' ? begin + 1 : begin;
+        while (*end && *end != ']') {
+          ++end;
+        }
+        if (!*end) {
+          break;
+        }
+        endLiteral();
+        std::vector<bool> set(256, false);
+        for (const char* s = begin; s < end; ++s) {
+          unsigned char first = static_cast<unsigned char>(*s);
+          unsigned char last = first;
+          if (s + 2 < end && s[1] == '-') {
+            last = static_cast<unsigned char>(s[2]);
+            s += 2;
+          }
+          for (unsigned int i = first; i <= last; ++i) {
+            set[FoldCase(char(i))] = true;
+          }
+        }
+        if (negate) {
+          set.flip();
+        }
+        token.mKind = eSet;
+        token.mValue = uint32_t(mSets.size());
+        mSets.push_back(std::move(set));
+        mTokens.push_back(token);
+        c = end;
+        continue;
+      }
+      default:
+        break;
+    }
+
+    token.mKind = eChar;
+    token.mValue = FoldCase(*c);
+    mTokens.push_back(token);
+    literal += char(token.mValue);
+    if (inPrefix) {
+      mPrefix += char(token.mValue);
+    }
+  }
+  endLiteral();
+}
+
+bool
+BpGlob::MatchToken(const Token& aToken, char aChar) const
+{
+  switch (aToken.mKind) {
+    case eChar:
+      return FoldCase(aChar) == aToken.mValue;
+    case eAny:
+      return true;
+    case eSet:
+      return mSets[aToken.mValue][FoldCase(aChar)];
+    default:
+      return false;
+  }
+}
+
+bool
+BpGlob::Match(const char* aName) const
+{
+  // On a mismatch, let the most recent * absorb one more character and
+  // retry from there. Earlier stars never need to be revisited, so this is
+  // linear for the usual patterns and never worse than quadratic.
+  const size_t numTokens = mTokens.size();
+  size_t token = 0;
+  size_t starToken = numTokens;
+  const char* starName = nullptr;
+  const char* name = aName;
+  while (*name) {
+    if (token < numTokens && mTokens[token].mKind == eStar) {
+      starToken = ++token;
+      starName = name;
+      continue;
+    }
+    if (token < numTokens && MatchToken(mTokens[token], *name)) {
+      ++token;
+      ++name;
+      continue;
+    }
+    if (!starName) {
+      return false;
+    }
+    token = starToken;
+    name = ++starName;
+  }
+  while (token < numTokens && mTokens[token].mKind == eStar) {
+    ++token;
+  }
+  return token == numTokens;
+}
+
+// Letters, digits, '_', ':' and everything else
+static const unsigned int kTrigramAlphabet = 26 + 10 + 2 + 1;
+static const unsigned int kNumTrigrams =
+  kTrigramAlphabet * kTrigramAlphabet * kTrigramAlphabet;
+
+namespace {
+
+struct TrigramChars
+{
+  TrigramChars()
+  {
+    for (unsigned int i = 0; i < 256; ++i) {
+      unsigned char c = FoldCase(char(i));
+      mChars[i] = c >= 'a' && c <= 'z' ? c - 'a' + 1 :
+                  c >= '0' && c <= '9' ? c - '0' + 27 :
+                  c == '_' ? 37 : c == ':' ? 38 : 0;
+    }
+  }
+  uint8_t mChars[256];
+};
+
+} // anonymous namespace
+
+static const TrigramChars gTrigramChars;
+
+static inline unsigned int
+TrigramChar(char aChar)
+{
+  return gTrigramChars.mChars[static_cast<unsigned char>(aChar)];
+}
+
+// Calls aFn(trigram) for every trigram of the NUL-terminated aText, in order
+// and with repeats.
+template <typename FnT>
+static void
+ForEachTrigram(const char* aText, FnT&& aFn)
+{
+  if (!aText[0] || !aText[1]) {
+    return;
+  }
+  unsigned int trigram = TrigramChar(aText[0]) * kTrigramAlphabet +
+                         TrigramChar(aText[1]);
+  for (const char* c = aText + 2; *c; ++c) {
+    trigram = (trigram % (kTrigramAlphabet * kTrigramAlphabet)) *
+              kTrigramAlphabet + TrigramChar(*c);
+    aFn(trigram);
+  }
+}
+
+static size_t
+VarintSize(uint32_t aValue)
+{
+  size_t size = 1;
+  while (aValue >= 0x80) {
+    aValue >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+static uint8_t*
+WriteVarint(uint8_t* aOut, uint32_t aValue)
+{
+  while (aValue >= 0x80) {
+    *aOut++ = uint8_t(aValue) | 0x80;
+    aValue >>= 7;
+  }
+  *aOut++ = uint8_t(aValue);
+  return aOut;
+}
+
+static inline uint32_t
+ReadVarint(const uint8_t*& aPos)
+{
+  uint32_t value = 0;
+  for (unsigned int shift = 0;; shift += 7) {
+    uint8_t byte = *aPos++;
+    value |= uint32_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+// Each list entry is the distance from the block after the previous entry,
+// starting from block 0.
+static const uint32_t kNoBlock = ~uint32_t(0);
+
+namespace {
+
+struct SortEntry
+{
+  const char* mName;
+  uint32_t    mSymbol;
+};
+
+} // anonymous namespace
+
+static inline uint32_t
+BlockDelta(uint32_t aBlock, uint32_t aPrevious)
+{
+  return aPrevious == kNoBlock ? aBlock : aBlock - aPrevious - 1;
+}
+
+BpNameIndex::BpNameIndex(const BpSymbolTable& aTable)
+  : mTable(aTable)
+{
+  // SymbolsByName() is in strcmp order, so the stable sort breaks ties
+  // between names that only differ in case the same way every time. The
+  // names are resolved up front to spare the comparisons an indirection.
+  const BpArray<uint32_t>& byName = aTable.SymbolsByName();
+  std::vector<SortEntry> entries(byName.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    entries[i].mName = aTable.String(aTable.SymbolNames()[byName[i]]);
+    entries[i].mSymbol = byName[i];
+  }
+  ParallelStableSort(entries.begin(), entries.end(),
+                     [](const SortEntry& aLeft, const SortEntry& aRight) {
+    return LessFolded(aLeft.mName, aRight.mName);
+  });
+  mSorted.resize(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    mSorted[i] = entries[i].mSymbol;
+  }
+
+  // Two passes over the blocks: the first sizes every list, the second
+  // fills them in. A block only enters a list once no matter how many of its
+  // names contain the trigram.
+  const uint32_t numBlocks =
+    uint32_t((mSorted.size() + kBlockSize - 1) / kBlockSize);
+  std::vector<uint32_t> lastBlock(kNumTrigrams);
+  auto forEachPosting = [&](auto&& aFn) -> void {
+    std::fill(lastBlock.begin(), lastBlock.end(), kNoBlock);
+    for (uint32_t block = 0; block < numBlocks; ++block) {
+      const size_t end = std::min(mSorted.size(),
+                                  size_t(block + 1) * kBlockSize);
+      for (size_t i = size_t(block) * kBlockSize; i < end; ++i) {
+        ForEachTrigram(entries[i].mName, [&](unsigned int aTrigram) -> void {
+          uint32_t& last = lastBlock[aTrigram];
+          if (last != block) {
+            aFn(aTrigram, BlockDelta(block, last));
+            last = block;
+          }
+        });
+      }
+    }
+  };
+
+  mPostingStarts.assign(kNumTrigrams + 1, 0);
+  forEachPosting([this](unsigned int aTrigram, uint32_t aDelta) -> void {
+    mPostingStarts[aTrigram + 1] += uint32_t(VarintSize(aDelta));
+  });
+  for (unsigned int i = 0; i < kNumTrigrams; ++i) {
+    mPostingStarts[i + 1] += mPostingStarts[i];
+  }
+  mPostings.resize(mPostingStarts.back());
+  std::vector<uint32_t> cursors(mPostingStarts.begin(),
+                                mPostingStarts.end() - 1);
+  forEachPosting([&](unsigned int aTrigram, uint32_t aDelta) -> void {
+    uint8_t* pos = mPostings.data() + cursors[aTrigram];
+    cursors[aTrigram] = uint32_t(WriteVarint(pos, aDelta) - mPostings.data());
+  });
+}
+
+const char*
+BpNameIndex::Name(size_t aPosition) const
+{
+  return mTable.String(mTable.SymbolNames()[mSorted[aPosition]]);
+}
+
+bool
+BpNameIndex::FindBlocks(const std::vector<std::string>& aLiterals,
+                        std::vector<uint32_t>& aBlocks) const
+{
+  std::vector<unsigned int> trigrams;
+  for (auto&& literal : aLiterals) {
+    ForEachTrigram(literal.c_str(), [&trigrams](unsigned int aTrigram) {
+      trigrams.push_back(aTrigram);
+    });
+  }
+  if (trigrams.empty()) {
+    return false;
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+                 trigrams.end());
+  // Shortest lists first, so that the candidates shrink as early as possible
+  std::sort(trigrams.begin(), trigrams.end(),
+            [this](unsigned int aLeft, unsigned int aRight) {
+    return mPostingStarts[aLeft + 1] - mPostingStarts[aLeft] <
+           mPostingStarts[aRight + 1] - mPostingStarts[aRight];
+  });
+
+  aBlocks.clear();
+  for (size_t t = 0; t < trigrams.size(); ++t) {
+    const uint8_t* pos = mPostings.data() + mPostingStarts[trigrams[t]];
+    const uint8_t* end = mPostings.data() + mPostingStarts[trigrams[t] + 1];
+    uint32_t block = kNoBlock;
+    auto next = [&]() -> uint32_t {
+      block = block == kNoBlock ? ReadVarint(pos) :
+                                  block + 1 + ReadVarint(pos);
+      return block;
+    };
+    if (!t) {
+      while (pos < end) {
+        aBlocks.push_back(next());
+      }
+      continue;
+    }
+    // Intersect in place
+    size_t kept = 0;
+    for (size_t i = 0; i < aBlocks.size(); ++i) {
+      while ((block == kNoBlock || block < aBlocks[i]) && pos < end) {
+        next();
+      }
+      if (block == kNoBlock || block < aBlocks[i]) {
+        break;
+      }
+      if (block == aBlocks[i]) {
+        aBlocks[kept++] = block;
+      }
+    }
+    aBlocks.resize(kept);
+    if (aBlocks.empty()) {
+      break;
+    }
+  }
+  return true;
+}
+
+void
+BpNameIndex::Find(const BpGlob& aGlob, std::vector<uint32_t>& aSymbols) const
+{
+  // Names that start with the glob's plain prefix are one range
+  const std::string& prefix = aGlob.Prefix();
+  const size_t length = prefix.size();
+  size_t first = std::lower_bound(mSorted.begin(), mSorted.end(), prefix,
+                                  [&](uint32_t aSymbol,
+                                      const std::string& aPrefix) {
+    return CompareFolded(mTable.String(mTable.SymbolNames()[aSymbol]),
+                         aPrefix.c_str(), length) < 0;
+  }) - mSorted.begin();
+  size_t last = std::upper_bound(mSorted.begin() + first, mSorted.end(),
+                                 prefix, [&](const std::string& aPrefix,
+                                             uint32_t aSymbol) {
+    return CompareFolded(mTable.String(mTable.SymbolNames()[aSymbol]),
+                         aPrefix.c_str(), length) > 0;
+  }) - mSorted.begin();
+
+  auto matchRange = [&](size_t aBegin, size_t aEnd) -> void {
+    for (size_t i = std::max(aBegin, first); i < std::min(aEnd, last); ++i) {
+      if (aGlob.Match(Name(i))) {
+        aSymbols.push_back(mSorted[i]);
+      }
+    }
+  };
+
+  std::vector<uint32_t> blocks;
+  if (!FindBlocks(aGlob.Literals(), blocks)) {
+    matchRange(first, last);
+    return;
+  }
+  auto itr = std::lower_bound(blocks.begin(), blocks.end(),
+                              uint32_t(first / kBlockSize));
+  for (; itr != blocks.end() && size_t(*itr) * kBlockSize < last; ++itr) {
+    matchRange(size_t(*itr) * kBlockSize, size_t(*itr + 1) * kBlockSize);
+  }
+}
+
+size_t
+BpNameIndex::HeapSize() const
+{
+  return (mSorted.capacity() + mPostingStarts.capacity()) * sizeof(uint32_t) +
+         mPostings.capacity();
+}
+
+// Bits of filter per key before rounding the size up to a power of two
+static const size_t kFilterBitsPerKey = 12;
+
+static inline uint64_t
+MixHash(uint64_t aValue)
+{
+  aValue ^= aValue >> 33;
+  aValue *= 0xFF51AFD7ED558CCDULL;
+  aValue ^= aValue >> 33;
+  aValue *= 0xC4CEB9FE1A85EC53ULL;
+  aValue ^= aValue >> 33;
+  return aValue;
+}
+
+static uint64_t
+HashName(const char* aName)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (const char* c = aName; *c; ++c) {
+    hash = (hash ^ static_cast<unsigned char>(*c)) * 0x100000001B3ULL;
+  }
+  return MixHash(hash);
+}
+
+// aTrigram holds three lowercased characters. The extra bit keeps trigram
+// keys apart from short names.
+static inline uint64_t
+HashTrigram(uint32_t aTrigram)
+{
+  return MixHash((uint64_t(1) << 32) | aTrigram);
+}
+
+// Calls aFn with every trigram of aText, lowercased and packed into the low
+// 24 bits of a uint32_t.
+template <typename FnT>
+static void
+ForEachFoldedTrigram(const char* aText, FnT&& aFn)
+{
+  if (!aText[0] || !aText[1]) {
+    return;
+  }
+  uint32_t trigram = (uint32_t(FoldCase(aText[0])) << 8) | FoldCase(aText[1]);
+  for (const char* c = aText + 2; *c; ++c) {
+    trigram = ((trigram << 8) | FoldCase(*c)) & 0xFFFFFF;
+    aFn(trigram);
+  }
+}
+
+// The word that aHash selects, and the four bits that it sets there
+static inline size_t
+FilterWord(uint64_t aHash, size_t aMask)
+{
+  return size_t(aHash) & aMask;
+}
+
+static inline uint64_t
+FilterBits(uint64_t aHash)
+{
+  return (uint64_t(1) << ((aHash >> 32) & 63)) |
+         (uint64_t(1) << ((aHash >> 38) & 63)) |
+         (uint64_t(1) << ((aHash >> 44) & 63)) |
+         (uint64_t(1) << ((aHash >> 50) & 63));
+}
+
+void
+BpNameFilter::Build(const std::vector<const char*>& aNames,
+                    std::vector<uint64_t>& aWords, unsigned int aMaxThreads)
+{
+  aWords.clear();
+  if (aNames.empty()) {
+    return;
+  }
+
+  // The number of distinct trigrams is only known after a pass over the
+  // names, so collect them in a bitmap first. Chunks of names are hashed on
+  // worker threads, each with a bitmap of its own.
+  const size_t kNumTrigramWords = size_t(1) << (24 - 6);
+  const size_t kMinChunkSize = 0x10000;
+  const size_t numChunks = std::max<size_t>(
+    std::min<size_t>(aMaxThreads,
+                     (aNames.size() + kMinChunkSize - 1) / kMinChunkSize),
+    1);
+  std::vector<uint64_t> hashes(aNames.size());
+  std::vector<std::vector<uint64_t>> chunkTrigrams(numChunks);
+  ParallelFor(numChunks, [&](size_t aChunk) -> void {
+    std::vector<uint64_t>& seen = chunkTrigrams[aChunk];
+    seen.assign(kNumTrigramWords, 0);
+    const size_t end = aNames.size() * (aChunk + 1) / numChunks;
+    for (size_t i = aNames.size() * aChunk / numChunks; i < end; ++i) {
+      hashes[i] = HashName(aNames[i]);
+      ForEachFoldedTrigram(aNames[i], [&seen](uint32_t aTrigram) -> void {
+        seen[aTrigram / 64] |= uint64_t(1) << (aTrigram % 64);
+      });
+    }
+  });
+  std::vector<uint64_t>& trigrams = chunkTrigrams[0];
+  size_t numKeys = aNames.size();
+  for (size_t i = 0; i < kNumTrigramWords; ++i) {
+    for (size_t chunk = 1; chunk < numChunks; ++chunk) {
+      trigrams[i] |= chunkTrigrams[chunk][i];
+    }
+    for (uint64_t word = trigrams[i]; word; word &= word - 1) {
+      ++numKeys;
+    }
+  }
+
+  size_t numWords = 1;
+  while (numWords * 64 < numKeys * kFilterBitsPerKey) {
+    numWords *= 2;
+  }
+  aWords.assign(numWords, 0);
+  const size_t mask = numWords - 1;
+  auto add = [&](uint64_t aHash) -> void {
+    aWords[FilterWord(aHash, mask)] |= FilterBits(aHash);
+  };
+  for (auto&& hash : hashes) {
+    add(hash);
+  }
+  for (size_t i = 0; i < kNumTrigramWords; ++i) {
+    for (unsigned int bit = 0; trigrams[i] && bit < 64; ++bit) {
+      if ((trigrams[i] >> bit) & 1) {
+        add(HashTrigram(uint32_t(i * 64 + bit)));
+      }
+    }
+  }
+}
+
+bool
+BpNameFilter::Test(uint64_t aHash) const
+{
+  const uint64_t bits = FilterBits(aHash);
+  return (mWords[FilterWord(aHash, mMask)] & bits) == bits;
+}
+
+bool
+BpNameFilter::MayContain(const char* aName) const
+{
+  return !mEmpty && Test(HashName(aName));
+}
+
+bool
+BpNameFilter::MayMatch(const BpGlob& aGlob) const
+{
+  if (mEmpty) {
+    return false;
+  }
+  bool mayMatch = true;
+  for (auto&& literal : aGlob.Literals()) {
+    ForEachFoldedTrigram(literal.c_str(), [&](uint32_t aTrigram) -> void {
+      mayMatch = mayMatch && Test(HashTrigram(aTrigram));
+    });
+  }
+  return mayMatch;
+}
@@ -0,0 +1,147 @@
+#ifndef __BPNAMEINDEX_H
+#define __BPNAMEINDEX_H
+
+// Glob search over the symbol names of a single module, and a compact filter
+// for deciding whether a module is worth searching at all. Platform-neutral.
+
+#include "parallel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class BpSymbolTable;
+
+/**
+ * A compiled glob, matched case-insensitively against whole names:
+ *   *      any run of characters, including none
+ *   +      any run of at least one character
+ *   ?      any single character
+ *   [...]  any character of the set, which may contain ranges and may be
+ *          negated with a leading ^ or !
+ * Every other character, including an unterminated [, stands for itself.
+ */
+class BpGlob
+{
+public:
+  explicit BpGlob(const char* aPattern);
+
+  bool Match(const char* aName) const;
+
+  // The characters that every match starts with, lowercased
+  const std::string& Prefix() const { return mPrefix; }
+  // Runs of plain characters that every match contains, lowercased
+  const std::vector<std::string>& Literals() const { return mLiterals; }
+
+private:
+  enum TokenKind : uint8_t
+  {
+    eChar,
+    eAny,
+    eSet,
+    eStar
+  };
+
+  struct Token
+  {
+    TokenKind mKind;
+    // The lowercased character for eChar, the index into mSets for eSet
+    uint32_t  mValue;
+  };
+
+  bool MatchToken(const Token& aToken, char aChar) const;
+
+  std::vector<Token>             mTokens;
+  // 256 flags per set, indexed by lowercased character
+  std::vector<std::vector<bool>> mSets;
+  std::string                    mPrefix;
+  std::vector<std::string>       mLiterals;
+};
+
+/**
+ * Index for glob searches over the names of a BpSymbolTable. The names are
+ * kept sorted case-insensitively, which answers globs that start with plain
+ * characters by a range lookup. On top of that, a posting list for every
+ * trigram records which blocks of kBlockSize consecutive names contain it,
+ * as delta-encoded varints. Each plain run of three or more characters in a
+ * glob selects the blocks in the intersection of its trigrams' lists, and
+ * only the names in those blocks are matched against the glob.
+ *
+ * Trigrams are taken over a reduced alphabet: letters regardless of case,
+ * digits, '_', ':', and one class for everything else. Neighbouring names
+ * share most of their trigrams, so blocks keep the lists short.
+ */
+class BpNameIndex
+{
+public:
+  explicit BpNameIndex(const BpSymbolTable& aTable);
+
+  // Appends the indices into the symbol arrays of aTable of all symbols whose
+  // names match aGlob to aSymbols, in case-insensitive name order.
+  void Find(const BpGlob& aGlob, std::vector<uint32_t>& aSymbols) const;
+
+  size_t HeapSize() const;
+
+private:
+  BpNameIndex(const BpNameIndex&) = delete;
+  BpNameIndex& operator=(const BpNameIndex&) = delete;
+
+  static const size_t kBlockSize = 8;
+
+  const char* Name(size_t aPosition) const;
+  // Stores the blocks whose names may contain all of aLiterals in aBlocks.
+  // Returns false if the literals have no trigrams to look up.
+  bool FindBlocks(const std::vector<std::string>& aLiterals,
+                  std::vector<uint32_t>& aBlocks) const;
+
+  const BpSymbolTable&  mTable;
+  // Indices into the symbol arrays, sorted by case-insensitive name
+  std::vector<uint32_t> mSorted;
+  // The posting list of trigram t is [mPostingStarts[t],
+  // mPostingStarts[t + 1]) in mPostings
+  std::vector<uint32_t> mPostingStarts;
+  std::vector<uint8_t>  mPostings;
+};
+
+/**
+ * Bloom filter over the distinct symbol names of a module and the trigrams
+ * of their lowercased forms, kept in the module's cache image. Searches
+ * across all modules consult it before touching a module's names, and skip
+ * the module when it rules out an exact name or any trigram of a glob's
+ * plain runs. Every key sets four bits of a single 64-bit word, so a query
+ * costs one memory access per key; at the sizes that Build picks, about one
+ * key in a few hundred is a false positive.
+ */
+class BpNameFilter
+{
+public:
+  // aNumWords must be a power of two, or zero for a filter that rejects
+  // everything.
+  BpNameFilter(const uint64_t* aWords, size_t aNumWords)
+    : mWords(aWords)
+    , mMask(aNumWords - 1)
+    , mEmpty(!aNumWords)
+  {
+  }
+
+  // Stores the filter words for the NUL-terminated names aNames, which must
+  // be distinct, in aWords. Hashes on up to aMaxThreads threads.
+  static void Build(const std::vector<const char*>& aNames,
+                    std::vector<uint64_t>& aWords,
+                    unsigned int aMaxThreads = GetWorkerThreadCount());
+
+  // False if no symbol is named exactly aName
+  bool MayContain(const char* aName) const;
+  // False if no symbol name can match aGlob
+  bool MayMatch(const BpGlob& aGlob) const;
+
+private:
+  bool Test(uint64_t aHash) const;
+
+  const uint64_t* mWords;
+  size_t          mMask;
+  bool            mEmpty;
+};
+
+#endif // __BPNAMEINDEX_H
@@ -0,0 +1,299 @@
+#include "bpsamples.h"
+
+#include "bpstacks.h"
+#include "bpsymtable.h"
+
+#include <algorithm>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <sstream>
+
+size_t
+BpStackTrie::ChildKeyHash::operator()(const ChildKey& aKey) const
+{
+  uint64_t hash = aKey.mAddress ^ (uint64_t(aKey.mParent) << 32);
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return size_t(hash);
+}
+
+BpStackTrie::BpStackTrie()
+  : mNumSamples(0)
+  , mNumStacks(0)
+{
+  Node root = { 0, 0, 0, 0 };
+  mNodes.push_back(root);
+}
+
+bool
+BpStackTrie::IsStack(uint32_t aLeaf, const uint64_t* aFrames,
+                     size_t aNumFrames) const
+{
+  if (mNodes[aLeaf].mDepth != aNumFrames) {
+    return false;
+  }
+  uint32_t node = aLeaf;
+  for (size_t i = 0; i < aNumFrames; ++i, node = mNodes[node].mParent) {
+    if (mNodes[node].mAddress != aFrames[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+BpStackTrie::Add(const uint64_t* aFrames, size_t aNumFrames, uint64_t aCount)
+{
+  // A thread whose stack couldn't be walked has nothing to contribute
+  if (!aNumFrames) {
+    return;
+  }
+  mNumSamples += aCount;
+
+  const uint64_t hash = BpHashFrames(aFrames, aNumFrames);
+  auto range = mStacksByHash.equal_range(hash);
+  for (auto itr = range.first; itr != range.second; ++itr) {
+    if (IsStack(itr->second, aFrames, aNumFrames)) {
+      mNodes[itr->second].mSelf += aCount;
+      return;
+    }
+  }
+
+  // A new stack, though usually most of its outer frames are known already
+  uint32_t node = 0;
+  for (size_t i = aNumFrames; i-- > 0;) {
+    ChildKey key = { aFrames[i], node };
+    auto inserted = mChildren.emplace(key, uint32_t(mNodes.size()));
+    if (inserted.second) {
+      Node child = { aFrames[i], 0, node, mNodes[node].mDepth + 1 };
+      mNodes.push_back(child);
+    }
+    node = inserted.first->second;
+  }
+  if (!mNodes[node].mSelf) {
+    mLeaves.push_back(node);
+    ++mNumStacks;
+  }
+  mNodes[node].mSelf += aCount;
+  mStacksByHash.emplace(hash, node);
+}
+
+size_t
+BpStackTrie::HeapSize() const
+{
+  // Node-based containers cost about their entries plus two pointers each
+  return mNodes.capacity() * sizeof(Node) +
+         mLeaves.capacity() * sizeof(uint32_t) +
+         mChildren.size() * (sizeof(ChildKey) + sizeof(uint32_t) +
+                             2 * sizeof(void*)) +
+         mChildren.bucket_count() * sizeof(void*) +
+         mStacksByHash.size() * (sizeof(uint64_t) + sizeof(uint32_t) +
+                                 2 * sizeof(void*)) +
+         mStacksByHash.bucket_count() * sizeof(void*);
+}
+
+void
+BpStackTrie::GetUniqueAddresses(std::vector<uint64_t>& aAddresses) const
+{
+  aAddresses.clear();
+  for (size_t i = 1; i < mNodes.size(); ++i) {
+    aAddresses.push_back(mNodes[i].mAddress);
+  }
+  std::sort(aAddresses.begin(), aAddresses.end());
+  aAddresses.erase(std::unique(aAddresses.begin(), aAddresses.end()),
+                   aAddresses.end());
+}
+
+// Appends aName as a single folded frame: ';' separates frames and the line
+// ends at the first newline, so neither may appear within a name.
+static void
+AppendFoldedFrame(const std::string& aName, std::string& aLine)
+{
+  if (!aLine.empty()) {
+    aLine += ';';
+  }
+  for (char c : aName) {
+    aLine += c == ';' ? ':' : (c == '\n' || c == '\r') ? ' ' : c;
+  }
+}
+
+void
+BpStackTrie::WriteFolded(
+  std::ostream& aStream, const std::vector<uint64_t>& aAddresses,
+  const std::vector<std::vector<std::string>>& aNames) const
+{
+  std::map<std::string, uint64_t> folded;
+  std::string line;
+  ForEachStack([&](const uint64_t* aFrames, size_t aNumFrames,
+                   uint64_t aCount) {
+    line.clear();
+    for (size_t i = aNumFrames; i-- > 0;) {
+      auto itr = std::lower_bound(aAddresses.begin(), aAddresses.end(),
+                                  aFrames[i]);
+      const size_t index = itr - aAddresses.begin();
+      if (itr == aAddresses.end() || *itr != aFrames[i] ||
+          aNames[index].empty()) {
+        std::ostringstream oss;
+        oss << "0x" << std::hex << aFrames[i];
+        AppendFoldedFrame(oss.str(), line);
+        continue;
+      }
+      for (auto&& name : aNames[index]) {
+        AppendFoldedFrame(name, line);
+      }
+    }
+    folded[line] += aCount;
+  });
+
+  for (auto&& entry : folded) {
+    aStream << entry.first << ' ' << entry.second << '\n';
+  }
+}
+
+void
+BpFrameNamer::AddModule(uint64_t aBase, uint64_t aSize,
+                        const std::string& aName, const BpSymbolTable* aTable)
+{
+  Module module = { aBase, aSize, aName, aTable };
+  auto itr = std::upper_bound(mModules.begin(), mModules.end(), aBase,
+                              [](uint64_t aAddress, const Module& aModule) {
+    return aAddress < aModule.mBase;
+  });
+  mModules.insert(itr, module);
+}
+
+void
+BpFrameNamer::Name(const std::vector<uint64_t>& aAddresses,
+                   std::vector<std::vector<std::string>>& aNames) const
+{
+  aNames.assign(aAddresses.size(), std::vector<std::string>());
+
+  // Both the addresses and the modules are sorted, so each module's run of
+  // addresses is looked up in a single batch.
+  std::vector<uint64_t> rvas;
+  std::vector<size_t> symbols;
+  std::vector<size_t> inlines;
+  size_t next = 0;
+  for (auto&& module : mModules) {
+    const size_t begin =
+      std::lower_bound(aAddresses.begin() + next, aAddresses.end(),
+                       module.mBase) - aAddresses.begin();
+    size_t end = begin;
+    while (end < aAddresses.size() &&
+           aAddresses[end] - module.mBase < module.mSize) {
+      ++end;
+    }
+    next = end;
+    if (begin == end || !module.mTable) {
+      continue;
+    }
+
+    rvas.clear();
+    for (size_t i = begin; i < end; ++i) {
+      rvas.push_back(aAddresses[i] - module.mBase);
+    }
+    symbols.resize(rvas.size());
+    module.mTable->FindSymbols(rvas.data(), rvas.size(), symbols.data());
+
+    for (size_t i = 0; i < rvas.size(); ++i) {
+      std::vector<std::string>& names = aNames[begin + i];
+      const size_t symbol = symbols[i];
+      if (symbol == BpSymbolTable::kNotFound) {
+        continue;
+      }
+
+      const BpSymbolTable& table = *module.mTable;
+      names.push_back(module.mName + "!" +
+                      table.String(table.SymbolNames()[symbol]));
+      table.FindInlines(symbol, rvas[i], inlines);
+      for (size_t index : inlines) {
+        names.push_back(module.mName + "!" +
+                        table.String(table.InlineNames()[index]) + "_[i]");
+      }
+    }
+  }
+}
+
+std::string
+BpFrameNamer::OffsetName(uint64_t aAddress) const
+{
+  auto itr = std::upper_bound(mModules.begin(), mModules.end(), aAddress,
+                              [](uint64_t aValue, const Module& aModule) {
+    return aValue < aModule.mBase;
+  });
+  if (itr == mModules.begin()) {
+    return std::string();
+  }
+  const Module& module = *(itr - 1);
+  if (aAddress - module.mBase >= module.mSize) {
+    return std::string();
+  }
+  std::ostringstream oss;
+  oss << module.mName << "+0x" << std::hex << aAddress - module.mBase;
+  return oss.str();
+}
+
+void
+BpWriteSamples(std::ostream& aStream,
+               const std::vector<BpSampleModule>& aModules,
+               const BpStackTrie& aStacks)
+{
+  aStream << std::hex;
+  for (auto&& module : aModules) {
+    aStream << "MODULE " << module.mBase << ' ' << module.mSize << ' '
+            << module.mName << '\n';
+  }
+  aStacks.ForEachStack([&](const uint64_t* aFrames, size_t aNumFrames,
+                           uint64_t aCount) {
+    aStream << "STACK " << std::dec << aCount << std::hex;
+    for (size_t i = 0; i < aNumFrames; ++i) {
+      aStream << ' ' << aFrames[i];
+    }
+    aStream << '\n';
+  });
+  aStream << std::dec;
+}
+
+bool
+BpReadSamples(std::istream& aStream, std::vector<BpSampleModule>& aModules,
+              BpStackTrie& aStacks)
+{
+  std::string line;
+  std::vector<uint64_t> frames;
+  while (std::getline(aStream, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    std::istringstream iss(line);
+    std::string kind;
+    if (!(iss >> kind)) {
+      continue;
+    }
+    if (kind == "MODULE") {
+      BpSampleModule module;
+      if (!(iss >> std::hex >> module.mBase >> module.mSize >> std::ws) ||
+          !std::getline(iss, module.mName) || module.mName.empty()) {
+        return false;
+      }
+      aModules.push_back(module);
+      continue;
+    }
+
+    uint64_t count;
+    if (kind != "STACK" || !(iss >> std::dec >> count)) {
+      return false;
+    }
+    frames.clear();
+    uint64_t frame;
+    while (iss >> std::hex >> frame) {
+      frames.push_back(frame);
+    }
+    if (!iss.eof()) {
+      return false;
+    }
+    aStacks.Add(frames.data(), frames.size(), count);
+  }
+  return true;
+}
@@ -0,0 +1,170 @@
+#ifndef __BPSAMPLES_H
+#define __BPSAMPLES_H
+
+// Aggregation of sampled stacks, naming of their frames, and output as
+// folded stacks for flame graph tools. Platform-neutral.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class BpSymbolTable;
+
+/**
+ * Sampled stacks, interned into a trie of frames rooted at the outermost
+ * frame, so that stacks sharing their outer frames share nodes. Sampling a
+ * hung or busy process yields the same few stacks over and over; the leaf
+ * node of each distinct stack is also kept in a table keyed by a hash of its
+ * frames, so that adding a repeat costs one hash, one lookup and a walk up
+ * the trie to compare the frames.
+ */
+class BpStackTrie
+{
+public:
+  BpStackTrie();
+
+  // Adds aCount samples of the stack aFrames, innermost frame first. Empty
+  // stacks are ignored.
+  void Add(const uint64_t* aFrames, size_t aNumFrames, uint64_t aCount = 1);
+
+  uint64_t NumSamples() const { return mNumSamples; }
+  size_t NumStacks() const { return mNumStacks; }
+  size_t NumNodes() const { return mNodes.size(); }
+  size_t HeapSize() const;
+
+  // Stores the distinct frame addresses of all stacks in aAddresses, in
+  // ascending order, ready to be named in one batch.
+  void GetUniqueAddresses(std::vector<uint64_t>& aAddresses) const;
+
+  // Calls aFn(frames, numFrames, count) for every distinct stack, with the
+  // frames innermost first, in the order in which the stacks were added.
+  template <typename Fn>
+  void ForEachStack(Fn aFn) const
+  {
+    std::vector<uint64_t> frames;
+    for (uint32_t leaf : mLeaves) {
+      frames.clear();
+      for (uint32_t node = leaf; node; node = mNodes[node].mParent) {
+        frames.push_back(mNodes[node].mAddress);
+      }
+      aFn(frames.data(), frames.size(), mNodes[leaf].mSelf);
+    }
+  }
+
+  // Writes one "outer;...;inner count" line per distinct sequence of frame
+  // names, sorted, as consumed by flamegraph.pl and most other flame graph
+  // tools. aNames[i] holds the names of the frames at aAddresses[i],
+  // outermost first; stacks whose frames differ only in their addresses
+  // within the same functions are merged.
+  void WriteFolded(std::ostream& aStream,
+                   const std::vector<uint64_t>& aAddresses,
+                   const std::vector<std::vector<std::string>>& aNames) const;
+
+private:
+  struct Node
+  {
+    uint64_t mAddress;
+    // Number of samples whose innermost frame is this node
+    uint64_t mSelf;
+    uint32_t mParent;
+    uint32_t mDepth;
+  };
+
+  struct ChildKey
+  {
+    uint64_t mAddress;
+    uint32_t mParent;
+    bool operator==(const ChildKey& aOther) const
+    {
+      return mAddress == aOther.mAddress && mParent == aOther.mParent;
+    }
+  };
+
+  struct ChildKeyHash
+  {
+    size_t operator()(const ChildKey& aKey) const;
+  };
+
+  bool IsStack(uint32_t aLeaf, const uint64_t* aFrames,
+               size_t aNumFrames) const;
+
+  // mNodes[0] is the root, which stands for no frame at all
+  std::vector<Node>                                   mNodes;
+  std::unordered_map<ChildKey, uint32_t, ChildKeyHash> mChildren;
+  // Stack hash -> leaf node of the stack
+  std::unordered_multimap<uint64_t, uint32_t>         mStacksByHash;
+  // The leaf of every distinct stack, in the order they were first added
+  std::vector<uint32_t>                               mLeaves;
+  uint64_t                                            mNumSamples;
+  size_t                                              mNumStacks;
+};
+
+/**
+ * Names the frames of sampled stacks from the Breakpad symbols of the
+ * modules that they fall into, as "module!function", with one extra name per
+ * inlined call, suffixed with "_[i]" like perf's folded output. Offsets and
+ * source lines are left out so that samples anywhere in a function share its
+ * frame.
+ */
+class BpFrameNamer
+{
+public:
+  // Adds a module of aSize bytes loaded at aBase. aTable may be null for a
+  // module without Breakpad symbols.
+  void AddModule(uint64_t aBase, uint64_t aSize, const std::string& aName,
+                 const BpSymbolTable* aTable);
+
+  // Names the frames at aAddresses, which must be sorted in ascending order.
+  // aNames[i] receives the names for aAddresses[i], outermost first, or
+  // nothing if no module has a symbol for it.
+  void Name(const std::vector<uint64_t>& aAddresses,
+            std::vector<std::vector<std::string>>& aNames) const;
+  // "module+0xrva" for a frame that has no symbol, or an empty string if
+  // aAddress isn't in any module
+  std::string OffsetName(uint64_t aAddress) const;
+
+private:
+  struct Module
+  {
+    uint64_t             mBase;
+    uint64_t             mSize;
+    std::string          mName;
+    const BpSymbolTable* mTable;
+  };
+
+  std::vector<Module> mModules;
+};
+
+/**
+ * A module listed in a sample file.
+ */
+struct BpSampleModule
+{
+  uint64_t    mBase;
+  uint64_t    mSize;
+  std::string mName;
+};
+
+// Sample files record the modules and the distinct stacks of a sampling run
+// as text, so that they can be named and folded again later, anywhere that
+// the modules' .sym files are at hand:
+//   MODULE <base> <size> <name>
+//   STACK <count> <frame>...
+// All numbers except the count are hexadecimal, and frames are listed
+// innermost first.
+void
+BpWriteSamples(std::ostream& aStream,
+               const std::vector<BpSampleModule>& aModules,
+               const BpStackTrie& aStacks);
+
+// Adds the stacks of a sample file to aStacks and appends its modules to
+// aModules. Returns false, having read everything up to the error, if a line
+// can't be parsed.
+bool
+BpReadSamples(std::istream& aStream, std::vector<BpSampleModule>& aModules,
+              BpStackTrie& aStacks);
+
+#endif // __BPSAMPLES_H
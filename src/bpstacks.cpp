@@ -0,0 +1,63 @@
+#include "bpstacks.h"
+
+#include <algorithm>
+
+uint64_t
+BpHashFrames(const uint64_t* aFrames, size_t aNumFrames)
+{
+  // FNV-1a over whole addresses, with a final mix so that stacks which
+  // differ only in their low bits still spread over the table
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < aNumFrames; ++i) {
+    hash = (hash ^ aFrames[i]) * 0x100000001B3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void
+BpStackBuckets::Add(uint32_t aThread, const uint64_t* aFrames,
+                    size_t aNumFrames)
+{
+  const uint64_t hash = BpHashFrames(aFrames, aNumFrames);
+  auto range = mIndex.equal_range(hash);
+  for (auto itr = range.first; itr != range.second; ++itr) {
+    Bucket& bucket = mBuckets[itr->second];
+    if (bucket.mNumFrames == aNumFrames &&
+        std::equal(aFrames, aFrames + aNumFrames,
+                   mFrames.begin() + bucket.mFirstFrame)) {
+      bucket.mThreads.push_back(aThread);
+      return;
+    }
+  }
+
+  Bucket bucket;
+  bucket.mFirstFrame = mFrames.size();
+  bucket.mNumFrames = aNumFrames;
+  bucket.mThreads.push_back(aThread);
+  mFrames.insert(mFrames.end(), aFrames, aFrames + aNumFrames);
+  mIndex.emplace(hash, mBuckets.size());
+  mBuckets.push_back(std::move(bucket));
+}
+
+void
+BpStackBuckets::Sort()
+{
+  std::stable_sort(mBuckets.begin(), mBuckets.end(),
+                   [](const Bucket& aLeft, const Bucket& aRight) {
+    return aLeft.mThreads.size() > aRight.mThreads.size();
+  });
+  // The indices are stale now, and nothing may be added after sorting
+  mIndex.clear();
+}
+
+void
+BpStackBuckets::GetUniqueAddresses(std::vector<uint64_t>& aAddresses) const
+{
+  aAddresses.assign(mFrames.begin(), mFrames.end());
+  std::sort(aAddresses.begin(), aAddresses.end());
+  aAddresses.erase(std::unique(aAddresses.begin(), aAddresses.end()),
+                   aAddresses.end());
+}
@@ -0,0 +1,54 @@
+#ifndef __BPSTACKS_H
+#define __BPSTACKS_H
+
+// Grouping of the stacks of many threads into buckets of identical stacks.
+// Platform-neutral.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Collects one stack per thread and keeps each distinct stack once, together
+ * with the threads that share it. Hangs typically have dozens of idle
+ * threads with the same stack, so this shrinks both the output and the
+ * number of addresses that need symbols.
+ */
+class BpStackBuckets
+{
+public:
+  struct Bucket
+  {
+    // [mFirstFrame, mFirstFrame + mNumFrames) in Frames()
+    size_t                mFirstFrame;
+    size_t                mNumFrames;
+    // In the order in which they were added
+    std::vector<uint32_t> mThreads;
+  };
+
+  // Adds the stack of thread aThread, innermost frame first.
+  void Add(uint32_t aThread, const uint64_t* aFrames, size_t aNumFrames);
+  // Orders the buckets by descending number of threads. Buckets with the
+  // same number keep the order in which their first thread was added, so
+  // the result doesn't depend on hashing.
+  void Sort();
+
+  const std::vector<Bucket>& Buckets() const { return mBuckets; }
+  const uint64_t* Frames() const { return mFrames.data(); }
+  // Stores the distinct frame addresses of all buckets in aAddresses, in
+  // ascending order, ready to be symbolized in one batch.
+  void GetUniqueAddresses(std::vector<uint64_t>& aAddresses) const;
+
+private:
+  std::vector<uint64_t> mFrames;
+  std::vector<Bucket>   mBuckets;
+  // Stack hash -> indices of the buckets with that hash
+  std::unordered_multimap<uint64_t, size_t> mIndex;
+};
+
+// Hash of the addresses of a stack, for finding stacks seen before
+uint64_t
+BpHashFrames(const uint64_t* aFrames, size_t aNumFrames);
+
+#endif // __BPSTACKS_H
@@ -0,0 +1,83 @@
+#include "bpstringpool.h"
+
+#include <string.h>
+
+static const size_t kInitialSlots = 1024;
+
+BpStringPool::BpStringPool()
+  : mChars(1, '\0')
+  , mSlots(kInitialSlots)
+  , mCount(0)
+{
+}
+
+uint32_t
+BpStringPool::Hash(const char* aBegin, const char* aEnd)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261U;
+  for (; aBegin != aEnd; ++aBegin) {
+    hash = (hash ^ static_cast<unsigned char>(*aBegin)) * 16777619U;
+  }
+  return hash;
+}
+
+uint32_t
+BpStringPool::Intern(const char* aBegin, const char* aEnd)
+{
+  if (aBegin == aEnd) {
+    return 0;
+  }
+
+  const size_t length = aEnd - aBegin;
+  const uint32_t hash = Hash(aBegin, aEnd);
+  size_t mask = mSlots.size() - 1;
+  size_t i = hash & mask;
+  for (; mSlots[i].mOffset; i = (i + 1) & mask) {
+    const Slot& slot = mSlots[i];
+    const char* candidate = mChars.data() + slot.mOffset;
+    if (slot.mHash == hash && slot.mLength == length &&
+        !memcmp(candidate, aBegin, length)) {
+      return slot.mOffset;
+    }
+  }
+
+  uint32_t offset = static_cast<uint32_t>(mChars.size());
+  mChars.insert(mChars.end(), aBegin, aEnd);
+  mChars.push_back('\0');
+  mSlots[i].mOffset = offset;
+  mSlots[i].mHash = hash;
+  mSlots[i].mLength = static_cast<uint32_t>(length);
+
+  // Keep the load factor at or below one half
+  if (++mCount * 2 > mSlots.size()) {
+    Grow();
+  }
+  return offset;
+}
+
+void
+BpStringPool::Grow()
+{
+  std::vector<Slot> slots(mSlots.size() * 2);
+  const size_t mask = slots.size() - 1;
+  for (auto&& slot : mSlots) {
+    if (!slot.mOffset) {
+      continue;
+    }
+    size_t i = slot.mHash & mask;
+    while (slots[i].mOffset) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = slot;
+  }
+  mSlots.swap(slots);
+}
+
+void
+BpStringPool::Release()
+{
+  std::vector<char>().swap(mChars);
+  std::vector<Slot>().swap(mSlots);
+  mCount = 0;
+}
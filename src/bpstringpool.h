@@ -0,0 +1,57 @@
+#ifndef __BPSTRINGPOOL_H
+#define __BPSTRINGPOOL_H
+
+// Interning string arena used while building symbol tables. Platform-neutral.
+
+#include "bpsymfile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Stores each distinct string once in a single growable buffer of
+ * NUL-terminated strings and identifies it by its 32-bit offset into that
+ * buffer. Offset 0 is always the empty string. The buffer is laid out exactly
+ * like the string section of a symbol cache image, so it can be copied there
+ * verbatim.
+ */
+class BpStringPool
+{
+public:
+  BpStringPool();
+
+  // Returns the offset of the string [aBegin, aEnd), adding it if it is not
+  // in the pool yet.
+  uint32_t Intern(const char* aBegin, const char* aEnd);
+  uint32_t Intern(const BpToken& aToken)
+  {
+    return Intern(aToken.mBegin, aToken.mEnd);
+  }
+
+  const char* Data() const { return mChars.data(); }
+  size_t Size() const { return mChars.size(); }
+  size_t Count() const { return mCount; }
+
+  // Frees the buffer and the index in one go.
+  void Release();
+
+private:
+  struct Slot
+  {
+    uint32_t mOffset; // 0 marks an empty slot
+    uint32_t mHash;
+    // Compared before the characters, so that a shorter candidate is never
+    // read past its end
+    uint32_t mLength;
+  };
+
+  static uint32_t Hash(const char* aBegin, const char* aEnd);
+  void Grow();
+
+  std::vector<char> mChars;
+  std::vector<Slot> mSlots;
+  size_t            mCount;
+};
+
+#endif // __BPSTRINGPOOL_H
@@ -0,0 +1,389 @@
+#include "bpsymcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bpsymcache {
+
+static bool
+GetSection(const Header& aHeader, size_t aImageSize, Section aSection,
+           uint64_t aElementSize, uint64_t& aCount)
+{
+  const SectionEntry& entry = aHeader.mSections[aSection];
+  if (entry.mSize % aElementSize) {
+    return false;
+  }
+  if (entry.mSize && (entry.mOffset % kSectionAlignment ||
+                      entry.mOffset < aHeader.mHeaderSize ||
+                      entry.mOffset > aImageSize ||
+                      entry.mSize > aImageSize - entry.mOffset)) {
+    return false;
+  }
+  aCount = entry.mSize / aElementSize;
+  return true;
+}
+
+static bool
+AllBelow(const char* aImage, const SectionEntry& aEntry, uint64_t aLimit)
+{
+  const uint32_t* values =
+    reinterpret_cast<const uint32_t*>(aImage + aEntry.mOffset);
+  const uint32_t* end = values + aEntry.mSize / sizeof(uint32_t);
+  uint32_t largest = 0;
+  for (; values != end; ++values) {
+    largest = *values > largest ? *values : largest;
+  }
+  return aEntry.mSize == 0 || largest < aLimit;
+}
+
+bool
+Validate(const char* aImage, size_t aImageSize, uint64_t aSourceSize,
+         uint64_t aSourceTime)
+{
+  if (aImageSize < sizeof(Header)) {
+    return false;
+  }
+  const Header& header = *reinterpret_cast<const Header*>(aImage);
+  if (memcmp(header.mMagic, kMagic, sizeof(kMagic)) ||
+      header.mVersion != kVersion || header.mHeaderSize != sizeof(Header)) {
+    return false;
+  }
+  if (aSourceSize && (header.mSourceSize != aSourceSize ||
+                      header.mSourceTime != aSourceTime)) {
+    return false;
+  }
+
+  uint64_t counts[eSectionCount];
+  for (int i = 0; i < eSectionCount; ++i) {
+    uint64_t elementSize = sizeof(uint32_t);
+    if (i == eStrings || i == eLineData || i == eUnwindCode) {
+      elementSize = 1;
+    } else if (i == eStackWin) {
+      elementSize = sizeof(StackWinRecord);
+    } else if (i == eNameFilter) {
+      elementSize = sizeof(uint64_t);
+    }
+    if (!GetSection(header, aImageSize, Section(i), elementSize, counts[i])) {
+      return false;
+    }
+  }
+
+  uint64_t numSymbols = counts[eSymbolRvas];
+  uint64_t numFiles = counts[eFileIds];
+  uint64_t numChars = counts[eStrings];
+  if (counts[eSymbolSizes] != numSymbols ||
+      counts[eSymbolNames] != numSymbols ||
+      counts[eSymbolParams] != numSymbols ||
+      counts[eSymbolsByName] > numSymbols ||
+      counts[eSymbolLines] != numSymbols + 1 ||
+      counts[eSymbolInlines] != numSymbols + 1 ||
+      counts[eFilePaths] != numFiles ||
+      (counts[eNameFilter] & (counts[eNameFilter] - 1))) {
+    return false;
+  }
+
+  const uint32_t* lineStarts = reinterpret_cast<const uint32_t*>(
+      aImage + header.mSections[eSymbolLines].mOffset);
+  uint64_t numLines = lineStarts[numSymbols];
+  uint64_t numBlocks = (numLines + kLineBlockSize - 1) / kLineBlockSize;
+  if (counts[eLineBlockRvas] != numBlocks ||
+      counts[eLineBlockOffsets] != numBlocks + 1) {
+    return false;
+  }
+
+  const char* strings = aImage + header.mSections[eStrings].mOffset;
+  if (!numChars || strings[0] || strings[numChars - 1] ||
+      header.mModuleName >= numChars) {
+    return false;
+  }
+
+  // The line slices must be in order and cover all of the lines, and the
+  // blocks must cover all of the line data. Decoding never reads past the end
+  // of a block, so the contents of the blocks need not be checked.
+  if (lineStarts[0]) {
+    return false;
+  }
+  for (uint64_t i = 0; i < numSymbols; ++i) {
+    if (lineStarts[i] > lineStarts[i + 1]) {
+      return false;
+    }
+  }
+  const uint32_t* blockOffsets = reinterpret_cast<const uint32_t*>(
+      aImage + header.mSections[eLineBlockOffsets].mOffset);
+  if (blockOffsets[0] || blockOffsets[numBlocks] != counts[eLineData]) {
+    return false;
+  }
+  for (uint64_t i = 0; i < numBlocks; ++i) {
+    if (blockOffsets[i] > blockOffsets[i + 1]) {
+      return false;
+    }
+  }
+
+  // Same for the inline slices. Every skip index must stay within its slice
+  // and move forward, so that walking the inline tree always terminates.
+  const uint32_t* inlineStarts = reinterpret_cast<const uint32_t*>(
+      aImage + header.mSections[eSymbolInlines].mOffset);
+  uint64_t numInlines = counts[eInlineRvas];
+  if (counts[eInlineSizes] != numInlines ||
+      counts[eInlineNext] != numInlines ||
+      counts[eInlineNames] != numInlines ||
+      counts[eInlineCallLines] != numInlines ||
+      counts[eInlineCallFiles] != numInlines ||
+      inlineStarts[0] || inlineStarts[numSymbols] != numInlines) {
+    return false;
+  }
+  const uint32_t* inlineNext = reinterpret_cast<const uint32_t*>(
+      aImage + header.mSections[eInlineNext].mOffset);
+  for (uint64_t i = 0; i < numSymbols; ++i) {
+    if (inlineStarts[i] > inlineStarts[i + 1]) {
+      return false;
+    }
+    for (uint64_t j = inlineStarts[i]; j < inlineStarts[i + 1]; ++j) {
+      if (inlineNext[j] <= j || inlineNext[j] > inlineStarts[i + 1]) {
+        return false;
+      }
+    }
+  }
+
+  // Programs are decoded with bounds checks, so it is enough for each one to
+  // start within eUnwindCode.
+  uint64_t numCfi = counts[eCfiRvas];
+  uint64_t numDeltas = counts[eCfiDeltaRvas];
+  uint64_t codeSize = counts[eUnwindCode];
+  if (counts[eCfiSizes] != numCfi || counts[eCfiCode] != numCfi ||
+      counts[eCfiDeltaStarts] != numCfi + 1 ||
+      counts[eCfiDeltaCode] != numDeltas) {
+    return false;
+  }
+  const uint32_t* deltaStarts = reinterpret_cast<const uint32_t*>(
+      aImage + header.mSections[eCfiDeltaStarts].mOffset);
+  if (deltaStarts[0] || deltaStarts[numCfi] != numDeltas) {
+    return false;
+  }
+  for (uint64_t i = 0; i < numCfi; ++i) {
+    if (deltaStarts[i] > deltaStarts[i + 1]) {
+      return false;
+    }
+  }
+  const StackWinRecord* stackWin = reinterpret_cast<const StackWinRecord*>(
+      aImage + header.mSections[eStackWin].mOffset);
+  for (uint64_t i = 0; i < counts[eStackWin]; ++i) {
+    if (stackWin[i].mCode != kNoUnwindCode && stackWin[i].mCode >= codeSize) {
+      return false;
+    }
+  }
+
+  return AllBelow(aImage, header.mSections[eSymbolNames], numChars) &&
+         AllBelow(aImage, header.mSections[eSymbolParams], numChars) &&
+         AllBelow(aImage, header.mSections[eFilePaths], numChars) &&
+         AllBelow(aImage, header.mSections[eInlineNames], numChars) &&
+         AllBelow(aImage, header.mSections[eSymbolsByName], numSymbols) &&
+         AllBelow(aImage, header.mSections[eCfiCode], codeSize) &&
+         AllBelow(aImage, header.mSections[eCfiDeltaCode], codeSize);
+}
+
+#if defined(_WIN32)
+
+bool
+Write(const BpPathChar* aPath, const char* aImage, size_t aImageSize)
+{
+  std::wstring tmpPath(aPath);
+  tmpPath += L".tmp";
+  tmpPath += std::to_wstring(GetCurrentProcessId());
+
+  HANDLE file = CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, nullptr,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  bool ok = true;
+  while (ok && aImageSize) {
+    DWORD chunk = aImageSize > 0x40000000 ? 0x40000000 : DWORD(aImageSize);
+    DWORD written = 0;
+    ok = WriteFile(file, aImage, chunk, &written, nullptr) && written == chunk;
+    aImage += chunk;
+    aImageSize -= chunk;
+  }
+  CloseHandle(file);
+
+  if (!ok || !MoveFileExW(tmpPath.c_str(), aPath, MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFileW(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+#else
+
+bool
+Write(const BpPathChar* aPath, const char* aImage, size_t aImageSize)
+{
+  std::string tmpPath(aPath);
+  tmpPath += ".tmp";
+  tmpPath += std::to_string(getpid());
+
+  FILE* file = fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = fwrite(aImage, 1, aImageSize, file) == aImageSize;
+  ok = !fclose(file) && ok;
+
+  if (!ok || rename(tmpPath.c_str(), aPath)) {
+    unlink(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif
+
+#if defined(_WIN32)
+
+static const BpPathChar kPathSeparator = L'\\';
+
+static bool
+IsPathSeparator(BpPathChar aChar)
+{
+  return aChar == L'\\' || aChar == L'/' || aChar == L':';
+}
+
+// Paths are case-insensitive, so "C:\\Foo" and "c:\\foo" hash alike
+static BpPathChar
+FoldPathChar(BpPathChar aChar)
+{
+  return aChar >= L'A' && aChar <= L'Z' ? aChar + (L'a' - L'A') : aChar;
+}
+
+static bool
+MakeDirectory(const std::wstring& aPath)
+{
+  return CreateDirectoryW(aPath.c_str(), nullptr) ||
+         GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+static std::wstring
+GetUserCacheDirectory(bool aCreate)
+{
+  wchar_t base[MAX_PATH];
+  DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", base, MAX_PATH);
+  if (!length || length >= MAX_PATH) {
+    return std::wstring();
+  }
+  std::wstring dir(base, length);
+  for (const wchar_t* component : {L"\\mozdbgext", L"\\symcache"}) {
+    dir += component;
+    if (aCreate && !MakeDirectory(dir)) {
+      return std::wstring();
+    }
+  }
+  return dir;
+}
+
+#else
+
+static const BpPathChar kPathSeparator = '/';
+
+static bool
+IsPathSeparator(BpPathChar aChar)
+{
+  return aChar == '/';
+}
+
+static BpPathChar
+FoldPathChar(BpPathChar aChar)
+{
+  return aChar;
+}
+
+static bool
+MakeDirectory(const std::string& aPath)
+{
+  return !mkdir(aPath.c_str(), 0777) || errno == EEXIST;
+}
+
+static std::string
+GetUserCacheDirectory(bool aCreate)
+{
+  std::string dir;
+  const char* base = getenv("XDG_CACHE_HOME");
+  if (base && *base) {
+    dir = base;
+  } else {
+    const char* home = getenv("HOME");
+    if (!home || !*home) {
+      return std::string();
+    }
+    dir = home;
+    dir += "/.cache";
+  }
+  if (aCreate && !MakeDirectory(dir)) {
+    return std::string();
+  }
+  for (const char* component : {"/mozdbgext", "/symcache"}) {
+    dir += component;
+    if (aCreate && !MakeDirectory(dir)) {
+      return std::string();
+    }
+  }
+  return dir;
+}
+
+#endif
+
+std::basic_string<BpPathChar>
+GetCachePath(const BpPathChar* aSymPath)
+{
+  static const BpPathChar kExtension[] = {'.', 's', 'y', 'm', 0};
+  static const BpPathChar kCacheExtension[] = {'.', 's', 'y', 'm', 'c', 'a',
+                                               'c', 'h', 'e', 0};
+  const size_t kExtensionLen = sizeof(kExtension) / sizeof(kExtension[0]) - 1;
+
+  std::basic_string<BpPathChar> path(aSymPath);
+  if (path.size() >= kExtensionLen &&
+      !path.compare(path.size() - kExtensionLen, kExtensionLen, kExtension)) {
+    path.resize(path.size() - kExtensionLen);
+  }
+  path += kCacheExtension;
+  return path;
+}
+
+std::basic_string<BpPathChar>
+GetUserCachePath(const BpPathChar* aSymPath, bool aCreate)
+{
+  std::basic_string<BpPathChar> path(GetUserCacheDirectory(aCreate));
+  if (path.empty()) {
+    return path;
+  }
+
+  // FNV-1a, so that .sym files of the same name in different directories
+  // get caches of their own
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  const BpPathChar* name = aSymPath;
+  for (const BpPathChar* p = aSymPath; *p; ++p) {
+    hash = (hash ^ uint64_t(FoldPathChar(*p))) * 0x100000001B3ULL;
+    if (IsPathSeparator(*p)) {
+      name = p + 1;
+    }
+  }
+
+  path += kPathSeparator;
+  for (int shift = 60; shift >= 0; shift -= 4) {
+    path += BpPathChar("0123456789abcdef"[(hash >> shift) & 0xF]);
+  }
+  path += BpPathChar('-');
+  path += GetCachePath(name);
+  return path;
+}
+
+} // namespace bpsymcache
@@ -0,0 +1,171 @@
+#ifndef __BPSYMCACHE_H
+#define __BPSYMCACHE_H
+
+// On-disk layout of the binary symbol cache that is written next to each
+// Breakpad .sym file, or to a per-user cache directory where the .sym file's
+// own directory is read-only. The cache image is position independent: every
+// table is a flat array addressed by an offset from the start of the image,
+// so a mapped cache file can be used as-is. Platform-neutral.
+
+#include "bpsymfile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace bpsymcache {
+
+const char     kMagic[8] = {'B', 'P', 'S', 'Y', 'M', 'C', 'A', 'C'};
+// Bump this whenever the layout of the header or of any section changes.
+const uint32_t kVersion = 8;
+// Sections start on cache line boundaries.
+const uint64_t kSectionAlignment = 64;
+// Number of source lines per block of eLineData.
+const uint32_t kLineBlockSize = 16;
+// Unwind code offset of STACK WIN records that have no program
+const uint32_t kNoUnwindCode = 0xFFFFFFFF;
+
+enum Section
+{
+  // Symbols, sorted by RVA; parallel arrays of uint32_t
+  eSymbolRvas,
+  eSymbolSizes,
+  eSymbolNames,     // string pool offsets
+  eSymbolParams,    // string pool offsets
+  // numSymbols + 1 indices into the line arrays; the lines of symbol i are
+  // [eSymbolLines[i], eSymbolLines[i + 1])
+  eSymbolLines,
+  // numSymbols + 1 indices into the inline arrays, like eSymbolLines
+  eSymbolInlines,
+  // Symbol indices sorted by name, one per distinct name
+  eSymbolsByName,
+  // Bloom filter over the distinct symbol names and the trigrams of their
+  // lowercased forms; a power-of-two number of uint64_t words, or none if
+  // there are no symbols (see BpNameFilter in bpnameindex.h)
+  eNameFilter,
+  // Source lines, grouped by symbol in symbol order and sorted by RVA within
+  // each symbol, in blocks of kLineBlockSize lines. The number of lines is
+  // the last entry of eSymbolLines.
+  eLineBlockOffsets, // numBlocks + 1 byte offsets into eLineData
+  eLineBlockRvas,    // RVA of the first line of each block
+  // Each line is encoded as a sequence of LEB128 varints:
+  //   zigzag(line - previous line) << 2 | (gap != 0) << 1 |
+  //     (file != previous file)
+  //   size
+  //   zigzag(gap), only if it is non-zero, where gap is
+  //     rva - (previous rva + previous size)
+  //   file, only if it differs from the previous file
+  // At the start of a block the previous RVA is the block's RVA and the
+  // previous size, line and file are all zero.
+  eLineData,
+  // One entry per address range of each INLINE record, grouped by symbol.
+  // Within a symbol the ranges are in depth-first order: each range is
+  // followed by the ranges nested inside it, and eInlineNext holds the index
+  // just past those. Parallel arrays of uint32_t.
+  eInlineRvas,
+  eInlineSizes,
+  eInlineNext,
+  eInlineNames,     // string pool offsets
+  eInlineCallLines, // line of the call site in the enclosing function
+  eInlineCallFiles, // Breakpad FILE id of the call site
+  // STACK CFI INIT records, sorted by RVA; parallel arrays of uint32_t
+  eCfiRvas,
+  eCfiSizes,
+  eCfiCode,         // eUnwindCode offsets
+  // numCfi + 1 indices into the delta arrays; the STACK CFI records that
+  // follow STACK CFI INIT record i are [eCfiDeltaStarts[i],
+  // eCfiDeltaStarts[i + 1]), sorted by RVA
+  eCfiDeltaStarts,
+  eCfiDeltaRvas,
+  eCfiDeltaCode,    // eUnwindCode offsets
+  // STACK WIN records of type 4 (FrameData) followed by those of type 0
+  // (FPO), each group sorted by RVA; an array of StackWinRecord
+  eStackWin,
+  // The rules of the records above, compiled by BpCompileCfiRules and
+  // BpCompileWinProgram (see bpunwind.h)
+  eUnwindCode,
+  // FILE records, sorted by id; parallel arrays of uint32_t
+  eFileIds,
+  eFilePaths,       // string pool offsets
+  // NUL-terminated strings; offset 0 is always the empty string
+  eStrings,
+  eSectionCount
+};
+
+struct StackWinRecord
+{
+  enum Flags
+  {
+    eAllocatesBasePointer = 1
+  };
+
+  uint32_t mRva;
+  uint32_t mCodeSize;
+  uint32_t mParamSize;
+  uint32_t mSavedRegSize;
+  uint32_t mLocalSize;
+  uint32_t mType;
+  uint32_t mFlags;
+  // eUnwindCode offset of the program, or kNoUnwindCode
+  uint32_t mCode;
+};
+
+struct SectionEntry
+{
+  uint64_t mOffset;
+  uint64_t mSize;
+};
+
+struct Header
+{
+  char         mMagic[8];
+  uint32_t     mVersion;
+  uint32_t     mHeaderSize;
+  // Size and modification time (see BpMappedFile::ModificationTime) of the
+  // .sym file the cache was generated from
+  uint64_t     mSourceSize;
+  uint64_t     mSourceTime;
+  // String pool offset of the MODULE name
+  uint32_t     mModuleName;
+  uint32_t     mReserved;
+  SectionEntry mSections[eSectionCount];
+};
+
+/**
+ * Checks that aImage is a complete, well-formed cache image of the current
+ * version. If aSourceSize is non-zero, it and aSourceTime must match the size
+ * and modification time recorded in the header, otherwise the cache is
+ * considered stale.
+ */
+bool
+Validate(const char* aImage, size_t aImageSize, uint64_t aSourceSize,
+         uint64_t aSourceTime);
+
+/**
+ * Atomically replaces aPath with aImage: the image is written to a temporary
+ * file next to aPath which is then renamed into place, so concurrent readers
+ * never observe a partially written cache.
+ */
+bool
+Write(const BpPathChar* aPath, const char* aImage, size_t aImageSize);
+
+/**
+ * "foo\\bar.sym" -> "foo\\bar.symcache"
+ */
+std::basic_string<BpPathChar>
+GetCachePath(const BpPathChar* aSymPath);
+
+/**
+ * Where the cache for aSymPath goes when it can't be written next to it:
+ * "%LOCALAPPDATA%\\mozdbgext\\symcache\\<hash>-bar.symcache" on Windows and
+ * "$XDG_CACHE_HOME/mozdbgext/symcache/<hash>-bar.symcache" (by default under
+ * "$HOME/.cache") elsewhere, where <hash> is a hash of the full path of the
+ * .sym file. If aCreate is set, the directory is created if need be. Returns
+ * an empty string if there is no such directory.
+ */
+std::basic_string<BpPathChar>
+GetUserCachePath(const BpPathChar* aSymPath, bool aCreate);
+
+} // namespace bpsymcache
+
+#endif // __BPSYMCACHE_H
@@ -0,0 +1,166 @@
+#include "bpsymfile.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+BpMappedFile::BpMappedFile()
+  : mBegin(nullptr)
+  , mSize(0)
+  , mModificationTime(0)
+  , mIsOpen(false)
+#if defined(_WIN32)
+  , mFile(INVALID_HANDLE_VALUE)
+  , mMapping(nullptr)
+#else
+  , mFd(-1)
+#endif
+{
+}
+
+BpMappedFile::~BpMappedFile()
+{
+  Close();
+}
+
+#if defined(_WIN32)
+
+bool
+BpMappedFile::Open(const BpPathChar* aPath)
+{
+  Close();
+
+  mFile = CreateFileW(aPath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (mFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  FILETIME lastWrite;
+  if (!GetFileSizeEx(mFile, &size) ||
+      static_cast<ULONGLONG>(size.QuadPart) > SIZE_MAX ||
+      !GetFileTime(mFile, nullptr, nullptr, &lastWrite)) {
+    DWORD err = GetLastError();
+    Close();
+    SetLastError(err);
+    return false;
+  }
+
+  mIsOpen = true;
+  mSize = static_cast<size_t>(size.QuadPart);
+  mModificationTime = uint64_t(lastWrite.dwHighDateTime) << 32 |
+                      lastWrite.dwLowDateTime;
+  if (!mSize) {
+    // Zero-length files cannot be mapped
+    static const char kEmpty = 0;
+    mBegin = &kEmpty;
+    return true;
+  }
+
+  mMapping = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mMapping) {
+    DWORD err = GetLastError();
+    Close();
+    SetLastError(err);
+    return false;
+  }
+
+  mBegin = static_cast<const char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0,
+                                                  0, 0));
+  if (!mBegin) {
+    DWORD err = GetLastError();
+    Close();
+    SetLastError(err);
+    return false;
+  }
+  return true;
+}
+
+void
+BpMappedFile::Close()
+{
+  if (mBegin && mSize) {
+    UnmapViewOfFile(mBegin);
+  }
+  if (mMapping) {
+    CloseHandle(mMapping);
+    mMapping = nullptr;
+  }
+  if (mFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(mFile);
+    mFile = INVALID_HANDLE_VALUE;
+  }
+  mBegin = nullptr;
+  mSize = 0;
+  mModificationTime = 0;
+  mIsOpen = false;
+}
+
+#else
+
+bool
+BpMappedFile::Open(const BpPathChar* aPath)
+{
+  Close();
+
+  mFd = open(aPath, O_RDONLY);
+  if (mFd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(mFd, &st)) {
+    Close();
+    return false;
+  }
+
+  mIsOpen = true;
+  mSize = static_cast<size_t>(st.st_size);
+  // In nanoseconds, so that a file rewritten within the same second, as
+  // generated test inputs are, still reads as changed
+#if defined(__APPLE__)
+  const struct timespec& mtime = st.st_mtimespec;
+#else
+  const struct timespec& mtime = st.st_mtim;
+#endif
+  mModificationTime = static_cast<uint64_t>(mtime.tv_sec) * 1000000000 +
+                      static_cast<uint64_t>(mtime.tv_nsec);
+  if (!mSize) {
+    static const char kEmpty = 0;
+    mBegin = &kEmpty;
+    return true;
+  }
+
+  void* view = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+  if (view == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  madvise(view, mSize, MADV_SEQUENTIAL);
+  mBegin = static_cast<const char*>(view);
+  return true;
+}
+
+void
+BpMappedFile::Close()
+{
+  if (mBegin && mSize) {
+    munmap(const_cast<char*>(mBegin), mSize);
+  }
+  if (mFd >= 0) {
+    close(mFd);
+    mFd = -1;
+  }
+  mBegin = nullptr;
+  mSize = 0;
+  mModificationTime = 0;
+  mIsOpen = false;
+}
+
+#endif
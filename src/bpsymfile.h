@@ -0,0 +1,582 @@
+#ifndef __BPSYMFILE_H
+#define __BPSYMFILE_H
+
+// Platform-neutral reader for Breakpad text symbol files. Nothing in here may
+// depend on dbgeng or on <windows.h>.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// Line records are scanned 32 bytes at a time with SSE2 where the compiler
+// allows it. Define BPSYMFILE_NO_SIMD to force the scalar parser.
+#if !defined(BPSYMFILE_NO_SIMD) && \
+    (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+     defined(__SSE2__))
+#define BPSYMFILE_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_WIN32)
+typedef wchar_t BpPathChar;
+#else
+typedef char BpPathChar;
+#endif
+
+/**
+ * Read-only mapping of an entire file. The view stays valid for as long as
+ * the BpMappedFile object is alive.
+ */
+class BpMappedFile
+{
+public:
+  BpMappedFile();
+  ~BpMappedFile();
+
+  bool Open(const BpPathChar* aPath);
+  void Close();
+
+  bool IsOpen() const { return mIsOpen; }
+  const char* Begin() const { return mBegin; }
+  const char* End() const { return mBegin + mSize; }
+  size_t Size() const { return mSize; }
+  // When the file was last written: FILETIME ticks on Windows, nanoseconds
+  // elsewhere. Only good for telling whether two versions of a file differ.
+  uint64_t ModificationTime() const { return mModificationTime; }
+
+private:
+  BpMappedFile(const BpMappedFile&) = delete;
+  BpMappedFile& operator=(const BpMappedFile&) = delete;
+
+  const char* mBegin;
+  size_t      mSize;
+  uint64_t    mModificationTime;
+  bool        mIsOpen;
+#if defined(_WIN32)
+  void*       mFile;
+  void*       mMapping;
+#else
+  int         mFd;
+#endif
+};
+
+/**
+ * A non-owning [mBegin, mEnd) slice of a mapped symbol file.
+ */
+struct BpToken
+{
+  BpToken()
+    : mBegin(nullptr)
+    , mEnd(nullptr)
+  {
+  }
+
+  BpToken(const char* aBegin, const char* aEnd)
+    : mBegin(aBegin)
+    , mEnd(aEnd)
+  {
+  }
+
+  size_t Length() const { return mEnd - mBegin; }
+  bool IsEmpty() const { return mBegin == mEnd; }
+  std::string ToString() const { return std::string(mBegin, mEnd); }
+
+  template <size_t N>
+  bool StartsWith(const char (&aLiteral)[N]) const
+  {
+    return Length() >= N - 1 && !memcmp(mBegin, aLiteral, N - 1);
+  }
+
+  const char* mBegin;
+  const char* mEnd;
+};
+
+/**
+ * The fields of a STACK WIN record. All sizes are in bytes.
+ */
+struct BpStackWin
+{
+  uint64_t mType; // 4 for FrameData, 0 for FPO
+  uint64_t mRva;
+  uint64_t mCodeSize;
+  uint64_t mPrologSize;
+  uint64_t mEpilogSize;
+  uint64_t mParamSize;
+  uint64_t mSavedRegSize;
+  uint64_t mLocalSize;
+  uint64_t mMaxStackSize;
+  // Only meaningful when mProgram is empty
+  bool     mAllocatesBasePointer;
+  // Postfix program that recovers the caller's registers, or empty
+  BpToken  mProgram;
+};
+
+namespace bpsymfile {
+
+inline bool
+IsSpace(char aChar)
+{
+  return aChar == ' ' || aChar == '\t' || aChar == '\r' || aChar == '\n' ||
+         aChar == '\v' || aChar == '\f';
+}
+
+// Returns 0-15 for a hex digit, or a value > 15 otherwise.
+inline unsigned int
+HexDigitValue(char aChar)
+{
+  unsigned int c = static_cast<unsigned char>(aChar);
+  if (c - '0' < 10) {
+    return c - '0';
+  }
+  c |= 0x20; // fold to lower case
+  if (c - 'a' < 6) {
+    return c - 'a' + 10;
+  }
+  return 0xFF;
+}
+
+// Pops the next space-delimited field off the front of aRest.
+inline bool
+NextField(BpToken& aRest, BpToken& aField)
+{
+  const char* p = aRest.mBegin;
+  const char* end = aRest.mEnd;
+  if (p == end) {
+    return false;
+  }
+  const char* space = static_cast<const char*>(memchr(p, ' ', end - p));
+  if (!space) {
+    aField = BpToken(p, end);
+    aRest = BpToken(end, end);
+  } else {
+    aField = BpToken(p, space);
+    aRest = BpToken(space + 1, end);
+  }
+  return true;
+}
+
+// Like std::hex extraction: consumes the leading run of hex digits.
+inline bool
+ParseHex(const BpToken& aField, uint64_t& aValue)
+{
+  uint64_t value = 0;
+  const char* p = aField.mBegin;
+  unsigned int digit;
+  while (p != aField.mEnd && (digit = HexDigitValue(*p)) < 16) {
+    value = (value << 4) | digit;
+    ++p;
+  }
+  aValue = value;
+  return p != aField.mBegin;
+}
+
+inline bool
+ParseDecimal(const BpToken& aField, uint64_t& aValue)
+{
+  uint64_t value = 0;
+  const char* p = aField.mBegin;
+  unsigned int digit;
+  while (p != aField.mEnd &&
+         (digit = static_cast<unsigned char>(*p) - '0') < 10) {
+    value = value * 10 + digit;
+    ++p;
+  }
+  aValue = value;
+  return p != aField.mBegin;
+}
+
+#if defined(BPSYMFILE_SSE2)
+
+inline unsigned int
+CountTrailingZeros(uint32_t aValue)
+{
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, aValue);
+  return index;
+#else
+  return __builtin_ctz(aValue);
+#endif
+}
+
+// Returns a mask with bit i set for each of the 32 bytes in aBytes for which
+// aTest is true.
+template <typename TestT>
+inline uint32_t
+Mask32(const __m128i (&aBytes)[2], TestT aTest)
+{
+  return static_cast<uint32_t>(_mm_movemask_epi8(aTest(aBytes[0]))) |
+         static_cast<uint32_t>(_mm_movemask_epi8(aTest(aBytes[1]))) << 16;
+}
+
+/**
+ * Fast path for the most common record, "<address> <size> <line> <file_id>".
+ * Classifies the 32 bytes at aLine in a handful of vector operations, which
+ * locates every delimiter and converts every digit at once; what is left is
+ * a short multiply-add per digit. All 32 bytes must be readable. Returns
+ * false, leaving the record to the general parser, unless the record ends
+ * within those 32 bytes and every field is a well-formed run of digits, so
+ * that both parsers always agree.
+ */
+inline bool
+ScanLineRecord(const char* aLine, const char*& aNext, uint64_t& aAddress,
+               uint64_t& aSize, uint64_t& aLineNo, uint64_t& aFileId)
+{
+  __m128i bytes[2];
+  bytes[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aLine));
+  bytes[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aLine + 16));
+
+  const uint32_t eolMask = Mask32(bytes, [](__m128i aChunk) {
+    return _mm_cmpeq_epi8(aChunk, _mm_set1_epi8('\n'));
+  });
+  if (!eolMask) {
+    return false;
+  }
+  size_t end = CountTrailingZeros(eolMask);
+  aNext = aLine + end + 1;
+  if (end && aLine[end - 1] == '\r') {
+    --end;
+  }
+  const uint32_t lineMask = end == 32 ? ~0U : (1U << end) - 1;
+
+  const uint32_t spaceMask = lineMask & Mask32(bytes, [](__m128i aChunk) {
+    return _mm_cmpeq_epi8(aChunk, _mm_set1_epi8(' '));
+  });
+
+  // Digit values: '0'-'9' -> 0-9 and 'a'-'f'/'A'-'F' -> 10-15. Unsigned
+  // byte comparisons are done as min(x, limit) == x.
+  alignas(16) uint8_t values[32];
+  uint32_t decMask = 0, hexMask = 0;
+  for (int i = 0; i < 2; ++i) {
+    const __m128i dec = _mm_sub_epi8(bytes[i], _mm_set1_epi8('0'));
+    const __m128i isDec =
+      _mm_cmpeq_epi8(_mm_min_epu8(dec, _mm_set1_epi8(9)), dec);
+    const __m128i alpha = _mm_sub_epi8(_mm_or_si128(bytes[i],
+                                                    _mm_set1_epi8(0x20)),
+                                       _mm_set1_epi8('a'));
+    const __m128i isAlpha =
+      _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    const __m128i value =
+      _mm_or_si128(_mm_and_si128(isDec, dec),
+                   _mm_and_si128(isAlpha,
+                                 _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+    _mm_store_si128(reinterpret_cast<__m128i*>(values) + i, value);
+    decMask |= static_cast<uint32_t>(_mm_movemask_epi8(isDec)) << (16 * i);
+    hexMask |= static_cast<uint32_t>(_mm_movemask_epi8(
+                 _mm_or_si128(isDec, isAlpha))) << (16 * i);
+  }
+
+  // Exactly three single spaces, none at either end of the record
+  uint32_t spaces = spaceMask;
+  size_t delims[4];
+  for (int i = 0; i < 3; ++i) {
+    if (!spaces) {
+      return false;
+    }
+    delims[i] = CountTrailingZeros(spaces);
+    spaces &= spaces - 1;
+  }
+  delims[3] = end;
+  if (spaces || !delims[0] || delims[1] == delims[0] + 1 ||
+      delims[2] == delims[1] + 1 || delims[3] == delims[2] + 1) {
+    return false;
+  }
+  const uint32_t hexFields = (1U << delims[1]) - 1;
+  const uint32_t decFields = lineMask & ~hexFields;
+  if ((hexFields & ~(hexMask | spaceMask)) ||
+      (decFields & ~(decMask | spaceMask))) {
+    return false;
+  }
+
+  uint64_t* const results[4] = {&aAddress, &aSize, &aLineNo, &aFileId};
+  size_t pos = 0;
+  for (int field = 0; field < 2; ++field) {
+    uint64_t value = 0;
+    for (; pos < delims[field]; ++pos) {
+      value = (value << 4) | values[pos];
+    }
+    *results[field] = value;
+    ++pos;
+  }
+  for (int field = 2; field < 4; ++field) {
+    uint64_t value = 0;
+    for (; pos < delims[field]; ++pos) {
+      value = value * 10 + values[pos];
+    }
+    *results[field] = value;
+    ++pos;
+  }
+  return true;
+}
+
+#endif // BPSYMFILE_SSE2
+
+// Splits "func(params)" into name and parameter list, taking care not to
+// split "operator()(params)" at the wrong parenthesis.
+inline void
+SplitFunctionName(const BpToken& aFullName, BpToken& aName, BpToken& aParams)
+{
+  static const char kOperator[] = "operator";
+  const size_t kOperatorLen = sizeof(kOperator) - 1;
+
+  const char* end = aFullName.mEnd;
+  const char* paren = static_cast<const char*>(
+      memchr(aFullName.mBegin, '(', aFullName.Length()));
+  if (paren && size_t(paren - aFullName.mBegin) >= kOperatorLen &&
+      !memcmp(paren - kOperatorLen, kOperator, kOperatorLen)) {
+    paren = static_cast<const char*>(memchr(paren + 1, '(', end - paren - 1));
+  }
+  if (!paren) {
+    aName = aFullName;
+    aParams = BpToken(end, end);
+    return;
+  }
+  aName = BpToken(aFullName.mBegin, paren);
+  aParams = BpToken(paren, end);
+}
+
+// Source paths from Mozilla's symbol server look like
+// "hg:hg.mozilla.org/mozilla-central:path/to/file.cpp:changeset"; reduce
+// those to "path/to/file.cpp".
+inline BpToken
+SanitizeFilePath(const BpToken& aPath)
+{
+  if (!aPath.StartsWith("hg:")) {
+    return aPath;
+  }
+  const char* repo = aPath.mBegin + 3;
+  const char* path = static_cast<const char*>(
+      memchr(repo, ':', aPath.mEnd - repo));
+  if (!path) {
+    return BpToken(aPath.mEnd, aPath.mEnd);
+  }
+  ++path;
+  const char* last = aPath.mEnd;
+  while (last != path && last[-1] != ':') {
+    --last;
+  }
+  return BpToken(path, last == path ? aPath.mEnd : last - 1);
+}
+
+} // namespace bpsymfile
+
+/**
+ * Scans the Breakpad records in [aBegin, aEnd) in place. No record is copied;
+ * every string handed to aSink points into the caller's buffer.
+ *
+ * SinkT must provide:
+ *   void Module(const BpToken& aName);
+ *   void File(uint64_t aId, const BpToken& aPath);
+ *   void Function(uint64_t aRva, uint64_t aSize, const BpToken& aName,
+ *                 const BpToken& aParams);
+ *   void Public(uint64_t aRva, const BpToken& aName);
+ *   void Line(uint64_t aRva, uint64_t aSize, uint64_t aLine,
+ *             uint64_t aFileId);
+ *   void InlineOrigin(uint64_t aId, const BpToken& aName);
+ *   // Called once for each address range of an INLINE record
+ *   void Inline(uint64_t aDepth, uint64_t aCallLine, uint64_t aCallFileId,
+ *               uint64_t aOriginId, uint64_t aRva, uint64_t aSize);
+ *   void StackCfiInit(uint64_t aRva, uint64_t aSize, const BpToken& aRules);
+ *   void StackCfi(uint64_t aRva, const BpToken& aRules);
+ *   void StackWin(const BpStackWin& aRecord);
+ */
+template <typename SinkT>
+void
+ParseBpSymbols(const char* aBegin, const char* aEnd, SinkT& aSink)
+{
+  using namespace bpsymfile;
+
+  const char* cur = aBegin;
+  while (cur < aEnd) {
+#if defined(BPSYMFILE_SSE2)
+    if (aEnd - cur >= 32 && HexDigitValue(*cur) < 16) {
+      uint64_t address, size, lineNo, fileId;
+      const char* next;
+      if (ScanLineRecord(cur, next, address, size, lineNo, fileId)) {
+        aSink.Line(address, size, lineNo, fileId);
+        cur = next;
+        continue;
+      }
+    }
+#endif
+
+    const char* eol = static_cast<const char*>(memchr(cur, '\n', aEnd - cur));
+    if (!eol) {
+      eol = aEnd;
+    }
+    BpToken line(cur, eol);
+    cur = eol + 1;
+
+    while (line.mEnd != line.mBegin && IsSpace(line.mEnd[-1])) {
+      --line.mEnd;
+    }
+    if (line.IsEmpty()) {
+      continue;
+    }
+
+    BpToken field;
+    uint64_t address, size, value;
+
+    switch (*line.mBegin) {
+      case 'M':
+        if (line.StartsWith("MODULE ")) {
+          // MODULE <os> <arch> <id> <name>
+          BpToken rest(line.mBegin + 7, line.mEnd);
+          if (!NextField(rest, field) || !NextField(rest, field) ||
+              !NextField(rest, field) || rest.IsEmpty()) {
+            continue;
+          }
+          // chop off any extension
+          const char* dot = rest.mEnd;
+          while (dot != rest.mBegin && dot[-1] != '.') {
+            --dot;
+          }
+          if (dot != rest.mBegin) {
+            rest.mEnd = dot - 1;
+          }
+          aSink.Module(rest);
+        }
+        continue;
+      case 'P':
+        if (line.StartsWith("PUBLIC ")) {
+          // PUBLIC [m] <address> <param_size> <name>
+          BpToken rest(line.mBegin + 7, line.mEnd);
+          if (rest.StartsWith("m ")) {
+            rest.mBegin += 2;
+          }
+          if (!NextField(rest, field) || !ParseHex(field, address) ||
+              !NextField(rest, field)) {
+            continue;
+          }
+          aSink.Public(address, rest);
+        }
+        continue;
+      case 'F':
+        if (line.StartsWith("FUNC ")) {
+          // FUNC [m] <address> <size> <param_size> <name>
+          BpToken rest(line.mBegin + 5, line.mEnd);
+          if (rest.StartsWith("m ")) {
+            rest.mBegin += 2;
+          }
+          if (!NextField(rest, field) || !ParseHex(field, address) ||
+              !NextField(rest, field) || !ParseHex(field, size) ||
+              !NextField(rest, field)) {
+            continue;
+          }
+          BpToken name, params;
+          SplitFunctionName(rest, name, params);
+          aSink.Function(address, size, name, params);
+          continue;
+        }
+        if (line.StartsWith("FILE ")) {
+          // FILE <id> <path>
+          BpToken rest(line.mBegin + 5, line.mEnd);
+          if (!NextField(rest, field) || !ParseDecimal(field, value)) {
+            continue;
+          }
+          aSink.File(value, SanitizeFilePath(rest));
+          continue;
+        }
+        break;
+      case 'I':
+        if (line.StartsWith("INLINE_ORIGIN ")) {
+          // INLINE_ORIGIN <origin_id> <name>
+          // Older dump_syms versions wrote a file id before the name; C++
+          // names never start with a digit, so that is easy to skip.
+          BpToken rest(line.mBegin + 14, line.mEnd);
+          if (!NextField(rest, field) || !ParseDecimal(field, value) ||
+              rest.IsEmpty()) {
+            continue;
+          }
+          BpToken name(rest);
+          uint64_t fileId;
+          if (NextField(rest, field) && ParseDecimal(field, fileId) &&
+              !rest.IsEmpty()) {
+            name = rest;
+          }
+          aSink.InlineOrigin(value, name);
+        } else if (line.StartsWith("INLINE ")) {
+          // INLINE <depth> <call_line> <call_file_id> <origin_id>
+          //        [<address> <size>]+
+          uint64_t depth, callLine, callFile;
+          BpToken rest(line.mBegin + 7, line.mEnd);
+          if (!NextField(rest, field) || !ParseDecimal(field, depth) ||
+              !NextField(rest, field) || !ParseDecimal(field, callLine) ||
+              !NextField(rest, field) || !ParseDecimal(field, callFile) ||
+              !NextField(rest, field) || !ParseDecimal(field, value)) {
+            continue;
+          }
+          while (NextField(rest, field) && ParseHex(field, address) &&
+                 NextField(rest, field) && ParseHex(field, size)) {
+            aSink.Inline(depth, callLine, callFile, value, address, size);
+          }
+        }
+        continue;
+      case 'S':
+        if (line.StartsWith("STACK CFI INIT ")) {
+          // STACK CFI INIT <address> <size> <rules>
+          BpToken rest(line.mBegin + 15, line.mEnd);
+          if (!NextField(rest, field) || !ParseHex(field, address) ||
+              !NextField(rest, field) || !ParseHex(field, size)) {
+            continue;
+          }
+          aSink.StackCfiInit(address, size, rest);
+        } else if (line.StartsWith("STACK CFI ")) {
+          // STACK CFI <address> <rules>
+          BpToken rest(line.mBegin + 10, line.mEnd);
+          if (!NextField(rest, field) || !ParseHex(field, address)) {
+            continue;
+          }
+          aSink.StackCfi(address, rest);
+        } else if (line.StartsWith("STACK WIN ")) {
+          // STACK WIN <type> <address> <code_size> <prolog_size>
+          //           <epilog_size> <param_size> <saved_reg_size>
+          //           <local_size> <max_stack_size> <has_program>
+          //           <program|allocates_base_pointer>
+          BpToken rest(line.mBegin + 10, line.mEnd);
+          BpStackWin record;
+          uint64_t* const fields[] = {
+            &record.mType, &record.mRva, &record.mCodeSize,
+            &record.mPrologSize, &record.mEpilogSize, &record.mParamSize,
+            &record.mSavedRegSize, &record.mLocalSize, &record.mMaxStackSize,
+            &value};
+          bool ok = true;
+          for (uint64_t* f : fields) {
+            ok = ok && NextField(rest, field) && ParseHex(field, *f);
+          }
+          if (!ok || rest.IsEmpty()) {
+            continue;
+          }
+          if (value) {
+            record.mAllocatesBasePointer = false;
+            record.mProgram = rest;
+          } else {
+            record.mAllocatesBasePointer = *rest.mBegin != '0';
+          }
+          aSink.StackWin(record);
+        }
+        continue;
+      default:
+        break;
+    }
+
+    if (HexDigitValue(*line.mBegin) < 16) {
+      // <address> <size> <line> <file_id>
+      uint64_t lineNo, fileId;
+      BpToken rest(line);
+      if (!NextField(rest, field) || !ParseHex(field, address) ||
+          !NextField(rest, field) || !ParseHex(field, size) ||
+          !NextField(rest, field) || !ParseDecimal(field, lineNo) ||
+          !NextField(rest, field) || !ParseDecimal(field, fileId)) {
+        continue;
+      }
+      aSink.Line(address, size, lineNo, fileId);
+    }
+  }
+}
+
+#endif // __BPSYMFILE_H
@@ -1,9 +1,18 @@
 #include "mozdbgext.h"
 #include "mozdbgextcb.h"
 #include "pe.h"
+#include "bpcodemap.h"
+#include "bphitcounts.h"
+#include "bpnameindex.h"
+#include "bpsamples.h"
+#include "bpstacks.h"
 #include "bpsyms.h"
+#include "bpsymfile.h"
+#include "bpsymstore.h"
+#include "bpsymtable.h"
+#include "bpunwind.h"
+#include "parallel.h"
 
-#include <pathcch.h>
 #include <winnt.h>
 
 #ifdef max
@@ -15,17 +24,21 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <ctype.h>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <ios>
 #include <limits>
-#include <locale>
 #include <map>
 #include <memory>
-#include <regex>
 #include <sstream>
+#include <stdlib.h>
 #include <string>
+#include <string.h>
 #include <unordered_map>
+#include <vector>
 
 #pragma pack(push, 1)
 struct IMAGE_DEBUG_INFO_CODEVIEW
@@ -37,13 +50,6 @@ struct IMAGE_DEBUG_INFO_CODEVIEW
 };
 #pragma pack(pop)
 
-enum SymbolType
-{
-  eFunctionSymbol,
-  ePublicSymbol,
-  eLineSymbol
-};
-
 static std::wstring
 GenerateDebugInfoUniqueId(REFGUID aGuid, DWORD aAge)
 {
@@ -138,325 +144,486 @@ split(const std::basic_string<CharType>& aBuf, const CharType aDelim,
   return result;
 }
 
-static void
-trim(std::string& aStr)
-{
-  if (aStr.empty()) {
-    return;
-  }
-  auto i = aStr.rbegin();
-  while (i != aStr.rend() && (std::isspace(*i, std::locale::classic()))) {
-    i = std::string::reverse_iterator(aStr.erase(i.base() - 1));
-  }
-}
+namespace {
 
-template <typename CharType, size_t N>
-static bool
-startswith(const std::basic_string<CharType>& aStr,
-           const CharType (&aLiteral)[N])
+// The Breakpad symbols for one particular build of a module. Every process
+// that has that build loaded shares the same instance.
+struct ModuleSymbols
 {
-  return aStr.find(aLiteral) == 0;
-}
+  ModuleSymbols()
+    : mSymSize(0)
+    , mLoadAttempted(false)
+  {
+  }
+  // The module's .sym file and its size, or empty if there is none. The file
+  // is not loaded until something first needs the module's symbols.
+  std::wstring mSymPath;
+  ULONG64      mSymSize;
+  bool         mLoadAttempted;
+  // Flat symbol, line and file tables; null until the module's Breakpad
+  // symbols have been loaded.
+  std::unique_ptr<BpSymbolTable> mTable;
+  // Glob search index over mTable's names; null until the first search
+  std::unique_ptr<BpNameIndex>   mNameIndex;
+};
 
-static void
-SanitizeFilePath(std::string& aStr)
+// A module that is loaded in a particular process
+struct ModuleInfo
 {
-  if (startswith(aStr, "hg:")) {
-    auto tokens = split(aStr, ':', 3);
-    aStr = tokens[2].substr(0, tokens[2].find_last_of(':'));
+  ModuleInfo(ULONG aSize, const std::string& aName,
+             const std::shared_ptr<ModuleSymbols>& aSymbols)
+    : mSize(aSize)
+    , mName(aName)
+    , mSymbols(aSymbols)
+  {
   }
-}
+  ULONG64     mSize;
+  std::string mName;
+  // Null if the module has no CodeView debug id
+  std::shared_ptr<ModuleSymbols> mSymbols;
+};
 
-static const size_t kSymBufLen = 0x1000000; // 16MB
+/**
+ * The modules of one process as sorted [base, base + size) intervals, kept
+ * in parallel arrays so that address lookups only touch the bases.
+ */
+class ModuleIntervals
+{
+public:
+  static const size_t kNotFound = ~size_t(0);
 
-namespace {
+  ModuleIntervals()
+    : mGeneration(0)
+  {
+  }
 
-struct BpLineInfo
-{
-  BpLineInfo(ULONG64 aRva, ULONG aSize, ULONG64 aFileId, ULONG64 aNameInt)
-    : mRva(aRva)
-    , mSize(aSize)
-    , mFileId(aFileId)
-    , mNameInt(aNameInt)
+  void Insert(ULONG64 aBase, const std::shared_ptr<ModuleInfo>& aModule)
   {
+    ++mGeneration;
+    size_t index = std::lower_bound(mBases.begin(), mBases.end(), aBase) -
+                   mBases.begin();
+    if (index < mBases.size() && mBases[index] == aBase) {
+      mEnds[index] = aBase + aModule->mSize;
+      mModules[index] = aModule;
+      return;
+    }
+    mBases.insert(mBases.begin() + index, aBase);
+    mEnds.insert(mEnds.begin() + index, aBase + aModule->mSize);
+    mModules.insert(mModules.begin() + index, aModule);
   }
 
-  ULONG64 mRva;
-  ULONG   mSize;
-  ULONG64 mFileId;
-  ULONG64 mNameInt;
-};
+  void Erase(ULONG64 aBase)
+  {
+    ++mGeneration;
+    size_t index = std::lower_bound(mBases.begin(), mBases.end(), aBase) -
+                   mBases.begin();
+    if (index < mBases.size() && mBases[index] == aBase) {
+      mBases.erase(mBases.begin() + index);
+      mEnds.erase(mEnds.begin() + index);
+      mModules.erase(mModules.begin() + index);
+    }
+  }
 
-struct ModuleInfo;
+  // Returns the index of the module containing aAddress, or kNotFound
+  size_t Find(ULONG64 aAddress) const
+  {
+    size_t length = mBases.size();
+    if (!length) {
+      return kNotFound;
+    }
+    // Branchless binary search for the last base <= aAddress
+    const ULONG64* base = mBases.data();
+    while (length > 1) {
+      size_t half = length / 2;
+      base = base[half] <= aAddress ? base + half : base;
+      length -= half;
+    }
+    size_t index = base - mBases.data();
+    if (*base > aAddress || aAddress >= mEnds[index]) {
+      return kNotFound;
+    }
+    return index;
+  }
 
-// 1) sort by offset to do symbol lookup;
-// 2) sort by name to do name lookup
-struct BpSymbolInfo
-{
-  BpSymbolInfo(ULONG64 aRva, ULONG aSize, std::string& aName,
-               std::string& aParams)
-    : mRva(aRva)
-    , mSize(aSize)
-    , mName(aName)
-    , mParams(aParams)
+  size_t Count() const { return mBases.size(); }
+  // Changes whenever a module is added or removed
+  ULONG64 Generation() const { return mGeneration; }
+  ULONG64 Base(size_t aIndex) const { return mBases[aIndex]; }
+  ULONG64 End(size_t aIndex) const { return mEnds[aIndex]; }
+  const std::shared_ptr<ModuleInfo>& Module(size_t aIndex) const
   {
+    return mModules[aIndex];
   }
-  ULONG64     mRva;
-  ULONG       mSize;
-  std::string mName;
-  std::string mParams;
-  std::weak_ptr<ModuleInfo> mModule;
+
+private:
+  std::vector<ULONG64>                     mBases;
+  std::vector<ULONG64>                     mEnds;
+  std::vector<std::shared_ptr<ModuleInfo>> mModules;
+  ULONG64                                  mGeneration;
 };
 
-struct ModuleInfo
+/**
+ * Direct-mapped cache of formatted symbols for one process, so that the
+ * return addresses of a stack that is dumped over and over again are only
+ * resolved and formatted once. Entries from an older module generation are
+ * treated as misses. Only Breakpad results are stored: engine names and bare
+ * addresses change whenever dbgeng loads or reloads symbols, which the
+ * module generation knows nothing about.
+ */
+class FormattedSymbolCache
 {
-  ModuleInfo(ULONG aSize, const std::string& aName)
-    : mSize(aSize)
-    , mName(aName)
+public:
+  struct Entry
+  {
+    ULONG64     mAddress;
+    ULONG64     mGeneration;
+    ULONG       mFlags;
+    bool        mValid;
+    bool        mFound;
+    bool        mHasSymOffset;
+    ULONG64     mSymOffset;
+    std::string mOutput;
+  };
+
+  // Returns the slot for aAddress, which the caller checks with IsHit and
+  // refills on a miss.
+  Entry& Lookup(ULONG64 aAddress, ULONG aFlags)
   {
+    if (mEntries.empty()) {
+      mEntries.resize(kNumEntries);
+    }
+    ULONG64 hash = (aAddress ^ (ULONG64(aFlags) << 59)) * 0x9E3779B97F4A7C15ULL;
+    return mEntries[size_t(hash >> (64 - kNumEntriesLog2))];
   }
-  ULONG64     mSize;
-  std::string mName;
-  typedef std::unordered_map<ULONG64,std::string> FileMapType;
-  FileMapType mFileMap;
-  typedef std::map<UINT64,BpLineInfo> LineMapType;
-  LineMapType mSourceLineSyms;
-  typedef std::shared_ptr<BpSymbolInfo> MapValueSymbol;
-  typedef std::map<UINT64,MapValueSymbol> SymbolRvaMapType;
-  SymbolRvaMapType mSymsByRva;
-  typedef std::map<std::string,MapValueSymbol> SymbolNameMapType;
-  SymbolNameMapType mSymsByName;
-};
 
-struct ModuleKey
-{
-  ModuleKey(ULONG aPid, ULONG64 aBase)
-    : mPid(aPid)
-    , mBase(aBase)
-  {}
-  bool operator<(const ModuleKey& aOther) const
+  static bool IsHit(const Entry& aEntry, ULONG64 aAddress, ULONG aFlags,
+                    ULONG64 aGeneration)
   {
-    return mPid < aOther.mPid ||
-           mPid == aOther.mPid && mBase < aOther.mBase;
+    return aEntry.mValid && aEntry.mAddress == aAddress &&
+           aEntry.mFlags == aFlags && aEntry.mGeneration == aGeneration;
   }
-  ULONG   mPid;
-  ULONG64 mBase;
+
+private:
+  static const size_t kNumEntriesLog2 = 12;
+  static const size_t kNumEntries = size_t(1) << kNumEntriesLog2;
+
+  std::vector<Entry> mEntries;
 };
 
 } // anonymous namespace
 
-static std::map<std::string,std::shared_ptr<ModuleInfo>> gModuleInfoByName;
-static std::map<ModuleKey,std::shared_ptr<ModuleInfo>> gModuleInfoByKey;
-
-std::shared_ptr<ModuleInfo>
-EmplaceModule(const ULONG aPid, const std::string& aModName,
-              DEBUG_MODULE_PARAMETERS& aModParams)
+// Keyed by "<pdb name>/<debug id>", so that different builds of a module
+// never share symbols while identical builds in different processes do.
+static std::map<std::wstring,std::shared_ptr<ModuleSymbols>> gModuleSymbolsById;
+static std::unordered_map<ULONG,ModuleIntervals> gModulesByPid;
+static std::unordered_map<ULONG,FormattedSymbolCache> gSymbolCaches;
+// The code ranges of each process, for stack scanning, and the
+// ModuleIntervals generation that they were built for
+static std::unordered_map<ULONG,std::pair<ULONG64,BpCodeMap>> gCodeMaps;
+static ULONG64 gSymbolCacheHits;
+static ULONG64 gSymbolCacheMisses;
+// Breakpoints that count their hits instead of stopping, and whether new
+// breakpoints set by bpbp and bpx join them; see !bpprof
+static BpHitCounts gHitCounts;
+static bool gCountNewBreakpoints;
+static bool gBreakpointEventsRegistered;
+// The command of counting breakpoints, a comment, which tells them apart
+// from a breakpoint of the user's that the engine gave a reused id
+static const char kCountingBreakpointCommand[] = "$$ !bpprof";
+
+// Finds the module named aName in the current process.
+static std::shared_ptr<ModuleInfo>
+FindModuleByName(const std::string& aName)
 {
-  auto module = gModuleInfoByName.emplace(
-      std::piecewise_construct,
-      std::forward_as_tuple(aModName),
-      std::forward_as_tuple(std::make_shared<ModuleInfo>(aModParams.Size,
-                                                         aModName)));
-  gModuleInfoByKey.emplace(
-                      std::piecewise_construct,
-                      std::forward_as_tuple(ModuleKey(aPid, aModParams.Base)),
-                      std::forward_as_tuple((*module.first).second));
+  ULONG pid;
+  if (FAILED(gDebugSystemObjects->GetCurrentProcessId(&pid))) {
+    dprintf("GetCurrentProcessId failed\n");
+    return nullptr;
+  }
+  auto modules = gModulesByPid.find(pid);
+  if (modules == gModulesByPid.end()) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < modules->second.Count(); ++i) {
+    if (modules->second.Module(i)->mName == aName) {
+      return modules->second.Module(i);
+    }
+  }
+  return nullptr;
+}
 
-  return module.first->second;
+// Drops the symbols of builds that are no longer loaded in any process.
+static void
+PruneModuleSymbols()
+{
+  for (auto itr = gModuleSymbolsById.begin(); itr != gModuleSymbolsById.end();) {
+    if (itr->second.use_count() == 1) {
+      itr = gModuleSymbolsById.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
 }
 
-template <typename CallbackT>
+namespace {
+
+// A module whose .sym file is loaded off the debugger thread. Everything that
+// needs dbgeng happens before or after (FinishBpSymbolLoad) the load itself.
+struct BpSymbolLoadJob
+{
+  explicit BpSymbolLoadJob(const std::shared_ptr<ModuleSymbols>& aSymbols)
+    : mSymbols(aSymbols)
+    , mOpenFailed(false)
+    , mFromCache(false)
+    , mCacheWriteFailed(false)
+  {
+  }
+
+  std::shared_ptr<ModuleSymbols> mSymbols;
+  // Results
+  bool                           mOpenFailed;
+  bool                           mFromCache;
+  bool                           mCacheWriteFailed;
+  std::string                    mBpModuleName;
+  // Why parsing or mapping the file failed, typically std::bad_alloc for a
+  // big file in a 32-bit debugger
+  std::string                    mLoadError;
+};
+
+} // anonymous namespace
+
+// Runs on a worker thread: may only touch aJob. Parsing uses up to
+// aMaxThreads threads of its own.
 static void
-LoadBpSymbolFile(ModuleInfo& aModuleInfo, const wchar_t* aSymPath,
-                 CallbackT&& aCb)
+LoadBpSymbolFile(BpSymbolLoadJob& aJob, unsigned int aMaxThreads)
 {
-  // Don't load the symbols if we already have them in memory.
-  if (!aModuleInfo.mSymsByRva.empty()) {
+  const wchar_t* symPath = aJob.mSymbols->mSymPath.c_str();
+
+  BpMappedFile file;
+  if (!file.Open(symPath)) {
+    aJob.mOpenFailed = true;
     return;
   }
 
-  auto buffer = std::make_unique<char[]>(kSymBufLen);
-  std::ifstream i(aSymPath);
-  if (!i) {
-    DWORD fileAttrs = GetFileAttributesW(aSymPath);
-    if (fileAttrs == INVALID_FILE_ATTRIBUTES &&
-        GetLastError() == ERROR_PATH_NOT_FOUND) {
-      // We don't have breakpad symbols for every module out there.
-      // Fail silently in this case.
-      return;
+  // .sym files never change for a given debug id, so once we have parsed one
+  // we keep a binary image of the resulting tables next to it, or in the
+  // user's cache directory if the symbols live somewhere read-only.
+  std::wstring cachePath(bpsymcache::GetCachePath(symPath));
+  const uint64_t symTime = file.ModificationTime();
+  auto table = BpSymbolTable::Map(cachePath.c_str(), file.Size(), symTime);
+  if (!table) {
+    std::wstring userCachePath(bpsymcache::GetUserCachePath(symPath, false));
+    if (!userCachePath.empty()) {
+      table = BpSymbolTable::Map(userCachePath.c_str(), file.Size(), symTime);
     }
-    dprintf("Failed to open \"%S\"\n", aSymPath);
-    return;
   }
-  i.rdbuf()->pubsetbuf(buffer.get(), kSymBufLen);
-  ModuleInfo::FileMapType& fileMap = aModuleInfo.mFileMap;
-  std::string moduleName;
-  HRESULT hr;
-  std::string line;
-  while (true) {
-    if (!std::getline(i, line)) {
-      break;
+  if (!table) {
+    table = BpSymbolTable::Parse(file.Begin(), file.End(), symTime,
+                                 aMaxThreads);
+    if (!table->Save(cachePath.c_str())) {
+      std::wstring userCachePath(bpsymcache::GetUserCachePath(symPath,
+                                                              true));
+      aJob.mCacheWriteFailed = userCachePath.empty() ||
+                               !table->Save(userCachePath.c_str());
     }
-    trim(line);
-    if (line.empty()) {
-      continue;
-    }
-    if (startswith(line, "MODULE ")) {
-      auto tokens = split(line, ' ', 5);
-      moduleName = tokens[4];
-      std::string::size_type pos = moduleName.find_last_of('.');
-      // chop off any extension
-      if (pos != std::string::npos) {
-        moduleName.erase(moduleName.begin() + pos, moduleName.end());
-      }
-    } else if (startswith(line, "FUNC ")) {
-      std::vector<std::string> tokens;
-      size_t startIndex;
-
-      if (startswith(line, "FUNC m ")) {
-        tokens = split(line, ' ', 6);
-        startIndex = 2;
-      } else {
-        tokens = split(line, ' ', 5);
-        startIndex = 1;
-      }
+  }
+  aJob.mFromCache = table->IsMapped();
+  aJob.mBpModuleName = table->ModuleName();
+  aJob.mSymbols->mTable = std::move(table);
+}
 
-      std::istringstream issAddress(tokens[startIndex]);
-      std::istringstream issSize(tokens[startIndex + 1]);
-      ULONG64 address, size;
-      issAddress >> std::hex >> address;
-      issSize >> std::hex >> size;
-      // Distinguish between func(params) and operator()(params)
-      const size_t funcNameIndex = startIndex + 3;
-      auto paramPos = tokens[funcNameIndex].find('(');
-      const auto strOperatorLen = ArrayLength("operator") - 1;
-      if (paramPos != std::string::npos && paramPos >= strOperatorLen) {
-        auto startPos = paramPos - strOperatorLen;
-        if (tokens[funcNameIndex].find("operator", startPos, strOperatorLen) == startPos) {
-          paramPos = tokens[funcNameIndex].find('(', paramPos + 1);
-        }
-      }
-      std::string symName(tokens[funcNameIndex].substr(0, paramPos));
-      std::string params;
-      if (paramPos != std::string::npos) {
-        params = tokens[funcNameIndex].substr(paramPos);
-      }
-      aCb(eFunctionSymbol, address, size, aModuleInfo, symName, params,
-          0, 0);
-    } else if(startswith(line, "PUBLIC ")) {
-      std::vector<std::string> tokens;
-      size_t startIndex;
-
-      if (startswith(line, "PUBLIC m ")) {
-        tokens = split(line, ' ', 5);
-        startIndex = 2;
-      } else {
-        tokens = split(line, ' ', 4);
-        startIndex = 1;
+// Every .sym file that we know about, from all of the symbol roots passed to
+// !bploadsyms
+static BpSymbolStore gSymbolStore;
+static std::string gSymbolRoots;
+// Bumped whenever the store is rescanned. Each process remembers the scan
+// its modules were looked up in, so that they are looked up again after one.
+static ULONG64 gSymbolStoreGeneration;
+static std::unordered_map<ULONG, ULONG64> gSymbolStoreGenerationByPid;
+
+// Debugger thread. Publishes aModName, sharing the symbols of any other
+// process that has the same build loaded. Otherwise only the location of its
+// .sym file is recorded; the file is loaded once its symbols are first needed.
+static void
+RegisterBpSymbols(const ULONG aPid, const std::string& aModName,
+                  const DEBUG_MODULE_PARAMETERS& aModParams)
+{
+  // Extract the unique ids for the pdb file from the module headers
+  std::shared_ptr<ModuleSymbols> symbols;
+  std::wstring uid, pdbFile;
+  if (GetDebugInfoUniqueId(aModParams.Base, uid, pdbFile)) {
+    std::shared_ptr<ModuleSymbols>& entry =
+      gModuleSymbolsById[pdbFile + L"/" + uid];
+    if (!entry) {
+      // We don't have breakpad symbols for every module out there, so a
+      // module that isn't in the symbol store simply gets none.
+      entry = std::make_shared<ModuleSymbols>();
+      uint64_t symSize;
+      if (gSymbolStore.Find(pdbFile, uid, entry->mSymPath, symSize)) {
+        entry->mSymSize = symSize;
       }
+    }
+    symbols = entry;
+  }
 
-      std::istringstream issAddress(tokens[startIndex]);
-      ULONG64 address;
-      issAddress >> std::hex >> address;
-      aCb(ePublicSymbol, address, 0, aModuleInfo, tokens[startIndex + 2],
-          std::string(), 0, 0);
-    } else if (startswith(line, "FILE ")) {
-      auto tokens = split(line, ' ', 3);
-      std::istringstream issFileId(tokens[1]);
-      ULONG64 fileId;
-      issFileId >> std::dec >> fileId;
-      SanitizeFilePath(fileMap[fileId] = tokens[2]);
-    } else if (std::isxdigit(line[0], std::locale::classic())) {
-      // line record
-      auto tokens = split(line, ' ', 4);
-      std::istringstream issAddress(tokens[0]);
-      std::istringstream issSize(tokens[1]);
-      std::istringstream issLine(tokens[2]);
-      std::istringstream issFileId(tokens[3]);
-      ULONG64 address, size, lineNo, fileId;
-      issAddress >> std::hex >> address;
-      issSize >> std::hex >> size;
-      issLine >> std::dec >> lineNo;
-      issFileId >> std::dec >> fileId;
-      aCb(eLineSymbol, address, size, aModuleInfo, std::string(),
-          std::string(), fileId, lineNo);
-    }
-  }
-  symprintf("Loaded Module \"%s\"\n", moduleName.c_str());
+  gModulesByPid[aPid].Insert(aModParams.Base,
+                             std::make_shared<ModuleInfo>(aModParams.Size,
+                                                          aModName, symbols));
 }
 
-template <typename CallbackT>
-static bool
-LoadBpSymbols(const std::wstring& aBasePdbPath, ModuleInfo& aModuleInfo,
-              const ULONG64 aBase, CallbackT&& aCb)
+// Debugger thread. Reports the outcome of a job.
+static void
+FinishBpSymbolLoad(BpSymbolLoadJob& aJob)
 {
-  // Extract the unique ids for the pdb file from the module headers
-  std::wstring uid, pdbFile;
-  if (!GetDebugInfoUniqueId(aBase, uid, pdbFile)) {
-    return false;
+  const std::wstring& symPath = aJob.mSymbols->mSymPath;
+  if (aJob.mOpenFailed) {
+    dprintf("Failed to open \"%S\"\n", symPath.c_str());
+  } else if (!aJob.mLoadError.empty()) {
+    dprintf("Failed to load \"%S\": %s\n", symPath.c_str(),
+            aJob.mLoadError.c_str());
+  } else {
+    if (aJob.mCacheWriteFailed) {
+      symprintf("Failed to write symbol cache for \"%S\", either next to it "
+                "or in the user's cache directory\n", symPath.c_str());
+    }
+    symprintf("Loaded Module \"%s\"%s\n", aJob.mBpModuleName.c_str(),
+              aJob.mFromCache ? " from cache" : "");
   }
-  // Construct the breakpad symbol path
-  wchar_t pdbPath[MAX_PATH + 1] = {0};
-  wcsncpy(pdbPath, aBasePdbPath.c_str(), MAX_PATH);
-  HRESULT hr;
-  hr = PathCchAppend(pdbPath, MAX_PATH, (pdbFile + L".pdb").c_str());
-  if (FAILED(hr)) {
-    dprintf("Path append failed\n");
-    return false;
+  aJob.mSymbols->mLoadAttempted = true;
+}
+
+// Debugger thread. Loads the symbols of every module in aModules that has a
+// .sym file which hasn't been loaded yet. Each file is only tried once.
+static void
+EnsureBpSymbols(const std::vector<std::shared_ptr<ModuleSymbols>>& aModules)
+{
+  std::vector<BpSymbolLoadJob> jobs;
+  for (auto&& symbols : aModules) {
+    if (symbols && !symbols->mLoadAttempted && !symbols->mSymPath.empty() &&
+        std::none_of(jobs.begin(), jobs.end(),
+                     [&](const BpSymbolLoadJob& aJob) {
+                       return aJob.mSymbols == symbols;
+                     })) {
+      jobs.emplace_back(symbols);
+    }
   }
-  hr = PathCchAppend(pdbPath, MAX_PATH, uid.c_str());
-  if (FAILED(hr)) {
-    dprintf("Path append failed\n");
-    return false;
+  if (jobs.empty()) {
+    return;
   }
-  hr = PathCchAppend(pdbPath, MAX_PATH, (pdbFile + L".sym").c_str());
-  if (FAILED(hr)) {
-    dprintf("Path append failed\n");
-    return false;
+
+  // Biggest files first: they are parsed on their own below, and among the
+  // rest, starting the big ones early keeps the threads evenly busy.
+  std::stable_sort(jobs.begin(), jobs.end(),
+                   [](const BpSymbolLoadJob& aLeft,
+                      const BpSymbolLoadJob& aRight) {
+    return aLeft.mSymbols->mSymSize > aRight.mSymbols->mSymSize;
+  });
+
+  // A file that fails to load must not take the other jobs, or the debugger,
+  // down with it.
+  auto load = [&](size_t aIndex, unsigned int aMaxThreads) -> void {
+    BpSymbolLoadJob& job = jobs[aIndex];
+    try {
+      LoadBpSymbolFile(job, aMaxThreads);
+    } catch (const std::exception& e) {
+      job.mLoadError = e.what();
+      job.mSymbols->mTable.reset();
+    }
+  };
+
+  // Each thread of a parse holds a chunk's worth of records, so running
+  // parallel parses side by side would multiply both the threads and the
+  // memory in flight, which a 32-bit debugger can't afford. Big files are
+  // parsed one at a time with every thread; the rest share the threads, one
+  // file each.
+  const uint64_t kMinParallelParseSize = 0x4000000; // 64MB
+  size_t numBig = 0;
+  while (numBig < jobs.size() &&
+         jobs[numBig].mSymbols->mSymSize >= kMinParallelParseSize) {
+    load(numBig++, GetWorkerThreadCount());
+  }
+  ParallelFor(jobs.size() - numBig, [&](size_t aIndex) -> void {
+    load(numBig + aIndex, 1);
+  });
+
+  for (auto&& job : jobs) {
+    FinishBpSymbolLoad(job);
   }
-  // Load the actual breakpad symbols
-  LoadBpSymbolFile(aModuleInfo, pdbPath, aCb);
-  return true;
 }
 
-static std::wstring gBasePdbPath;
+static const BpSymbolTable*
+GetBpSymbolTable(const ModuleInfo& aModuleInfo)
+{
+  if (!aModuleInfo.mSymbols) {
+    return nullptr;
+  }
+  EnsureBpSymbols({aModuleInfo.mSymbols});
+  return aModuleInfo.mSymbols->mTable.get();
+}
 
-namespace {
+static const BpNameIndex*
+GetBpNameIndex(const ModuleInfo& aModuleInfo)
+{
+  const BpSymbolTable* table = GetBpSymbolTable(aModuleInfo);
+  if (!table) {
+    return nullptr;
+  }
+  std::unique_ptr<BpNameIndex>& index = aModuleInfo.mSymbols->mNameIndex;
+  if (!index) {
+    index.reset(new BpNameIndex(*table));
+  }
+  return index.get();
+}
 
-/**
- * Perf improvement: don't use stdio on the same files as iostreams while an
- * instance of this class is on the stack!
- */
-class DisableStdioSync
+// Keeps the module lists of the processes that !bploadsyms has registered
+// up to date. Module events arrive with the process that they concern as the
+// current one.
+static void
+OnModuleEvent(PCWSTR aModName, ULONG64 aBaseAddress, bool aIsLoad)
 {
-public:
-  DisableStdioSync()
-    : mPrevSetting(std::ios_base::sync_with_stdio(false))
-  {
+  ULONG pid;
+  if (FAILED(gDebugSystemObjects->GetCurrentProcessId(&pid)) ||
+      !gSymbolStoreGenerationByPid.count(pid)) {
+    return;
   }
 
-  ~DisableStdioSync()
-  {
-    std::ios_base::sync_with_stdio(mPrevSetting);
+  if (!aIsLoad) {
+    gModulesByPid[pid].Erase(aBaseAddress);
+    PruneModuleSymbols();
+    return;
   }
 
-private:
-  DisableStdioSync(const DisableStdioSync&) = delete;
-  DisableStdioSync(const DisableStdioSync&&) = delete;
-  DisableStdioSync& operator=(const DisableStdioSync&) = delete;
-  DisableStdioSync& operator=(DisableStdioSync&&) = delete;
+  DEBUG_MODULE_PARAMETERS modParams;
+  HRESULT hr = gDebugSymbols->GetModuleParameters(1, &aBaseAddress, 0,
+                                                  &modParams);
+  if (FAILED(hr)) {
+    return;
+  }
+  std::string name(modParams.ModuleNameSize, 0);
+  hr = gDebugSymbols->GetModuleNameString(DEBUG_MODNAME_MODULE, DEBUG_ANY_ID,
+                                          aBaseAddress, &name[0],
+                                          modParams.ModuleNameSize, nullptr);
+  if (FAILED(hr)) {
+    return;
+  }
+  name.resize(modParams.ModuleNameSize - 1);
+  RegisterBpSymbols(pid, name, modParams);
+}
 
-  const bool  mPrevSetting;
-};
+// One listener serves every process; registering it again for each
+// !bploadsyms would record every event once per registration.
+static bool gModuleEventsRegistered;
 
-} // anonymous namespace
+static bool
+HasModuleInfoForPid(ULONG aPid)
+{
+  auto modules = gModulesByPid.find(aPid);
+  return modules != gModulesByPid.end() && modules->second.Count();
+}
 
-template <typename CallbackT>
 static void
-LoadBpSymbolsForModules(const char* aPath, CallbackT&& aCb)
+LoadBpSymbolsForModules(const char* aPath)
 {
-  DisableStdioSync stdioSyncDisabled;
-
   ULONG pid;
   HRESULT hr = gDebugSystemObjects->GetCurrentProcessId(&pid);
   if (FAILED(hr)) {
@@ -464,20 +631,66 @@ LoadBpSymbolsForModules(const char* aPath, CallbackT&& aCb)
     return;
   }
 
-  // For now we only support loading from a single bp symbol path
-  if (!gBasePdbPath.empty() && HasModuleInfoForPid(pid)) {
-    dprintf("Breakpad symbols are already loaded for this process\n");
-    return;
+  // aPath should contain one or more symbol store roots separated by ';',
+  // optionally preceded by -r. Roots that come first take precedence. The
+  // store is only rescanned when the roots change, or when -r asks for it
+  // because their contents did; -r alone rescans the current roots.
+  while (isspace(uint8_t(*aPath))) {
+    ++aPath;
+  }
+  bool rescan = false;
+  if (!strncmp(aPath, "-r", 2) && (!aPath[2] || isspace(uint8_t(aPath[2])))) {
+    rescan = true;
+    aPath += 2;
+    while (isspace(uint8_t(*aPath))) {
+      ++aPath;
+    }
   }
+  std::string roots(rescan && !*aPath ? gSymbolRoots : aPath);
+  const bool rootsChanged =
+    rescan || gSymbolStore.IsEmpty() || gSymbolRoots != roots;
 
-  // aPath should contain the base path to the bp symbols
-  DWORD attrs = GetFileAttributesA(aPath);
-  if (attrs == INVALID_FILE_ATTRIBUTES ||
-      (attrs & FILE_ATTRIBUTE_DIRECTORY) == 0) {
-    dprintf("Error: \"%s\" is not a valid directory\n", aPath);
+  if (!rootsChanged && HasModuleInfoForPid(pid) &&
+      gSymbolStoreGenerationByPid[pid] == gSymbolStoreGeneration) {
+    dprintf("Breakpad symbols are already loaded for this process; use "
+            "!bploadsyms -r <roots> to rescan the symbol store\n");
     return;
   }
 
+  if (rootsChanged) {
+    gSymbolStore.Clear();
+    gSymbolRoots = roots;
+    ++gSymbolStoreGeneration;
+    // Modules that had no .sym file under the old roots may have one now.
+    // Symbols that were found stay, loaded or not.
+    for (auto itr = gModuleSymbolsById.begin();
+         itr != gModuleSymbolsById.end();) {
+      if (itr->second->mSymPath.empty()) {
+        itr = gModuleSymbolsById.erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+    for (auto&& root : split(gSymbolRoots, ';', gSymbolRoots.size() + 1)) {
+      if (root.empty()) {
+        continue;
+      }
+      wchar_t wideRoot[MAX_PATH + 1] = {0};
+      if (!MultiByteToWideChar(CP_ACP, 0, root.c_str(), -1, wideRoot,
+                               MAX_PATH)) {
+        dprintf("Error converting \"%s\" to UTF16\n", root.c_str());
+        continue;
+      }
+      if (!gSymbolStore.AddRoot(wideRoot)) {
+        dprintf("Error: \"%s\" is not a valid directory\n", root.c_str());
+      }
+    }
+    if (gSymbolStore.IsEmpty()) {
+      gSymbolRoots.clear();
+      return;
+    }
+  }
+
   // Get the module list;
   ULONG numLoaded, numUnloaded;
   hr = gDebugSymbols->GetNumberModules(&numLoaded, &numUnloaded);
@@ -496,16 +709,7 @@ LoadBpSymbolsForModules(const char* aPath, CallbackT&& aCb)
     return;
   }
 
-  wchar_t basePdbPath[MAX_PATH + 1] = {0};
-  int convResult = MultiByteToWideChar(CP_ACP, 0, aPath, -1, basePdbPath,
-                                       MAX_PATH);
-  if (!convResult) {
-    dprintf("Error converting \"%s\" to UTF16\n", aPath);
-    return;
-  }
-  gBasePdbPath = basePdbPath;
-
-  // For each module, load its symbol file
+  // Only record where each module's symbols are; they are loaded on demand.
   for (ULONG i = 0; i < numLoaded; ++i) {
     std::string modName(modules[i].ModuleNameSize, 0);
     hr = gDebugSymbols->GetModuleNameString(DEBUG_MODNAME_MODULE, i, 0,
@@ -513,105 +717,65 @@ LoadBpSymbolsForModules(const char* aPath, CallbackT&& aCb)
                                             modules[i].ModuleNameSize, nullptr);
     if (FAILED(hr)) {
       dprintf("GetModuleNameString(%u) failed\n", i);
-      return;
+      break;
     }
     modName.resize(modules[i].ModuleNameSize - 1);
-    std::shared_ptr<ModuleInfo> moduleInfo = EmplaceModule(pid, modName,
-                                                           modules[i]);
-    LoadBpSymbols(basePdbPath, *moduleInfo, modules[i].Base, aCb);
+    RegisterBpSymbols(pid, modName, modules[i]);
   }
+  if (FAILED(hr)) {
+    return;
+  }
+  gSymbolStoreGenerationByPid[pid] = gSymbolStoreGeneration;
 
-  mozilla::DbgExtCallbacks::RegisterModuleEventListener(
-    [=](PCWSTR aModName, ULONG64 aBaseAddress, bool aIsLoad) -> void {
-      if (!aIsLoad) {
-        gModuleInfoByKey.erase(ModuleKey(pid, aBaseAddress));
-        return;
-      }
-
-      DEBUG_MODULE_PARAMETERS modParams;
-      HRESULT hr = gDebugSymbols->GetModuleParameters(1, &aBaseAddress, 0,
-                                                      &modParams);
-      if (FAILED(hr)) {
-        return;
-      }
-      std::string name(modParams.ModuleNameSize, 0);
-      hr = gDebugSymbols->GetModuleNameString(DEBUG_MODNAME_MODULE,
-                                              DEBUG_ANY_ID, aBaseAddress,
-                                              &name[0],
-                                              modParams.ModuleNameSize,
-                                              nullptr);
-      if (FAILED(hr)) {
-        return;
-      }
-      name.resize(modParams.ModuleNameSize - 1);
-      std::shared_ptr<ModuleInfo> moduleInfo = EmplaceModule(pid, name,
-                                                             modParams);
-      LoadBpSymbols(gBasePdbPath, *moduleInfo, aBaseAddress, aCb);
+  if (!gModuleEventsRegistered) {
+    gModuleEventsRegistered =
+      mozilla::DbgExtCallbacks::RegisterModuleEventListener(&OnModuleEvent);
+    if (!gModuleEventsRegistered) {
+      dprintf("Failed to register for module events; modules loaded from "
+              "now on will have no Breakpad symbols\n");
     }
-  );
+  }
 }
 
 HRESULT CALLBACK
 bpsynthsyms(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
-  LoadBpSymbolsForModules(aArgs, [](SymbolType aType, ULONG64 aRva,
-                                    ULONG aSize, ModuleInfo& aModuleInfo,
-                                    std::string& aName, std::string& aParams,
-                                    ULONG64 aFileId, ULONG64 aNameInt)
-                                      -> void {
+  LoadBpSymbolsForModules(aArgs);
 #if 0
-      if (aType == eLineSymbol) {
-        return;
+  for (auto&& modules : gModulesByPid) {
+    for (size_t m = 0; m < modules.second.Count(); ++m) {
+      const BpSymbolTable* table =
+        GetBpSymbolTable(*modules.second.Module(m));
+      if (!table) {
+        continue;
       }
-      HRESULT hr = gDebugSymbols->AddSyntheticSymbol(aOffset, aSize,
-                                                     aName.c_str(),
-                                                     DEBUG_ADDSYNTHSYM_DEFAULT,
-                                                     nullptr);
-      if (FAILED(hr)) {
-        dprintf("Failed to add synthetic symbol for \"%s\", hr 0x%08X\n",
-                aName.c_str(), hr);
+      for (size_t i = 0; i < table->SymbolRvas().size(); ++i) {
+        const char* name = table->String(table->SymbolNames()[i]);
+        HRESULT hr = gDebugSymbols->AddSyntheticSymbol(
+                        modules.second.Base(m) + table->SymbolRvas()[i],
+                        table->SymbolSizes()[i], name,
+                        DEBUG_ADDSYNTHSYM_DEFAULT, nullptr);
+        if (FAILED(hr)) {
+          dprintf("Failed to add synthetic symbol for \"%s\", hr 0x%08X\n",
+                  name, hr);
+        }
       }
+    }
+  }
 #endif
-    });
   return S_OK;
 }
 
 static void
 ClearModuleInfoForPid(ULONG aPid)
 {
-  auto first = gModuleInfoByKey.lower_bound(ModuleKey(aPid, std::numeric_limits<ULONG64>::min()));
-  auto last = gModuleInfoByKey.upper_bound(ModuleKey(aPid, std::numeric_limits<ULONG64>::max()));
-
-  // Once we've deleted all ModuleInfo for that pid, we need to see if
-  // that module is referenced by any other pids. Save the affected modules
-  // off to a temporary vector so that we can look into that.
-  std::vector<std::shared_ptr<ModuleInfo>> affectedModules;
-
-  for (auto itr = first; itr != last; ++itr) {
-    assert(itr->first.mPid == aPid);
-    affectedModules.emplace_back(itr->second);
-  }
-
-  gModuleInfoByKey.erase(first, last);
-
-  // Now that the modules for the pid are gone, we should be able to check
-  // the refcount of the affected modules to tell us whether we can delete
-  // their entry from gModuleInfoByName as well.
-  for (auto&& m : affectedModules) {
-    if (m.use_count() == 2) {
-      // ie, the only users of this module are gModuleInfoByName and
-      // affectedModules
-      gModuleInfoByName.erase(m->mName);
-    }
-  }
-}
+  gModulesByPid.erase(aPid);
+  gSymbolStoreGenerationByPid.erase(aPid);
+  gSymbolCaches.erase(aPid);
+  gCodeMaps.erase(aPid);
 
-static bool
-HasModuleInfoForPid(ULONG aPid)
-{
-  auto first = gModuleInfoByKey.lower_bound(ModuleKey(aPid, std::numeric_limits<ULONG64>::min()));
-  auto last = gModuleInfoByKey.upper_bound(ModuleKey(aPid, std::numeric_limits<ULONG64>::max()));
-  return first != last;
+  // Symbols that no other process is using can go as well.
+  PruneModuleSymbols();
 }
 
 HRESULT CALLBACK
@@ -619,50 +783,51 @@ bploadsyms(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
   static const bool kRegdPidUnload =
     mozilla::DbgExtCallbacks::RegisterProcessDetachListener(&ClearModuleInfoForPid);
-  LoadBpSymbolsForModules(aArgs, [](SymbolType aType, ULONG64 aRva,
-                                    ULONG aSize, ModuleInfo& aModuleInfo,
-                                    std::string& aName, std::string& aParams,
-                                    ULONG64 aFileId, ULONG64 aNameInt)
-                                      -> void {
-      if (aType == eLineSymbol) {
-        aModuleInfo.mSourceLineSyms.emplace(
-                                std::piecewise_construct,
-                                std::forward_as_tuple(aRva),
-                                std::forward_as_tuple(aRva, aSize, aFileId,
-                                                      aNameInt));
-        return;
-      }
-
-      auto symPtr = std::make_shared<BpSymbolInfo>(aRva, aSize, aName, aParams);
-      aModuleInfo.mSymsByRva.emplace(aRva, symPtr);
-      aModuleInfo.mSymsByName.emplace(aName, std::move(symPtr));
-    });
+  LoadBpSymbolsForModules(aArgs);
   return S_OK;
 }
 
 HRESULT CALLBACK
 bpsyminfo(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
-  unsigned int symCount = 0;
-  unsigned int lineCount = 0;
-  for (auto&& i : gModuleInfoByName) {
-    symCount += i.second->mSymsByRva.size();
-    lineCount += i.second->mSourceLineSyms.size();
+  ULONG64 symCount = 0;
+  ULONG64 lineCount = 0;
+  ULONG64 heapBytes = 0;
+  ULONG64 mappedBytes = 0;
+  ULONG numWithSyms = 0;
+  ULONG numLoaded = 0;
+  ULONG numInstances = 0;
+  for (auto&& modules : gModulesByPid) {
+    numInstances += ULONG(modules.second.Count());
+  }
+  for (auto&& i : gModuleSymbolsById) {
+    numWithSyms += !i.second->mSymPath.empty();
+    const BpSymbolTable* table = i.second->mTable.get();
+    if (!table) {
+      continue;
+    }
+    ++numLoaded;
+    symCount += table->SymbolRvas().size();
+    lineCount += table->NumLines();
+    (table->IsMapped() ? mappedBytes : heapBytes) += table->ImageSize();
+    heapBytes += table->IndexSize();
+    if (i.second->mNameIndex) {
+      heapBytes += i.second->mNameIndex->HeapSize();
+    }
   }
-  dprintf("%u breakpad symbols loaded\n%u source line symbols loaded\n",
+  dprintf("%u of %u module builds with breakpad symbols loaded, shared by %u module instances\n",
+          numLoaded, numWithSyms, numInstances);
+  dprintf("%I64u breakpad symbols loaded\n%I64u source line symbols loaded\n",
           symCount, lineCount);
+  dprintf("Symbol tables use %I64u KB of heap and %I64u KB of mapped cache files\n",
+          heapBytes / 1024, mappedBytes / 1024);
+  dprintf("Symbol cache: %I64u hits, %I64u misses\n", gSymbolCacheHits,
+          gSymbolCacheMisses);
   return S_OK;
 }
 
 static const size_t kSymbolBufSize = 0x1000000;
 
-enum NearestSymbolFlags
-{
-  eDMLOutput = 1,
-  eIncludeLineNumbers = 2 | eDMLOutput,
-  eLazyAddSynthSyms = 4
-};
-
 template <typename CharType>
 void
 FindAndReplace(std::basic_string<CharType>& aStr,
@@ -719,8 +884,7 @@ GetEnclosingModule(ULONG64 const aOffset, std::string* aOutModuleName = nullptr)
 }
 
 static bool
-ResolveSymbolViaDbgEngine(ULONG64 const aOffset, std::string& aOutput,
-                          ULONG64& aOutSymOffset, ULONG aFlags)
+ResolveSymbolViaDbgEngine(ULONG64 const aOffset, ResolvedSymbol& aResult)
 {
   ULONG64 displacement = 0;
   auto buf = std::make_unique<char[]>(kSymbolBufSize);
@@ -733,11 +897,25 @@ ResolveSymbolViaDbgEngine(ULONG64 const aOffset, std::string& aOutput,
   // TODO: Get line numbers if eIncludeLineNumbers is set
   std::ostringstream oss;
   oss << buf.get() << "+0x" << std::hex << displacement << " (pdb)";
-  gDebugSymbols->GetOffsetByName(buf.get(), &aOutSymOffset);
-  aOutput = oss.str();
+  gDebugSymbols->GetOffsetByName(buf.get(), &aResult.mSymOffset);
+  aResult.mEngineName = oss.str();
+  aResult.mKind = eResolvedEngine;
   return true;
 }
 
+static void
+ResolveWithoutBreakpad(ULONG64 const aOffset, ResolvedSymbol& aResult,
+                       bool aCheckModule)
+{
+  // Try to fall back to the symbol engine. Otherwise we'll just output the
+  // hex value (useful for JITcode)
+  if ((!aCheckModule || GetEnclosingModule(aOffset)) &&
+      ResolveSymbolViaDbgEngine(aOffset, aResult)) {
+    return;
+  }
+  aResult.mKind = eResolvedAddress;
+}
+
 static inline std::string
 OutputPointerValue(ULONG64 const aOffset)
 {
@@ -749,10 +927,22 @@ OutputPointerValue(ULONG64 const aOffset)
 }
 
 bool
-NearestSymbol(ULONG64 const aOffset, std::string& aOutput,
-              ULONG64& aOutSymOffset, ULONG aFlags)
+ResolveSymbols(const ULONG64* aAddresses, size_t aCount,
+               ResolvedSymbol* aResults, ULONG aFlags)
 {
-  aOutput.clear();
+  for (size_t i = 0; i < aCount; ++i) {
+    ResolvedSymbol& result = aResults[i];
+    result.mKind = eResolvedError;
+    result.mAddress = aAddresses[i];
+    result.mSymOffset = 0;
+    result.mSymSize = 0;
+    result.mModule = nullptr;
+    result.mName = nullptr;
+    result.mFile = nullptr;
+    result.mLine = 0;
+    result.mEngineName.clear();
+    result.mInlines.clear();
+  }
 
   ULONG pid;
   HRESULT hr = gDebugSystemObjects->GetCurrentProcessId(&pid);
@@ -761,162 +951,1083 @@ NearestSymbol(ULONG64 const aOffset, std::string& aOutput,
     return false;
   }
 
-  auto module = gModuleInfoByKey.upper_bound(ModuleKey(pid, aOffset));
-  if (module == gModuleInfoByKey.begin()) {
-    if (GetEnclosingModule(aOffset) &&
-        ResolveSymbolViaDbgEngine(aOffset, aOutput, aOutSymOffset, aFlags)) {
-      return true;
-    }
-    // We don't have a module for that, so just dump the hex value
-    // (useful for JITcode)
-    aOutput = OutputPointerValue(aOffset);
-    return true;
+  std::vector<size_t> order(aCount);
+  for (size_t i = 0; i < aCount; ++i) {
+    order[i] = i;
   }
-  // This returns the first module >, but if it's > then we actually want the
-  // one <= that key
-  --module;
-  if (aOffset > (module->first.mBase + module->second->mSize)) {
-    if (ResolveSymbolViaDbgEngine(aOffset, aOutput, aOutSymOffset, aFlags)) {
-      return true;
+  std::sort(order.begin(), order.end(), [aAddresses](size_t aLeft, size_t aRight) {
+    return aAddresses[aLeft] < aAddresses[aRight];
+  });
+
+  // First split the sorted addresses into runs that fall within the same
+  // module, so that every module that we need can be loaded in one go.
+  struct AddressRun
+  {
+    size_t                      mBegin;
+    size_t                      mEnd;
+    ULONG64                     mBase;
+    std::shared_ptr<ModuleInfo> mModuleInfo;
+  };
+  std::vector<AddressRun> runs;
+  std::vector<std::shared_ptr<ModuleSymbols>> modules;
+  auto processModules = gModulesByPid.find(pid);
+  for (size_t pos = 0; pos < aCount;) {
+    const ULONG64 firstOffset = aAddresses[order[pos]];
+    size_t module = processModules == gModulesByPid.end() ?
+                    ModuleIntervals::kNotFound :
+                    processModules->second.Find(firstOffset);
+    if (module == ModuleIntervals::kNotFound) {
+      ResolveWithoutBreakpad(firstOffset, aResults[order[pos]], true);
+      ++pos;
+      continue;
     }
-    // We don't have a module for that, so just dump the hex value
-    // (useful for JITcode)
-    aOutput = OutputPointerValue(aOffset);
-    return true;
-  }
-  ULONG64 rvaLookup = aOffset - module->first.mBase;
-  auto symbol = module->second->mSymsByRva.upper_bound(rvaLookup);
-  if (symbol == module->second->mSymsByRva.begin()) {
-    // Try to fall back to the symbol engine
-    if (ResolveSymbolViaDbgEngine(aOffset, aOutput, aOutSymOffset, aFlags)) {
-      return true;
+
+    // Every address up to the end of the module belongs to this run
+    const ModuleIntervals& intervals = processModules->second;
+    const ULONG64 moduleEnd = intervals.End(module);
+    AddressRun run = {pos, pos, intervals.Base(module),
+                      intervals.Module(module)};
+    while (run.mEnd < aCount && aAddresses[order[run.mEnd]] < moduleEnd) {
+      ++run.mEnd;
+    }
+    pos = run.mEnd;
+    runs.push_back(run);
+    modules.push_back(run.mModuleInfo->mSymbols);
+  }
+
+  EnsureBpSymbols(modules);
+
+  std::vector<uint64_t> rvas, offsets;
+  std::vector<size_t> symbols, inlines;
+  for (auto&& run : runs) {
+    const size_t runSize = run.mEnd - run.mBegin;
+    const ModuleSymbols* moduleSymbols = run.mModuleInfo->mSymbols.get();
+    const BpSymbolTable* table =
+      moduleSymbols ? moduleSymbols->mTable.get() : nullptr;
+    if (!table) {
+      for (size_t pos = run.mBegin; pos < run.mEnd; ++pos) {
+        ResolveWithoutBreakpad(aAddresses[order[pos]], aResults[order[pos]],
+                               false);
+      }
+      continue;
     }
-    aOutput = OutputPointerValue(aOffset);
-    return true;
-  }
-  // This returns the first symbol >, but if it's > then we actually want the
-  // one <= that RVA
-  --symbol;
-  aOutSymOffset = module->first.mBase + symbol->second->mRva;
 
-  if (aFlags & eLazyAddSynthSyms) {
-    gDebugSymbols->AddSyntheticSymbol(aOutSymOffset, symbol->second->mSize,
-                                      symbol->second->mName.c_str(),
-                                      DEBUG_ADDSYNTHSYM_DEFAULT, nullptr);
-  }
+    rvas.resize(runSize);
+    offsets.resize(runSize);
+    symbols.resize(runSize);
+    for (size_t i = 0; i < runSize; ++i) {
+      offsets[i] = aAddresses[order[run.mBegin + i]];
+      rvas[i] = offsets[i] - run.mBase;
+    }
+    table->FindSymbols(rvas.data(), runSize, symbols.data());
+    const bool wantLines =
+      (aFlags & eIncludeLineNumbers) == eIncludeLineNumbers;
+
+    for (size_t i = 0; i < runSize; ++i) {
+      ResolvedSymbol& result = aResults[order[run.mBegin + i]];
+      const size_t symbol = symbols[i];
+      if (symbol == BpSymbolTable::kNotFound) {
+        ResolveWithoutBreakpad(offsets[i], result, false);
+        continue;
+      }
 
-  // We're going to output DML, so we need to escape any angle brackets in
-  // the symbol name
-  std::string symName(symbol->second->mName);
-  if (aFlags & eDMLOutput) {
-    EscapeForDml(symName);
-  }
+      result.mKind = eResolvedBreakpad;
+      result.mSymOffset = run.mBase + table->SymbolRvas()[symbol];
+      result.mSymSize = table->SymbolSizes()[symbol];
+      result.mModule = run.mModuleInfo->mName.c_str();
+      result.mName = table->String(table->SymbolNames()[symbol]);
 
-  std::string moduleName(module->second->mName);
-  if (aFlags & eDMLOutput) {
-    EscapeForDml(moduleName);
-  }
-  const auto& fileMap = module->second->mFileMap;
+      if (aFlags & eLazyAddSynthSyms) {
+        gDebugSymbols->AddSyntheticSymbol(result.mSymOffset, result.mSymSize,
+                                          result.mName,
+                                          DEBUG_ADDSYNTHSYM_DEFAULT, nullptr);
+      }
 
-  std::ostringstream oss;
-  ULONG64 offsetFromSym = aOffset - aOutSymOffset;
-  oss << moduleName << "!" << symName << "+0x"
-      << std::hex << offsetFromSym << std::flush;
-  if ((aFlags & eIncludeLineNumbers) == eIncludeLineNumbers) {
-    auto& sourceLineSyms = module->second->mSourceLineSyms;
-    auto& lineSymbol = sourceLineSyms.upper_bound(aOffset);
-    if (lineSymbol != sourceLineSyms.begin() &&
-        lineSymbol != sourceLineSyms.end()) {
-      --lineSymbol;
-      // Look up the file name
-      auto& fileItr = fileMap.find(lineSymbol->second.mFileId);
-      if (fileItr == fileMap.end()) {
-        dprintf("Error: File id does not map to a valid file name\n");
-        return false;
+      if (aFlags & eExpandInlines) {
+        table->FindInlines(symbol, rvas[i], inlines);
+        for (size_t index : inlines) {
+          ResolvedInline frame = {
+            table->String(table->InlineNames()[index]),
+            table->FilePath(table->InlineCallFiles()[index]),
+            table->InlineCallLines()[index]
+          };
+          result.mInlines.push_back(frame);
+        }
       }
-      std::string file(fileItr->second);
-      EscapeForDml(file);
-      oss << " [<exec cmd=\".open " << file << "\">"
+
+      BpLine line;
+      if (wantLines && table->FindLine(symbol, rvas[i], line)) {
+        // Look up the file name
+        result.mFile = table->FilePath(line.mFile);
+        if (!result.mFile) {
+          dprintf("Error: File id does not map to a valid file name\n");
+          result.mKind = eResolvedError;
+          continue;
+        }
+        result.mLine = line.mLine;
+      }
+    }
+  }
+  return true;
+}
+
+static void
+AppendSourceLine(std::ostringstream& aStream, const char* aFile, ULONG aLine)
+{
+  std::string file(aFile);
+  EscapeForDml(file);
+  aStream << " [<exec cmd=\".open " << file << "\">"
           << file
           << "</exec>"
           << " @ "
-          << "<exec cmd=\"!gotoline " << std::dec << lineSymbol->second.mNameInt
+          << "<exec cmd=\"!gotoline " << std::dec << aLine
                                       << " " << file << "\">"
-          << std::dec << lineSymbol->second.mNameInt
+          << std::dec << aLine
           << "</exec>]"
           << std::flush;
+}
+
+bool
+FormatSymbol(const ResolvedSymbol& aSymbol, std::string& aOutput,
+             ULONG aFlags)
+{
+  switch (aSymbol.mKind) {
+    case eResolvedAddress:
+      aOutput = OutputPointerValue(aSymbol.mAddress);
+      return true;
+    case eResolvedEngine:
+      aOutput = aSymbol.mEngineName;
+      return true;
+    case eResolvedBreakpad:
+      break;
+    default:
+      aOutput.clear();
+      return false;
+  }
+
+  // We're going to output DML, so we need to escape any angle brackets in
+  // the symbol name
+  std::string symName(aSymbol.mName);
+  if (aFlags & eDMLOutput) {
+    EscapeForDml(symName);
+  }
+
+  std::string moduleName(aSymbol.mModule);
+  if (aFlags & eDMLOutput) {
+    EscapeForDml(moduleName);
+  }
+
+  const bool wantLines =
+    (aFlags & eIncludeLineNumbers) == eIncludeLineNumbers;
+  std::ostringstream oss;
+
+  // Each inlined call is shown at the line that the next one in was called
+  // from, and the innermost one at the line that the address is on.
+  const char* file = aSymbol.mFile;
+  ULONG line = aSymbol.mLine;
+  if (aFlags & eExpandInlines) {
+    for (size_t i = aSymbol.mInlines.size(); i-- > 0;) {
+      const ResolvedInline& frame = aSymbol.mInlines[i];
+      std::string inlineName(frame.mName);
+      if (aFlags & eDMLOutput) {
+        EscapeForDml(inlineName);
+      }
+      oss << moduleName << "!" << inlineName << " (inlined)";
+      if (wantLines && file) {
+        AppendSourceLine(oss, file, line);
+      }
+      oss << "\n";
+      file = frame.mCallFile;
+      line = frame.mCallLine;
     }
   }
+
+  ULONG64 offsetFromSym = aSymbol.mAddress - aSymbol.mSymOffset;
+  oss << moduleName << "!" << symName << "+0x"
+      << std::hex << offsetFromSym << std::flush;
+  if (wantLines && file) {
+    AppendSourceLine(oss, file, line);
+  }
   aOutput = oss.str();
   return true;
 }
 
+namespace {
+
+struct FormattedSymbol
+{
+  bool        mFound;
+  bool        mHasSymOffset;
+  ULONG64     mSymOffset;
+  std::string mOutput;
+};
+
+} // anonymous namespace
+
+// Resolves and formats aCount addresses of the current process, answering as
+// many of them as possible from the process's FormattedSymbolCache.
+static void
+FormatSymbols(const ULONG64* aAddresses, size_t aCount, ULONG aFlags,
+              FormattedSymbol* aOutput)
+{
+  ULONG pid;
+  HRESULT hr = gDebugSystemObjects->GetCurrentProcessId(&pid);
+  if (FAILED(hr)) {
+    dprintf("GetCurrentProcessId failed\n");
+    for (size_t i = 0; i < aCount; ++i) {
+      aOutput[i].mFound = false;
+      aOutput[i].mHasSymOffset = false;
+      aOutput[i].mOutput.clear();
+    }
+    return;
+  }
+  auto modules = gModulesByPid.find(pid);
+  const ULONG64 generation =
+    modules == gModulesByPid.end() ? 0 : modules->second.Generation();
+  FormattedSymbolCache& cache = gSymbolCaches[pid];
+
+  std::vector<size_t> misses;
+  for (size_t i = 0; i < aCount; ++i) {
+    const FormattedSymbolCache::Entry& entry =
+      cache.Lookup(aAddresses[i], aFlags);
+    if (!FormattedSymbolCache::IsHit(entry, aAddresses[i], aFlags,
+                                     generation)) {
+      misses.push_back(i);
+      continue;
+    }
+    aOutput[i].mFound = entry.mFound;
+    aOutput[i].mHasSymOffset = entry.mHasSymOffset;
+    aOutput[i].mSymOffset = entry.mSymOffset;
+    aOutput[i].mOutput = entry.mOutput;
+  }
+  gSymbolCacheHits += aCount - misses.size();
+  gSymbolCacheMisses += misses.size();
+  if (misses.empty()) {
+    return;
+  }
+
+  std::vector<ULONG64> addresses(misses.size());
+  for (size_t i = 0; i < misses.size(); ++i) {
+    addresses[i] = aAddresses[misses[i]];
+  }
+  std::vector<ResolvedSymbol> symbols(misses.size());
+  bool resolved = ResolveSymbols(addresses.data(), addresses.size(),
+                                 symbols.data(), aFlags);
+
+  // Formatting is nothing but string work, so large batches, such as the
+  // stacks of every thread, are spread over worker threads.
+  const size_t kMinParallelFormat = 256;
+  auto format = [&](size_t aIndex) -> void {
+    const ResolvedSymbol& symbol = symbols[aIndex];
+    FormattedSymbol& output = aOutput[misses[aIndex]];
+    output.mFound = FormatSymbol(symbol, output.mOutput, aFlags);
+    output.mHasSymOffset = symbol.mKind == eResolvedBreakpad ||
+                           symbol.mKind == eResolvedEngine;
+    output.mSymOffset = symbol.mSymOffset;
+  };
+  if (misses.size() >= kMinParallelFormat) {
+    ParallelFor(misses.size(), format);
+  } else {
+    for (size_t i = 0; i < misses.size(); ++i) {
+      format(i);
+    }
+  }
+  if (!resolved) {
+    return;
+  }
+
+  for (size_t i = 0; i < misses.size(); ++i) {
+    if (symbols[i].mKind != eResolvedBreakpad) {
+      continue;
+    }
+    const FormattedSymbol& output = aOutput[misses[i]];
+    FormattedSymbolCache::Entry& entry = cache.Lookup(addresses[i], aFlags);
+    entry.mAddress = addresses[i];
+    entry.mGeneration = generation;
+    entry.mFlags = aFlags;
+    entry.mValid = true;
+    entry.mFound = output.mFound;
+    entry.mHasSymOffset = output.mHasSymOffset;
+    entry.mSymOffset = output.mSymOffset;
+    entry.mOutput = output.mOutput;
+  }
+}
+
+bool
+NearestSymbol(ULONG64 const aOffset, std::string& aOutput,
+              ULONG64& aOutSymOffset, ULONG aFlags)
+{
+  FormattedSymbol symbol;
+  FormatSymbols(&aOffset, 1, aFlags, &symbol);
+  if (symbol.mHasSymOffset) {
+    aOutSymOffset = symbol.mSymOffset;
+  }
+  aOutput.swap(symbol.mOutput);
+  return symbol.mFound;
+}
+
+namespace {
+
+class DebuggeeMemory : public BpMemoryReader
+{
+public:
+  bool Read(uint64_t aAddress, void* aBuffer, size_t aSize) override
+  {
+    ULONG bytesRead = 0;
+    HRESULT hr = gDebugDataSpaces->ReadVirtual(aAddress, aBuffer, ULONG(aSize),
+                                               &bytesRead);
+    return SUCCEEDED(hr) && bytesRead == aSize;
+  }
+};
+
+} // anonymous namespace
+
+// Reads the registers of the current thread that unwind rules may refer to.
+static bool
+GetUnwindRegisters(BpArch aArch, BpUnwindRegs& aRegs)
+{
+  // In BpUnwindRegs::Slot order
+  static const char* const kNamesX86[] = {
+    "eip", "esp", "ebp", "ebx", "esi", "edi", "eax", "ecx", "edx"
+  };
+  static const char* const kNamesX64[] = {
+    "rip", "rsp", "rbp", "rbx", "rsi", "rdi", "rax", "rcx", "rdx",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+  };
+  const char* const* names = aArch == eBpArchX64 ? kNamesX64 : kNamesX86;
+  const size_t count = aArch == eBpArchX64 ?
+    sizeof(kNamesX64) / sizeof(kNamesX64[0]) :
+    sizeof(kNamesX86) / sizeof(kNamesX86[0]);
+
+  aRegs.Clear();
+  for (size_t i = 0; i < count; ++i) {
+    ULONG index;
+    DEBUG_VALUE value;
+    if (SUCCEEDED(gDebugRegisters->GetIndexByName(names[i], &index)) &&
+        SUCCEEDED(gDebugRegisters->GetValue(index, &value))) {
+      aRegs.Set(int(i), aArch == eBpArchX64 ? value.I64 : value.I32);
+    }
+  }
+  return aRegs.Has(BpUnwindRegs::ePc) && aRegs.Has(BpUnwindRegs::eSp);
+}
+
+// Walks the current thread's stack using the STACK CFI and STACK WIN records
+// of the Breakpad symbols of each module, instead of dbgeng's unwinder, which
+// gets lost in modules without PDBs. Each frame's pc goes into aAddresses
+// and the method by which the frame was found into aMethods; the first
+// frame comes straight from the thread's context and has eBpUnwindFailed.
+static bool
+WalkStackWithBpUnwindInfo(size_t aMaxFrames, std::vector<ULONG64>& aAddresses,
+                          std::vector<BpUnwindMethod>& aMethods)
+{
+  ULONG pid;
+  HRESULT hr = gDebugSystemObjects->GetCurrentProcessId(&pid);
+  if (FAILED(hr)) {
+    dprintf("GetCurrentProcessId failed\n");
+    return false;
+  }
+  const BpArch arch = gPointerWidth == 8 ? eBpArchX64 : eBpArchX86;
+  BpUnwindRegs regs;
+  if (!GetUnwindRegisters(arch, regs)) {
+    dprintf("Failed to read the current thread's registers\n");
+    return false;
+  }
+
+  const ModuleIntervals* modules = nullptr;
+  auto itr = gModulesByPid.find(pid);
+  if (itr != gModulesByPid.end()) {
+    modules = &itr->second;
+  }
+
+  DebuggeeMemory memory;
+  BpUnwindMethod method = eBpUnwindFailed;
+  for (size_t i = 0; i < aMaxFrames; ++i) {
+    const ULONG64 pc = regs.Get(BpUnwindRegs::ePc);
+    aAddresses.push_back(pc);
+    aMethods.push_back(method);
+
+    const BpSymbolTable* table = nullptr;
+    ULONG64 base = 0;
+    size_t index = modules ? modules->Find(pc) : ModuleIntervals::kNotFound;
+    if (index != ModuleIntervals::kNotFound) {
+      base = modules->Base(index);
+      table = GetBpSymbolTable(*modules->Module(index));
+    }
+    BpUnwindRegs caller;
+    method = BpUnwindFrame(table, base, arch, regs, i > 0, memory, caller);
+    if (method == eBpUnwindFailed) {
+      break;
+    }
+    regs = caller;
+  }
+  return true;
+}
+
+// Returns the code ranges of every module of process aPid, loading the
+// Breakpad symbols of all of them first.
+static const BpCodeMap*
+GetCodeMap(ULONG aPid)
+{
+  auto modules = gModulesByPid.find(aPid);
+  if (modules == gModulesByPid.end()) {
+    return nullptr;
+  }
+  const ModuleIntervals& intervals = modules->second;
+  auto cached = gCodeMaps.find(aPid);
+  if (cached != gCodeMaps.end() &&
+      cached->second.first == intervals.Generation()) {
+    return &cached->second.second;
+  }
+
+  std::vector<std::shared_ptr<ModuleSymbols>> symbols;
+  for (size_t i = 0; i < intervals.Count(); ++i) {
+    symbols.push_back(intervals.Module(i)->mSymbols);
+  }
+  EnsureBpSymbols(symbols);
+
+  BpCodeMap codeMap;
+  for (size_t i = 0; i < intervals.Count(); ++i) {
+    const std::shared_ptr<ModuleSymbols>& moduleSymbols =
+      intervals.Module(i)->mSymbols;
+    codeMap.AddModule(intervals.Base(i),
+                      intervals.End(i) - intervals.Base(i),
+                      moduleSymbols ? moduleSymbols->mTable.get() : nullptr);
+  }
+  codeMap.Finish();
+  auto& entry = gCodeMaps[aPid];
+  entry.first = intervals.Generation();
+  entry.second = std::move(codeMap);
+  return &entry.second;
+}
+
+// Reads the current thread's stack, from its stack pointer up to the stack
+// base, and collects the slots that hold code addresses. This finds return
+// addresses when unwinding fails, along with stale ones and function
+// pointers, so the results need judgment.
+static bool
+ScanStackForCode(std::vector<ULONG64>& aSlots, std::vector<ULONG64>& aValues)
+{
+  ULONG pid;
+  HRESULT hr = gDebugSystemObjects->GetCurrentProcessId(&pid);
+  if (FAILED(hr)) {
+    dprintf("GetCurrentProcessId failed\n");
+    return false;
+  }
+  const BpCodeMap* codeMap = GetCodeMap(pid);
+  if (!codeMap) {
+    dprintf("No breakpad symbols loaded for this process; run !bploadsyms\n");
+    return false;
+  }
+
+  // NT_TIB, at the start of the TEB, is followed by StackBase and StackLimit
+  ULONG64 teb;
+  ULONG64 stackBounds[2];
+  hr = gDebugSystemObjects->GetCurrentThreadTeb(&teb);
+  if (SUCCEEDED(hr)) {
+    hr = gDebugDataSpaces->ReadPointersVirtual(2, teb + gPointerWidth,
+                                               stackBounds);
+  }
+  if (FAILED(hr)) {
+    dprintf("Failed to read the current thread's stack bounds\n");
+    return false;
+  }
+  // A thread that is exiting, or a TEB read at the wrong width under WOW64,
+  // can yield a zeroed or garbage TEB.
+  const ULONG64 stackBase = stackBounds[0];
+  const ULONG64 stackLimit = stackBounds[1];
+  if (stackLimit >= stackBase) {
+    dprintf("The current thread's stack bounds %s-%s are invalid\n",
+            OutputPointerValue(stackLimit).c_str(),
+            OutputPointerValue(stackBase).c_str());
+    return false;
+  }
+  ULONG64 sp;
+  hr = gDebugRegisters->GetStackOffset(&sp);
+  if (FAILED(hr) || sp < stackLimit || sp >= stackBase) {
+    sp = stackLimit;
+  }
+  // Default stacks reserve 1MB and hardly any thread asks for more than a
+  // few, so anything beyond this is more likely garbage than stack.
+  const ULONG64 kMaxScanSize = 0x800000; // 8MB
+  if (stackBase - sp > kMaxScanSize) {
+    dprintf("Only scanning the %I64u KB of the stack nearest to %s\n",
+            kMaxScanSize / 1024, OutputPointerValue(sp).c_str());
+  }
+  const ULONG64 end = sp + std::min(stackBase - sp, kMaxScanSize);
+
+  // Read in chunks, so that a page that can't be read only costs its own
+  // chunk rather than the whole scan
+  const ULONG kChunkSize = 0x10000;
+  std::vector<uint8_t> chunk(kChunkSize);
+  bool readAny = false;
+  for (ULONG64 address = sp; address < end; address += kChunkSize) {
+    const ULONG size = ULONG(std::min<ULONG64>(kChunkSize, end - address));
+    ULONG bytesRead = 0;
+    hr = gDebugDataSpaces->ReadVirtual(address, chunk.data(), size,
+                                       &bytesRead);
+    if (FAILED(hr) || !bytesRead) {
+      dprintf("Failed to read the stack at %s\n",
+              OutputPointerValue(address).c_str());
+      continue;
+    }
+    readAny = true;
+    BpScanStack(*codeMap, chunk.data(), bytesRead, address, gPointerWidth,
+                aSlots, aValues);
+  }
+  return readAny;
+}
+
+// Prints frame number aFrameNumber, whose formatted symbol is aSymbol, after
+// aPrefix. Inlined calls come out as extra lines, which share the frame
+// number.
+static void
+OutputFrame(ULONG aFrameNumber, const std::string& aPrefix,
+            FormattedSymbol& aSymbol)
+{
+  std::string& symOutput = aSymbol.mOutput;
+  if (!aSymbol.mFound) {
+    symOutput = "<No symbol found>";
+    EscapeForDml(symOutput);
+  }
+  std::string::size_type lineStart = 0;
+  do {
+    std::string::size_type lineEnd = symOutput.find('\n', lineStart);
+    std::string line(symOutput, lineStart,
+                     lineEnd == std::string::npos ? std::string::npos :
+                                                    lineEnd - lineStart);
+    lineStart = lineEnd == std::string::npos ? lineEnd : lineEnd + 1;
+#ifdef DEBUG_DML
+    dprintf("symOutput.length() == %u\n", line.length());
+    dprintf("%02x %s%s\n", aFrameNumber, aPrefix.c_str(), line.c_str());
+#else
+    dmlprintf("%02x %s%s\n", aFrameNumber, aPrefix.c_str(), line.c_str());
+#endif
+  } while (lineStart != std::string::npos);
+}
+
 HRESULT CALLBACK
 bpk(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
+  // -u: unwind with the Breakpad symbols' own unwind info
+  // -s: list every code address on the stack, for when unwinding fails
+  bool useBpUnwindInfo = false;
+  bool scan = false;
+  std::istringstream iss(aArgs);
+  std::string arg;
+  while (iss >> arg) {
+    if (arg == "-u") {
+      useBpUnwindInfo = true;
+    } else if (arg == "-s") {
+      scan = true;
+    } else {
+      dprintf("Usage: !bpk [-u | -s]\n");
+      return E_FAIL;
+    }
+  }
+  if (useBpUnwindInfo && scan) {
+    dprintf("Usage: !bpk [-u | -s]\n");
+    return E_FAIL;
+  }
+
   const size_t kMaxFrames = 256;
-  DEBUG_STACK_FRAME_EX frames[kMaxFrames];
+  std::vector<ULONG64> addresses;
+  std::vector<ULONG> frameNumbers;
+  std::vector<BpUnwindMethod> methods;
+  std::vector<ULONG64> slots;
+  if (scan) {
+    if (!ScanStackForCode(slots, addresses)) {
+      return E_FAIL;
+    }
+    for (ULONG i = 0; i < addresses.size(); ++i) {
+      frameNumbers.push_back(i);
+    }
+  } else if (useBpUnwindInfo) {
+    if (!WalkStackWithBpUnwindInfo(kMaxFrames, addresses, methods)) {
+      return E_FAIL;
+    }
+    for (ULONG i = 0; i < addresses.size(); ++i) {
+      frameNumbers.push_back(i);
+    }
+  } else {
+    DEBUG_STACK_FRAME_EX frames[kMaxFrames];
+    ULONG framesFilled = 0;
+    HRESULT hr = gDebugControl->GetStackTraceEx(0, 0, 0, frames, kMaxFrames,
+                                                &framesFilled);
+    if (FAILED(hr)) {
+      dprintf("Failed to obtain stack trace\n");
+      return E_FAIL;
+    }
+
+#if defined(DEBUG)
+    dprintf("Debug engine trace:\n");
+    hr = gDebugControl->OutputStackTraceEx(DEBUG_OUTCTL_ALL_OTHER_CLIENTS,
+                                           frames, framesFilled,
+                                           DEBUG_STACK_FRAME_NUMBERS);
+    if (FAILED(hr)) {
+      dprintf("Failed to output stack trace\n");
+      return E_FAIL;
+    }
+    dprintf("\nBreakpad trace:\n");
+#endif
+
+    for (ULONG i = 0; i < framesFilled; ++i) {
+      addresses.push_back(frames[i].InstructionOffset);
+      frameNumbers.push_back(frames[i].FrameNumber);
+    }
+  }
+
+  const ULONG framesFilled = ULONG(addresses.size());
+  std::vector<FormattedSymbol> symbols(framesFilled);
+  FormatSymbols(addresses.data(), framesFilled,
+                eIncludeLineNumbers | eLazyAddSynthSyms | eExpandInlines,
+                symbols.data());
+
+  // How each frame was found, in -u mode
+  static const char* const kMethodNames[] = {"ctx", "cfi", "win", "fp",
+                                             "leaf"};
+  for (ULONG i = 0; i < framesFilled; ++i) {
+    // In -s mode, the stack slot that holds the address
+    std::string prefix;
+    if (useBpUnwindInfo) {
+      prefix = kMethodNames[methods[i]];
+      prefix.resize(5, ' ');
+    } else if (scan) {
+      prefix = OutputPointerValue(slots[i]) + ' ';
+    }
+    OutputFrame(frameNumbers[i], prefix, symbols[i]);
+  }
+  return S_OK;
+}
+
+static const size_t kMaxThreadStackFrames = 256;
+
+// Stores the frames of the current thread's stack in aAddresses, as found
+// by dbgeng or, if aUseBpUnwindInfo, by WalkStackWithBpUnwindInfo.
+static bool
+GetThreadStack(bool aUseBpUnwindInfo, std::vector<ULONG64>& aAddresses)
+{
+  aAddresses.clear();
+  if (aUseBpUnwindInfo) {
+    std::vector<BpUnwindMethod> methods;
+    return WalkStackWithBpUnwindInfo(kMaxThreadStackFrames, aAddresses,
+                                     methods);
+  }
+  DEBUG_STACK_FRAME_EX frames[kMaxThreadStackFrames];
   ULONG framesFilled = 0;
-  HRESULT hr = gDebugControl->GetStackTraceEx(0, 0, 0, frames, kMaxFrames,
+  HRESULT hr = gDebugControl->GetStackTraceEx(0, 0, 0, frames,
+                                              kMaxThreadStackFrames,
                                               &framesFilled);
   if (FAILED(hr)) {
-    dprintf("Failed to obtain stack trace\n");
+    return false;
+  }
+  for (ULONG i = 0; i < framesFilled; ++i) {
+    aAddresses.push_back(frames[i].InstructionOffset);
+  }
+  return true;
+}
+
+typedef std::function<void (ULONG, const std::vector<ULONG64>&)>
+  ThreadStackFn;
+
+// Walks the stack of every thread of the current process and passes each
+// thread's system id and frames to aFn. dbgeng walks the current thread, so
+// each one is made current in turn, and the original one is restored at the
+// end. Threads whose stacks can't be walked are skipped, and reported if
+// aReportFailures is set. aNumThreads receives the number of threads.
+static bool
+ForEachThreadStack(bool aUseBpUnwindInfo, bool aReportFailures,
+                   ULONG& aNumThreads, const ThreadStackFn& aFn)
+{
+  ULONG numThreads = 0;
+  HRESULT hr = gDebugSystemObjects->GetNumberThreads(&numThreads);
+  if (FAILED(hr) || !numThreads) {
+    dprintf("Failed to enumerate threads\n");
+    return false;
+  }
+  std::vector<ULONG> engineIds(numThreads), systemIds(numThreads);
+  hr = gDebugSystemObjects->GetThreadIdsByIndex(0, numThreads,
+                                                engineIds.data(),
+                                                systemIds.data());
+  ULONG currentThread = 0;
+  if (SUCCEEDED(hr)) {
+    hr = gDebugSystemObjects->GetCurrentThreadId(&currentThread);
+  }
+  if (FAILED(hr)) {
+    dprintf("Failed to enumerate threads\n");
+    return false;
+  }
+
+  std::vector<ULONG64> frames;
+  for (ULONG i = 0; i < numThreads; ++i) {
+    if (FAILED(gDebugSystemObjects->SetCurrentThreadId(engineIds[i])) ||
+        !GetThreadStack(aUseBpUnwindInfo, frames)) {
+      if (aReportFailures) {
+        dprintf("Failed to obtain the stack of thread 0x%x\n", systemIds[i]);
+      }
+      continue;
+    }
+    aFn(systemIds[i], frames);
+  }
+  gDebugSystemObjects->SetCurrentThreadId(currentThread);
+  aNumThreads = numThreads;
+  return true;
+}
+
+HRESULT CALLBACK
+bpstacks(PDEBUG_CLIENT aClient, PCSTR aArgs)
+{
+  // -u: unwind with the Breakpad symbols' own unwind info, like !bpk -u
+  bool useBpUnwindInfo = false;
+  std::istringstream iss(aArgs);
+  std::string arg;
+  while (iss >> arg) {
+    if (arg != "-u") {
+      dprintf("Usage: !bpstacks [-u]\n");
+      return E_FAIL;
+    }
+    useBpUnwindInfo = true;
+  }
+
+  BpStackBuckets buckets;
+  ULONG numThreads = 0;
+  bool walked = ForEachThreadStack(useBpUnwindInfo, true, numThreads,
+                                   [&](ULONG aThread,
+                                       const std::vector<ULONG64>& aFrames) {
+    buckets.Add(aThread, aFrames.data(), aFrames.size());
+  });
+  if (!walked) {
     return E_FAIL;
   }
+  buckets.Sort();
 
-#if defined(DEBUG)
-  dprintf("Debug engine trace:\n");
-  hr = gDebugControl->OutputStackTraceEx(DEBUG_OUTCTL_ALL_OTHER_CLIENTS,
-                                         frames, framesFilled,
-                                         DEBUG_STACK_FRAME_NUMBERS);
+  std::vector<ULONG64> addresses;
+  buckets.GetUniqueAddresses(addresses);
+  std::vector<FormattedSymbol> symbols(addresses.size());
+  FormatSymbols(addresses.data(), addresses.size(),
+                eIncludeLineNumbers | eLazyAddSynthSyms | eExpandInlines,
+                symbols.data());
+
+  const ULONG64* bucketFrames = buckets.Frames();
+  for (auto&& bucket : buckets.Buckets()) {
+    std::ostringstream threads;
+    for (auto&& thread : bucket.mThreads) {
+      threads << ' ' << std::hex << thread;
+    }
+    dprintf("\n%u thread(s):%s\n", ULONG(bucket.mThreads.size()),
+            threads.str().c_str());
+    for (size_t i = 0; i < bucket.mNumFrames; ++i) {
+      const ULONG64 address = bucketFrames[bucket.mFirstFrame + i];
+      size_t index = std::lower_bound(addresses.begin(), addresses.end(),
+                                      address) - addresses.begin();
+      // OutputFrame may rewrite symbols that are not found, which is
+      // harmless since they are rewritten the same way every time.
+      OutputFrame(ULONG(i), std::string(), symbols[index]);
+    }
+  }
+  dprintf("\n%u thread(s), %u unique stack(s), %u unique address(es)\n",
+          numThreads, ULONG(buckets.Buckets().size()),
+          ULONG(addresses.size()));
+  return S_OK;
+}
+
+// Lets the target run for aMilliseconds and then breaks into it again, from
+// within the extension command: the engine processes events meanwhile as it
+// would for "g". Breakpoints stay armed; those whose commands continue the
+// target, like the counting ones of !bpprof, are handled by the engine and
+// don't end the wait. Any event that stops the target, such as a breakpoint,
+// an exception, a Ctrl+Break or the process exiting, does, and then the
+// target is left stopped at that event and false is returned, as it is if
+// the target can't be resumed.
+static bool
+RunTargetFor(ULONG aMilliseconds)
+{
+  HRESULT hr = gDebugControl->SetExecutionStatus(DEBUG_STATUS_GO);
+  if (FAILED(hr)) {
+    dprintf("SetExecutionStatus failed with HRESULT 0x%08X\n", hr);
+    return false;
+  }
+  // S_FALSE means that the time ran out without an event
+  hr = gDebugControl->WaitForEvent(DEBUG_WAIT_DEFAULT, aMilliseconds);
+  if (hr != S_FALSE) {
+    char description[0x200];
+    ULONG type, processId, threadId;
+    if (FAILED(hr) ||
+        FAILED(gDebugControl->GetLastEventInformation(&type, &processId,
+                                                      &threadId, nullptr, 0,
+                                                      nullptr, description,
+                                                      sizeof(description),
+                                                      nullptr))) {
+      dprintf("The target could not be run, HRESULT 0x%08X\n", hr);
+    } else {
+      dprintf("The target stopped at an event and is left there: %s\n",
+              description);
+    }
+    return false;
+  }
+  hr = gDebugControl->SetInterrupt(DEBUG_INTERRUPT_ACTIVE);
+  if (SUCCEEDED(hr)) {
+    hr = gDebugControl->WaitForEvent(DEBUG_WAIT_DEFAULT, INFINITE);
+  }
+  if (FAILED(hr)) {
+    dprintf("Failed to break into the target, HRESULT 0x%08X\n", hr);
+    return false;
+  }
+  return true;
+}
+
+// Returns the system id of the thread that the debugger created to break
+// into the target, if that is what the target is stopped by, or 0. Both
+// Ctrl+Break and SetInterrupt create one, which only sits at a breakpoint in
+// ntdll!DbgBreakPoint and is not worth sampling; a breakpoint in the
+// target's own code stops one of its own threads, which is.
+static ULONG
+GetBreakInThreadSystemId()
+{
+  ULONG type, processId, threadId;
+  DEBUG_LAST_EVENT_INFO_EXCEPTION info;
+  HRESULT hr = gDebugControl->GetLastEventInformation(&type, &processId,
+                                                      &threadId, &info,
+                                                      sizeof(info), nullptr,
+                                                      nullptr, 0, nullptr);
+  // A 32-bit process under WOW64 reports its breakpoints as 0x4000001F
+  if (FAILED(hr) || type != DEBUG_EVENT_EXCEPTION ||
+      (info.ExceptionRecord.ExceptionCode != STATUS_BREAKPOINT &&
+       info.ExceptionRecord.ExceptionCode != 0x4000001F)) {
+    return 0;
+  }
+
+  static const char kBreakIn[] = "!DbgBreakPoint";
+  const size_t suffixLength = sizeof(kBreakIn) - 1;
+  char name[0x100];
+  ULONG64 displacement;
+  if (FAILED(gDebugSymbols->GetNameByOffset(
+               info.ExceptionRecord.ExceptionAddress, name, sizeof(name),
+               nullptr, &displacement)) ||
+      strlen(name) < suffixLength ||
+      strcmp(name + strlen(name) - suffixLength, kBreakIn)) {
+    return 0;
+  }
+
+  ULONG currentThread;
+  if (FAILED(gDebugSystemObjects->GetCurrentThreadId(&currentThread))) {
+    return 0;
+  }
+  ULONG systemId;
+  if (FAILED(gDebugSystemObjects->SetCurrentThreadId(threadId)) ||
+      FAILED(gDebugSystemObjects->GetCurrentThreadSystemId(&systemId))) {
+    systemId = 0;
+  }
+  gDebugSystemObjects->SetCurrentThreadId(currentThread);
+  return systemId;
+}
+
+// Names the frames at aAddresses, which are sorted, for folded output: from
+// Breakpad symbols where the module has them, from the engine's symbols
+// otherwise, and as module+offset as a last resort.
+static void
+NameSampledFrames(const ModuleIntervals& aModules,
+                  const std::vector<ULONG64>& aAddresses,
+                  std::vector<std::vector<std::string>>& aNames)
+{
+  std::vector<std::shared_ptr<ModuleSymbols>> symbols;
+  for (size_t i = 0; i < aModules.Count(); ++i) {
+    symbols.push_back(aModules.Module(i)->mSymbols);
+  }
+  EnsureBpSymbols(symbols);
+
+  BpFrameNamer namer;
+  for (size_t i = 0; i < aModules.Count(); ++i) {
+    const std::shared_ptr<ModuleInfo>& module = aModules.Module(i);
+    namer.AddModule(aModules.Base(i), aModules.End(i) - aModules.Base(i),
+                    module->mName,
+                    module->mSymbols ? module->mSymbols->mTable.get() :
+                                       nullptr);
+  }
+  namer.Name(aAddresses, aNames);
+
+  char buf[0x1000];
+  for (size_t i = 0; i < aAddresses.size(); ++i) {
+    if (!aNames[i].empty()) {
+      continue;
+    }
+    ULONG64 displacement;
+    if (SUCCEEDED(gDebugSymbols->GetNameByOffset(aAddresses[i], buf,
+                                                 sizeof(buf), nullptr,
+                                                 &displacement))) {
+      aNames[i].push_back(buf);
+      continue;
+    }
+    std::string offsetName = namer.OffsetName(aAddresses[i]);
+    if (!offsetName.empty()) {
+      aNames[i].push_back(std::move(offsetName));
+    }
+  }
+}
+
+HRESULT CALLBACK
+bpsample(PDEBUG_CLIENT aClient, PCSTR aArgs)
+{
+  // -u: unwind with the Breakpad symbols' own unwind info, like !bpk -u
+  // -n: number of times to sample all threads
+  // -i: milliseconds to let the target run between samples
+  // -s: also record the samples in a file that BpReadSamples can read
+  bool useBpUnwindInfo = false;
+  ULONG numSamples = 100;
+  ULONG interval = 50;
+  std::string samplesPath;
+  std::istringstream iss(aArgs);
+  std::string arg;
+  bool ok = true;
+  while (ok && iss >> std::ws && iss.peek() == '-' && iss >> arg) {
+    if (arg == "-u") {
+      useBpUnwindInfo = true;
+    } else if (arg == "-n") {
+      ok = !!(iss >> numSamples) && numSamples;
+    } else if (arg == "-i") {
+      ok = !!(iss >> interval);
+    } else if (arg == "-s") {
+      ok = !!(iss >> samplesPath);
+    } else {
+      ok = false;
+    }
+  }
+  std::string foldedPath;
+  std::getline(iss, foldedPath);
+  while (!foldedPath.empty() && isspace(uint8_t(foldedPath.back()))) {
+    foldedPath.pop_back();
+  }
+  if (!ok || foldedPath.empty()) {
+    dprintf("Usage: !bpsample [-u] [-n <samples>] [-i <milliseconds>] "
+            "[-s <sample file>] <folded output file>\n");
+    return E_FAIL;
+  }
+
+  ULONG pid;
+  HRESULT hr = gDebugSystemObjects->GetCurrentProcessId(&pid);
   if (FAILED(hr)) {
-    dprintf("Failed to output stack trace\n");
+    dprintf("GetCurrentProcessId failed\n");
+    return E_FAIL;
+  }
+  if (gModulesByPid.find(pid) == gModulesByPid.end()) {
+    dprintf("No breakpad symbols loaded for this process; run !bploadsyms\n");
     return E_FAIL;
   }
-  dprintf("\nBreakpad trace:\n");
-#endif
 
-  for (ULONG i = 0; i < framesFilled; ++i) {
-    std::string symOutput;
-    ULONG64 symOffset;
-    if (!NearestSymbol(frames[i].InstructionOffset, symOutput, symOffset,
-                       eDMLOutput | eLazyAddSynthSyms)) {
-      symOutput = "<No symbol found>";
-      EscapeForDml(symOutput);
+  BpStackTrie stacks;
+  std::vector<ULONG64> frames;
+  ULONG numTaken = 0;
+  const ULONGLONG start = GetTickCount64();
+  for (; numTaken < numSamples; ++numTaken) {
+    // The target runs between samples, and is then stopped by our
+    // interrupt, as it usually is by Ctrl+Break before the first sample.
+    if (numTaken && !RunTargetFor(interval)) {
+      dprintf("Sampling ends early\n");
+      break;
     }
-#ifdef DEBUG_DML
-    dprintf("symOutput.length() == %u\n", symOutput.length());
-    dprintf("%02x %s\n", frames[i].FrameNumber, symOutput.c_str());
-#else
-    dmlprintf("%02x %s\n", frames[i].FrameNumber, symOutput.c_str());
-#endif
+    const ULONG breakInThread = GetBreakInThreadSystemId();
+
+    ULONG numThreads;
+    bool walked = ForEachThreadStack(useBpUnwindInfo, false, numThreads,
+                                     [&](ULONG aThread,
+                                         const std::vector<ULONG64>& aFrames) {
+      if (aThread != breakInThread) {
+        stacks.Add(aFrames.data(), aFrames.size());
+      }
+    });
+    if (!walked) {
+      break;
+    }
+    if ((numTaken + 1) % 10 == 0) {
+      dprintf("Took %u of %u samples\n", numTaken + 1, numSamples);
+    }
+    if (gDebugControl->GetInterrupt() == S_OK) {
+      dprintf("Interrupted\n");
+      ++numTaken;
+      break;
+    }
+  }
+  const ULONGLONG elapsed = GetTickCount64() - start;
+
+  // The module list may have changed while the target ran
+  auto modules = gModulesByPid.find(pid);
+  if (modules == gModulesByPid.end()) {
+    dprintf("The process has no modules left to name the frames by\n");
+    return E_FAIL;
   }
+
+  if (!samplesPath.empty()) {
+    std::vector<BpSampleModule> sampleModules;
+    const ModuleIntervals& intervals = modules->second;
+    for (size_t i = 0; i < intervals.Count(); ++i) {
+      BpSampleModule module = {
+        intervals.Base(i),
+        intervals.End(i) - intervals.Base(i),
+        intervals.Module(i)->mName
+      };
+      sampleModules.push_back(module);
+    }
+    std::ofstream samplesFile(samplesPath);
+    BpWriteSamples(samplesFile, sampleModules, stacks);
+    if (!samplesFile) {
+      dprintf("Failed to write %s\n", samplesPath.c_str());
+    }
+  }
+
+  // Each distinct address is named once, however many stacks it is in
+  std::vector<ULONG64> addresses;
+  stacks.GetUniqueAddresses(addresses);
+  std::vector<std::vector<std::string>> names;
+  NameSampledFrames(modules->second, addresses, names);
+
+  std::ofstream foldedFile(foldedPath);
+  stacks.WriteFolded(foldedFile, addresses, names);
+  if (!foldedFile) {
+    dprintf("Failed to write %s\n", foldedPath.c_str());
+    return E_FAIL;
+  }
+
+  dprintf("%u sample(s) of all threads in %I64u ms: %I64u stack(s), "
+          "%u distinct, %u unique address(es)\n",
+          numTaken, elapsed, stacks.NumSamples(), ULONG(stacks.NumStacks()),
+          ULONG(addresses.size()));
+  dprintf("Wrote folded stacks to %s\n", foldedPath.c_str());
   return S_OK;
 }
 
 HRESULT CALLBACK
 bpln(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
+  // Accepts any number of whitespace-separated addresses
   std::istringstream iss(aArgs);
+  std::vector<ULONG64> addresses;
   ULONG64 address = 0;
-  iss >> std::hex >> address;
-  if (!iss) {
+  while (iss >> std::hex >> address) {
+    addresses.push_back(address);
+  }
+  if (addresses.empty() || !iss.eof()) {
     dprintf("Failed to parse address parameter\n");
     return E_FAIL;
   }
-  std::string symOutput;
-  ULONG64 symOffset;
-  if (!NearestSymbol(address, symOutput, symOffset, eLazyAddSynthSyms)) {
-    symOutput = "<No symbol found>";
-  }
-  if (gPointerWidth == 4) {
-    dprintf("(%08I64x)   %s\n", symOffset, symOutput.c_str());
-  } else {
-    dprintf("(%016I64x)   %s\n", symOffset, symOutput.c_str());
+
+  std::vector<FormattedSymbol> symbols(addresses.size());
+  FormatSymbols(addresses.data(), addresses.size(), eLazyAddSynthSyms,
+                symbols.data());
+  for (auto&& symbol : symbols) {
+    if (!symbol.mFound) {
+      symbol.mOutput = "<No symbol found>";
+    }
+    ULONG64 symOffset = symbol.mHasSymOffset ? symbol.mSymOffset : 0;
+    if (gPointerWidth == 4) {
+      dprintf("(%08I64x)   %s\n", symOffset, symbol.mOutput.c_str());
+    } else {
+      dprintf("(%016I64x)   %s\n", symOffset, symbol.mOutput.c_str());
+    }
   }
   return S_OK;
 }
 
+// Splits |module!name|. A bare name, or * as the module, leaves aOutModule
+// empty, which stands for every module.
 static bool
 CrackSymbolicName(PCSTR aArgs, std::string& aOutModule, std::string& aSymName)
 {
@@ -925,48 +2036,135 @@ CrackSymbolicName(PCSTR aArgs, std::string& aOutModule, std::string& aSymName)
 
   auto tokens = split(std::string(aArgs), '!', 2);
   if (tokens.size() != 2) {
-    return false;
+    aSymName = tokens[0];
+    return !aSymName.empty();
   }
 
-  aOutModule = tokens[0];
+  if (tokens[0] != "*") {
+    aOutModule = tokens[0];
+  }
   aSymName = tokens[1];
   return true;
 }
 
-static ModuleInfo::MapValueSymbol
-LookupSymbolByName(const std::string& aModule, const std::string& aName)
+// Stores the modules that a search of aModule covers in aModules, with their
+// Breakpad symbols loaded: the module of that name, or every module of the
+// current process if aModule is empty.
+static bool
+GetModulesToSearch(const std::string& aModule,
+                   std::vector<std::shared_ptr<ModuleInfo>>& aModules)
 {
-  auto itr = gModuleInfoByName.find(aModule);
-  if (itr == gModuleInfoByName.end()) {
-    dprintf("Module \"%s\" not found\n", aModule.c_str());
-    return nullptr;
+  aModules.clear();
+  if (!aModule.empty()) {
+    auto moduleInfo = FindModuleByName(aModule);
+    if (!moduleInfo) {
+      dprintf("Module \"%s\" not found\n", aModule.c_str());
+      return false;
+    }
+    aModules.push_back(moduleInfo);
+  } else {
+    ULONG pid;
+    if (FAILED(gDebugSystemObjects->GetCurrentProcessId(&pid))) {
+      dprintf("GetCurrentProcessId failed\n");
+      return false;
+    }
+    auto modules = gModulesByPid.find(pid);
+    if (modules != gModulesByPid.end()) {
+      for (size_t i = 0; i < modules->second.Count(); ++i) {
+        aModules.push_back(modules->second.Module(i));
+      }
+    }
   }
 
-  auto entry = itr->second->mSymsByName.find(aName);
-  if (entry == itr->second->mSymsByName.end()) {
-    dprintf("Symbol \"%s!%s\" not found\n", aModule.c_str(), aName.c_str());
-    return nullptr;
+  // Load all of the symbols in one go, on worker threads
+  std::vector<std::shared_ptr<ModuleSymbols>> symbols;
+  for (auto&& moduleInfo : aModules) {
+    symbols.push_back(moduleInfo->mSymbols);
   }
+  EnsureBpSymbols(symbols);
+  return true;
+}
 
-  return entry->second;
+static BpNameFilter
+GetNameFilter(const BpSymbolTable& aTable)
+{
+  return BpNameFilter(aTable.NameFilter().begin(), aTable.NameFilter().size());
 }
 
-HRESULT CALLBACK
-bpbp(PDEBUG_CLIENT aClient, PCSTR aArgs)
+namespace {
+
+struct FoundSymbol
 {
-  std::string module, name;
+  std::string mModule;
+  ULONG64     mRva;
+  ULONG64     mSize;
+  std::string mName;
+};
 
-  if (!CrackSymbolicName(aArgs, module, name)) {
-    dprintf("Failed to parse symbol name; use |module!name| format\n");
-    return E_FAIL;
+} // anonymous namespace
+
+static bool
+LookupSymbolByName(const std::string& aModule, const std::string& aName,
+                   FoundSymbol& aSymbol)
+{
+  std::vector<std::shared_ptr<ModuleInfo>> modules;
+  if (!GetModulesToSearch(aModule, modules)) {
+    return false;
   }
 
-  auto sym = LookupSymbolByName(module, name);
-  if (!sym) {
-    return E_FAIL;
+  std::vector<FoundSymbol> found;
+  for (auto&& moduleInfo : modules) {
+    const BpSymbolTable* table = GetBpSymbolTable(*moduleInfo);
+    // The filter rules out most modules without touching their names, which
+    // for mapped caches may not even be paged in yet.
+    size_t index;
+    if (!table || !GetNameFilter(*table).MayContain(aName.c_str()) ||
+        !table->FindSymbolByName(aName.c_str(), index)) {
+      continue;
+    }
+    FoundSymbol sym;
+    sym.mModule = moduleInfo->mName;
+    sym.mRva = table->SymbolRvas()[index];
+    sym.mSize = table->SymbolSizes()[index];
+    sym.mName = table->String(table->SymbolNames()[index]);
+    found.push_back(std::move(sym));
   }
 
-  IDebugBreakpointPtr bp;
+  if (found.empty()) {
+    dprintf("Symbol \"%s!%s\" not found\n",
+            aModule.empty() ? "*" : aModule.c_str(), aName.c_str());
+    return false;
+  }
+  if (found.size() > 1) {
+    dprintf("Symbol \"%s\" is ambiguous; use |module!name| format:\n",
+            aName.c_str());
+    for (auto&& sym : found) {
+      dprintf("  %s!%s\n", sym.mModule.c_str(), sym.mName.c_str());
+    }
+    return false;
+  }
+
+  aSymbol = std::move(found[0]);
+  return true;
+}
+
+namespace {
+
+struct BreakpointTarget
+{
+  ULONG64     mOffset;
+  ULONG64     mSize;
+  const char* mName;
+};
+
+} // anonymous namespace
+
+// Sets an enabled code breakpoint at aOffset, with the command aCommand if
+// it isn't null, and stores its id in aId.
+static HRESULT
+SetCodeBreakpoint(ULONG64 aOffset, const char* aCommand, ULONG& aId)
+{
+  PDEBUG_BREAKPOINT bp;
   HRESULT hr = gDebugControl->AddBreakpoint(DEBUG_BREAKPOINT_CODE,
                                             DEBUG_ANY_ID, &bp);
   if (FAILED(hr)) {
@@ -974,115 +2172,439 @@ bpbp(PDEBUG_CLIENT aClient, PCSTR aArgs)
     return hr;
   }
 
-  ULONG64 offset;
-  hr = gDebugSymbols->GetModuleByModuleName(module.c_str(), 0, nullptr, &offset);
+  hr = bp->SetOffset(aOffset);
   if (FAILED(hr)) {
-    dprintf("IDebugSymbols2::GetModuleByModuleName failed with HRESULT 0x%08X\n", hr);
+    dprintf("IDebugBreakpoint::SetOffset failed with HRESULT 0x%08X\n", hr);
+    gDebugControl->RemoveBreakpoint(bp);
     return hr;
   }
 
-  offset += sym->mRva;
-
-  hr = bp->SetOffset(offset);
-  if (FAILED(hr)) {
-    dprintf("IDebugBreakpoint::SetOffset failed with HRESULT 0x%08X\n", hr);
-    return hr;
+  if (aCommand) {
+    hr = bp->SetCommand(aCommand);
+    if (FAILED(hr)) {
+      dprintf("IDebugBreakpoint::SetCommand failed with HRESULT 0x%08X\n",
+              hr);
+      gDebugControl->RemoveBreakpoint(bp);
+      return hr;
+    }
   }
 
   hr = bp->AddFlags(DEBUG_BREAKPOINT_ENABLED);
   if (FAILED(hr)) {
     dprintf("IDebugBreakpoint::AddFlags failed with HRESULT 0x%08X\n", hr);
+    gDebugControl->RemoveBreakpoint(bp);
     return hr;
   }
 
-  gDebugSymbols->AddSyntheticSymbol(offset, sym->mSize, sym->mName.c_str(),
-                                    DEBUG_ADDSYNTHSYM_DEFAULT, nullptr);
+  return bp->GetId(&aId);
+}
 
-  return S_OK;
+// Stores the parameters of all existing breakpoints in aParams, with one
+// call into the engine.
+static bool
+GetAllBreakpointParameters(std::vector<DEBUG_BREAKPOINT_PARAMETERS>& aParams)
+{
+  aParams.clear();
+  ULONG count;
+  HRESULT hr = gDebugControl->GetNumberBreakpoints(&count);
+  if (FAILED(hr)) {
+    dprintf("IDebugControl::GetNumberBreakpoints failed with HRESULT 0x%08X\n",
+            hr);
+    return false;
+  }
+  if (!count) {
+    return true;
+  }
+
+  aParams.resize(count);
+  hr = gDebugControl->GetBreakpointParameters(count, nullptr, 0,
+                                              aParams.data());
+  if (FAILED(hr)) {
+    dprintf("IDebugControl::GetBreakpointParameters failed with HRESULT 0x%08X\n",
+            hr);
+    aParams.clear();
+    return false;
+  }
+  return true;
 }
 
-// This function isn't a generic conversion function; it only handles the cases
-// that we expect to see as input to the bpx command.
-static std::regex
-GlobToRegex(const std::string& aGlob)
+// Stores the offsets of all existing breakpoints in aOffsets, sorted, with
+// one call into the engine.
+static bool
+GetBreakpointOffsets(std::vector<ULONG64>& aOffsets)
 {
-  std::string re(1, '^');
+  aOffsets.clear();
+  std::vector<DEBUG_BREAKPOINT_PARAMETERS> params;
+  if (!GetAllBreakpointParameters(params)) {
+    return false;
+  }
+  for (auto&& param : params) {
+    // Deferred breakpoints have no offset yet
+    if (param.Offset != DEBUG_INVALID_OFFSET) {
+      aOffsets.push_back(param.Offset);
+    }
+  }
+  std::sort(aOffsets.begin(), aOffsets.end());
+  return true;
+}
 
-  for (auto&& c : aGlob) {
-    switch (c) {
-      // TODO ASK: Support '#'
-      case '*':
-      case '?':
-      case '+':
-        re += '.';
-        break;
-      default:
+// Sets a breakpoint on every target whose offset doesn't have one yet, then
+// adds synthetic symbols for those targets, so that the breakpoints show up
+// with their Breakpad names. Reports progress on large batches, which may be
+// cancelled with Ctrl+Break between breakpoints.
+static HRESULT
+SetBreakpoints(std::vector<BreakpointTarget>& aTargets)
+{
+  const ULONGLONG start = GetTickCount64();
+
+  // Aliases of one function, such as those that identical code folding
+  // leaves behind, share an offset and only need one breakpoint.
+  std::stable_sort(aTargets.begin(), aTargets.end(),
+                   [](const BreakpointTarget& aLeft,
+                      const BreakpointTarget& aRight) {
+    return aLeft.mOffset < aRight.mOffset;
+  });
+  const size_t numMatches = aTargets.size();
+  aTargets.erase(std::unique(aTargets.begin(), aTargets.end(),
+                             [](const BreakpointTarget& aLeft,
+                                const BreakpointTarget& aRight) {
+                   return aLeft.mOffset == aRight.mOffset;
+                 }), aTargets.end());
+  const size_t numDuplicates = numMatches - aTargets.size();
+
+  std::vector<ULONG64> existing;
+  if (!GetBreakpointOffsets(existing)) {
+    return E_FAIL;
+  }
+  aTargets.erase(std::remove_if(aTargets.begin(), aTargets.end(),
+                                [&](const BreakpointTarget& aTarget) {
+                   return std::binary_search(existing.begin(), existing.end(),
+                                             aTarget.mOffset);
+                 }), aTargets.end());
+  const size_t numExisting = numMatches - numDuplicates - aTargets.size();
+
+  const size_t kProgressInterval = 1000;
+  HRESULT hr = S_OK;
+  size_t numSet = 0;
+  for (; numSet < aTargets.size(); ++numSet) {
+    if (numSet && numSet % kProgressInterval == 0) {
+      dprintf("%u of %u breakpoints set\n", ULONG(numSet),
+              ULONG(aTargets.size()));
+      if (gDebugControl->GetInterrupt() == S_OK) {
+        dprintf("Interrupted\n");
         break;
+      }
+    }
+    ULONG id;
+    hr = SetCodeBreakpoint(aTargets[numSet].mOffset,
+                           gCountNewBreakpoints ? kCountingBreakpointCommand :
+                                                  nullptr,
+                           id);
+    if (FAILED(hr)) {
+      break;
+    }
+    if (gCountNewBreakpoints) {
+      gHitCounts.Track(id, aTargets[numSet].mOffset);
     }
-
-    re += c;
   }
 
-  re += '$';
+  for (size_t i = 0; i < numSet; ++i) {
+    gDebugSymbols->AddSyntheticSymbol(aTargets[i].mOffset, aTargets[i].mSize,
+                                      aTargets[i].mName,
+                                      DEBUG_ADDSYNTHSYM_DEFAULT, nullptr);
+  }
 
-  return std::regex(re, std::regex_constants::extended |
-                        std::regex_constants::icase);
+  if (numMatches > 1) {
+    dprintf("Set %u breakpoints in %I64u ms; skipped %u duplicate offsets "
+            "and %u offsets that already had breakpoints\n", ULONG(numSet),
+            GetTickCount64() - start, ULONG(numDuplicates),
+            ULONG(numExisting));
+  } else if (numExisting) {
+    dprintf("There already is a breakpoint at that address\n");
+  }
+  return hr;
 }
 
-static std::string
-InitialNonGlobChars(const std::string& aGlob)
+HRESULT CALLBACK
+bpbp(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
-  std::string result;
+  std::string module, name;
 
-  for (auto&& c : aGlob) {
-    switch (c) {
-      case '*':
-      case '?':
-      case '#':
-      case '+':
-      case '[':
-        return result;
-      default:
-        break;
-    }
+  if (!CrackSymbolicName(aArgs, module, name)) {
+    dprintf("Failed to parse symbol name; use |[module!]name| format\n");
+    return E_FAIL;
+  }
 
-    result += c;
+  FoundSymbol sym;
+  if (!LookupSymbolByName(module, name, sym)) {
+    return E_FAIL;
   }
 
-  return result;
+  ULONG64 base;
+  HRESULT hr = gDebugSymbols->GetModuleByModuleName(sym.mModule.c_str(), 0,
+                                                    nullptr, &base);
+  if (FAILED(hr)) {
+    dprintf("IDebugSymbols2::GetModuleByModuleName failed with HRESULT 0x%08X\n", hr);
+    return hr;
+  }
+
+  std::vector<BreakpointTarget> targets(1);
+  targets[0].mOffset = base + sym.mRva;
+  targets[0].mSize = sym.mSize;
+  targets[0].mName = sym.mName.c_str();
+  return SetBreakpoints(targets);
 }
 
 HRESULT CALLBACK
 bpx(PDEBUG_CLIENT aClient, PCSTR aArgs)
 {
+  // -b: set a breakpoint on every match instead of listing the matches
+  bool setBreakpoints = false;
+  while (isspace(static_cast<unsigned char>(*aArgs))) {
+    ++aArgs;
+  }
+  if (!strncmp(aArgs, "-b", 2) &&
+      (!aArgs[2] || isspace(static_cast<unsigned char>(aArgs[2])))) {
+    setBreakpoints = true;
+    aArgs += 2;
+    while (isspace(static_cast<unsigned char>(*aArgs))) {
+      ++aArgs;
+    }
+  }
+
   std::string module, symGlob;
 
   if (!CrackSymbolicName(aArgs, module, symGlob)) {
-    dprintf("Failed to parse symbol name; use |module!name| format\n");
+    dprintf("Failed to parse symbol name; use |[module!]name| format\n");
     return E_FAIL;
   }
 
-  auto moduleInfo = gModuleInfoByName.find(module);
-  if (moduleInfo == gModuleInfoByName.end()) {
-    dprintf("Module \"%s\" not found\n", module.c_str());
+  std::vector<std::shared_ptr<ModuleInfo>> modules;
+  if (!GetModulesToSearch(module, modules)) {
     return E_FAIL;
   }
 
-  auto& symsByName = moduleInfo->second->mSymsByName;
-  auto nonGlob(InitialNonGlobChars(symGlob));
+  BpGlob glob(symGlob.c_str());
+  std::vector<uint32_t> matches;
+  std::vector<BreakpointTarget> targets;
+  for (auto&& moduleInfo : modules) {
+    const BpSymbolTable* table = GetBpSymbolTable(*moduleInfo);
+    if (!table) {
+      if (!module.empty()) {
+        dprintf("No breakpad symbols loaded for module \"%s\"\n",
+                module.c_str());
+        return E_FAIL;
+      }
+      continue;
+    }
+    // Only build the name index of modules that may have matches
+    if (!GetNameFilter(*table).MayMatch(glob)) {
+      continue;
+    }
+    matches.clear();
+    GetBpNameIndex(*moduleInfo)->Find(glob, matches);
+    if (!setBreakpoints) {
+      for (auto&& match : matches) {
+        dprintf("%s!%s\n", moduleInfo->mName.c_str(),
+                table->String(table->SymbolNames()[match]));
+      }
+      continue;
+    }
+    if (matches.empty()) {
+      continue;
+    }
 
-  auto first = symsByName.lower_bound(nonGlob);
-  if (first != symsByName.begin()) {
-    --first;
+    ULONG64 base;
+    HRESULT hr = gDebugSymbols->GetModuleByModuleName(
+                   moduleInfo->mName.c_str(), 0, nullptr, &base);
+    if (FAILED(hr)) {
+      dprintf("IDebugSymbols2::GetModuleByModuleName failed with HRESULT 0x%08X\n", hr);
+      return hr;
+    }
+    for (auto&& match : matches) {
+      BreakpointTarget target = {
+        base + table->SymbolRvas()[match],
+        table->SymbolSizes()[match],
+        table->String(table->SymbolNames()[match])
+      };
+      targets.push_back(target);
+    }
   }
 
-  std::regex re(GlobToRegex(symGlob));
-  for (auto itr = first; itr != symsByName.end(); ++itr) {
-    if (std::regex_match(itr->first, re)) {
-      dprintf("%s!%s\n", module.c_str(), itr->first.c_str());
+  if (setBreakpoints) {
+    if (targets.empty()) {
+      dprintf("No symbols match \"%s\"\n", symGlob.c_str());
+      return S_OK;
     }
+    return SetBreakpoints(targets);
   }
 
   return S_OK;
 }
 
+// Runs for every breakpoint event, so it does as little as it can.
+static ULONG
+CountBreakpointHit(PDEBUG_BREAKPOINT2 aBp)
+{
+  char command[sizeof(kCountingBreakpointCommand)];
+  ULONG commandSize;
+  if (aBp->GetCommand(command, sizeof(command), &commandSize) != S_OK ||
+      strcmp(command, kCountingBreakpointCommand)) {
+    return DEBUG_STATUS_NO_CHANGE;
+  }
+
+  ULONG id;
+  ULONG64 offset;
+  bool sampleCaller = false;
+  if (FAILED(aBp->GetId(&id)) || FAILED(aBp->GetOffset(&offset)) ||
+      !gHitCounts.Hit(id, offset, sampleCaller)) {
+    return DEBUG_STATUS_NO_CHANGE;
+  }
+  if (sampleCaller) {
+    // Counting breakpoints are on function entries, where the return address
+    // is at the top of the stack.
+    ULONG64 sp, caller;
+    if (SUCCEEDED(gDebugRegisters->GetStackOffset(&sp)) &&
+        SUCCEEDED(gDebugDataSpaces->ReadPointersVirtual(1, sp, &caller))) {
+      gHitCounts.AddCallerSample(id, caller);
+    }
+  }
+  return DEBUG_STATUS_GO;
+}
+
+// Stops counting the breakpoints that have been cleared, with bc or
+// otherwise, so that they drop out of the report along with their hits. An
+// id that the engine has since handed to a breakpoint elsewhere counts as
+// cleared too.
+static void
+UntrackClearedBreakpoints()
+{
+  std::vector<DEBUG_BREAKPOINT_PARAMETERS> params;
+  if (!GetAllBreakpointParameters(params)) {
+    return;
+  }
+  std::vector<std::pair<ULONG, ULONG64>> existing;
+  for (auto&& param : params) {
+    existing.emplace_back(param.Id, param.Offset);
+  }
+  std::sort(existing.begin(), existing.end());
+
+  std::vector<uint32_t> cleared;
+  gHitCounts.ForEachTracked([&](uint32_t aId, uint64_t aAddress) -> void {
+    if (!std::binary_search(existing.begin(), existing.end(),
+                            std::make_pair(ULONG(aId), ULONG64(aAddress)))) {
+      cleared.push_back(aId);
+    }
+  });
+  for (uint32_t id : cleared) {
+    gHitCounts.Untrack(id);
+  }
+}
+
+static void
+OutputHitCountReport(size_t aCount)
+{
+  UntrackClearedBreakpoints();
+
+  const size_t kNumCallers = 3;
+  std::vector<BpHitCounts::Summary> top;
+  gHitCounts.GetTop(aCount, kNumCallers, top);
+  const uint64_t total = gHitCounts.TotalHits();
+  if (top.empty()) {
+    dprintf("No hits recorded\n");
+    return;
+  }
+
+  // Symbolize the functions and their callers in one batch, each address
+  // once
+  std::vector<ULONG64> addresses;
+  for (auto&& summary : top) {
+    addresses.push_back(summary.mAddress);
+    for (auto&& caller : summary.mCallers) {
+      addresses.push_back(caller.first);
+    }
+  }
+  std::sort(addresses.begin(), addresses.end());
+  addresses.erase(std::unique(addresses.begin(), addresses.end()),
+                  addresses.end());
+  std::vector<FormattedSymbol> symbols(addresses.size());
+  FormatSymbols(addresses.data(), addresses.size(), 0, symbols.data());
+  auto symbolize = [&](ULONG64 aAddress) -> std::string {
+    size_t index = std::lower_bound(addresses.begin(), addresses.end(),
+                                    aAddress) - addresses.begin();
+    return symbols[index].mFound ? symbols[index].mOutput :
+                                   OutputPointerValue(aAddress);
+  };
+
+  dprintf("      Hits      %%  Function\n");
+  for (auto&& summary : top) {
+    dprintf("%10I64u %5.1f%%  %s\n", summary.mHits,
+            100.0 * summary.mHits / total,
+            symbolize(summary.mAddress).c_str());
+    for (auto&& caller : summary.mCallers) {
+      dprintf("%10I64u samples   from %s\n", caller.second,
+              symbolize(caller.first).c_str());
+    }
+  }
+  dprintf("%I64u hits on %u counting breakpoints\n", total,
+          ULONG(gHitCounts.NumTracked()));
+}
+
+HRESULT CALLBACK
+bpprof(PDEBUG_CLIENT aClient, PCSTR aArgs)
+{
+  std::istringstream iss(aArgs);
+  std::string command;
+  iss >> command;
+  if (command == "on") {
+    // -c N: sample the caller on every Nth hit of each breakpoint
+    std::string arg;
+    ULONG interval = 0;
+    if (iss >> arg && (arg != "-c" || !(iss >> interval) || !interval)) {
+      dprintf("Usage: !bpprof on [-c <interval>]\n");
+      return E_FAIL;
+    }
+    // A failure is not remembered, so that the next !bpprof on retries
+    if (!gBreakpointEventsRegistered) {
+      gBreakpointEventsRegistered =
+        mozilla::DbgExtCallbacks::RegisterBreakpointListener(
+          &CountBreakpointHit);
+    }
+    if (!gBreakpointEventsRegistered) {
+      dprintf("Failed to register for breakpoint events; breakpoints can't "
+              "count hits\n");
+      return E_FAIL;
+    }
+    gCountNewBreakpoints = true;
+    gHitCounts.SetSampleInterval(interval);
+    dprintf("Breakpoints set by !bpbp and !bpx now count hits and continue\n");
+    return S_OK;
+  }
+  if (command == "off") {
+    gCountNewBreakpoints = false;
+    dprintf("New breakpoints stop again; existing counting breakpoints keep "
+            "counting until they are cleared\n");
+    return S_OK;
+  }
+  if (command == "reset") {
+    gHitCounts.ResetCounts();
+    return S_OK;
+  }
+  if (command == "report") {
+    size_t count = 20;
+    std::string arg;
+    if (iss >> arg) {
+      char* end;
+      count = strtoul(arg.c_str(), &end, 0);
+      if (*end || !count || iss >> arg) {
+        dprintf("Usage: !bpprof report [count]\n");
+        return E_FAIL;
+      }
+    }
+    OutputHitCountReport(count);
+    return S_OK;
+  }
+
+  dprintf("Usage: !bpprof on [-c <interval>] | off | reset | report [count]\n");
+  return E_FAIL;
+}
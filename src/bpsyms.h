@@ -3,10 +3,80 @@
 
 #include <windows.h>
 #include <string>
+#include <vector>
+
+enum NearestSymbolFlags
+{
+  eDMLOutput = 1,
+  eIncludeLineNumbers = 2 | eDMLOutput,
+  eLazyAddSynthSyms = 4,
+  // Output one line per inlined call, innermost first, followed by the
+  // function that they were inlined into
+  eExpandInlines = 8
+};
+
+enum ResolvedSymbolKind
+{
+  // No symbol; formats as the raw pointer value
+  eResolvedAddress,
+  // Symbol from a breakpad symbol table
+  eResolvedBreakpad,
+  // Symbol from dbgeng, already formatted into mEngineName
+  eResolvedEngine,
+  // The symbol tables are inconsistent; formatting fails
+  eResolvedError
+};
+
+/**
+ * An inlined call that an address falls within.
+ */
+struct ResolvedInline
+{
+  const char* mName;
+  // Call site in the enclosing function, or nullptr and 0
+  const char* mCallFile;
+  ULONG       mCallLine;
+};
+
+/**
+ * The result of resolving a single address. The char pointers refer to the
+ * loaded symbol tables and are only valid until symbols are next loaded or
+ * unloaded.
+ */
+struct ResolvedSymbol
+{
+  ResolvedSymbolKind mKind;
+  ULONG64            mAddress;
+  // Address of the start of the symbol
+  ULONG64            mSymOffset;
+  ULONG64            mSymSize;
+  const char*        mModule;
+  const char*        mName;
+  // Source file and line, or nullptr and 0
+  const char*        mFile;
+  ULONG              mLine;
+  std::string        mEngineName;
+  // Only filled in for eExpandInlines; outermost first
+  std::vector<ResolvedInline> mInlines;
+};
+
+/**
+ * Resolves aCount addresses of the current process at once. The addresses
+ * are grouped by module and sorted so that each module's tables are walked
+ * in a single pass. aResults must have room for aCount entries; they are
+ * filled in the order of aAddresses. Only eLazyAddSynthSyms,
+ * eIncludeLineNumbers and eExpandInlines are meaningful in aFlags.
+ */
+bool
+ResolveSymbols(const ULONG64* aAddresses, size_t aCount,
+               ResolvedSymbol* aResults, ULONG aFlags = 0);
+
+bool
+FormatSymbol(const ResolvedSymbol& aSymbol, std::string& aOutput,
+             ULONG aFlags = 0);
 
 bool
 NearestSymbol(ULONG64 const aOffset, std::string& aOutput,
               ULONG64& aOutSymOffset, ULONG aFlags = 0);
 
 #endif // __BPSYMS_H
-
@@ -0,0 +1,180 @@
+#include "bpsymstore.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+typedef BpSymbolStore::PathString PathString;
+
+#if defined(_WIN32)
+
+static const BpPathChar kSeparator = L'\\';
+
+static bool
+ListSubdirectories(const PathString& aDir, std::vector<PathString>& aNames)
+{
+  WIN32_FIND_DATAW data;
+  HANDLE find = FindFirstFileExW((aDir + L"\\*").c_str(), FindExInfoBasic,
+                                 &data, FindExSearchLimitToDirectories,
+                                 nullptr, FIND_FIRST_EX_LARGE_FETCH);
+  if (find == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  do {
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      aNames.push_back(data.cFileName);
+    }
+  } while (FindNextFileW(find, &data));
+  FindClose(find);
+  return true;
+}
+
+static bool
+GetSymFileSize(const PathString& aPath, uint64_t& aSize)
+{
+  WIN32_FILE_ATTRIBUTE_DATA attrs;
+  if (!GetFileAttributesExW(aPath.c_str(), GetFileExInfoStandard, &attrs) ||
+      (attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+    return false;
+  }
+  aSize = (uint64_t(attrs.nFileSizeHigh) << 32) | attrs.nFileSizeLow;
+  return true;
+}
+
+#else
+
+static const BpPathChar kSeparator = '/';
+
+static bool
+ListSubdirectories(const PathString& aDir, std::vector<PathString>& aNames)
+{
+  DIR* dir = opendir(aDir.c_str());
+  if (!dir) {
+    return false;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    struct stat st;
+    PathString name(entry->d_name);
+    if (!stat((aDir + kSeparator + name).c_str(), &st) &&
+        S_ISDIR(st.st_mode)) {
+      aNames.push_back(name);
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
+static bool
+GetSymFileSize(const PathString& aPath, uint64_t& aSize)
+{
+  struct stat st;
+  if (stat(aPath.c_str(), &st) || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  aSize = static_cast<uint64_t>(st.st_size);
+  return true;
+}
+
+#endif
+
+static PathString
+ToLower(PathString aStr)
+{
+  // Symbol store names are ASCII
+  for (auto&& c : aStr) {
+    if (c >= 'A' && c <= 'Z') {
+      c = c - 'A' + 'a';
+    }
+  }
+  return aStr;
+}
+
+static bool
+EndsWithPdb(const PathString& aName)
+{
+  static const BpPathChar kPdbExtension[] = {'.', 'p', 'd', 'b', 0};
+  const size_t kPdbExtensionLen = 4;
+  return aName.size() > kPdbExtensionLen &&
+         !ToLower(aName.substr(aName.size() - kPdbExtensionLen))
+            .compare(kPdbExtension);
+}
+
+bool
+BpSymbolStore::AddRoot(const PathString& aRoot)
+{
+  PathString root(aRoot);
+  while (root.size() > 1 && (root.back() == '\\' || root.back() == '/')) {
+    root.pop_back();
+  }
+
+  std::vector<PathString> names;
+  if (!ListSubdirectories(root, names)) {
+    return false;
+  }
+
+  const size_t rootIndex = mRoots.size();
+  mRoots.push_back(root);
+  for (auto&& name : names) {
+    if (!EndsWithPdb(name)) {
+      continue;
+    }
+    PdbDirectory dir = {rootIndex, name};
+    mPdbs[ToLower(name.substr(0, name.size() - 4))].push_back(dir);
+  }
+  // Earlier misses may be satisfied by the new root
+  mResults.clear();
+  return true;
+}
+
+void
+BpSymbolStore::Clear()
+{
+  mRoots.clear();
+  mPdbs.clear();
+  mResults.clear();
+}
+
+bool
+BpSymbolStore::Find(const PathString& aPdbName, const PathString& aId,
+                    PathString& aSymPath, uint64_t& aSymSize)
+{
+  PathString pdbKey(ToLower(aPdbName));
+  PathString resultKey(pdbKey);
+  resultKey += '/';
+  resultKey += ToLower(aId);
+
+  auto cached = mResults.find(resultKey);
+  if (cached == mResults.end()) {
+    Result result = {false, PathString(), 0};
+    auto pdb = mPdbs.find(pdbKey);
+    if (pdb != mPdbs.end()) {
+      static const BpPathChar kSymExtension[] = {'.', 's', 'y', 'm', 0};
+      for (auto&& dir : pdb->second) {
+        PathString path(mRoots[dir.mRoot]);
+        path += kSeparator;
+        path += dir.mName;
+        path += kSeparator;
+        path += aId;
+        path += kSeparator;
+        path += aPdbName;
+        path += kSymExtension;
+        if (GetSymFileSize(path, result.mSymSize)) {
+          result.mFound = true;
+          result.mSymPath = path;
+          break;
+        }
+      }
+    }
+    cached = mResults.emplace(resultKey, result).first;
+  }
+
+  if (!cached->second.mFound) {
+    return false;
+  }
+  aSymPath = cached->second.mSymPath;
+  aSymSize = cached->second.mSymSize;
+  return true;
+}
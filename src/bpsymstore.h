@@ -0,0 +1,67 @@
+#ifndef __BPSYMSTORE_H
+#define __BPSYMSTORE_H
+
+// Index of the .sym files available in one or more Breakpad symbol stores.
+// Platform-neutral.
+
+#include "bpsymfile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A Breakpad symbol store is laid out as <root>/<pdb>.pdb/<id>/<pdb>.sym.
+ * Adding a root lists its <pdb>.pdb directories once; after that a module
+ * whose pdb name appears in none of the roots (which is the case for most
+ * system DLLs) is rejected with a single hash lookup. The outcome of every
+ * (pdb name, id) query, hit or miss, is remembered, so the file system is
+ * consulted at most once per module build. Files added to a root later are
+ * only seen after Clear() and adding the roots again, which is what
+ * !bploadsyms -r does.
+ *
+ * Roots are searched in the order in which they were added, and the first
+ * root that contains a matching .sym file wins. Pdb names and ids are
+ * compared case-insensitively.
+ */
+class BpSymbolStore
+{
+public:
+  typedef std::basic_string<BpPathChar> PathString;
+
+  // Returns false if aRoot cannot be listed.
+  bool AddRoot(const PathString& aRoot);
+  void Clear();
+  bool IsEmpty() const { return mRoots.empty(); }
+  size_t NumRoots() const { return mRoots.size(); }
+
+  // aPdbName is the pdb file name without its extension and aId is the
+  // Breakpad debug id (GUID followed by age).
+  bool Find(const PathString& aPdbName, const PathString& aId,
+            PathString& aSymPath, uint64_t& aSymSize);
+
+private:
+  struct PdbDirectory
+  {
+    size_t     mRoot;
+    // As spelled on disk
+    PathString mName;
+  };
+
+  struct Result
+  {
+    bool       mFound;
+    PathString mSymPath;
+    uint64_t   mSymSize;
+  };
+
+  std::vector<PathString> mRoots;
+  // Lowercased pdb name without extension -> directories, in root order
+  std::unordered_map<PathString, std::vector<PdbDirectory>> mPdbs;
+  // Lowercased "pdb name/id" -> outcome of Find
+  std::unordered_map<PathString, Result> mResults;
+};
+
+#endif // __BPSYMSTORE_H
@@ -0,0 +1,1422 @@
+#include "bpsymtable.h"
+#include "bpnameindex.h"
+#include "bpstringpool.h"
+#include "bpunwind.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace bpsymcache;
+
+namespace {
+
+struct SymbolRecord
+{
+  uint32_t mRva;
+  uint32_t mSize;
+  uint32_t mName;
+  uint32_t mParams;
+  // Position in file order, which is what LineRecord::mOwner refers to
+  uint32_t mIndex;
+};
+
+struct LineRecord
+{
+  uint32_t mRva;
+  uint32_t mSize;
+  uint32_t mLine;
+  uint32_t mFile;
+  // The FUNC record that this line follows
+  uint32_t mOwner;
+};
+
+// LineRecord::mOwner values for lines that don't follow a usable FUNC, and
+// for lines at the start of a chunk whose FUNC is in an earlier chunk.
+const uint32_t kNoFunction = 0xFFFFFFFF;
+const uint32_t kPreviousChunk = 0xFFFFFFFE;
+static_assert(kNoFunction > kPreviousChunk, "Sort() relies on this order");
+
+struct FileRecord
+{
+  uint32_t mId;
+  uint32_t mPath;
+};
+
+struct OriginRecord
+{
+  uint32_t mId;
+  uint32_t mName;
+};
+
+// One address range of an INLINE record
+struct InlineRecord
+{
+  uint32_t mRva;
+  uint32_t mSize;
+  uint32_t mDepth;
+  uint32_t mCallLine;
+  uint32_t mCallFile;
+  // INLINE_ORIGIN id until Sort() resolves it to a string pool offset
+  uint32_t mOrigin;
+  uint32_t mOwner;
+};
+
+// A STACK CFI INIT record
+struct CfiRecord
+{
+  uint32_t mRva;
+  uint32_t mSize;
+  // Rules pool offset until Sort() replaces it with an eUnwindCode offset
+  uint32_t mRules;
+  // Position in file order, which is what CfiDeltaRecord::mOwner refers to
+  uint32_t mIndex;
+};
+
+// A STACK CFI record
+struct CfiDeltaRecord
+{
+  uint32_t mRva;
+  uint32_t mRules;
+  // The STACK CFI INIT record that this record follows
+  uint32_t mOwner;
+};
+
+const uint64_t kMaxRva = 0xFFFFFFFF;
+
+uint32_t
+Clamp32(uint64_t aValue)
+{
+  return aValue > 0xFFFFFFFF ? 0xFFFFFFFF : static_cast<uint32_t>(aValue);
+}
+
+uint64_t
+AlignUp(uint64_t aValue)
+{
+  return (aValue + kSectionAlignment - 1) & ~(kSectionAlignment - 1);
+}
+
+// Line encoding; see eLineData in bpsymcache.h
+
+void
+WriteVarint(std::vector<uint8_t>& aOut, uint64_t aValue)
+{
+  while (aValue >= 0x80) {
+    aOut.push_back(static_cast<uint8_t>(aValue | 0x80));
+    aValue >>= 7;
+  }
+  aOut.push_back(static_cast<uint8_t>(aValue));
+}
+
+uint64_t
+ZigZag(int64_t aValue)
+{
+  return (static_cast<uint64_t>(aValue) << 1) ^
+         static_cast<uint64_t>(aValue >> 63);
+}
+
+int64_t
+UnZigZag(uint64_t aValue)
+{
+  return static_cast<int64_t>(aValue >> 1) ^ -static_cast<int64_t>(aValue & 1);
+}
+
+/**
+ * Decodes the lines of a single block in order. Reads stop at the end of the
+ * block, so corrupt data yields garbage lines but never reads out of bounds.
+ */
+class LineBlockReader
+{
+public:
+  LineBlockReader(const uint8_t* aBegin, const uint8_t* aEnd, uint32_t aRva)
+    : mPos(aBegin)
+    , mEnd(aEnd)
+  {
+    mLine.mRva = aRva;
+    mLine.mSize = 0;
+    mLine.mLine = 0;
+    mLine.mFile = 0;
+  }
+
+  const BpLine& Next()
+  {
+    const uint64_t flags = Read();
+    const uint64_t prevEnd = uint64_t(mLine.mRva) + mLine.mSize;
+    mLine.mLine = static_cast<uint32_t>(mLine.mLine + UnZigZag(flags >> 2));
+    mLine.mSize = static_cast<uint32_t>(Read());
+    mLine.mRva = static_cast<uint32_t>(
+        flags & 2 ? prevEnd + UnZigZag(Read()) : prevEnd);
+    if (flags & 1) {
+      mLine.mFile = static_cast<uint32_t>(Read());
+    }
+    return mLine;
+  }
+
+private:
+  uint64_t Read()
+  {
+    // Almost every value fits in a single byte
+    if (mPos != mEnd && *mPos < 0x80) {
+      return *mPos++;
+    }
+    uint64_t value = 0;
+    for (int shift = 0; mPos != mEnd && shift < 64; shift += 7) {
+      const uint8_t byte = *mPos++;
+      value |= uint64_t(byte & 0x7F) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+    return value;
+  }
+
+  const uint8_t* mPos;
+  const uint8_t* mEnd;
+  BpLine         mLine;
+};
+
+/**
+ * Collects the records produced by ParseBpSymbols and lays them out as a
+ * cache image.
+ */
+class BpSymbolTableBuilder
+{
+public:
+  BpSymbolTableBuilder()
+    : mModuleName(0)
+    , mCurrentFunction(kNoFunction)
+    , mSawSymbol(false)
+    , mCurrentCfi(kNoFunction)
+    , mSawCfi(false)
+  {
+  }
+
+  void Module(const BpToken& aName)
+  {
+    mModuleName = AddString(aName);
+  }
+
+  void File(uint64_t aId, const BpToken& aPath)
+  {
+    FileRecord rec = {Clamp32(aId), AddString(aPath)};
+    mFiles.push_back(rec);
+  }
+
+  void Function(uint64_t aRva, uint64_t aSize, const BpToken& aName,
+                const BpToken& aParams)
+  {
+    mSawSymbol = true;
+    mCurrentFunction = kNoFunction;
+    if (aRva > kMaxRva) {
+      return;
+    }
+    mCurrentFunction = static_cast<uint32_t>(mSymbols.size());
+    SymbolRecord rec = {uint32_t(aRva), Clamp32(aSize), AddString(aName),
+                        AddString(aParams), mCurrentFunction};
+    mSymbols.push_back(rec);
+  }
+
+  void Public(uint64_t aRva, const BpToken& aName)
+  {
+    mSawSymbol = true;
+    mCurrentFunction = kNoFunction;
+    if (aRva > kMaxRva) {
+      return;
+    }
+    SymbolRecord rec = {uint32_t(aRva), 0, AddString(aName), 0,
+                        static_cast<uint32_t>(mSymbols.size())};
+    mSymbols.push_back(rec);
+  }
+
+  void Line(uint64_t aRva, uint64_t aSize, uint64_t aLine, uint64_t aFileId)
+  {
+    uint32_t owner = mSawSymbol ? mCurrentFunction : kPreviousChunk;
+    if (aRva > kMaxRva || owner == kNoFunction) {
+      return;
+    }
+    LineRecord rec = {uint32_t(aRva), Clamp32(aSize), Clamp32(aLine),
+                      Clamp32(aFileId), owner};
+    mLines.push_back(rec);
+  }
+
+  void InlineOrigin(uint64_t aId, const BpToken& aName)
+  {
+    OriginRecord rec = {Clamp32(aId), AddString(aName)};
+    mOrigins.push_back(rec);
+  }
+
+  void Inline(uint64_t aDepth, uint64_t aCallLine, uint64_t aCallFileId,
+              uint64_t aOriginId, uint64_t aRva, uint64_t aSize)
+  {
+    uint32_t owner = mSawSymbol ? mCurrentFunction : kPreviousChunk;
+    if (aRva > kMaxRva || owner == kNoFunction) {
+      return;
+    }
+    InlineRecord rec = {uint32_t(aRva), Clamp32(aSize), Clamp32(aDepth),
+                        Clamp32(aCallLine), Clamp32(aCallFileId),
+                        Clamp32(aOriginId), owner};
+    mInlines.push_back(rec);
+  }
+
+  void StackCfiInit(uint64_t aRva, uint64_t aSize, const BpToken& aRules)
+  {
+    mSawCfi = true;
+    mCurrentCfi = kNoFunction;
+    if (aRva > kMaxRva) {
+      return;
+    }
+    mCurrentCfi = static_cast<uint32_t>(mCfi.size());
+    CfiRecord rec = {uint32_t(aRva), Clamp32(aSize), mRules.Intern(aRules),
+                     mCurrentCfi};
+    mCfi.push_back(rec);
+  }
+
+  void StackCfi(uint64_t aRva, const BpToken& aRules)
+  {
+    uint32_t owner = mSawCfi ? mCurrentCfi : kPreviousChunk;
+    if (aRva > kMaxRva || owner == kNoFunction) {
+      return;
+    }
+    CfiDeltaRecord rec = {uint32_t(aRva), mRules.Intern(aRules), owner};
+    mCfiDeltas.push_back(rec);
+  }
+
+  void StackWin(const BpStackWin& aRecord)
+  {
+    // Only FrameData and FPO records describe how to unwind
+    if (aRecord.mRva > kMaxRva || (aRecord.mType != 4 && aRecord.mType)) {
+      return;
+    }
+    StackWinRecord rec = {uint32_t(aRecord.mRva), Clamp32(aRecord.mCodeSize),
+                          Clamp32(aRecord.mParamSize),
+                          Clamp32(aRecord.mSavedRegSize),
+                          Clamp32(aRecord.mLocalSize),
+                          uint32_t(aRecord.mType),
+                          aRecord.mAllocatesBasePointer ?
+                            uint32_t(StackWinRecord::eAllocatesBasePointer) :
+                            0,
+                          mRules.Intern(aRecord.mProgram)};
+    mStackWin.push_back(rec);
+  }
+
+  // Replaces the contents of this builder with the concatenation of the
+  // records in aChunks, which must be in file order.
+  void Merge(std::vector<BpSymbolTableBuilder>& aChunks);
+
+  // Sorts on up to aMaxThreads threads.
+  std::unique_ptr<char[]> Finish(uint64_t aSourceSize,
+                                 uint64_t aSourceTime,
+                                 unsigned int aMaxThreads,
+                                 size_t& aImageSize);
+
+private:
+  uint32_t AddString(const BpToken& aToken)
+  {
+    return mStrings.Intern(aToken);
+  }
+
+  void Sort(unsigned int aMaxThreads);
+  void SortUnwindInfo(unsigned int aMaxThreads);
+
+  uint32_t                  mModuleName;
+  BpStringPool              mStrings;
+  // Unwind rules are kept apart from mStrings because they are compiled
+  // rather than copied into the image.
+  BpStringPool              mRules;
+  std::vector<SymbolRecord> mSymbols;
+  std::vector<LineRecord>   mLines;
+  std::vector<FileRecord>   mFiles;
+  std::vector<OriginRecord> mOrigins;
+  std::vector<InlineRecord> mInlines;
+  std::vector<uint32_t>     mSymbolsByName;
+  std::vector<uint64_t>     mNameFilter;
+  std::vector<uint32_t>     mSymbolLines;
+  std::vector<uint32_t>     mSymbolInlines;
+  std::vector<uint32_t>     mInlineNext;
+  std::vector<uint32_t>     mLineBlockOffsets;
+  std::vector<uint32_t>     mLineBlockRvas;
+  std::vector<uint8_t>      mLineData;
+  std::vector<CfiRecord>      mCfi;
+  std::vector<CfiDeltaRecord> mCfiDeltas;
+  // mCode is a rules pool offset, or 0, until SortUnwindInfo()
+  std::vector<StackWinRecord> mStackWin;
+  std::vector<uint32_t>       mCfiDeltaStarts;
+  std::vector<uint8_t>        mUnwindCode;
+  // Index of the FUNC that subsequent line and INLINE records belong to
+  uint32_t                  mCurrentFunction;
+  bool                      mSawSymbol;
+  // Index of the STACK CFI INIT that subsequent STACK CFI records belong to
+  uint32_t                  mCurrentCfi;
+  bool                      mSawCfi;
+};
+
+template <typename T>
+static void
+Release(std::vector<T>& aVector)
+{
+  std::vector<T>().swap(aVector);
+}
+
+/**
+ * Maps the string offsets of one chunk's pool to offsets in the merged pool.
+ * The chunk's strings are interned in the order in which they appear in its
+ * pool, which is the order in which the chunk first saw them, so the merged
+ * pool comes out identical to that of a sequential parse.
+ */
+class StringRemap
+{
+public:
+  void Build(const BpStringPool& aFrom, BpStringPool& aTo)
+  {
+    const char* base = aFrom.Data();
+    mOld.reserve(aFrom.Count());
+    mNew.reserve(aFrom.Count());
+    for (size_t offset = 1; offset < aFrom.Size();) {
+      const char* str = base + offset;
+      size_t length = strlen(str);
+      mOld.push_back(static_cast<uint32_t>(offset));
+      mNew.push_back(aTo.Intern(str, str + length));
+      offset += length + 1;
+    }
+  }
+
+  uint32_t operator()(uint32_t aOffset) const
+  {
+    if (!aOffset) {
+      return 0;
+    }
+    auto itr = std::lower_bound(mOld.begin(), mOld.end(), aOffset);
+    return mNew[itr - mOld.begin()];
+  }
+
+private:
+  std::vector<uint32_t> mOld;
+  std::vector<uint32_t> mNew;
+};
+
+void
+BpSymbolTableBuilder::Merge(std::vector<BpSymbolTableBuilder>& aChunks)
+{
+  const size_t numChunks = aChunks.size();
+  std::vector<size_t> symbolBase(numChunks), lineBase(numChunks),
+                      fileBase(numChunks), originBase(numChunks),
+                      inlineBase(numChunks), cfiBase(numChunks),
+                      deltaBase(numChunks), stackWinBase(numChunks);
+  size_t numSymbols = 0, numLines = 0, numFiles = 0, numOrigins = 0,
+         numInlines = 0, numCfi = 0, numDeltas = 0, numStackWin = 0;
+  for (size_t i = 0; i < numChunks; ++i) {
+    BpSymbolTableBuilder& chunk = aChunks[i];
+    symbolBase[i] = numSymbols;
+    lineBase[i] = numLines;
+    fileBase[i] = numFiles;
+    originBase[i] = numOrigins;
+    inlineBase[i] = numInlines;
+    cfiBase[i] = numCfi;
+    deltaBase[i] = numDeltas;
+    stackWinBase[i] = numStackWin;
+    numSymbols += chunk.mSymbols.size();
+    numLines += chunk.mLines.size();
+    numFiles += chunk.mFiles.size();
+    numOrigins += chunk.mOrigins.size();
+    numInlines += chunk.mInlines.size();
+    numCfi += chunk.mCfi.size();
+    numDeltas += chunk.mCfiDeltas.size();
+    numStackWin += chunk.mStackWin.size();
+  }
+
+  // Interning has to happen in file order, so this part is sequential.
+  std::vector<StringRemap> remaps(numChunks), ruleRemaps(numChunks);
+  mModuleName = 0;
+  for (size_t i = 0; i < numChunks; ++i) {
+    BpSymbolTableBuilder& chunk = aChunks[i];
+    remaps[i].Build(chunk.mStrings, mStrings);
+    chunk.mStrings.Release();
+    ruleRemaps[i].Build(chunk.mRules, mRules);
+    chunk.mRules.Release();
+    if (!mModuleName) {
+      mModuleName = remaps[i](chunk.mModuleName);
+    }
+  }
+
+  // Lines and INLINE records at the start of a chunk belong to the last FUNC
+  // of the chunks before it, if that is where the last symbol record was.
+  std::vector<uint32_t> previousFunction(numChunks, kNoFunction);
+  for (size_t i = 1; i < numChunks; ++i) {
+    const BpSymbolTableBuilder& prev = aChunks[i - 1];
+    previousFunction[i] = previousFunction[i - 1];
+    if (prev.mSawSymbol) {
+      previousFunction[i] = prev.mCurrentFunction == kNoFunction ?
+                            kNoFunction :
+                            static_cast<uint32_t>(symbolBase[i - 1] +
+                                                  prev.mCurrentFunction);
+    }
+  }
+  // Likewise for STACK CFI records and the last STACK CFI INIT
+  std::vector<uint32_t> previousCfi(numChunks, kNoFunction);
+  for (size_t i = 1; i < numChunks; ++i) {
+    const BpSymbolTableBuilder& prev = aChunks[i - 1];
+    previousCfi[i] = previousCfi[i - 1];
+    if (prev.mSawCfi) {
+      previousCfi[i] = prev.mCurrentCfi == kNoFunction ?
+                       kNoFunction :
+                       static_cast<uint32_t>(cfiBase[i - 1] +
+                                             prev.mCurrentCfi);
+    }
+  }
+
+  mSymbols.resize(numSymbols);
+  mLines.resize(numLines);
+  mFiles.resize(numFiles);
+  mOrigins.resize(numOrigins);
+  mInlines.resize(numInlines);
+  mCfi.resize(numCfi);
+  mCfiDeltas.resize(numDeltas);
+  mStackWin.resize(numStackWin);
+
+  ParallelFor(numChunks, [&](size_t aChunk) -> void {
+    BpSymbolTableBuilder& chunk = aChunks[aChunk];
+    const StringRemap& remap = remaps[aChunk];
+
+    const uint32_t indexShift = static_cast<uint32_t>(symbolBase[aChunk]);
+    SymbolRecord* symbols = mSymbols.data() + symbolBase[aChunk];
+    for (auto&& sym : chunk.mSymbols) {
+      *symbols = sym;
+      symbols->mName = remap(sym.mName);
+      symbols->mParams = remap(sym.mParams);
+      symbols->mIndex += indexShift;
+      ++symbols;
+    }
+    auto rebaseOwner = [&](uint32_t aOwner) -> uint32_t {
+      return aOwner == kPreviousChunk ? previousFunction[aChunk] :
+                                        aOwner + indexShift;
+    };
+    LineRecord* lines = mLines.data() + lineBase[aChunk];
+    for (auto&& line : chunk.mLines) {
+      *lines = line;
+      lines->mOwner = rebaseOwner(line.mOwner);
+      ++lines;
+    }
+    InlineRecord* inlines = mInlines.data() + inlineBase[aChunk];
+    for (auto&& inl : chunk.mInlines) {
+      *inlines = inl;
+      inlines->mOwner = rebaseOwner(inl.mOwner);
+      ++inlines;
+    }
+    OriginRecord* origins = mOrigins.data() + originBase[aChunk];
+    for (auto&& origin : chunk.mOrigins) {
+      *origins = origin;
+      origins->mName = remap(origin.mName);
+      ++origins;
+    }
+    FileRecord* files = mFiles.data() + fileBase[aChunk];
+    for (auto&& file : chunk.mFiles) {
+      *files = file;
+      files->mPath = remap(file.mPath);
+      ++files;
+    }
+
+    const StringRemap& ruleRemap = ruleRemaps[aChunk];
+    const uint32_t cfiShift = static_cast<uint32_t>(cfiBase[aChunk]);
+    CfiRecord* cfi = mCfi.data() + cfiBase[aChunk];
+    for (auto&& rec : chunk.mCfi) {
+      *cfi = rec;
+      cfi->mRules = ruleRemap(rec.mRules);
+      cfi->mIndex += cfiShift;
+      ++cfi;
+    }
+    CfiDeltaRecord* deltas = mCfiDeltas.data() + deltaBase[aChunk];
+    for (auto&& rec : chunk.mCfiDeltas) {
+      *deltas = rec;
+      deltas->mRules = ruleRemap(rec.mRules);
+      deltas->mOwner = rec.mOwner == kPreviousChunk ? previousCfi[aChunk] :
+                                                      rec.mOwner + cfiShift;
+      ++deltas;
+    }
+    StackWinRecord* stackWin = mStackWin.data() + stackWinBase[aChunk];
+    for (auto&& rec : chunk.mStackWin) {
+      *stackWin = rec;
+      stackWin->mCode = ruleRemap(rec.mCode);
+      ++stackWin;
+    }
+
+    Release(chunk.mSymbols);
+    Release(chunk.mLines);
+    Release(chunk.mFiles);
+    Release(chunk.mOrigins);
+    Release(chunk.mInlines);
+    Release(chunk.mCfi);
+    Release(chunk.mCfiDeltas);
+    Release(chunk.mStackWin);
+  });
+}
+
+void
+BpSymbolTableBuilder::Sort(unsigned int aMaxThreads)
+{
+  // When several records share a key, the first one in the file wins, just
+  // like the std::map::emplace calls that this replaces.
+  ParallelStableSort(mSymbols.begin(), mSymbols.end(),
+                     [](const SymbolRecord& aLeft,
+                        const SymbolRecord& aRight) {
+    return aLeft.mRva < aRight.mRva;
+  }, aMaxThreads);
+
+  // Group the lines by the position of their FUNC in the sorted symbols, so
+  // that each symbol owns a contiguous slice of the line arrays. Within a
+  // slice the first of several lines with the same RVA wins.
+  std::vector<uint32_t> sortedIndex(mSymbols.size());
+  for (uint32_t i = 0; i < mSymbols.size(); ++i) {
+    sortedIndex[mSymbols[i].mIndex] = i;
+  }
+  // Records that precede every symbol record still say kPreviousChunk when
+  // the file was parsed in one piece.
+  mLines.erase(std::remove_if(mLines.begin(), mLines.end(),
+                              [](const LineRecord& aLine) {
+                 return aLine.mOwner >= kPreviousChunk;
+               }), mLines.end());
+  for (auto&& line : mLines) {
+    line.mOwner = sortedIndex[line.mOwner];
+  }
+  ParallelStableSort(mLines.begin(), mLines.end(),
+                     [](const LineRecord& aLeft, const LineRecord& aRight) {
+    return aLeft.mOwner < aRight.mOwner ||
+           (aLeft.mOwner == aRight.mOwner && aLeft.mRva < aRight.mRva);
+  }, aMaxThreads);
+  mLines.erase(std::unique(mLines.begin(), mLines.end(),
+                           [](const LineRecord& aLeft,
+                              const LineRecord& aRight) {
+                 return aLeft.mOwner == aRight.mOwner &&
+                        aLeft.mRva == aRight.mRva;
+               }), mLines.end());
+
+  mSymbolLines.assign(mSymbols.size() + 1, 0);
+  for (auto&& line : mLines) {
+    ++mSymbolLines[line.mOwner + 1];
+  }
+  for (size_t i = 1; i < mSymbolLines.size(); ++i) {
+    mSymbolLines[i] += mSymbolLines[i - 1];
+  }
+
+  // Most lines follow on directly from the previous one and differ from it
+  // by a small line number and not at all by file, so they encode into two
+  // bytes instead of sixteen.
+  const size_t numBlocks = (mLines.size() + kLineBlockSize - 1) /
+                           kLineBlockSize;
+  mLineBlockOffsets.reserve(numBlocks + 1);
+  mLineBlockRvas.reserve(numBlocks);
+  mLineData.reserve(mLines.size() * 4);
+  uint64_t prevEnd = 0;
+  uint32_t prevLine = 0, prevFile = 0;
+  for (size_t i = 0; i < mLines.size(); ++i) {
+    const LineRecord& line = mLines[i];
+    if (i % kLineBlockSize == 0) {
+      mLineBlockOffsets.push_back(static_cast<uint32_t>(mLineData.size()));
+      mLineBlockRvas.push_back(line.mRva);
+      prevEnd = line.mRva;
+      prevLine = prevFile = 0;
+    }
+    const int64_t gap = int64_t(line.mRva) - int64_t(prevEnd);
+    const bool newFile = line.mFile != prevFile;
+    WriteVarint(mLineData,
+                ZigZag(int64_t(line.mLine) - int64_t(prevLine)) << 2 |
+                uint64_t(gap != 0) << 1 | newFile);
+    WriteVarint(mLineData, line.mSize);
+    if (gap) {
+      WriteVarint(mLineData, ZigZag(gap));
+    }
+    if (newFile) {
+      WriteVarint(mLineData, line.mFile);
+    }
+    prevEnd = uint64_t(line.mRva) + line.mSize;
+    prevLine = line.mLine;
+    prevFile = line.mFile;
+  }
+  mLineBlockOffsets.push_back(static_cast<uint32_t>(mLineData.size()));
+  Release(mLines);
+
+  // INLINE_ORIGIN ids are unique in practice; if not, the last one wins.
+  std::stable_sort(mOrigins.begin(), mOrigins.end(),
+                   [](const OriginRecord& aLeft, const OriginRecord& aRight) {
+    return aLeft.mId < aRight.mId;
+  });
+  std::reverse(mOrigins.begin(), mOrigins.end());
+  mOrigins.erase(std::unique(mOrigins.begin(), mOrigins.end(),
+                             [](const OriginRecord& aLeft,
+                                const OriginRecord& aRight) {
+                   return aLeft.mId == aRight.mId;
+                 }), mOrigins.end());
+  std::reverse(mOrigins.begin(), mOrigins.end());
+
+  // Inline ranges whose origin is unknown cannot be named, so drop them.
+  // Their nested ranges are still contained in the enclosing ones, so the
+  // tree below stays well-formed.
+  for (auto&& inl : mInlines) {
+    auto origin = std::lower_bound(mOrigins.begin(), mOrigins.end(),
+                                   inl.mOrigin,
+                                   [](const OriginRecord& aLeft,
+                                      uint32_t aRight) {
+      return aLeft.mId < aRight;
+    });
+    if (inl.mOwner >= kPreviousChunk || origin == mOrigins.end() ||
+        origin->mId != inl.mOrigin) {
+      inl.mOwner = kNoFunction;
+      continue;
+    }
+    inl.mOrigin = origin->mName;
+    inl.mOwner = sortedIndex[inl.mOwner];
+  }
+  mInlines.erase(std::remove_if(mInlines.begin(), mInlines.end(),
+                                [](const InlineRecord& aInline) {
+                   return aInline.mOwner == kNoFunction;
+                 }), mInlines.end());
+  Release(mOrigins);
+  Release(sortedIndex);
+
+  // Sorting each symbol's ranges by start and then by depth puts every range
+  // ahead of the ranges nested inside it. The ranges that are still open
+  // when a range starts outside of them end that range's subtree.
+  ParallelStableSort(mInlines.begin(), mInlines.end(),
+                     [](const InlineRecord& aLeft,
+                        const InlineRecord& aRight) {
+    if (aLeft.mOwner != aRight.mOwner) {
+      return aLeft.mOwner < aRight.mOwner;
+    }
+    if (aLeft.mRva != aRight.mRva) {
+      return aLeft.mRva < aRight.mRva;
+    }
+    return aLeft.mDepth < aRight.mDepth;
+  }, aMaxThreads);
+  mSymbolInlines.assign(mSymbols.size() + 1, 0);
+  mInlineNext.resize(mInlines.size());
+  std::vector<uint32_t> open;
+  for (uint32_t i = 0; i <= mInlines.size(); ++i) {
+    const InlineRecord* cur = i < mInlines.size() ? &mInlines[i] : nullptr;
+    while (!open.empty()) {
+      const InlineRecord& parent = mInlines[open.back()];
+      if (cur && cur->mOwner == parent.mOwner &&
+          cur->mDepth > parent.mDepth &&
+          cur->mRva - parent.mRva < parent.mSize) {
+        break;
+      }
+      mInlineNext[open.back()] = i;
+      open.pop_back();
+    }
+    if (cur) {
+      open.push_back(i);
+      ++mSymbolInlines[cur->mOwner + 1];
+    }
+  }
+  for (size_t i = 1; i < mSymbolInlines.size(); ++i) {
+    mSymbolInlines[i] += mSymbolInlines[i - 1];
+  }
+
+  // FILE ids are unique in practice; if not, the last one wins.
+  std::stable_sort(mFiles.begin(), mFiles.end(),
+                   [](const FileRecord& aLeft, const FileRecord& aRight) {
+    return aLeft.mId < aRight.mId;
+  });
+  std::reverse(mFiles.begin(), mFiles.end());
+  mFiles.erase(std::unique(mFiles.begin(), mFiles.end(),
+                           [](const FileRecord& aLeft,
+                              const FileRecord& aRight) {
+                 return aLeft.mId == aRight.mId;
+               }), mFiles.end());
+  std::reverse(mFiles.begin(), mFiles.end());
+
+  const char* strings = mStrings.Data();
+  mSymbolsByName.resize(mSymbols.size());
+  for (uint32_t i = 0; i < mSymbolsByName.size(); ++i) {
+    mSymbolsByName[i] = i;
+  }
+  ParallelStableSort(mSymbolsByName.begin(), mSymbolsByName.end(),
+                     [&](uint32_t aLeft, uint32_t aRight) {
+    uint32_t left = mSymbols[aLeft].mName;
+    uint32_t right = mSymbols[aRight].mName;
+    return left != right && strcmp(strings + left, strings + right) < 0;
+  }, aMaxThreads);
+  // Names are interned, so equal names have equal offsets
+  mSymbolsByName.erase(std::unique(mSymbolsByName.begin(),
+                                   mSymbolsByName.end(),
+                                   [&](uint32_t aLeft, uint32_t aRight) {
+                         return mSymbols[aLeft].mName == mSymbols[aRight].mName;
+                       }), mSymbolsByName.end());
+
+  // Visiting the names in pool order rather than in name order keeps the
+  // reads sequential.
+  std::vector<uint32_t> nameOffsets(mSymbolsByName.size());
+  for (size_t i = 0; i < nameOffsets.size(); ++i) {
+    nameOffsets[i] = mSymbols[mSymbolsByName[i]].mName;
+  }
+  std::sort(nameOffsets.begin(), nameOffsets.end());
+  std::vector<const char*> names(nameOffsets.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    names[i] = strings + nameOffsets[i];
+  }
+  BpNameFilter::Build(names, mNameFilter, aMaxThreads);
+
+  SortUnwindInfo(aMaxThreads);
+}
+
+void
+BpSymbolTableBuilder::SortUnwindInfo(unsigned int aMaxThreads)
+{
+  // Every distinct rule string is compiled once. Records are visited in
+  // sorted order, so the code comes out the same however the file was
+  // parsed. Records whose rules don't compile are dropped.
+  std::unordered_map<uint32_t, uint32_t> cfiCode, winCode;
+  auto compile = [&](uint32_t aRules, bool aIsCfi) -> uint32_t {
+    std::unordered_map<uint32_t, uint32_t>& cache = aIsCfi ? cfiCode : winCode;
+    auto itr = cache.find(aRules);
+    if (itr != cache.end()) {
+      return itr->second;
+    }
+    const char* rules = mRules.Data() + aRules;
+    const char* rulesEnd = rules + strlen(rules);
+    const size_t offset = mUnwindCode.size();
+    bool ok = aIsCfi ? BpCompileCfiRules(rules, rulesEnd, mUnwindCode) :
+                       BpCompileWinProgram(rules, rulesEnd, mUnwindCode);
+    uint32_t code = kNoUnwindCode;
+    if (ok) {
+      code = static_cast<uint32_t>(offset);
+    } else {
+      mUnwindCode.resize(offset);
+    }
+    cache.emplace(aRules, code);
+    return code;
+  };
+
+  // STACK CFI INIT ranges don't overlap in practice; when several start at
+  // the same RVA the first one wins.
+  std::vector<uint32_t> sortedIndex(mCfi.size(), kNoFunction);
+  ParallelStableSort(mCfi.begin(), mCfi.end(),
+                     [](const CfiRecord& aLeft, const CfiRecord& aRight) {
+    return aLeft.mRva < aRight.mRva;
+  }, aMaxThreads);
+  mCfi.erase(std::unique(mCfi.begin(), mCfi.end(),
+                         [](const CfiRecord& aLeft, const CfiRecord& aRight) {
+               return aLeft.mRva == aRight.mRva;
+             }), mCfi.end());
+  for (auto&& cfi : mCfi) {
+    cfi.mRules = compile(cfi.mRules, true);
+  }
+  mCfi.erase(std::remove_if(mCfi.begin(), mCfi.end(),
+                            [](const CfiRecord& aCfi) {
+               return aCfi.mRules == kNoUnwindCode;
+             }), mCfi.end());
+
+  // Group the STACK CFI records by their STACK CFI INIT, like the lines of a
+  // symbol above. Those of dropped STACK CFI INIT records go with them.
+  for (uint32_t i = 0; i < mCfi.size(); ++i) {
+    sortedIndex[mCfi[i].mIndex] = i;
+  }
+  for (auto&& delta : mCfiDeltas) {
+    if (delta.mOwner >= sortedIndex.size()) {
+      delta.mOwner = kNoFunction;
+      continue;
+    }
+    delta.mOwner = sortedIndex[delta.mOwner];
+    if (delta.mOwner != kNoFunction) {
+      delta.mRules = compile(delta.mRules, true);
+    }
+  }
+  mCfiDeltas.erase(std::remove_if(mCfiDeltas.begin(), mCfiDeltas.end(),
+                                  [](const CfiDeltaRecord& aDelta) {
+                     return aDelta.mOwner == kNoFunction ||
+                            aDelta.mRules == kNoUnwindCode;
+                   }), mCfiDeltas.end());
+  Release(sortedIndex);
+  ParallelStableSort(mCfiDeltas.begin(), mCfiDeltas.end(),
+                     [](const CfiDeltaRecord& aLeft,
+                        const CfiDeltaRecord& aRight) {
+    return aLeft.mOwner < aRight.mOwner ||
+           (aLeft.mOwner == aRight.mOwner && aLeft.mRva < aRight.mRva);
+  }, aMaxThreads);
+  mCfiDeltaStarts.assign(mCfi.size() + 1, 0);
+  for (auto&& delta : mCfiDeltas) {
+    ++mCfiDeltaStarts[delta.mOwner + 1];
+  }
+  for (size_t i = 1; i < mCfiDeltaStarts.size(); ++i) {
+    mCfiDeltaStarts[i] += mCfiDeltaStarts[i - 1];
+  }
+
+  // FrameData records are more precise than FPO ones, so they go first and
+  // are searched first. Within each type the first record at an RVA wins.
+  std::stable_sort(mStackWin.begin(), mStackWin.end(),
+                   [](const StackWinRecord& aLeft,
+                      const StackWinRecord& aRight) {
+    return aLeft.mType > aRight.mType ||
+           (aLeft.mType == aRight.mType && aLeft.mRva < aRight.mRva);
+  });
+  mStackWin.erase(std::unique(mStackWin.begin(), mStackWin.end(),
+                              [](const StackWinRecord& aLeft,
+                                 const StackWinRecord& aRight) {
+                    return aLeft.mType == aRight.mType &&
+                           aLeft.mRva == aRight.mRva;
+                  }), mStackWin.end());
+  // Records that cover no code are useless, so those whose program doesn't
+  // compile are turned into such records and dropped along with them.
+  for (auto&& rec : mStackWin) {
+    if (rec.mCode) {
+      rec.mCode = compile(rec.mCode, false);
+      if (rec.mCode == kNoUnwindCode) {
+        rec.mCodeSize = 0;
+      }
+    } else {
+      rec.mCode = kNoUnwindCode;
+    }
+  }
+  mStackWin.erase(std::remove_if(mStackWin.begin(), mStackWin.end(),
+                                 [](const StackWinRecord& aRecord) {
+                    return !aRecord.mCodeSize;
+                  }), mStackWin.end());
+  mRules.Release();
+}
+
+std::unique_ptr<char[]>
+BpSymbolTableBuilder::Finish(uint64_t aSourceSize, uint64_t aSourceTime,
+                             unsigned int aMaxThreads, size_t& aImageSize)
+{
+  Sort(aMaxThreads);
+
+  uint64_t sizes[eSectionCount];
+  const uint64_t kU32 = sizeof(uint32_t);
+  sizes[eSymbolRvas] = sizes[eSymbolSizes] = sizes[eSymbolNames] =
+    sizes[eSymbolParams] = mSymbols.size() * kU32;
+  sizes[eSymbolsByName] = mSymbolsByName.size() * kU32;
+  sizes[eNameFilter] = mNameFilter.size() * sizeof(uint64_t);
+  sizes[eSymbolLines] = mSymbolLines.size() * kU32;
+  sizes[eLineBlockOffsets] = mLineBlockOffsets.size() * kU32;
+  sizes[eLineBlockRvas] = mLineBlockRvas.size() * kU32;
+  sizes[eLineData] = mLineData.size();
+  sizes[eSymbolInlines] = mSymbolInlines.size() * kU32;
+  sizes[eInlineRvas] = sizes[eInlineSizes] = sizes[eInlineNext] =
+    sizes[eInlineNames] = sizes[eInlineCallLines] =
+    sizes[eInlineCallFiles] = mInlines.size() * kU32;
+  sizes[eCfiRvas] = sizes[eCfiSizes] = sizes[eCfiCode] = mCfi.size() * kU32;
+  sizes[eCfiDeltaStarts] = mCfiDeltaStarts.size() * kU32;
+  sizes[eCfiDeltaRvas] = sizes[eCfiDeltaCode] = mCfiDeltas.size() * kU32;
+  sizes[eStackWin] = mStackWin.size() * sizeof(StackWinRecord);
+  sizes[eUnwindCode] = mUnwindCode.size();
+  sizes[eFileIds] = sizes[eFilePaths] = mFiles.size() * kU32;
+  sizes[eStrings] = mStrings.Size();
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.mMagic, kMagic, sizeof(kMagic));
+  header.mVersion = kVersion;
+  header.mHeaderSize = sizeof(Header);
+  header.mSourceSize = aSourceSize;
+  header.mSourceTime = aSourceTime;
+  header.mModuleName = mModuleName;
+
+  uint64_t offset = AlignUp(sizeof(Header));
+  for (int i = 0; i < eSectionCount; ++i) {
+    header.mSections[i].mOffset = offset;
+    header.mSections[i].mSize = sizes[i];
+    offset = AlignUp(offset + sizes[i]);
+  }
+
+  aImageSize = static_cast<size_t>(offset);
+  std::unique_ptr<char[]> image(new char[aImageSize]());
+  char* base = image.get();
+  memcpy(base, &header, sizeof(header));
+
+  auto section = [&](Section aSection) -> uint32_t* {
+    return reinterpret_cast<uint32_t*>(base + header.mSections[aSection].mOffset);
+  };
+
+  uint32_t* rvas = section(eSymbolRvas);
+  uint32_t* symSizes = section(eSymbolSizes);
+  uint32_t* names = section(eSymbolNames);
+  uint32_t* params = section(eSymbolParams);
+  for (size_t i = 0; i < mSymbols.size(); ++i) {
+    rvas[i] = mSymbols[i].mRva;
+    symSizes[i] = mSymbols[i].mSize;
+    names[i] = mSymbols[i].mName;
+    params[i] = mSymbols[i].mParams;
+  }
+  if (!mSymbolsByName.empty()) {
+    memcpy(section(eSymbolsByName), mSymbolsByName.data(),
+           sizes[eSymbolsByName]);
+  }
+  if (!mNameFilter.empty()) {
+    memcpy(section(eNameFilter), mNameFilter.data(), sizes[eNameFilter]);
+  }
+  memcpy(section(eSymbolLines), mSymbolLines.data(), sizes[eSymbolLines]);
+
+  memcpy(section(eLineBlockOffsets), mLineBlockOffsets.data(),
+         sizes[eLineBlockOffsets]);
+  if (!mLineBlockRvas.empty()) {
+    memcpy(section(eLineBlockRvas), mLineBlockRvas.data(),
+           sizes[eLineBlockRvas]);
+    memcpy(base + header.mSections[eLineData].mOffset, mLineData.data(),
+           sizes[eLineData]);
+  }
+
+  memcpy(section(eSymbolInlines), mSymbolInlines.data(),
+         sizes[eSymbolInlines]);
+  uint32_t* inlineRvas = section(eInlineRvas);
+  uint32_t* inlineSizes = section(eInlineSizes);
+  uint32_t* inlineNext = section(eInlineNext);
+  uint32_t* inlineNames = section(eInlineNames);
+  uint32_t* inlineCallLines = section(eInlineCallLines);
+  uint32_t* inlineCallFiles = section(eInlineCallFiles);
+  for (size_t i = 0; i < mInlines.size(); ++i) {
+    inlineRvas[i] = mInlines[i].mRva;
+    inlineSizes[i] = mInlines[i].mSize;
+    inlineNext[i] = mInlineNext[i];
+    inlineNames[i] = mInlines[i].mOrigin;
+    inlineCallLines[i] = mInlines[i].mCallLine;
+    inlineCallFiles[i] = mInlines[i].mCallFile;
+  }
+
+  uint32_t* cfiRvas = section(eCfiRvas);
+  uint32_t* cfiSizes = section(eCfiSizes);
+  uint32_t* cfiCode = section(eCfiCode);
+  for (size_t i = 0; i < mCfi.size(); ++i) {
+    cfiRvas[i] = mCfi[i].mRva;
+    cfiSizes[i] = mCfi[i].mSize;
+    cfiCode[i] = mCfi[i].mRules;
+  }
+  memcpy(section(eCfiDeltaStarts), mCfiDeltaStarts.data(),
+         sizes[eCfiDeltaStarts]);
+  uint32_t* deltaRvas = section(eCfiDeltaRvas);
+  uint32_t* deltaCode = section(eCfiDeltaCode);
+  for (size_t i = 0; i < mCfiDeltas.size(); ++i) {
+    deltaRvas[i] = mCfiDeltas[i].mRva;
+    deltaCode[i] = mCfiDeltas[i].mRules;
+  }
+  if (!mStackWin.empty()) {
+    memcpy(section(eStackWin), mStackWin.data(), sizes[eStackWin]);
+  }
+  if (!mUnwindCode.empty()) {
+    memcpy(section(eUnwindCode), mUnwindCode.data(), sizes[eUnwindCode]);
+  }
+
+  uint32_t* fileIds = section(eFileIds);
+  uint32_t* filePaths = section(eFilePaths);
+  for (size_t i = 0; i < mFiles.size(); ++i) {
+    fileIds[i] = mFiles[i].mId;
+    filePaths[i] = mFiles[i].mPath;
+  }
+
+  memcpy(base + header.mSections[eStrings].mOffset, mStrings.Data(),
+         mStrings.Size());
+  return image;
+}
+
+} // anonymous namespace
+
+BpSymbolTable::BpSymbolTable()
+  : mImage(nullptr)
+  , mImageSize(0)
+  , mHeader(nullptr)
+  , mStrings(nullptr)
+  , mLineData(nullptr)
+{
+}
+
+BpSymbolTable::~BpSymbolTable()
+{
+}
+
+std::unique_ptr<BpSymbolTable>
+BpSymbolTable::Parse(const char* aBegin, const char* aEnd,
+                     uint64_t aSourceTime, unsigned int aMaxThreads)
+{
+  // Large files are cut into chunks at line boundaries which are parsed
+  // concurrently. Merging the chunks in file order before sorting keeps the
+  // result identical to that of a sequential parse.
+  const size_t kMinChunkSize = 0x800000; // 8MB
+  const size_t size = aEnd - aBegin;
+  const size_t numChunks = std::max<size_t>(
+      std::min<size_t>(aMaxThreads, size / kMinChunkSize), 1);
+
+  BpSymbolTableBuilder builder;
+  if (numChunks == 1) {
+    ParseBpSymbols(aBegin, aEnd, builder);
+  } else {
+    std::vector<const char*> bounds(numChunks + 1);
+    bounds[0] = aBegin;
+    bounds[numChunks] = aEnd;
+    for (size_t i = 1; i < numChunks; ++i) {
+      const char* p = std::max(aBegin + size * i / numChunks, bounds[i - 1]);
+      const char* eol = static_cast<const char*>(memchr(p, '\n', aEnd - p));
+      bounds[i] = eol ? eol + 1 : aEnd;
+    }
+
+    std::vector<BpSymbolTableBuilder> chunks(numChunks);
+    ParallelFor(numChunks, [&](size_t aChunk) -> void {
+      ParseBpSymbols(bounds[aChunk], bounds[aChunk + 1], chunks[aChunk]);
+    }, aMaxThreads);
+    builder.Merge(chunks);
+  }
+
+  std::unique_ptr<BpSymbolTable> table(new BpSymbolTable());
+  size_t imageSize;
+  table->mOwnedImage = builder.Finish(aEnd - aBegin, aSourceTime,
+                                      aMaxThreads, imageSize);
+  table->Attach(table->mOwnedImage.get(), imageSize);
+  return table;
+}
+
+std::unique_ptr<BpSymbolTable>
+BpSymbolTable::Map(const BpPathChar* aCachePath, uint64_t aSourceSize,
+                   uint64_t aSourceTime)
+{
+  std::unique_ptr<BpSymbolTable> table(new BpSymbolTable());
+  BpMappedFile& file = table->mMappedImage;
+  if (!file.Open(aCachePath) ||
+      !Validate(file.Begin(), file.Size(), aSourceSize, aSourceTime)) {
+    return nullptr;
+  }
+  table->Attach(file.Begin(), file.Size());
+  return table;
+}
+
+bool
+BpSymbolTable::Save(const BpPathChar* aCachePath) const
+{
+  return Write(aCachePath, mImage, mImageSize);
+}
+
+void
+BpSymbolTable::Attach(const char* aImage, size_t aImageSize)
+{
+  mImage = aImage;
+  mImageSize = aImageSize;
+  mHeader = reinterpret_cast<const Header*>(aImage);
+  mStrings = aImage + mHeader->mSections[eStrings].mOffset;
+
+  mSymbolRvas = GetArray(eSymbolRvas);
+  mSymbolSizes = GetArray(eSymbolSizes);
+  mSymbolNames = GetArray(eSymbolNames);
+  mSymbolParams = GetArray(eSymbolParams);
+  mSymbolsByName = GetArray(eSymbolsByName);
+  const SectionEntry& nameFilter = mHeader->mSections[eNameFilter];
+  mNameFilter = BpArray<uint64_t>(
+      reinterpret_cast<const uint64_t*>(aImage + nameFilter.mOffset),
+      static_cast<size_t>(nameFilter.mSize / sizeof(uint64_t)));
+  mSymbolLines = GetArray(eSymbolLines);
+  mLineBlockOffsets = GetArray(eLineBlockOffsets);
+  mLineBlockRvas = GetArray(eLineBlockRvas);
+  mLineData = reinterpret_cast<const uint8_t*>(
+      aImage + mHeader->mSections[eLineData].mOffset);
+  mSymbolInlines = GetArray(eSymbolInlines);
+  mInlineRvas = GetArray(eInlineRvas);
+  mInlineSizes = GetArray(eInlineSizes);
+  mInlineNext = GetArray(eInlineNext);
+  mInlineNames = GetArray(eInlineNames);
+  mInlineCallLines = GetArray(eInlineCallLines);
+  mInlineCallFiles = GetArray(eInlineCallFiles);
+  mCfiRvas = GetArray(eCfiRvas);
+  mCfiSizes = GetArray(eCfiSizes);
+  mCfiCode = GetArray(eCfiCode);
+  mCfiDeltaStarts = GetArray(eCfiDeltaStarts);
+  mCfiDeltaRvas = GetArray(eCfiDeltaRvas);
+  mCfiDeltaCode = GetArray(eCfiDeltaCode);
+  const SectionEntry& stackWin = mHeader->mSections[eStackWin];
+  mStackWin = BpArray<StackWinRecord>(
+      reinterpret_cast<const StackWinRecord*>(aImage + stackWin.mOffset),
+      static_cast<size_t>(stackWin.mSize / sizeof(StackWinRecord)));
+  const SectionEntry& unwindCode = mHeader->mSections[eUnwindCode];
+  mUnwindCode = BpArray<uint8_t>(
+      reinterpret_cast<const uint8_t*>(aImage + unwindCode.mOffset),
+      static_cast<size_t>(unwindCode.mSize));
+  mFileIds = GetArray(eFileIds);
+  mFilePaths = GetArray(eFilePaths);
+
+  mSymbolIndex.Build(mSymbolRvas);
+}
+
+BpArray<uint32_t>
+BpSymbolTable::GetArray(Section aSection) const
+{
+  const SectionEntry& entry = mHeader->mSections[aSection];
+  return BpArray<uint32_t>(
+      reinterpret_cast<const uint32_t*>(mImage + entry.mOffset),
+      static_cast<size_t>(entry.mSize / sizeof(uint32_t)));
+}
+
+const char*
+BpSymbolTable::FilePath(uint32_t aFileId) const
+{
+  auto itr = std::lower_bound(mFileIds.begin(), mFileIds.end(), aFileId);
+  if (itr == mFileIds.end() || *itr != aFileId) {
+    return nullptr;
+  }
+  return String(mFilePaths[itr - mFileIds.begin()]);
+}
+
+size_t
+BpSymbolTable::IndexSize() const
+{
+  return mSymbolIndex.HeapSize();
+}
+
+bool
+BpSymbolTable::FindSymbol(uint64_t aRva, size_t& aIndex) const
+{
+  size_t index;
+  if (!mSymbolIndex.Find(aRva, index)) {
+    return false;
+  }
+  const uint32_t* rvas = mSymbolRvas.begin();
+  while (index && rvas[index - 1] == rvas[index]) {
+    --index;
+  }
+  aIndex = index;
+  return true;
+}
+
+bool
+BpSymbolTable::FindLine(size_t aSymbol, uint64_t aRva, BpLine& aLine) const
+{
+  const size_t begin = mSymbolLines[aSymbol];
+  const size_t end = mSymbolLines[aSymbol + 1];
+  if (begin == end) {
+    return false;
+  }
+
+  // Every block after the one containing the symbol's first line starts with
+  // one of the symbol's lines, so the block RVAs of those are sorted. Pick
+  // the last block that starts at or before aRva; the line we want is in it,
+  // or else it is in the first block, past the lines of earlier symbols.
+  const uint32_t* blockRvas = mLineBlockRvas.begin();
+  const size_t firstBlock = begin / kLineBlockSize;
+  const size_t lastBlock = (end - 1) / kLineBlockSize;
+  const size_t block =
+    std::upper_bound(blockRvas + firstBlock + 1, blockRvas + lastBlock + 1,
+                     aRva) - blockRvas - 1;
+
+  LineBlockReader reader(mLineData + mLineBlockOffsets[block],
+                         mLineData + mLineBlockOffsets[block + 1],
+                         blockRvas[block]);
+  size_t index = block * kLineBlockSize;
+  const size_t blockEnd = std::min(index + kLineBlockSize, end);
+  for (; index < begin; ++index) {
+    reader.Next();
+  }
+
+  bool found = false;
+  for (; index < blockEnd; ++index) {
+    const BpLine& line = reader.Next();
+    if (line.mRva > aRva) {
+      break;
+    }
+    aLine = line;
+    found = true;
+  }
+  return found && aRva - aLine.mRva < aLine.mSize;
+}
+
+void
+BpSymbolTable::FindInlines(size_t aSymbol, uint64_t aRva,
+                           std::vector<size_t>& aIndices) const
+{
+  // Each range that contains aRva narrows the walk to the ranges nested in
+  // it; each one that doesn't is skipped along with everything nested in it.
+  aIndices.clear();
+  size_t index = mSymbolInlines[aSymbol];
+  size_t end = mSymbolInlines[aSymbol + 1];
+  while (index < end) {
+    if (aRva - mInlineRvas[index] < mInlineSizes[index]) {
+      aIndices.push_back(index);
+      end = mInlineNext[index];
+      ++index;
+    } else {
+      index = mInlineNext[index];
+    }
+  }
+}
+
+bool
+BpSymbolTable::FindCfi(uint64_t aRva, size_t& aIndex) const
+{
+  auto itr = std::upper_bound(mCfiRvas.begin(), mCfiRvas.end(), aRva);
+  if (itr == mCfiRvas.begin()) {
+    return false;
+  }
+  const size_t index = itr - mCfiRvas.begin() - 1;
+  if (aRva - mCfiRvas[index] >= mCfiSizes[index]) {
+    return false;
+  }
+  aIndex = index;
+  return true;
+}
+
+const StackWinRecord*
+BpSymbolTable::FindStackWin(uint64_t aRva) const
+{
+  // FrameData records may be nested, as when a function's prolog has a
+  // record of its own; the innermost one is the last one containing aRva.
+  // A few records back is as far as nesting goes in practice.
+  const size_t kMaxNesting = 8;
+  const StackWinRecord* begin = mStackWin.begin();
+  const StackWinRecord* end = mStackWin.end();
+  const StackWinRecord* fpo = std::partition_point(begin, end,
+      [](const StackWinRecord& aRecord) {
+    return aRecord.mType != 0;
+  });
+  const StackWinRecord* const groups[][2] = {{begin, fpo}, {fpo, end}};
+  for (auto&& group : groups) {
+    const StackWinRecord* itr = std::upper_bound(group[0], group[1], aRva,
+        [](uint64_t aLeft, const StackWinRecord& aRight) {
+      return aLeft < aRight.mRva;
+    });
+    for (size_t i = 0; i < kMaxNesting && itr != group[0]; ++i) {
+      --itr;
+      if (aRva - itr->mRva < itr->mCodeSize) {
+        return itr;
+      }
+    }
+  }
+  return nullptr;
+}
+
+void
+BpSymbolTable::FindSymbols(const uint64_t* aRvas, size_t aCount,
+                           size_t* aIndices) const
+{
+  mSymbolIndex.FindSorted(aRvas, aCount, aIndices);
+  const uint32_t* rvas = mSymbolRvas.begin();
+  for (size_t i = 0; i < aCount; ++i) {
+    size_t& index = aIndices[i];
+    if (index == kNotFound) {
+      continue;
+    }
+    while (index && rvas[index - 1] == rvas[index]) {
+      --index;
+    }
+  }
+}
+
+size_t
+BpSymbolTable::LowerBoundByName(const char* aName) const
+{
+  auto itr = std::lower_bound(mSymbolsByName.begin(), mSymbolsByName.end(),
+                              aName, [this](uint32_t aLeft, const char* aRight) {
+    return strcmp(String(mSymbolNames[aLeft]), aRight) < 0;
+  });
+  return itr - mSymbolsByName.begin();
+}
+
+bool
+BpSymbolTable::FindSymbolByName(const char* aName, size_t& aIndex) const
+{
+  size_t pos = LowerBoundByName(aName);
+  if (pos == mSymbolsByName.size() ||
+      strcmp(String(mSymbolNames[mSymbolsByName[pos]]), aName)) {
+    return false;
+  }
+  aIndex = mSymbolsByName[pos];
+  return true;
+}
+
+void
+BpRvaIndex::Build(const BpArray<uint32_t>& aRvas)
+{
+  mRvas = aRvas;
+  mLevels.clear();
+
+  const uint32_t* keys = aRvas.begin();
+  size_t numKeys = aRvas.size();
+  while (numKeys > kBlockSize) {
+    std::vector<uint32_t> level((numKeys + kBlockSize - 1) / kBlockSize);
+    for (size_t i = 0; i < level.size(); ++i) {
+      level[i] = keys[i * kBlockSize];
+    }
+    mLevels.push_back(std::move(level));
+    keys = mLevels.back().data();
+    numKeys = mLevels.back().size();
+  }
+}
+
+// Returns the number of keys in [aBlock, aBlock + aLength) that are <= aKey.
+static size_t
+CountNotAbove(const uint32_t* aBlock, size_t aLength, uint32_t aKey)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < aLength; ++i) {
+    count += aBlock[i] <= aKey;
+  }
+  return count;
+}
+
+bool
+BpRvaIndex::Find(uint64_t aRva, size_t& aIndex) const
+{
+  if (mRvas.empty()) {
+    return false;
+  }
+  if (aRva > 0xFFFFFFFF) {
+    aIndex = mRvas.size() - 1;
+    return true;
+  }
+  const uint32_t key = static_cast<uint32_t>(aRva);
+
+  // Every level, including the top one, is searched one block at a time.
+  // Since each key at one level is the first key of a block in the level
+  // below, the block that we descend into always has a key <= aRva.
+  size_t index = 0;
+  for (size_t level = mLevels.size() + 1; level-- > 0;) {
+    const uint32_t* keys = level ? mLevels[level - 1].data() : mRvas.begin();
+    const size_t numKeys = level ? mLevels[level - 1].size() : mRvas.size();
+    const size_t begin = index * kBlockSize;
+    const size_t length =
+      numKeys - begin < kBlockSize ? numKeys - begin : kBlockSize;
+    const size_t count = CountNotAbove(keys + begin, length, key);
+    if (!count) {
+      // Only possible in the top block: aRva precedes the first key
+      return false;
+    }
+    index = begin + count - 1;
+  }
+
+  aIndex = index;
+  return true;
+}
+
+void
+BpRvaIndex::FindSorted(const uint64_t* aRvas, size_t aCount,
+                       size_t* aIndices) const
+{
+  // Merge the queries with mRvas. Each query first checks whether its answer
+  // lies within the next block past the previous answer, which is the common
+  // case for clustered addresses; otherwise it falls back to the index.
+  const uint32_t* rvas = mRvas.begin();
+  const size_t numRvas = mRvas.size();
+  size_t prev = ~size_t(0);
+  for (size_t i = 0; i < aCount; ++i) {
+    const uint64_t rva = aRvas[i];
+    if (prev != ~size_t(0)) {
+      size_t limit = std::min(prev + 1 + kBlockSize, numRvas);
+      size_t next = prev + 1;
+      while (next < limit && rvas[next] <= rva) {
+        ++next;
+      }
+      if (next < limit || next == numRvas) {
+        prev = aIndices[i] = next - 1;
+        continue;
+      }
+    }
+    size_t index;
+    if (Find(rva, index)) {
+      prev = aIndices[i] = index;
+    } else {
+      aIndices[i] = ~size_t(0);
+    }
+  }
+}
+
+size_t
+BpRvaIndex::HeapSize() const
+{
+  size_t size = 0;
+  for (auto&& level : mLevels) {
+    size += level.capacity() * sizeof(uint32_t);
+  }
+  return size;
+}
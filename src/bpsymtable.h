@@ -0,0 +1,232 @@
+#ifndef __BPSYMTABLE_H
+#define __BPSYMTABLE_H
+
+// Flat, immutable symbol tables for a single module. Platform-neutral.
+
+#include "bpsymcache.h"
+#include "bpsymfile.h"
+#include "parallel.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+/**
+ * Read-only view of an array that lives inside a symbol table image.
+ */
+template <typename T>
+class BpArray
+{
+public:
+  BpArray()
+    : mData(nullptr)
+    , mLength(0)
+  {
+  }
+
+  BpArray(const T* aData, size_t aLength)
+    : mData(aData)
+    , mLength(aLength)
+  {
+  }
+
+  const T* begin() const { return mData; }
+  const T* end() const { return mData + mLength; }
+  size_t size() const { return mLength; }
+  bool empty() const { return !mLength; }
+  const T& operator[](size_t aIndex) const { return mData[aIndex]; }
+
+private:
+  const T* mData;
+  size_t   mLength;
+};
+
+/**
+ * Static search index over a sorted array of RVAs. Each level above the array
+ * holds the first key of every cache-line-sized block of the level below, so
+ * a lookup reads one block per level instead of bouncing around the whole
+ * array the way a binary search does. Each block is scanned without
+ * data-dependent branches. The upper levels add about 1/15th to the size of
+ * the array and are rebuilt whenever a table is loaded.
+ */
+class BpRvaIndex
+{
+public:
+  void Build(const BpArray<uint32_t>& aRvas);
+
+  // Finds the last element that is <= aRva.
+  bool Find(uint64_t aRva, size_t& aIndex) const;
+  // Same as Find for every element of the ascending array aRvas, storing
+  // ~size_t(0) when there is no such element.
+  void FindSorted(const uint64_t* aRvas, size_t aCount,
+                  size_t* aIndices) const;
+
+  size_t HeapSize() const;
+
+private:
+  // Number of uint32_t keys in a 64-byte cache line
+  static const size_t kBlockSize = 16;
+
+  BpArray<uint32_t>                  mRvas;
+  // Level 0 summarizes mRvas; the last level has at most kBlockSize keys
+  std::vector<std::vector<uint32_t>> mLevels;
+};
+
+/**
+ * A single decoded source line.
+ */
+struct BpLine
+{
+  uint32_t mRva;
+  uint32_t mSize;
+  uint32_t mLine;
+  uint32_t mFile; // Breakpad FILE id
+};
+
+/**
+ * All of a module's symbols, source lines and file names. The tables live in
+ * a single contiguous image that uses the binary cache layout described in
+ * bpsymcache.h; the image is either generated in memory from a text .sym file
+ * or mapped directly from a cache file on disk.
+ */
+class BpSymbolTable
+{
+public:
+  ~BpSymbolTable();
+
+  // Builds a table from the text of a Breakpad .sym file, on up to
+  // aMaxThreads threads. aSourceTime is the file's modification time, which
+  // is recorded in the image for Map() to check.
+  static std::unique_ptr<BpSymbolTable> Parse(
+    const char* aBegin, const char* aEnd, uint64_t aSourceTime,
+    unsigned int aMaxThreads = GetWorkerThreadCount());
+  // Maps a cache file written by Save(). aSourceSize and aSourceTime are the
+  // size and modification time of the .sym file the cache should correspond
+  // to, or zero to skip that check.
+  static std::unique_ptr<BpSymbolTable> Map(const BpPathChar* aCachePath,
+                                            uint64_t aSourceSize,
+                                            uint64_t aSourceTime);
+  bool Save(const BpPathChar* aCachePath) const;
+
+  const char* ModuleName() const { return String(mHeader->mModuleName); }
+  const char* String(uint32_t aOffset) const { return mStrings + aOffset; }
+
+  // Symbols, sorted by RVA
+  const BpArray<uint32_t>& SymbolRvas() const { return mSymbolRvas; }
+  const BpArray<uint32_t>& SymbolSizes() const { return mSymbolSizes; }
+  const BpArray<uint32_t>& SymbolNames() const { return mSymbolNames; }
+  const BpArray<uint32_t>& SymbolParams() const { return mSymbolParams; }
+  // Indices into the symbol arrays, sorted by name
+  const BpArray<uint32_t>& SymbolsByName() const { return mSymbolsByName; }
+  // The source lines of symbol i are [SymbolLines()[i], SymbolLines()[i + 1])
+  const BpArray<uint32_t>& SymbolLines() const { return mSymbolLines; }
+
+  // Source lines are stored compressed and can only be looked up via
+  // FindLine.
+  size_t NumLines() const { return mSymbolLines[mSymbolLines.size() - 1]; }
+
+  // Finds the symbol that aRva falls into: the last symbol whose RVA is <=
+  // aRva, or the first listed of several that share that RVA.
+  bool FindSymbol(uint64_t aRva, size_t& aIndex) const;
+  // Finds the source line of symbol aSymbol that contains aRva.
+  bool FindLine(size_t aSymbol, uint64_t aRva, BpLine& aLine) const;
+
+  // Inlined calls: one entry per address range of each INLINE record
+  const BpArray<uint32_t>& InlineNames() const { return mInlineNames; }
+  const BpArray<uint32_t>& InlineCallLines() const { return mInlineCallLines; }
+  const BpArray<uint32_t>& InlineCallFiles() const { return mInlineCallFiles; }
+  // Stores the indices of the inlined calls of symbol aSymbol that contain
+  // aRva in aIndices, outermost first.
+  void FindInlines(size_t aSymbol, uint64_t aRva,
+                   std::vector<size_t>& aIndices) const;
+
+  static const size_t kNotFound = ~size_t(0);
+  // Batch version of FindSymbol. aRvas must be sorted in ascending order;
+  // aIndices[i] receives the index for aRvas[i], or kNotFound. Lookups resume
+  // from the previous result, so resolving many nearby addresses costs about
+  // one pass over the arrays.
+  void FindSymbols(const uint64_t* aRvas, size_t aCount,
+                   size_t* aIndices) const;
+  // Finds the symbol named exactly aName.
+  bool FindSymbolByName(const char* aName, size_t& aIndex) const;
+  // Returns the position in SymbolsByName() of the first name >= aName.
+  size_t LowerBoundByName(const char* aName) const;
+  // Words of the Bloom filter over the symbol names; see BpNameFilter
+  const BpArray<uint64_t>& NameFilter() const { return mNameFilter; }
+
+  // STACK CFI INIT records, sorted by RVA, with the eUnwindCode offsets of
+  // their rules. The STACK CFI records that refine the rules of record i are
+  // [CfiDeltaStarts()[i], CfiDeltaStarts()[i + 1]) in the delta arrays.
+  const BpArray<uint32_t>& CfiRvas() const { return mCfiRvas; }
+  const BpArray<uint32_t>& CfiSizes() const { return mCfiSizes; }
+  const BpArray<uint32_t>& CfiCode() const { return mCfiCode; }
+  const BpArray<uint32_t>& CfiDeltaStarts() const { return mCfiDeltaStarts; }
+  const BpArray<uint32_t>& CfiDeltaRvas() const { return mCfiDeltaRvas; }
+  const BpArray<uint32_t>& CfiDeltaCode() const { return mCfiDeltaCode; }
+  // Compiled unwind rules; see bpunwind.h
+  const BpArray<uint8_t>& UnwindCode() const { return mUnwindCode; }
+  // Finds the STACK CFI INIT record whose range contains aRva.
+  bool FindCfi(uint64_t aRva, size_t& aIndex) const;
+  // Finds the STACK WIN record whose range contains aRva, preferring
+  // FrameData records over FPO ones, or returns nullptr.
+  const bpsymcache::StackWinRecord* FindStackWin(uint64_t aRva) const;
+
+  // FILE records, sorted by id
+  const BpArray<uint32_t>& FileIds() const { return mFileIds; }
+  const BpArray<uint32_t>& FilePaths() const { return mFilePaths; }
+  // Returns the path for Breakpad FILE id aFileId, or nullptr
+  const char* FilePath(uint32_t aFileId) const;
+
+  size_t ImageSize() const { return mImageSize; }
+  // Memory used by the search indices, which are not part of the image
+  size_t IndexSize() const;
+  bool IsMapped() const { return mMappedImage.IsOpen(); }
+
+private:
+  BpSymbolTable();
+  BpSymbolTable(const BpSymbolTable&) = delete;
+  BpSymbolTable& operator=(const BpSymbolTable&) = delete;
+
+  void Attach(const char* aImage, size_t aImageSize);
+  BpArray<uint32_t> GetArray(bpsymcache::Section aSection) const;
+
+  std::unique_ptr<char[]>   mOwnedImage;
+  BpMappedFile              mMappedImage;
+  const char*               mImage;
+  size_t                    mImageSize;
+  const bpsymcache::Header* mHeader;
+  const char*               mStrings;
+
+  BpArray<uint32_t> mSymbolRvas;
+  BpArray<uint32_t> mSymbolSizes;
+  BpArray<uint32_t> mSymbolNames;
+  BpArray<uint32_t> mSymbolParams;
+  BpArray<uint32_t> mSymbolsByName;
+  BpArray<uint64_t> mNameFilter;
+  BpArray<uint32_t> mSymbolLines;
+  BpArray<uint32_t> mLineBlockOffsets;
+  BpArray<uint32_t> mLineBlockRvas;
+  const uint8_t*    mLineData;
+  BpArray<uint32_t> mSymbolInlines;
+  BpArray<uint32_t> mInlineRvas;
+  BpArray<uint32_t> mInlineSizes;
+  BpArray<uint32_t> mInlineNext;
+  BpArray<uint32_t> mInlineNames;
+  BpArray<uint32_t> mInlineCallLines;
+  BpArray<uint32_t> mInlineCallFiles;
+  BpArray<uint32_t> mCfiRvas;
+  BpArray<uint32_t> mCfiSizes;
+  BpArray<uint32_t> mCfiCode;
+  BpArray<uint32_t> mCfiDeltaStarts;
+  BpArray<uint32_t> mCfiDeltaRvas;
+  BpArray<uint32_t> mCfiDeltaCode;
+  BpArray<bpsymcache::StackWinRecord> mStackWin;
+  BpArray<uint8_t>  mUnwindCode;
+  BpArray<uint32_t> mFileIds;
+  BpArray<uint32_t> mFilePaths;
+
+  BpRvaIndex        mSymbolIndex;
+};
+
+#endif // __BPSYMTABLE_H
@@ -0,0 +1,733 @@
+#include "bpunwind.h"
+#include "bpsymtable.h"
+
+#include <string.h>
+
+using namespace bpsymcache;
+
+typedef BpUnwindRegs Regs;
+
+namespace {
+
+// Expression code is a sequence of these, each followed by its operand, if
+// any. Operators pop their operands and push their result.
+enum Opcode
+{
+  eOpVar,    // slot (1 byte); pushes the slot's value
+  eOpConst,  // zigzag varint; pushes the constant
+  eOpAdd,
+  eOpSub,
+  eOpMul,
+  eOpDiv,
+  eOpMod,
+  eOpAlign,  // a b @ -> a & -b
+  eOpDeref   // a ^ -> the pointer-sized value at address a
+};
+
+// Slot of variables that no rule can define, such as $xmm0. Reading it
+// always fails, so only the rules that need it are lost.
+const uint8_t kUnknownSlot = 0xFF;
+
+// Deepest operand stack that an expression may use
+const size_t kMaxDepth = 32;
+
+typedef std::vector<uint8_t> Code;
+
+struct SlotName
+{
+  const char* mName;
+  int         mSlot;
+};
+
+const SlotName kSlotNames[] = {
+  {"$eip", Regs::ePc}, {"$rip", Regs::ePc},
+  {"$esp", Regs::eSp}, {"$rsp", Regs::eSp},
+  {"$ebp", Regs::eBp}, {"$rbp", Regs::eBp},
+  {"$ebx", Regs::eBx}, {"$rbx", Regs::eBx},
+  {"$esi", Regs::eSi}, {"$rsi", Regs::eSi},
+  {"$edi", Regs::eDi}, {"$rdi", Regs::eDi},
+  {"$eax", Regs::eAx}, {"$rax", Regs::eAx},
+  {"$ecx", Regs::eCx}, {"$rcx", Regs::eCx},
+  {"$edx", Regs::eDx}, {"$rdx", Regs::eDx},
+  {"$r8", Regs::eR8}, {"$r9", Regs::eR9},
+  {"$r10", Regs::eR10}, {"$r11", Regs::eR11},
+  {"$r12", Regs::eR12}, {"$r13", Regs::eR13},
+  {"$r14", Regs::eR14}, {"$r15", Regs::eR15},
+  {".cfa", Regs::eCfa}, {".ra", Regs::eRa},
+  {"$L", Regs::eL}, {"$P", Regs::eP},
+  {".raSearch", Regs::eRaSearch},
+  {".raSearchStart", Regs::eRaSearchStart},
+  {".cbCalleeParams", Regs::eCbCalleeParams},
+  {".cbSavedRegs", Regs::eCbSavedRegs},
+  {".cbLocals", Regs::eCbLocals},
+  {".cbParams", Regs::eCbParams},
+};
+
+// Registers that a callee must preserve, and which therefore keep their
+// values in the caller unless a rule says where they were saved.
+const int kCalleeSavedX86[] = {Regs::eBp, Regs::eBx, Regs::eSi, Regs::eDi};
+const int kCalleeSavedX64[] = {Regs::eBp, Regs::eBx, Regs::eSi, Regs::eDi,
+                               Regs::eR12, Regs::eR13, Regs::eR14,
+                               Regs::eR15};
+
+void
+WriteVarint(Code& aOut, uint64_t aValue)
+{
+  while (aValue >= 0x80) {
+    aOut.push_back(static_cast<uint8_t>(aValue | 0x80));
+    aValue >>= 7;
+  }
+  aOut.push_back(static_cast<uint8_t>(aValue));
+}
+
+bool
+ReadVarint(const uint8_t*& aPos, const uint8_t* aEnd, uint64_t& aValue)
+{
+  uint64_t value = 0;
+  for (int shift = 0; aPos != aEnd && shift < 64; shift += 7) {
+    const uint8_t byte = *aPos++;
+    value |= uint64_t(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      aValue = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Pops the next whitespace-delimited token off the front of [aPos, aEnd).
+bool
+NextToken(const char*& aPos, const char* aEnd, const char*& aBegin,
+          const char*& aTokenEnd)
+{
+  while (aPos != aEnd && bpsymfile::IsSpace(*aPos)) {
+    ++aPos;
+  }
+  if (aPos == aEnd) {
+    return false;
+  }
+  aBegin = aPos;
+  while (aPos != aEnd && !bpsymfile::IsSpace(*aPos)) {
+    ++aPos;
+  }
+  aTokenEnd = aPos;
+  return true;
+}
+
+// Parses an optionally negative decimal constant.
+bool
+ParseConstant(const char* aBegin, const char* aEnd, int64_t& aValue)
+{
+  const bool negative = aEnd - aBegin > 1 && *aBegin == '-';
+  const char* p = aBegin + negative;
+  if (p == aEnd) {
+    return false;
+  }
+  uint64_t value = 0;
+  for (; p != aEnd; ++p) {
+    const unsigned int digit = static_cast<unsigned char>(*p) - '0';
+    if (digit >= 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  aValue = negative ? -static_cast<int64_t>(value) :
+                      static_cast<int64_t>(value);
+  return true;
+}
+
+/**
+ * Compiles a postfix expression one token at a time. Each entry of the stack
+ * holds the code that computes one operand, so applying an operator is just
+ * a matter of concatenating the code of its operands.
+ */
+class ExpressionCompiler
+{
+public:
+  // Pushes a variable or constant, or applies an operator.
+  bool Push(const char* aBegin, const char* aEnd)
+  {
+    static const char kOperators[] = "+-*/%@^";
+    const char* op = aEnd - aBegin == 1 ? strchr(kOperators, *aBegin) :
+                                          nullptr;
+    if (op && *op == '^') {
+      if (mStack.empty()) {
+        return false;
+      }
+      mStack.back().mCode.push_back(eOpDeref);
+      mStack.back().mIsVariable = false;
+      return true;
+    }
+    if (op && *op) {
+      if (mStack.size() < 2) {
+        return false;
+      }
+      Operand& left = mStack[mStack.size() - 2];
+      const Code& right = mStack.back().mCode;
+      left.mCode.insert(left.mCode.end(), right.begin(), right.end());
+      left.mCode.push_back(static_cast<uint8_t>(eOpAdd + (op - kOperators)));
+      left.mIsVariable = false;
+      mStack.pop_back();
+      return true;
+    }
+
+    Operand operand;
+    int64_t constant;
+    if (ParseConstant(aBegin, aEnd, constant)) {
+      operand.mIsVariable = false;
+      operand.mVariable = -1;
+      operand.mCode.push_back(eOpConst);
+      WriteVarint(operand.mCode,
+                  (static_cast<uint64_t>(constant) << 1) ^
+                  static_cast<uint64_t>(constant >> 63));
+    } else {
+      int slot = Regs::Lookup(aBegin, aEnd);
+      operand.mIsVariable = true;
+      operand.mVariable = slot;
+      operand.mCode.push_back(eOpVar);
+      operand.mCode.push_back(slot < 0 ? kUnknownSlot : uint8_t(slot));
+    }
+    mStack.push_back(std::move(operand));
+    return true;
+  }
+
+  // Pops the only operand left, which is the value of a CFI rule.
+  bool PopValue(Code& aValue)
+  {
+    if (mStack.size() != 1) {
+      return false;
+    }
+    aValue.swap(mStack.back().mCode);
+    mStack.clear();
+    return true;
+  }
+
+  // Pops the operands of the '=' operator of a STACK WIN program: a variable
+  // and the value to assign to it.
+  bool PopAssignment(int& aTarget, Code& aValue)
+  {
+    if (mStack.size() < 2 || !mStack[mStack.size() - 2].mIsVariable) {
+      return false;
+    }
+    aTarget = mStack[mStack.size() - 2].mVariable;
+    aValue.swap(mStack.back().mCode);
+    mStack.resize(mStack.size() - 2);
+    return true;
+  }
+
+  bool IsEmpty() const { return mStack.empty(); }
+
+private:
+  struct Operand
+  {
+    Code mCode;
+    bool mIsVariable;
+    // The slot of a variable, or -1 if it is unknown
+    int  mVariable;
+  };
+
+  std::vector<Operand> mStack;
+};
+
+/**
+ * Accumulates the assignments of one program.
+ */
+class ProgramWriter
+{
+public:
+  ProgramWriter()
+    : mCount(0)
+  {
+  }
+
+  void Add(int aTarget, const Code& aValue)
+  {
+    // Rules for registers we don't track are dropped
+    if (aTarget < 0) {
+      return;
+    }
+    mAssignments.push_back(static_cast<uint8_t>(aTarget));
+    WriteVarint(mAssignments, aValue.size());
+    mAssignments.insert(mAssignments.end(), aValue.begin(), aValue.end());
+    ++mCount;
+  }
+
+  void Finish(Code& aCode) const
+  {
+    WriteVarint(aCode, mCount);
+    aCode.insert(aCode.end(), mAssignments.begin(), mAssignments.end());
+  }
+
+private:
+  Code   mAssignments;
+  size_t mCount;
+};
+
+/**
+ * Iterates over the assignments of a compiled program. Every read is bounds
+ * checked, since the program may come from a corrupt cache file.
+ */
+class ProgramReader
+{
+public:
+  ProgramReader(const BpArray<uint8_t>& aCode, uint32_t aOffset)
+    : mPos(aCode.begin() + aOffset)
+    , mEnd(aCode.end())
+    , mCount(0)
+  {
+    if (aOffset >= aCode.size() || !ReadVarint(mPos, mEnd, mCount)) {
+      mCount = 0;
+    }
+  }
+
+  bool Next(int& aTarget, const uint8_t*& aBegin, const uint8_t*& aEnd)
+  {
+    uint64_t length;
+    if (!mCount || mPos == mEnd) {
+      return false;
+    }
+    aTarget = *mPos++;
+    if (!ReadVarint(mPos, mEnd, length) || length > uint64_t(mEnd - mPos)) {
+      mCount = 0;
+      return false;
+    }
+    aBegin = mPos;
+    aEnd = mPos += length;
+    --mCount;
+    return true;
+  }
+
+private:
+  const uint8_t* mPos;
+  const uint8_t* mEnd;
+  uint64_t       mCount;
+};
+
+/**
+ * Evaluates expression code against a set of registers. Arithmetic wraps
+ * at the pointer size of the architecture.
+ */
+class Evaluator
+{
+public:
+  Evaluator(BpArch aArch, BpMemoryReader& aMemory)
+    : mMemory(aMemory)
+    , mPointerSize(aArch == eBpArchX64 ? 8 : 4)
+    , mMask(aArch == eBpArchX64 ? ~uint64_t(0) : 0xFFFFFFFF)
+  {
+  }
+
+  size_t PointerSize() const { return mPointerSize; }
+  uint64_t Mask() const { return mMask; }
+
+  bool Evaluate(const uint8_t* aCode, const uint8_t* aEnd, const Regs& aRegs,
+                uint64_t& aResult)
+  {
+    uint64_t stack[kMaxDepth];
+    size_t depth = 0;
+    while (aCode != aEnd) {
+      const uint8_t op = *aCode++;
+      uint64_t value;
+      switch (op) {
+        case eOpVar:
+          if (aCode == aEnd || *aCode >= Regs::eNumSlots ||
+              !aRegs.Has(*aCode) || depth == kMaxDepth) {
+            return false;
+          }
+          stack[depth++] = aRegs.Get(*aCode++) & mMask;
+          continue;
+        case eOpConst:
+          if (!ReadVarint(aCode, aEnd, value) || depth == kMaxDepth) {
+            return false;
+          }
+          stack[depth++] = ((value >> 1) ^ (0 - (value & 1))) & mMask;
+          continue;
+        case eOpDeref:
+          if (!depth || !ReadPointer(stack[depth - 1], value)) {
+            return false;
+          }
+          stack[depth - 1] = value;
+          continue;
+        default:
+          break;
+      }
+
+      if (depth < 2) {
+        return false;
+      }
+      const uint64_t right = stack[--depth];
+      uint64_t& left = stack[depth - 1];
+      switch (op) {
+        case eOpAdd:
+          left += right;
+          break;
+        case eOpSub:
+          left -= right;
+          break;
+        case eOpMul:
+          left *= right;
+          break;
+        case eOpDiv:
+          if (!right) {
+            return false;
+          }
+          left /= right;
+          break;
+        case eOpMod:
+          if (!right) {
+            return false;
+          }
+          left %= right;
+          break;
+        case eOpAlign:
+          left &= 0 - right;
+          break;
+        default:
+          return false;
+      }
+      left &= mMask;
+    }
+    if (depth != 1) {
+      return false;
+    }
+    aResult = stack[0];
+    return true;
+  }
+
+  bool ReadPointer(uint64_t aAddress, uint64_t& aValue)
+  {
+    uint8_t bytes[8];
+    if (!mMemory.Read(aAddress, bytes, mPointerSize)) {
+      return false;
+    }
+    // Both architectures are little-endian
+    uint64_t value = 0;
+    for (size_t i = mPointerSize; i-- > 0;) {
+      value = (value << 8) | bytes[i];
+    }
+    aValue = value;
+    return true;
+  }
+
+private:
+  BpMemoryReader& mMemory;
+  size_t          mPointerSize;
+  uint64_t        mMask;
+};
+
+// Copies the callee-saved registers that aCaller doesn't have yet, except
+// for those in aExclude.
+void
+CopyCalleeSaved(BpArch aArch, const Regs& aCallee, Regs& aCaller,
+                uint64_t aExclude)
+{
+  const int* regs = aArch == eBpArchX64 ? kCalleeSavedX64 : kCalleeSavedX86;
+  const size_t count = aArch == eBpArchX64 ?
+    sizeof(kCalleeSavedX64) / sizeof(kCalleeSavedX64[0]) :
+    sizeof(kCalleeSavedX86) / sizeof(kCalleeSavedX86[0]);
+  for (size_t i = 0; i < count; ++i) {
+    const int reg = regs[i];
+    if (!aCaller.Has(reg) && aCallee.Has(reg) &&
+        !((aExclude >> reg) & 1)) {
+      aCaller.Set(reg, aCallee.Get(reg));
+    }
+  }
+}
+
+// A STACK CFI INIT record gives the rules at the start of a function; each
+// STACK CFI record after it replaces some of them from its RVA onwards.
+bool
+UnwindCfi(const BpSymbolTable& aTable, uint64_t aRva, BpArch aArch,
+          const Regs& aCallee, Evaluator& aEvaluator, Regs& aCaller)
+{
+  size_t index;
+  if (!aTable.FindCfi(aRva, index)) {
+    return false;
+  }
+
+  const uint8_t* ruleBegin[Regs::eNumSlots] = {};
+  const uint8_t* ruleEnd[Regs::eNumSlots] = {};
+  auto addRules = [&](uint32_t aOffset) -> void {
+    ProgramReader reader(aTable.UnwindCode(), aOffset);
+    int target;
+    const uint8_t* begin;
+    const uint8_t* end;
+    while (reader.Next(target, begin, end)) {
+      if (target < Regs::eNumSlots) {
+        ruleBegin[target] = begin;
+        ruleEnd[target] = end;
+      }
+    }
+  };
+  addRules(aTable.CfiCode()[index]);
+  const BpArray<uint32_t>& deltaRvas = aTable.CfiDeltaRvas();
+  for (size_t i = aTable.CfiDeltaStarts()[index];
+       i < aTable.CfiDeltaStarts()[index + 1] && deltaRvas[i] <= aRva; ++i) {
+    addRules(aTable.CfiDeltaCode()[i]);
+  }
+
+  // Every rule is evaluated against the callee's registers, plus the CFA
+  Regs regs(aCallee);
+  uint64_t cfa, ra;
+  if (!ruleBegin[Regs::eCfa] || !ruleBegin[Regs::eRa] ||
+      !aEvaluator.Evaluate(ruleBegin[Regs::eCfa], ruleEnd[Regs::eCfa], regs,
+                           cfa)) {
+    return false;
+  }
+  regs.Set(Regs::eCfa, cfa);
+  if (!aEvaluator.Evaluate(ruleBegin[Regs::eRa], ruleEnd[Regs::eRa], regs,
+                           ra)) {
+    return false;
+  }
+
+  aCaller.Clear();
+  aCaller.Set(Regs::eSp, cfa);
+  aCaller.Set(Regs::ePc, ra);
+  for (int reg = 0; reg < Regs::eNumRegisters; ++reg) {
+    uint64_t value;
+    if (ruleBegin[reg] &&
+        aEvaluator.Evaluate(ruleBegin[reg], ruleEnd[reg], regs, value)) {
+      aCaller.Set(reg, value);
+    }
+  }
+  CopyCalleeSaved(aArch, aCallee, aCaller, 0);
+  return true;
+}
+
+// STACK WIN programs assign to registers and temporaries in order.
+// Records without a program describe FPO functions, whose return address
+// sits just past their locals and saved registers.
+bool
+UnwindWin(const BpSymbolTable& aTable, uint64_t aRva, const Regs& aCallee,
+          Evaluator& aEvaluator, Regs& aCaller)
+{
+  const StackWinRecord* record = aTable.FindStackWin(aRva);
+  if (!record) {
+    return false;
+  }
+
+  Regs regs(aCallee);
+  const uint64_t raSearchStart = aCallee.Get(Regs::eSp) +
+                                 record->mLocalSize + record->mSavedRegSize;
+  regs.Set(Regs::eCbCalleeParams, 0);
+  regs.Set(Regs::eCbSavedRegs, record->mSavedRegSize);
+  regs.Set(Regs::eCbLocals, record->mLocalSize);
+  regs.Set(Regs::eCbParams, record->mParamSize);
+  regs.Set(Regs::eRaSearchStart, raSearchStart);
+  regs.Set(Regs::eRaSearch, raSearchStart);
+
+  aCaller.Clear();
+  if (record->mCode == kNoUnwindCode) {
+    uint64_t pc;
+    if (!aEvaluator.ReadPointer(raSearchStart, pc)) {
+      return false;
+    }
+    aCaller.Set(Regs::ePc, pc);
+    aCaller.Set(Regs::eSp, raSearchStart + aEvaluator.PointerSize());
+    // A function that uses ebp as a general register saved the caller's
+    // value somewhere among its saved registers, but the record doesn't
+    // say where, so it is unknown.
+    uint64_t exclude =
+      record->mFlags & StackWinRecord::eAllocatesBasePointer ?
+      uint64_t(1) << Regs::eBp : 0;
+    CopyCalleeSaved(eBpArchX86, aCallee, aCaller, exclude);
+    return true;
+  }
+
+  ProgramReader reader(aTable.UnwindCode(), record->mCode);
+  int target;
+  const uint8_t* begin;
+  const uint8_t* end;
+  while (reader.Next(target, begin, end)) {
+    uint64_t value;
+    if (target >= Regs::eNumSlots ||
+        !aEvaluator.Evaluate(begin, end, regs, value)) {
+      return false;
+    }
+    regs.Set(target, value);
+    if (target < Regs::eNumRegisters) {
+      aCaller.Set(target, value);
+    }
+  }
+  CopyCalleeSaved(eBpArchX86, aCallee, aCaller, 0);
+  return true;
+}
+
+// The frame pointer points at the caller's frame pointer, which is followed
+// by the return address.
+bool
+UnwindFramePointer(const Regs& aCallee, Evaluator& aEvaluator, Regs& aCaller)
+{
+  if (!aCallee.Has(Regs::eBp)) {
+    return false;
+  }
+  const uint64_t fp = aCallee.Get(Regs::eBp);
+  const size_t pointerSize = aEvaluator.PointerSize();
+  uint64_t callerFp, pc;
+  if (fp < aCallee.Get(Regs::eSp) ||
+      !aEvaluator.ReadPointer(fp, callerFp) ||
+      !aEvaluator.ReadPointer(fp + pointerSize, pc)) {
+    return false;
+  }
+  aCaller.Clear();
+  aCaller.Set(Regs::eBp, callerFp);
+  aCaller.Set(Regs::ePc, pc);
+  aCaller.Set(Regs::eSp, fp + 2 * pointerSize);
+  return true;
+}
+
+// Leaf functions on x64 have no unwind info because they never touch the
+// stack pointer, so their return address is on top of the stack.
+bool
+UnwindLeaf(const Regs& aCallee, Evaluator& aEvaluator, Regs& aCaller)
+{
+  const uint64_t sp = aCallee.Get(Regs::eSp);
+  uint64_t pc;
+  if (!aEvaluator.ReadPointer(sp, pc)) {
+    return false;
+  }
+  aCaller.Clear();
+  aCaller.Set(Regs::ePc, pc);
+  aCaller.Set(Regs::eSp, sp + aEvaluator.PointerSize());
+  CopyCalleeSaved(eBpArchX64, aCallee, aCaller, 0);
+  return true;
+}
+
+// Stacks grow down, so every caller's frame must be above its callee's.
+bool
+IsPlausible(const Regs& aCallee, const Regs& aCaller)
+{
+  return aCaller.Has(Regs::ePc) && aCaller.Has(Regs::eSp) &&
+         aCaller.Get(Regs::ePc) &&
+         aCaller.Get(Regs::eSp) > aCallee.Get(Regs::eSp);
+}
+
+} // anonymous namespace
+
+int
+BpUnwindRegs::Lookup(const char* aBegin, const char* aEnd)
+{
+  const size_t length = aEnd - aBegin;
+  if (length == 3 && aBegin[0] == '$' && aBegin[1] == 'T' &&
+      aBegin[2] >= '0' && aBegin[2] <= '9') {
+    return eT0 + (aBegin[2] - '0');
+  }
+  for (auto&& name : kSlotNames) {
+    if (strlen(name.mName) == length &&
+        !memcmp(name.mName, aBegin, length)) {
+      return name.mSlot;
+    }
+  }
+  return -1;
+}
+
+bool
+BpCompileCfiRules(const char* aBegin, const char* aEnd,
+                  std::vector<uint8_t>& aCode)
+{
+  // "<register>: <expression>" pairs, where the expression is every token
+  // up to the next register name
+  ProgramWriter program;
+  ExpressionCompiler expression;
+  Code value;
+  int target = -1;
+  bool haveTarget = false;
+  const char* pos = aBegin;
+  const char* begin;
+  const char* end;
+  while (NextToken(pos, aEnd, begin, end)) {
+    if (end[-1] == ':') {
+      if (haveTarget) {
+        if (!expression.PopValue(value)) {
+          return false;
+        }
+        program.Add(target, value);
+      }
+      target = Regs::Lookup(begin, end - 1);
+      haveTarget = true;
+      continue;
+    }
+    if (!haveTarget || !expression.Push(begin, end)) {
+      return false;
+    }
+  }
+  if (haveTarget) {
+    if (!expression.PopValue(value)) {
+      return false;
+    }
+    program.Add(target, value);
+  }
+  program.Finish(aCode);
+  return true;
+}
+
+bool
+BpCompileWinProgram(const char* aBegin, const char* aEnd,
+                    std::vector<uint8_t>& aCode)
+{
+  ProgramWriter program;
+  ExpressionCompiler expression;
+  Code value;
+  const char* pos = aBegin;
+  const char* begin;
+  const char* end;
+  while (NextToken(pos, aEnd, begin, end)) {
+    if (end - begin == 1 && *begin == '=') {
+      int target;
+      if (!expression.PopAssignment(target, value)) {
+        return false;
+      }
+      program.Add(target, value);
+      continue;
+    }
+    if (!expression.Push(begin, end)) {
+      return false;
+    }
+  }
+  if (!expression.IsEmpty()) {
+    return false;
+  }
+  program.Finish(aCode);
+  return true;
+}
+
+BpUnwindMethod
+BpUnwindFrame(const BpSymbolTable* aTable, uint64_t aModuleBase,
+              BpArch aArch, const BpUnwindRegs& aCallee,
+              bool aIsReturnAddress, BpMemoryReader& aMemory,
+              BpUnwindRegs& aCaller)
+{
+  if (!aCallee.Has(Regs::ePc) || !aCallee.Has(Regs::eSp)) {
+    return eBpUnwindFailed;
+  }
+  Evaluator evaluator(aArch, aMemory);
+
+  const uint64_t pc = aCallee.Get(Regs::ePc);
+  if (aTable && pc >= aModuleBase) {
+    uint64_t rva = pc - aModuleBase;
+    if (aIsReturnAddress && rva) {
+      --rva;
+    }
+    if (UnwindCfi(*aTable, rva, aArch, aCallee, evaluator, aCaller)) {
+      if (IsPlausible(aCallee, aCaller)) {
+        return eBpUnwindCfi;
+      }
+    } else if (aArch == eBpArchX64 && !aIsReturnAddress &&
+               UnwindLeaf(aCallee, evaluator, aCaller) &&
+               IsPlausible(aCallee, aCaller)) {
+      return eBpUnwindLeaf;
+    }
+    if (aArch == eBpArchX86 &&
+        UnwindWin(*aTable, rva, aCallee, evaluator, aCaller) &&
+        IsPlausible(aCallee, aCaller)) {
+      return eBpUnwindWin;
+    }
+  }
+
+  if (UnwindFramePointer(aCallee, evaluator, aCaller) &&
+      IsPlausible(aCallee, aCaller)) {
+    return eBpUnwindFramePointer;
+  }
+  aCaller.Clear();
+  return eBpUnwindFailed;
+}
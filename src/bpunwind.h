@@ -0,0 +1,145 @@
+#ifndef __BPUNWIND_H
+#define __BPUNWIND_H
+
+// Stack unwinding driven by the STACK CFI and STACK WIN records of Breakpad
+// symbol files. Platform-neutral.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class BpSymbolTable;
+
+enum BpArch
+{
+  eBpArchX86,
+  eBpArchX64
+};
+
+/**
+ * The registers of one stack frame, plus the pseudo-variables that unwind
+ * rules refer to. Registers are identified by role, so that ePc is $eip on
+ * x86 and $rip on x64. Only slots that have been set are known; the rest are
+ * undefined and any rule that reads them fails.
+ */
+class BpUnwindRegs
+{
+public:
+  enum Slot
+  {
+    ePc,
+    eSp,
+    eBp,
+    eBx,
+    eSi,
+    eDi,
+    eAx,
+    eCx,
+    eDx,
+    eR8,
+    eR9,
+    eR10,
+    eR11,
+    eR12,
+    eR13,
+    eR14,
+    eR15,
+    eNumRegisters,
+    // Pseudo-variables
+    eCfa = eNumRegisters,
+    eRa,
+    eT0,
+    eT9 = eT0 + 9,
+    eL,
+    eP,
+    eRaSearch,
+    eRaSearchStart,
+    eCbCalleeParams,
+    eCbSavedRegs,
+    eCbLocals,
+    eCbParams,
+    eNumSlots
+  };
+  static_assert(eNumSlots <= 64, "mValid has one bit per slot");
+
+  BpUnwindRegs()
+    : mValid(0)
+  {
+  }
+
+  bool Has(int aSlot) const { return (mValid >> aSlot) & 1; }
+  uint64_t Get(int aSlot) const { return mValues[aSlot]; }
+  void Set(int aSlot, uint64_t aValue)
+  {
+    mValues[aSlot] = aValue;
+    mValid |= uint64_t(1) << aSlot;
+  }
+  void Clear() { mValid = 0; }
+
+  // Maps a name such as "$esp", "$rip", ".cfa" or "$T0" to its slot, or
+  // returns -1 if the name is unknown.
+  static int Lookup(const char* aBegin, const char* aEnd);
+
+private:
+  uint64_t mValues[eNumSlots];
+  uint64_t mValid;
+};
+
+/**
+ * Source of the target's memory.
+ */
+class BpMemoryReader
+{
+public:
+  virtual ~BpMemoryReader() {}
+  // Reads exactly aSize bytes at aAddress, or fails.
+  virtual bool Read(uint64_t aAddress, void* aBuffer, size_t aSize) = 0;
+};
+
+// Unwind rules are compiled once, when a symbol table is built, into a
+// program that is stored in the table:
+//   varint count of assignments
+//   for each assignment: target slot (1 byte), varint code length, code
+// The code of an assignment is a postfix expression; see bpunwind.cpp.
+
+// Compiles the rules of a STACK CFI INIT or STACK CFI record, such as
+// ".cfa: $esp 4 + .ra: .cfa 4 - ^", and appends the program to aCode.
+bool
+BpCompileCfiRules(const char* aBegin, const char* aEnd,
+                  std::vector<uint8_t>& aCode);
+
+// Compiles the program string of a STACK WIN record, such as
+// "$T0 $ebp = $eip $T0 4 + ^ = $ebp $T0 ^ = $esp $T0 8 + =", and appends the
+// program to aCode.
+bool
+BpCompileWinProgram(const char* aBegin, const char* aEnd,
+                    std::vector<uint8_t>& aCode);
+
+enum BpUnwindMethod
+{
+  eBpUnwindFailed,
+  eBpUnwindCfi,
+  eBpUnwindWin,
+  eBpUnwindFramePointer,
+  // x64 only: the innermost frame is a leaf function without unwind info, so
+  // its return address is on top of the stack
+  eBpUnwindLeaf
+};
+
+/**
+ * Recovers the registers of the caller of the frame aCallee. aTable holds the
+ * symbols of the module that contains aCallee's pc and is loaded at
+ * aModuleBase; it may be null, in which case only the frame pointer chain is
+ * followed. aIsReturnAddress says whether aCallee's pc is a return address,
+ * which is true of every frame but the innermost one; such addresses are
+ * looked up one byte earlier so that they fall inside the call instruction.
+ * Returns the method that produced aCaller, or eBpUnwindFailed if none of
+ * them yielded a plausible frame.
+ */
+BpUnwindMethod
+BpUnwindFrame(const BpSymbolTable* aTable, uint64_t aModuleBase,
+              BpArch aArch, const BpUnwindRegs& aCallee,
+              bool aIsReturnAddress, BpMemoryReader& aMemory,
+              BpUnwindRegs& aCaller);
+
+#endif // __BPUNWIND_H
@@ -62,6 +62,22 @@ DbgExtCallbacks::DeregisterProcessDetachListener(ProcessDetachListenerFn aListen
   return true;
 }
 
+bool
+DbgExtCallbacks::RegisterBreakpointListener(BreakpointListenerFn aListener)
+{
+  if (!sInstance) {
+    sInstance = new DbgExtCallbacks();
+    HRESULT hr = gDebugClient->SetEventCallbacksWide(sInstance);
+    if (FAILED(hr)) {
+      delete sInstance;
+      sInstance = nullptr;
+      return false;
+    }
+  }
+  sInstance->mBreakpointListeners.push_back(aListener);
+  return true;
+}
+
 DbgExtCallbacks::DbgExtCallbacks()
   : mRefCnt(1)
 {
@@ -115,16 +131,23 @@ DbgExtCallbacks::GetInterestMask(PULONG aMask)
   if (!aMask) {
     return E_INVALIDARG;
   }
-  *aMask = DEBUG_EVENT_LOAD_MODULE | DEBUG_EVENT_UNLOAD_MODULE |
-           DEBUG_EVENT_EXIT_PROCESS | DEBUG_EVENT_SESSION_STATUS |
-           DEBUG_EVENT_CHANGE_ENGINE_STATE;
+  *aMask = DEBUG_EVENT_BREAKPOINT | DEBUG_EVENT_LOAD_MODULE |
+           DEBUG_EVENT_UNLOAD_MODULE | DEBUG_EVENT_EXIT_PROCESS |
+           DEBUG_EVENT_SESSION_STATUS | DEBUG_EVENT_CHANGE_ENGINE_STATE;
   return S_OK;
 }
 
 STDMETHODIMP
 DbgExtCallbacks::Breakpoint(PDEBUG_BREAKPOINT2 aBp)
 {
-  return E_NOTIMPL;
+  ULONG status = DEBUG_STATUS_NO_CHANGE;
+  for (auto&& fn : mBreakpointListeners) {
+    ULONG listenerStatus = fn(aBp);
+    if (listenerStatus != DEBUG_STATUS_NO_CHANGE) {
+      status = listenerStatus;
+    }
+  }
+  return status;
 }
 
 STDMETHODIMP
@@ -48,6 +48,11 @@ public:
   static bool RegisterProcessDetachListener(ProcessDetachListenerFn aListener);
   static bool DeregisterProcessDetachListener(ProcessDetachListenerFn aListener);
 
+  // Returns the execution status that the breakpoint should result in, such
+  // as DEBUG_STATUS_GO, or DEBUG_STATUS_NO_CHANGE to leave it to others.
+  typedef std::function<ULONG (PDEBUG_BREAKPOINT2)> BreakpointListenerFn;
+  static bool RegisterBreakpointListener(BreakpointListenerFn aListener);
+
 private:
   DbgExtCallbacks();
   virtual ~DbgExtCallbacks();
@@ -57,6 +62,7 @@ private:
 
   std::vector<ModuleEventListenerFn> mModuleEventListeners;
   std::vector<ProcessDetachListenerFn> mProcessDetachListeners;
+  std::vector<BreakpointListenerFn> mBreakpointListeners;
 
   static DbgExtCallbacks* sInstance;
 };
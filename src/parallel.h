@@ -0,0 +1,115 @@
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+// Minimal fork/join helpers. Platform-neutral.
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline unsigned int
+GetWorkerThreadCount()
+{
+  unsigned int count = std::thread::hardware_concurrency();
+  return count ? count : 1;
+}
+
+/**
+ * Calls aFn(i) for every i in [0, aCount), spreading the calls over up to
+ * aMaxThreads threads (including the calling thread). Indices are handed out
+ * one at a time in increasing order, so callers that want the expensive items
+ * to start first should order them that way. Returns once every call has
+ * completed.
+ *
+ * If a call throws, no further indices are handed out, and the first
+ * exception is rethrown on the calling thread once every thread has been
+ * joined.
+ *
+ * aFn runs on arbitrary threads and therefore must not call into dbgeng.
+ */
+template <typename FnT>
+void
+ParallelFor(size_t aCount, FnT&& aFn,
+            unsigned int aMaxThreads = GetWorkerThreadCount())
+{
+  size_t numThreads = std::min<size_t>(std::max(aMaxThreads, 1U), aCount);
+  std::atomic<size_t> next(0);
+  std::mutex errorLock;
+  std::exception_ptr error;
+  auto worker = [&]() -> void {
+    for (size_t i; (i = next.fetch_add(1)) < aCount;) {
+      try {
+        aFn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorLock);
+        if (!error) {
+          error = std::current_exception();
+        }
+        next = aCount;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  try {
+    threads.reserve(numThreads);
+    for (size_t i = 1; i < numThreads; ++i) {
+      threads.emplace_back(worker);
+    }
+  } catch (...) {
+    // Make do with the threads that we already have
+  }
+  worker();
+  for (auto&& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * Stable sort of [aBegin, aEnd) that sorts runs on separate threads and then
+ * merges neighbouring runs pairwise. Inputs that are too small to be worth
+ * splitting are sorted on the calling thread.
+ */
+template <typename IteratorT, typename CompareT>
+void
+ParallelStableSort(IteratorT aBegin, IteratorT aEnd, CompareT aCompare,
+                   unsigned int aMaxThreads = GetWorkerThreadCount())
+{
+  const size_t kMinRunLength = 0x10000;
+  const size_t length = aEnd - aBegin;
+  const size_t numRuns = std::min<size_t>(aMaxThreads,
+                                          length / kMinRunLength);
+  if (numRuns <= 1) {
+    std::stable_sort(aBegin, aEnd, aCompare);
+    return;
+  }
+
+  std::vector<IteratorT> bounds(numRuns + 1);
+  for (size_t i = 0; i <= numRuns; ++i) {
+    bounds[i] = aBegin + length * i / numRuns;
+  }
+  ParallelFor(numRuns, [&](size_t aRun) -> void {
+    std::stable_sort(bounds[aRun], bounds[aRun + 1], aCompare);
+  }, aMaxThreads);
+
+  for (size_t width = 1; width < numRuns; width *= 2) {
+    size_t numPairs = (numRuns + 2 * width - 1) / (2 * width);
+    ParallelFor(numPairs, [&](size_t aPair) -> void {
+      size_t lo = aPair * 2 * width;
+      size_t mid = lo + width;
+      size_t hi = std::min(lo + 2 * width, numRuns);
+      if (mid < hi) {
+        std::inplace_merge(bounds[lo], bounds[mid], bounds[hi], aCompare);
+      }
+    }, aMaxThreads);
+  }
+}
+
+#endif // __PARALLEL_H
@@ -0,0 +1,299 @@
+// Memory and lookup time of the delta-encoded line blocks against the two
+// line tables they replaced: four parallel uint32_t arrays sliced by symbol
+// (16 bytes per line), and before that a std::map of BpLineInfo keyed by
+// RVA. The compressed tables are meant to be at least 5x smaller than the
+// flat arrays with lookups within 2x of theirs. Every lookup must find the
+// same line in all three.
+//
+// Usage: bplinetable_bench [<megabytes of .sym text> [<lookups>]]
+
+#include "bptest.h"
+#include "bpsymcache.h"
+#include "bpsymtable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Bytes handed out by CountingAllocator, which is all that the map's nodes
+// cost short of the heap's own overhead
+size_t gAllocated;
+
+template <typename T>
+struct CountingAllocator
+{
+  typedef T value_type;
+
+  CountingAllocator() {}
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t aCount)
+  {
+    gAllocated += aCount * sizeof(T);
+    return static_cast<T*>(::operator new(aCount * sizeof(T)));
+  }
+  void deallocate(T* aPointer, size_t aCount)
+  {
+    gAllocated -= aCount * sizeof(T);
+    ::operator delete(aPointer);
+  }
+
+  template <typename U>
+  bool operator==(const CountingAllocator<U>&) const { return true; }
+  template <typename U>
+  bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+
+// The value type of the original map
+struct BpLineInfo
+{
+  uint64_t mRva;
+  uint32_t mSize;
+  uint64_t mFileId;
+  uint64_t mNameInt;
+};
+
+typedef std::map<uint64_t, BpLineInfo, std::less<uint64_t>,
+                 CountingAllocator<std::pair<const uint64_t, BpLineInfo>>>
+  LineMap;
+
+struct FuncLines
+{
+  uint64_t            mRva;
+  std::vector<BpLine> mLines;
+};
+
+/**
+ * Collects the line records of each FUNC, the way BpSymbolTable assigns
+ * them: lines after a PUBLIC record belong to no symbol.
+ */
+class LineSink
+{
+public:
+  explicit LineSink(std::vector<FuncLines>& aFuncs)
+    : mFuncs(aFuncs)
+    , mInFunction(false)
+  {
+  }
+
+  void Module(const BpToken&) {}
+  void File(uint64_t, const BpToken&) {}
+  void Function(uint64_t aRva, uint64_t, const BpToken&, const BpToken&)
+  {
+    mFuncs.push_back(FuncLines());
+    mFuncs.back().mRva = aRva;
+    mInFunction = true;
+  }
+  void Public(uint64_t, const BpToken&) { mInFunction = false; }
+  void Line(uint64_t aRva, uint64_t aSize, uint64_t aLine, uint64_t aFileId)
+  {
+    if (mInFunction) {
+      BpLine line = {uint32_t(aRva), uint32_t(aSize), uint32_t(aLine),
+                     uint32_t(aFileId)};
+      mFuncs.back().mLines.push_back(line);
+    }
+  }
+  void InlineOrigin(uint64_t, const BpToken&) {}
+  void Inline(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) {}
+  void StackCfiInit(uint64_t, uint64_t, const BpToken&) {}
+  void StackCfi(uint64_t, const BpToken&) {}
+  void StackWin(const BpStackWin&) {}
+
+private:
+  std::vector<FuncLines>& mFuncs;
+  bool                    mInFunction;
+};
+
+/**
+ * The line table as it was before compression: parallel arrays, grouped by
+ * symbol and sorted by RVA within each symbol.
+ */
+struct FlatLines
+{
+  std::vector<uint32_t> mSymbolLines;
+  std::vector<uint32_t> mRvas;
+  std::vector<uint32_t> mSizes;
+  std::vector<uint32_t> mLines;
+  std::vector<uint32_t> mFiles;
+
+  // The compressed tables slice the lines by symbol the same way, so the
+  // slice starts are left out of both sizes
+  size_t Size() const
+  {
+    return (mRvas.size() + mSizes.size() + mLines.size() + mFiles.size()) *
+           sizeof(uint32_t);
+  }
+
+  bool Find(size_t aSymbol, uint64_t aRva, BpLine& aLine) const
+  {
+    const uint32_t* begin = mRvas.data() + mSymbolLines[aSymbol];
+    const uint32_t* end = mRvas.data() + mSymbolLines[aSymbol + 1];
+    const uint32_t* itr = std::upper_bound(begin, end, aRva);
+    if (itr == begin) {
+      return false;
+    }
+    const size_t index = itr - mRvas.data() - 1;
+    if (aRva - mRvas[index] >= mSizes[index]) {
+      return false;
+    }
+    BpLine line = {mRvas[index], mSizes[index], mLines[index], mFiles[index]};
+    aLine = line;
+    return true;
+  }
+};
+
+// Size of the line sections of aTable's image, read back from its cache
+size_t
+CompressedSize(const BpSymbolTable& aTable)
+{
+  const char* kPath = "bplinetable_bench.symcache";
+  BpMappedFile file;
+  size_t size = 0;
+  if (aTable.Save(kPath) && file.Open(kPath)) {
+    const bpsymcache::Header& header =
+      *reinterpret_cast<const bpsymcache::Header*>(file.Begin());
+    size = size_t(header.mSections[bpsymcache::eLineBlockOffsets].mSize +
+                  header.mSections[bpsymcache::eLineBlockRvas].mSize +
+                  header.mSections[bpsymcache::eLineData].mSize);
+  }
+  file.Close();
+  remove(kPath);
+  return size;
+}
+
+bool
+SameLine(bool aFoundA, const BpLine& aA, bool aFoundB, const BpLine& aB)
+{
+  return aFoundA == aFoundB &&
+         (!aFoundA || !memcmp(&aA, &aB, sizeof(BpLine)));
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  BpTestSymOptions options;
+  options.mSize = BpTestArg(aArgc, aArgv, 1, 128) << 20;
+  const size_t numLookups = size_t(BpTestArg(aArgc, aArgv, 2, 2000000));
+  std::string text;
+  BpGenerateSymFile(options, text);
+  auto table = BpSymbolTable::Parse(text.data(), text.data() + text.size(),
+                                    0);
+  std::vector<FuncLines> funcs;
+  LineSink sink(funcs);
+  ParseBpSymbols(text.data(), text.data() + text.size(), sink);
+  text.clear();
+  text.shrink_to_fit();
+
+  // Both older tables, from the same records
+  const size_t numSymbols = table->SymbolRvas().size();
+  std::vector<std::vector<BpLine>*> linesBySymbol(numSymbols, nullptr);
+  LineMap lineMap;
+  for (auto&& func : funcs) {
+    size_t symbol;
+    BPTEST_CHECK(table->FindSymbol(func.mRva, symbol) &&
+                 table->SymbolRvas()[symbol] == func.mRva);
+    std::sort(func.mLines.begin(), func.mLines.end(),
+              [](const BpLine& aLeft, const BpLine& aRight) {
+      return aLeft.mRva < aRight.mRva;
+    });
+    linesBySymbol[symbol] = &func.mLines;
+    for (auto&& line : func.mLines) {
+      BpLineInfo info = {line.mRva, line.mSize, line.mFile, line.mLine};
+      lineMap.emplace(line.mRva, info);
+    }
+  }
+  FlatLines flat;
+  flat.mSymbolLines.push_back(0);
+  for (size_t i = 0; i < numSymbols; ++i) {
+    if (linesBySymbol[i]) {
+      for (auto&& line : *linesBySymbol[i]) {
+        flat.mRvas.push_back(line.mRva);
+        flat.mSizes.push_back(line.mSize);
+        flat.mLines.push_back(line.mLine);
+        flat.mFiles.push_back(line.mFile);
+      }
+    }
+    flat.mSymbolLines.push_back(uint32_t(flat.mRvas.size()));
+  }
+  funcs.clear();
+  funcs.shrink_to_fit();
+
+  const size_t numLines = table->NumLines();
+  BPTEST_CHECK(flat.mRvas.size() == numLines);
+  const size_t compressedSize = CompressedSize(*table);
+  printf("%u symbols, %u lines\n", unsigned(numSymbols), unsigned(numLines));
+  printf("std::map nodes:  %8.1f MB (%5.1f bytes/line)\n",
+         gAllocated / 1048576.0, double(gAllocated) / numLines);
+  printf("flat arrays:     %8.1f MB (%5.1f bytes/line)\n",
+         flat.Size() / 1048576.0, double(flat.Size()) / numLines);
+  printf("varint blocks:   %8.1f MB (%5.1f bytes/line), %.1fx smaller than "
+         "the flat arrays, %.1fx smaller than the map\n",
+         compressedSize / 1048576.0, double(compressedSize) / numLines,
+         double(flat.Size()) / compressedSize,
+         double(gAllocated) / compressedSize);
+
+  // Random addresses within the module, nearly all of which fall into a
+  // function with lines
+  BpTestRandom random(options.mSeed);
+  const BpArray<uint32_t>& rvas = table->SymbolRvas();
+  const uint32_t end = rvas[rvas.size() - 1];
+  std::vector<uint64_t> stream(numLookups);
+  for (uint64_t& rva : stream) {
+    rva = random.Below(end);
+  }
+
+  std::vector<BpLine> expected(numLookups);
+  std::vector<bool> expectedFound(numLookups);
+  BpTestTimer timer;
+  for (size_t i = 0; i < numLookups; ++i) {
+    size_t symbol;
+    expectedFound[i] = table->FindSymbol(stream[i], symbol) &&
+                       flat.Find(symbol, stream[i], expected[i]);
+  }
+  const double flatSeconds = timer.Seconds();
+
+  size_t mismatches = 0;
+  timer.Restart();
+  for (size_t i = 0; i < numLookups; ++i) {
+    size_t symbol;
+    BpLine line;
+    const bool found = table->FindSymbol(stream[i], symbol) &&
+                       table->FindLine(symbol, stream[i], line);
+    mismatches += !SameLine(found, line, expectedFound[i], expected[i]);
+  }
+  const double compressedSeconds = timer.Seconds();
+
+  timer.Restart();
+  for (size_t i = 0; i < numLookups; ++i) {
+    auto itr = lineMap.upper_bound(stream[i]);
+    bool found = itr != lineMap.begin();
+    BpLine line = {};
+    if (found) {
+      const BpLineInfo& info = (--itr)->second;
+      BpLine mapLine = {uint32_t(info.mRva), info.mSize,
+                        uint32_t(info.mNameInt), uint32_t(info.mFileId)};
+      line = mapLine;
+      found = stream[i] - info.mRva < info.mSize;
+    }
+    mismatches += !SameLine(found, line, expectedFound[i], expected[i]);
+  }
+  const double mapSeconds = timer.Seconds();
+  BPTEST_CHECK(!mismatches);
+
+  printf("FindSymbol + line lookup, per random address:\n");
+  printf("  std::map        %7.1f ns\n", mapSeconds * 1e9 / numLookups);
+  printf("  flat arrays     %7.1f ns\n", flatSeconds * 1e9 / numLookups);
+  printf("  varint blocks   %7.1f ns (%.2fx the flat arrays)\n",
+         compressedSeconds * 1e9 / numLookups,
+         compressedSeconds / flatSeconds);
+  return BpTestResult("bplinetable_bench");
+}
@@ -0,0 +1,64 @@
+// Scaling of BpSymbolTable::Parse with the number of threads, on a synthetic
+// .sym file parsed in place from memory. Every thread count must produce the
+// same image as a sequential parse. The request this answers asked for a
+// 500MB file and up to 8 threads: bpparse_bench 500 8
+//
+// Usage: bpparse_bench [<megabytes of .sym text> [<max threads>]]
+
+#include "bptest.h"
+#include "bpsymtable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+namespace {
+
+bool
+SaveImage(const BpSymbolTable& aTable, std::string& aImage)
+{
+  const char* kPath = "bpparse_bench.symcache";
+  BpMappedFile file;
+  bool ok = aTable.Save(kPath) && file.Open(kPath);
+  if (ok) {
+    aImage.assign(file.Begin(), file.Size());
+  }
+  file.Close();
+  remove(kPath);
+  return ok;
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  BpTestSymOptions options;
+  options.mSize = BpTestArg(aArgc, aArgv, 1, 128) << 20;
+  const unsigned int maxThreads = unsigned(BpTestArg(aArgc, aArgv, 2, 8));
+  std::string text;
+  BpGenerateSymFile(options, text);
+  const double megabytes = text.size() / 1048576.0;
+  printf("%.1f MB of text, %u hardware thread(s)\n", megabytes,
+         std::thread::hardware_concurrency());
+
+  std::string sequentialImage, image;
+  double sequentialSeconds = 0;
+  for (unsigned int threads = 1; threads <= maxThreads; threads *= 2) {
+    BpTestTimer timer;
+    auto table = BpSymbolTable::Parse(text.data(), text.data() + text.size(),
+                                      0, threads);
+    const double seconds = timer.Seconds();
+    if (threads == 1) {
+      sequentialSeconds = seconds;
+      BPTEST_CHECK(SaveImage(*table, sequentialImage));
+    } else {
+      BPTEST_CHECK(SaveImage(*table, image));
+      BPTEST_CHECK(image == sequentialImage);
+    }
+    printf("%2u thread(s): %8.1f ms, %7.1f MB/s, %.2fx\n", threads,
+           seconds * 1000, megabytes / seconds, sequentialSeconds / seconds);
+  }
+  return BpTestResult("bpparse_bench");
+}
@@ -0,0 +1,121 @@
+// RVA lookups through BpRvaIndex against std::upper_bound over the same
+// sorted array and against the std::map that the symbols used to live in,
+// for two address streams: uniformly random addresses, and stack-like ones,
+// where a few hundred stacks of nearby frames are walked over and over as
+// when symbolizing the threads of a process. All three must agree.
+//
+// Usage: bprvaindex_bench [<megabytes of .sym text> [<lookups>]]
+
+#include "bptest.h"
+#include "bpsymtable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+const size_t kNotFound = ~size_t(0);
+
+// The lookups of each strategy are summed so that none can be optimized out
+// and so that the strategies can be checked against each other.
+template <typename FindT>
+uint64_t
+Time(const char* aLabel, const std::vector<uint64_t>& aStream, FindT aFind)
+{
+  BpTestTimer timer;
+  uint64_t sum = 0;
+  for (uint64_t rva : aStream) {
+    sum += aFind(rva);
+  }
+  const double seconds = timer.Seconds();
+  printf("  %-16s %7.1f ns/lookup\n", aLabel, seconds * 1e9 / aStream.size());
+  return sum;
+}
+
+void
+Run(const char* aStreamName, const std::vector<uint64_t>& aStream,
+    const BpArray<uint32_t>& aRvas, const BpRvaIndex& aIndex,
+    const std::map<uint64_t, size_t>& aTree)
+{
+  printf("%s addresses:\n", aStreamName);
+  const uint64_t tree = Time("std::map", aStream, [&](uint64_t aRva) {
+    auto itr = aTree.upper_bound(aRva);
+    return itr == aTree.begin() ? kNotFound : (--itr)->second;
+  });
+  const uint64_t binary = Time("std::upper_bound", aStream,
+                               [&](uint64_t aRva) {
+    auto itr = std::upper_bound(aRvas.begin(), aRvas.end(), aRva);
+    return itr == aRvas.begin() ? kNotFound : size_t(itr - aRvas.begin() - 1);
+  });
+  const uint64_t blocked = Time("BpRvaIndex", aStream, [&](uint64_t aRva) {
+    size_t index;
+    return aIndex.Find(aRva, index) ? index : kNotFound;
+  });
+  BPTEST_CHECK(tree == binary);
+  BPTEST_CHECK(blocked == binary);
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  BpTestSymOptions options;
+  options.mSize = BpTestArg(aArgc, aArgv, 1, 128) << 20;
+  const size_t numLookups = size_t(BpTestArg(aArgc, aArgv, 2, 4000000));
+  std::string text;
+  BpGenerateSymFile(options, text);
+  auto table = BpSymbolTable::Parse(text.data(), text.data() + text.size(),
+                                    0);
+  text.clear();
+  text.shrink_to_fit();
+
+  // Symbols that share an RVA make the strategies differ in which of them
+  // they return, so keep the first of each
+  const BpArray<uint32_t>& symbolRvas = table->SymbolRvas();
+  std::vector<uint32_t> unique(symbolRvas.begin(), symbolRvas.end());
+  unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+  BpArray<uint32_t> rvas(unique.data(), unique.size());
+  BpRvaIndex index;
+  index.Build(rvas);
+  std::map<uint64_t, size_t> tree;
+  for (size_t i = 0; i < rvas.size(); ++i) {
+    tree.emplace(rvas[i], i);
+  }
+  printf("%u symbols, index of %u KB\n", unsigned(rvas.size()),
+         unsigned(index.HeapSize() / 1024));
+
+  BpTestRandom random(options.mSeed);
+  const uint32_t end = rvas[rvas.size() - 1] + 0x100;
+  std::vector<uint64_t> stream(numLookups);
+  for (uint64_t& rva : stream) {
+    rva = random.Below(end);
+  }
+  Run("Random", stream, rvas, index, tree);
+
+  // 500 stacks of 30 frames, each frame within 128KB of its caller, as code
+  // mostly calls into its own component
+  const size_t kNumStacks = 500;
+  const size_t kDepth = 30;
+  std::vector<uint64_t> frames(kNumStacks * kDepth);
+  for (size_t i = 0; i < kNumStacks; ++i) {
+    uint64_t rva = random.Below(end);
+    for (size_t j = 0; j < kDepth; ++j) {
+      frames[i * kDepth + j] = rva;
+      rva = (rva + random.Below(0x40000) + end - 0x20000) % end;
+    }
+  }
+  for (size_t i = 0; i < numLookups; i += kDepth) {
+    const size_t stack = random.Below(kNumStacks);
+    for (size_t j = 0; j < kDepth && i + j < numLookups; ++j) {
+      stream[i + j] = frames[stack * kDepth + j];
+    }
+  }
+  Run("Stack-like", stream, rvas, index, tree);
+
+  return BpTestResult("bprvaindex_bench");
+}
@@ -0,0 +1,215 @@
+// Reads the stacks recorded by !bpsample -s from data/hang.samples into a
+// BpStackTrie, writes them back out, names their frames from
+// data/<module>.sym with BpFrameNamer, and compares the folded stacks with
+// data/hang.folded. On a mismatch the output is left in hang.folded.actual
+// for diffing.
+//
+// Usage: bpsamples_test [<data directory>]
+
+#include "bptest.h"
+#include "bpsamples.h"
+#include "bpsymtable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool
+ReadFile(const std::string& aPath, std::string& aContents)
+{
+  std::ifstream stream(aPath, std::ios::binary);
+  if (!stream) {
+    return false;
+  }
+  std::ostringstream oss;
+  oss << stream.rdbuf();
+  aContents = oss.str();
+  return true;
+}
+
+std::string
+WriteSamples(const std::vector<BpSampleModule>& aModules,
+             const BpStackTrie& aStacks)
+{
+  std::ostringstream oss;
+  BpWriteSamples(oss, aModules, aStacks);
+  return oss.str();
+}
+
+// Reads aText, expecting it to be rejected after the stacks before the bad
+// line have been added
+void
+CheckRejected(const char* aText, uint64_t aNumSamples)
+{
+  std::istringstream iss(aText);
+  std::vector<BpSampleModule> modules;
+  BpStackTrie stacks;
+  if (BpReadSamples(iss, modules, stacks)) {
+    fprintf(stderr, "accepted malformed samples: %s\n", aText);
+    ++BpTestFailures();
+  }
+  BPTEST_CHECK(stacks.NumSamples() == aNumSamples);
+}
+
+// Checks of BpStackTrie and the sample format that don't need symbols
+void
+CheckTrie()
+{
+  const uint64_t a[] = { 0x1005, 0x1085, 0x2010 };
+  const uint64_t b[] = { 0x1006, 0x1085, 0x2010 };
+  BpStackTrie stacks;
+  stacks.Add(a, 3, 3);
+  stacks.Add(b, 3, 2);
+  stacks.Add(a + 1, 2);
+  stacks.Add(a, 3);
+  stacks.Add(nullptr, 0, 4);
+  BPTEST_CHECK(stacks.NumSamples() == 7);
+  BPTEST_CHECK(stacks.NumStacks() == 3);
+  // The root, the two shared outer frames and the two innermost ones
+  BPTEST_CHECK(stacks.NumNodes() == 5);
+
+  // In the order first added, innermost frame first
+  std::vector<std::vector<uint64_t>> frames;
+  std::vector<uint64_t> counts;
+  stacks.ForEachStack([&](const uint64_t* aFrames, size_t aNumFrames,
+                          uint64_t aCount) {
+    frames.emplace_back(aFrames, aFrames + aNumFrames);
+    counts.push_back(aCount);
+  });
+  BPTEST_CHECK(frames.size() == 3 &&
+               frames[0] == std::vector<uint64_t>(a, a + 3) &&
+               frames[1] == std::vector<uint64_t>(b, b + 3) &&
+               frames[2] == std::vector<uint64_t>(a + 1, a + 3));
+  BPTEST_CHECK((counts == std::vector<uint64_t>{ 4, 2, 1 }));
+
+  std::vector<uint64_t> addresses;
+  stacks.GetUniqueAddresses(addresses);
+  BPTEST_CHECK((addresses ==
+                std::vector<uint64_t>{ 0x1005, 0x1006, 0x1085, 0x2010 }));
+
+  CheckRejected("STACK x 1005\n", 0);
+  CheckRejected("STACK 2 1005\nSTACK 1 1005 zz\n", 2);
+  CheckRejected("MODULE 1000 2000\n", 0);
+  CheckRejected("MODULE 1000\n", 0);
+  CheckRejected("STACK 1 1005\nTHREAD 1a2c 1005\n", 1);
+
+  // Blank lines are skipped, and so is an empty stack
+  std::istringstream iss("\nSTACK 3\n\nSTACK 1 1005\n");
+  std::vector<BpSampleModule> modules;
+  BpStackTrie blank;
+  BPTEST_CHECK(BpReadSamples(iss, modules, blank));
+  BPTEST_CHECK(blank.NumSamples() == 1 && blank.NumStacks() == 1);
+}
+
+void
+CheckHang(const std::string& aDataDir)
+{
+  std::string text;
+  BPTEST_CHECK(ReadFile(aDataDir + "/hang.samples", text));
+  std::vector<BpSampleModule> modules;
+  BpStackTrie stacks;
+  {
+    std::istringstream iss(text);
+    BPTEST_CHECK(BpReadSamples(iss, modules, stacks));
+  }
+  BPTEST_CHECK(modules.size() == 2 && modules[0].mName == "xul" &&
+               modules[0].mBase == 0x7ffb10000000 &&
+               modules[0].mSize == 0x100000);
+  // The idle stack was recorded twice; its counts add up
+  BPTEST_CHECK(stacks.NumSamples() == 93);
+  BPTEST_CHECK(stacks.NumStacks() == 7);
+  BPTEST_CHECK(stacks.NumNodes() == 17);
+
+  // Writing the stacks out and reading them in again loses nothing, with
+  // either line ending
+  const std::string written = WriteSamples(modules, stacks);
+  std::string crlf;
+  for (char c : written) {
+    crlf += c == '\n' ? "\r\n" : std::string(1, c);
+  }
+  for (const std::string& copy : { written, crlf }) {
+    std::istringstream iss(copy);
+    std::vector<BpSampleModule> readModules;
+    BpStackTrie readStacks;
+    BPTEST_CHECK(BpReadSamples(iss, readModules, readStacks));
+    BPTEST_CHECK(readStacks.NumSamples() == stacks.NumSamples());
+    BPTEST_CHECK(WriteSamples(readModules, readStacks) == written);
+  }
+
+  std::vector<BpMappedFile> syms(modules.size());
+  std::vector<std::unique_ptr<BpSymbolTable>> tables(modules.size());
+  BpFrameNamer namer;
+  for (size_t i = 0; i < modules.size(); ++i) {
+    const std::string path = aDataDir + "/" + modules[i].mName + ".sym";
+    if (syms[i].Open(path.c_str())) {
+      tables[i] = BpSymbolTable::Parse(syms[i].Begin(), syms[i].End(), 0);
+    }
+    namer.AddModule(modules[i].mBase, modules[i].mSize, modules[i].mName,
+                    tables[i].get());
+  }
+  BPTEST_CHECK(tables[0] && !tables[1]);
+
+  // As !bpsample names them, minus the fallback to dbgeng's symbols
+  std::vector<uint64_t> addresses;
+  stacks.GetUniqueAddresses(addresses);
+  std::vector<std::vector<std::string>> names;
+  namer.Name(addresses, names);
+  BPTEST_CHECK(names.size() == addresses.size());
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    if (names[i].empty()) {
+      std::string offsetName = namer.OffsetName(addresses[i]);
+      if (!offsetName.empty()) {
+        names[i].push_back(std::move(offsetName));
+      }
+    }
+  }
+
+  // The lock frame is named for its function and both calls inlined into
+  // it, outermost first; other modules' frames by their offsets
+  auto index = [&](uint64_t aAddress) -> size_t {
+    return std::lower_bound(addresses.begin(), addresses.end(), aAddress) -
+           addresses.begin();
+  };
+  BPTEST_CHECK((names[index(0x7ffb10001118)] == std::vector<std::string>{
+    "xul!mozilla::detail::MutexImpl::lock",
+    "xul!mozilla::MutexAutoLock::MutexAutoLock(mozilla::Mutex&)_[i]",
+    "xul!mozilla::OffTheBooksMutex::Lock()_[i]"
+  }));
+  BPTEST_CHECK((names[index(0x7ffb20001234)] ==
+                std::vector<std::string>{ "ntdll+0x1234" }));
+  BPTEST_CHECK(names[index(0x12345678)].empty());
+  BPTEST_CHECK(namer.OffsetName(0x12345678).empty());
+  BPTEST_CHECK(namer.OffsetName(0x7ffb10100000).empty());
+  BPTEST_CHECK(namer.OffsetName(0x7ffb10000000) == "xul+0x0");
+
+  std::ostringstream folded;
+  stacks.WriteFolded(folded, addresses, names);
+  std::string expected;
+  BPTEST_CHECK(ReadFile(aDataDir + "/hang.folded", expected));
+  if (folded.str() != expected) {
+    fprintf(stderr, "output differs from hang.folded; "
+            "see hang.folded.actual\n");
+    BpTestWriteFile("hang.folded.actual", folded.str());
+    ++BpTestFailures();
+  }
+  printf("%llu samples, %u stacks, %u distinct frames\n",
+         (unsigned long long)stacks.NumSamples(),
+         unsigned(stacks.NumStacks()), unsigned(addresses.size()));
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  CheckTrie();
+  CheckHang(aArgc > 1 ? aArgv[1] : "../data");
+  return BpTestResult("bpsamples_test");
+}
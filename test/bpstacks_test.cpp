@@ -0,0 +1,343 @@
+// Buckets the stacks of every thread of a hung process, captured as frame
+// lists in data/hang.stacks, symbolizes the distinct frames in one batch per
+// module from data/<module>.sym, and compares the result, laid out as
+// !bpstacks prints it, with data/hang.stacks.expected. On a mismatch the
+// output is left in hang.stacks.actual for diffing.
+//
+// Usage: bpstacks_test [<data directory>]
+
+#include "bptest.h"
+#include "bpstacks.h"
+#include "bpsymtable.h"
+#include "parallel.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Module
+{
+  uint64_t                       mBase;
+  uint64_t                       mSize;
+  std::string                    mName;
+  // Null for a module without a .sym file
+  std::unique_ptr<BpSymbolTable> mTable;
+};
+
+struct Thread
+{
+  uint32_t              mId;
+  std::vector<uint64_t> mFrames;
+};
+
+// Reads the MODULE and THREAD records of a frame list, skipping comments
+bool
+ReadStacks(const std::string& aPath, std::vector<Module>& aModules,
+           std::vector<Thread>& aThreads)
+{
+  std::ifstream stream(aPath);
+  if (!stream) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(stream, line)) {
+    std::istringstream iss(line);
+    std::string kind;
+    if (!(iss >> kind) || kind[0] == '#') {
+      continue;
+    }
+    iss >> std::hex;
+    if (kind == "MODULE") {
+      Module module;
+      if (!(iss >> module.mBase >> module.mSize >> module.mName)) {
+        return false;
+      }
+      aModules.push_back(std::move(module));
+    } else if (kind == "THREAD") {
+      Thread thread;
+      uint64_t frame;
+      if (!(iss >> thread.mId)) {
+        return false;
+      }
+      while (iss >> frame) {
+        thread.mFrames.push_back(frame);
+      }
+      aThreads.push_back(std::move(thread));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+ReadFile(const std::string& aPath, std::string& aContents)
+{
+  std::ifstream stream(aPath, std::ios::binary);
+  if (!stream) {
+    return false;
+  }
+  std::ostringstream oss;
+  oss << stream.rdbuf();
+  aContents = oss.str();
+  return true;
+}
+
+// Where a distinct frame address was found
+struct Resolved
+{
+  const Module* mModule;
+  size_t        mSymbol;
+};
+
+// Looks up aAddresses, which are sorted, with one FindSymbols call per
+// module, checking every answer against FindSymbol
+void
+Symbolize(const std::vector<Module>& aModules,
+          const std::vector<uint64_t>& aAddresses,
+          std::vector<Resolved>& aResolved)
+{
+  Resolved none = { nullptr, BpSymbolTable::kNotFound };
+  aResolved.assign(aAddresses.size(), none);
+  std::vector<uint64_t> rvas;
+  std::vector<size_t> symbols;
+  for (auto&& module : aModules) {
+    rvas.clear();
+    size_t first = aAddresses.size();
+    for (size_t i = 0; i < aAddresses.size(); ++i) {
+      if (aAddresses[i] - module.mBase < module.mSize) {
+        first = std::min(first, i);
+        rvas.push_back(aAddresses[i] - module.mBase);
+        aResolved[i].mModule = &module;
+      }
+    }
+    if (rvas.empty() || !module.mTable) {
+      continue;
+    }
+    symbols.resize(rvas.size());
+    module.mTable->FindSymbols(rvas.data(), rvas.size(), symbols.data());
+    for (size_t i = 0; i < rvas.size(); ++i) {
+      size_t symbol = BpSymbolTable::kNotFound;
+      if (!module.mTable->FindSymbol(rvas[i], symbol)) {
+        symbol = BpSymbolTable::kNotFound;
+      }
+      BPTEST_CHECK(symbols[i] == symbol);
+      aResolved[first + i].mSymbol = symbols[i];
+    }
+  }
+}
+
+void
+AppendSourceLine(std::ostringstream& aStream, const char* aFile,
+                 uint32_t aLine)
+{
+  aStream << " [" << aFile << " @ " << std::dec << aLine << "]";
+}
+
+// Formats a frame the way FormatSymbol does without DML: each inlined call
+// on a line of its own, innermost first, at the line that the next one in
+// was called from, then the function and the offset into it
+std::string
+FormatFrame(uint64_t aAddress, const Resolved& aResolved)
+{
+  std::ostringstream oss;
+  const Module* module = aResolved.mModule;
+  if (!module) {
+    oss << "0x" << std::hex << aAddress;
+    return oss.str();
+  }
+  const uint64_t rva = aAddress - module->mBase;
+  if (aResolved.mSymbol == BpSymbolTable::kNotFound) {
+    oss << module->mName << "+0x" << std::hex << rva;
+    return oss.str();
+  }
+
+  const BpSymbolTable& table = *module->mTable;
+  const size_t symbol = aResolved.mSymbol;
+  BpLine line;
+  const char* file = nullptr;
+  uint32_t lineNumber = 0;
+  if (table.FindLine(symbol, rva, line)) {
+    file = table.FilePath(line.mFile);
+    lineNumber = line.mLine;
+  }
+  std::vector<size_t> inlines;
+  table.FindInlines(symbol, rva, inlines);
+  for (size_t i = inlines.size(); i-- > 0;) {
+    const size_t index = inlines[i];
+    oss << module->mName << "!" << table.String(table.InlineNames()[index])
+        << " (inlined)";
+    if (file) {
+      AppendSourceLine(oss, file, lineNumber);
+    }
+    oss << "\n";
+    file = table.FilePath(table.InlineCallFiles()[index]);
+    lineNumber = table.InlineCallLines()[index];
+  }
+  oss << module->mName << "!" << table.String(table.SymbolNames()[symbol])
+      << "+0x" << std::hex << rva - table.SymbolRvas()[symbol];
+  if (file) {
+    AppendSourceLine(oss, file, lineNumber);
+  }
+  return oss.str();
+}
+
+// Lays the buckets out as !bpstacks does, with every line of a frame's
+// output under the frame's number
+std::string
+Render(const BpStackBuckets& aBuckets,
+       const std::vector<uint64_t>& aAddresses,
+       const std::vector<std::string>& aFormatted)
+{
+  std::ostringstream oss;
+  char buf[32];
+  for (auto&& bucket : aBuckets.Buckets()) {
+    oss << std::dec << bucket.mThreads.size() << " thread(s):";
+    for (uint32_t thread : bucket.mThreads) {
+      snprintf(buf, sizeof(buf), " %x", thread);
+      oss << buf;
+    }
+    oss << "\n";
+    const uint64_t* frames = aBuckets.Frames() + bucket.mFirstFrame;
+    for (size_t i = 0; i < bucket.mNumFrames; ++i) {
+      const size_t index =
+        std::lower_bound(aAddresses.begin(), aAddresses.end(), frames[i]) -
+        aAddresses.begin();
+      const std::string& frame = aFormatted[index];
+      std::string::size_type start = 0;
+      do {
+        std::string::size_type end = frame.find('\n', start);
+        snprintf(buf, sizeof(buf), "%02x ", unsigned(i));
+        oss << buf << frame.substr(start, end == std::string::npos ?
+                                            std::string::npos : end - start)
+            << "\n";
+        start = end == std::string::npos ? end : end + 1;
+      } while (start != std::string::npos);
+    }
+    oss << "\n";
+  }
+  return oss.str();
+}
+
+// Checks of BpStackBuckets that don't need symbols
+void
+CheckBuckets()
+{
+  // Stacks that differ in a single low bit, or that are a prefix of another,
+  // are distinct; empty stacks share one bucket
+  const uint64_t a[] = { 0x7ffb10001060, 0x7ffb100010a8 };
+  const uint64_t b[] = { 0x7ffb10001061, 0x7ffb100010a8 };
+  BpStackBuckets buckets;
+  buckets.Add(1, a, 2);
+  buckets.Add(2, b, 2);
+  buckets.Add(3, a, 1);
+  buckets.Add(4, nullptr, 0);
+  buckets.Add(5, b, 2);
+  buckets.Add(6, nullptr, 0);
+  buckets.Add(7, a, 2);
+  buckets.Add(8, a, 2);
+  buckets.Sort();
+
+  const std::vector<BpStackBuckets::Bucket>& sorted = buckets.Buckets();
+  BPTEST_CHECK(sorted.size() == 4);
+  if (sorted.size() != 4) {
+    return;
+  }
+  BPTEST_CHECK((sorted[0].mThreads == std::vector<uint32_t>{ 1, 7, 8 }));
+  BPTEST_CHECK((sorted[1].mThreads == std::vector<uint32_t>{ 2, 5 }));
+  BPTEST_CHECK((sorted[2].mThreads == std::vector<uint32_t>{ 4, 6 }));
+  BPTEST_CHECK(sorted[2].mNumFrames == 0);
+  BPTEST_CHECK((sorted[3].mThreads == std::vector<uint32_t>{ 3 }));
+  BPTEST_CHECK(sorted[3].mNumFrames == 1);
+  BPTEST_CHECK(buckets.Frames()[sorted[1].mFirstFrame] == b[0]);
+
+  std::vector<uint64_t> addresses;
+  buckets.GetUniqueAddresses(addresses);
+  BPTEST_CHECK((addresses == std::vector<uint64_t>{ a[0], b[0], a[1] }));
+}
+
+void
+CheckHang(const std::string& aDataDir)
+{
+  std::vector<Module> modules;
+  std::vector<Thread> threads;
+  BPTEST_CHECK(ReadStacks(aDataDir + "/hang.stacks", modules, threads));
+  BPTEST_CHECK(modules.size() == 2 && threads.size() == 21);
+
+  std::vector<BpMappedFile> syms(modules.size());
+  for (size_t i = 0; i < modules.size(); ++i) {
+    const std::string path = aDataDir + "/" + modules[i].mName + ".sym";
+    if (syms[i].Open(path.c_str())) {
+      modules[i].mTable = BpSymbolTable::Parse(syms[i].Begin(),
+                                               syms[i].End(), 0);
+    }
+  }
+  BPTEST_CHECK(modules.size() && modules[0].mTable);
+
+  BpStackBuckets buckets;
+  for (auto&& thread : threads) {
+    buckets.Add(thread.mId, thread.mFrames.data(), thread.mFrames.size());
+  }
+  buckets.Sort();
+
+  // The idle, IPC and lock stacks, then the singletons in the order that
+  // their threads came in, the main thread first
+  std::vector<size_t> sizes;
+  for (auto&& bucket : buckets.Buckets()) {
+    sizes.push_back(bucket.mThreads.size());
+  }
+  BPTEST_CHECK((sizes == std::vector<size_t>{ 12, 3, 2, 1, 1, 1, 1 }));
+  BPTEST_CHECK(buckets.Buckets().size() == 7 &&
+               buckets.Buckets()[3].mThreads[0] == 0x1a2c);
+
+  std::vector<uint64_t> addresses;
+  buckets.GetUniqueAddresses(addresses);
+  BPTEST_CHECK(std::is_sorted(addresses.begin(), addresses.end()) &&
+               std::adjacent_find(addresses.begin(), addresses.end()) ==
+                 addresses.end());
+
+  std::vector<Resolved> resolved;
+  Symbolize(modules, addresses, resolved);
+
+  // Formatting is spread over threads in !bpstacks; the result must not
+  // depend on how many
+  std::vector<std::string> formatted(addresses.size());
+  std::vector<std::string> serial(addresses.size());
+  ParallelFor(addresses.size(), [&](size_t aIndex) -> void {
+    formatted[aIndex] = FormatFrame(addresses[aIndex], resolved[aIndex]);
+  }, 4);
+  ParallelFor(addresses.size(), [&](size_t aIndex) -> void {
+    serial[aIndex] = FormatFrame(addresses[aIndex], resolved[aIndex]);
+  }, 1);
+  BPTEST_CHECK(formatted == serial);
+
+  const std::string actual = Render(buckets, addresses, formatted);
+  std::string expected;
+  BPTEST_CHECK(ReadFile(aDataDir + "/hang.stacks.expected", expected));
+  if (actual != expected) {
+    fprintf(stderr, "output differs from hang.stacks.expected; "
+            "see hang.stacks.actual\n");
+    BpTestWriteFile("hang.stacks.actual", actual);
+    ++BpTestFailures();
+  }
+  printf("%u threads, %u buckets, %u distinct frames\n",
+         unsigned(threads.size()), unsigned(buckets.Buckets().size()),
+         unsigned(addresses.size()));
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  CheckBuckets();
+  CheckHang(aArgc > 1 ? aArgv[1] : "../data");
+  return BpTestResult("bpstacks_test");
+}
@@ -0,0 +1,81 @@
+// Loading a module from its .sym text against mapping its binary cache: the
+// time to parse, to write the cache, to map it, and to resolve the first
+// addresses from the mapped cache, which is what a debugger session waits
+// for. The cache is written to the current directory.
+//
+// Usage: bpsymcache_bench [<megabytes of .sym text> [<threads>]]
+
+#include "bptest.h"
+#include "bpsymtable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+int
+main(int aArgc, char** aArgv)
+{
+  const char* kSymPath = "bpsymcache_bench.sym";
+  const char* kCachePath = "bpsymcache_bench.symcache";
+  BpTestSymOptions options;
+  options.mSize = BpTestArg(aArgc, aArgv, 1, 128) << 20;
+  const unsigned int threads =
+    unsigned(BpTestArg(aArgc, aArgv, 2, GetWorkerThreadCount()));
+  {
+    std::string text;
+    BpGenerateSymFile(options, text);
+    BPTEST_CHECK(BpTestWriteFile(kSymPath, text));
+  }
+
+  BpMappedFile sym;
+  BPTEST_CHECK(sym.Open(kSymPath));
+  BpTestTimer timer;
+  auto parsed = BpSymbolTable::Parse(sym.Begin(), sym.End(),
+                                     sym.ModificationTime(), threads);
+  const double parseSeconds = timer.Seconds();
+
+  timer.Restart();
+  BPTEST_CHECK(parsed->Save(kCachePath));
+  const double saveSeconds = timer.Seconds();
+  const size_t imageSize = parsed->ImageSize();
+  parsed.reset();
+
+  // Validating the cache reads all of its index arrays, but none of the
+  // line data, names or unwind rules
+  timer.Restart();
+  auto mapped = BpSymbolTable::Map(kCachePath, sym.Size(),
+                                   sym.ModificationTime());
+  const double mapSeconds = timer.Seconds();
+  BPTEST_CHECK(mapped != nullptr);
+
+  const int kLookups = 1000;
+  BpTestRandom random(options.mSeed);
+  const BpArray<uint32_t>& rvas = mapped->SymbolRvas();
+  const uint32_t end = rvas.empty() ? 1 : rvas[rvas.size() - 1];
+  size_t found = 0;
+  timer.Restart();
+  for (int i = 0; i < kLookups; ++i) {
+    const uint64_t rva = random.Below(end);
+    size_t symbol;
+    BpLine line;
+    found += mapped->FindSymbol(rva, symbol) &&
+             mapped->FindLine(symbol, rva, line);
+  }
+  const double lookupSeconds = timer.Seconds();
+
+  printf("%.1f MB of text on %u thread(s), %.1f MB of cache\n",
+         sym.Size() / 1048576.0, threads, imageSize / 1048576.0);
+  printf("parse text:        %9.1f ms\n", parseSeconds * 1000);
+  printf("write cache:       %9.1f ms\n", saveSeconds * 1000);
+  printf("map cache:         %9.1f ms (%.0fx faster than parsing)\n",
+         mapSeconds * 1000, parseSeconds / mapSeconds);
+  printf("first %d lookups: %9.1f ms (%u with a line)\n", kLookups,
+         lookupSeconds * 1000, unsigned(found));
+
+  mapped.reset();
+  sym.Close();
+  remove(kSymPath);
+  remove(kCachePath);
+  return BpTestResult("bpsymcache_bench");
+}
@@ -0,0 +1,235 @@
+// Round trip through the binary symbol cache: a table parsed from text, saved
+// and mapped again must answer every query the way the parsed one does, and
+// saving the mapped table must reproduce the file byte for byte. Caches that
+// are stale, truncated or corrupt must be rejected.
+//
+// Usage: bpsymcache_test [<megabytes of .sym text>]
+
+#include "bptest.h"
+#include "bpsymcache.h"
+#include "bpsymtable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+template <typename T>
+bool
+ArraysEqual(const BpArray<T>& aA, const BpArray<T>& aB)
+{
+  return aA.size() == aB.size() &&
+         (aA.empty() || !memcmp(aA.begin(), aB.begin(), aA.size() * sizeof(T)));
+}
+
+bool
+ReadFile(const char* aPath, std::string& aContents)
+{
+  BpMappedFile file;
+  if (!file.Open(aPath)) {
+    return false;
+  }
+  aContents.assign(file.Begin(), file.Size());
+  return true;
+}
+
+void
+CompareTables(const BpSymbolTable& aParsed, const BpSymbolTable& aMapped,
+              uint64_t aSeed)
+{
+  BPTEST_CHECK(!strcmp(aParsed.ModuleName(), aMapped.ModuleName()));
+  BPTEST_CHECK(aParsed.ImageSize() == aMapped.ImageSize());
+  BPTEST_CHECK(aParsed.NumLines() == aMapped.NumLines());
+  BPTEST_CHECK(ArraysEqual(aParsed.SymbolRvas(), aMapped.SymbolRvas()));
+  BPTEST_CHECK(ArraysEqual(aParsed.SymbolSizes(), aMapped.SymbolSizes()));
+  BPTEST_CHECK(ArraysEqual(aParsed.SymbolNames(), aMapped.SymbolNames()));
+  BPTEST_CHECK(ArraysEqual(aParsed.SymbolParams(), aMapped.SymbolParams()));
+  BPTEST_CHECK(ArraysEqual(aParsed.SymbolsByName(),
+                           aMapped.SymbolsByName()));
+  BPTEST_CHECK(ArraysEqual(aParsed.SymbolLines(), aMapped.SymbolLines()));
+  BPTEST_CHECK(ArraysEqual(aParsed.InlineNames(), aMapped.InlineNames()));
+  BPTEST_CHECK(ArraysEqual(aParsed.NameFilter(), aMapped.NameFilter()));
+  BPTEST_CHECK(ArraysEqual(aParsed.CfiRvas(), aMapped.CfiRvas()));
+  BPTEST_CHECK(ArraysEqual(aParsed.CfiDeltaStarts(),
+                           aMapped.CfiDeltaStarts()));
+  BPTEST_CHECK(ArraysEqual(aParsed.UnwindCode(), aMapped.UnwindCode()));
+  BPTEST_CHECK(ArraysEqual(aParsed.FileIds(), aMapped.FileIds()));
+  BPTEST_CHECK(ArraysEqual(aParsed.FilePaths(), aMapped.FilePaths()));
+
+  // The same answers for addresses all over the module, and for names
+  const BpArray<uint32_t>& rvas = aParsed.SymbolRvas();
+  if (rvas.empty()) {
+    return;
+  }
+  const uint32_t end = rvas[rvas.size() - 1] + 0x1000;
+  BpTestRandom random(aSeed);
+  std::vector<size_t> parsedInlines, mappedInlines;
+  int mismatches = 0;
+  for (int i = 0; i < 100000; ++i) {
+    const uint64_t rva = random.Below(end);
+    size_t parsedSymbol = 0, mappedSymbol = 0;
+    const bool found = aParsed.FindSymbol(rva, parsedSymbol);
+    if (found != aMapped.FindSymbol(rva, mappedSymbol) ||
+        (found && parsedSymbol != mappedSymbol)) {
+      ++mismatches;
+      continue;
+    }
+    if (found) {
+      BpLine parsedLine = {}, mappedLine = {};
+      const bool hasLine = aParsed.FindLine(parsedSymbol, rva, parsedLine);
+      if (hasLine != aMapped.FindLine(mappedSymbol, rva, mappedLine) ||
+          memcmp(&parsedLine, &mappedLine, sizeof(BpLine))) {
+        ++mismatches;
+      }
+      aParsed.FindInlines(parsedSymbol, rva, parsedInlines);
+      aMapped.FindInlines(mappedSymbol, rva, mappedInlines);
+      mismatches += parsedInlines != mappedInlines;
+
+      const char* name = aParsed.String(aParsed.SymbolNames()[parsedSymbol]);
+      size_t parsedByName = 0, mappedByName = 0;
+      mismatches += !aParsed.FindSymbolByName(name, parsedByName) ||
+                    !aMapped.FindSymbolByName(name, mappedByName) ||
+                    parsedByName != mappedByName;
+    }
+    size_t parsedCfi = 0, mappedCfi = 0;
+    const bool hasCfi = aParsed.FindCfi(rva, parsedCfi);
+    mismatches += hasCfi != aMapped.FindCfi(rva, mappedCfi) ||
+                  (hasCfi && parsedCfi != mappedCfi);
+    const bpsymcache::StackWinRecord* parsedWin = aParsed.FindStackWin(rva);
+    const bpsymcache::StackWinRecord* mappedWin = aMapped.FindStackWin(rva);
+    mismatches += !parsedWin != !mappedWin ||
+                  (parsedWin && memcmp(parsedWin, mappedWin,
+                                       sizeof(*parsedWin)));
+  }
+  BPTEST_CHECK(!mismatches);
+}
+
+// Maps aImage, written to aPath, expecting it to be rejected
+void
+CheckRejected(const char* aPath, const std::string& aImage,
+              uint64_t aSourceSize, uint64_t aSourceTime, const char* aWhat)
+{
+  BPTEST_CHECK(BpTestWriteFile(aPath, aImage));
+  if (BpSymbolTable::Map(aPath, aSourceSize, aSourceTime)) {
+    fprintf(stderr, "accepted a cache that is %s\n", aWhat);
+    ++BpTestFailures();
+  }
+}
+
+// A .sym file rewritten with the same size within the same second, as in a
+// generate-then-test loop, must not pass for the one the cache was made from
+void
+CheckRewrittenInSameSecond(const char* aSymPath, const char* aCachePath)
+{
+#if !defined(_WIN32)
+  auto modificationTime = [&]() -> uint64_t {
+    BpMappedFile file;
+    return file.Open(aSymPath) ? file.ModificationTime() : 0;
+  };
+  struct stat st;
+  BPTEST_CHECK(!stat(aSymPath, &st));
+  const uint64_t oldTime = modificationTime();
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+  BPTEST_CHECK(!utimensat(AT_FDCWD, aSymPath, times, 0));
+  const uint64_t newTime = modificationTime();
+  BPTEST_CHECK(newTime != oldTime && newTime / 1000000000 ==
+                                       oldTime / 1000000000);
+  BPTEST_CHECK(!BpSymbolTable::Map(aCachePath, uint64_t(st.st_size),
+                                   newTime));
+#endif
+}
+
+void
+RoundTrip(const BpTestSymOptions& aOptions)
+{
+  const char* kSymPath = "bpsymcache_test.sym";
+  const char* kCachePath = "bpsymcache_test.symcache";
+  const char* kCopyPath = "bpsymcache_test.copy.symcache";
+
+  std::string text;
+  BpGenerateSymFile(aOptions, text);
+  BPTEST_CHECK(BpTestWriteFile(kSymPath, text));
+  BpMappedFile sym;
+  BPTEST_CHECK(sym.Open(kSymPath));
+  const uint64_t size = sym.Size();
+  const uint64_t time = sym.ModificationTime();
+
+  auto parsed = BpSymbolTable::Parse(sym.Begin(), sym.End(), time);
+  BPTEST_CHECK(!parsed->IsMapped());
+  BPTEST_CHECK(parsed->Save(kCachePath));
+  auto mapped = BpSymbolTable::Map(kCachePath, size, time);
+  BPTEST_CHECK(mapped && mapped->IsMapped());
+  if (!mapped) {
+    return;
+  }
+  CompareTables(*parsed, *mapped, aOptions.mSeed);
+
+  std::string image, copy;
+  BPTEST_CHECK(mapped->Save(kCopyPath));
+  BPTEST_CHECK(ReadFile(kCachePath, image) && ReadFile(kCopyPath, copy));
+  BPTEST_CHECK(image == copy);
+  printf("%.1f MB of text, %.1f MB of cache, %u symbols, %u lines\n",
+         size / 1048576.0, image.size() / 1048576.0,
+         unsigned(parsed->SymbolRvas().size()), unsigned(parsed->NumLines()));
+
+  // A zero size skips the staleness check, for tools that only have the
+  // cache at hand
+  BPTEST_CHECK(BpSymbolTable::Map(kCachePath, 0, 0) != nullptr);
+  CheckRejected(kCopyPath, image, size + 1, time, "for a bigger .sym file");
+  CheckRejected(kCopyPath, image, size, time + 1, "for a newer .sym file");
+  CheckRewrittenInSameSecond(kSymPath, kCachePath);
+  CheckRejected(kCopyPath, image.substr(0, image.size() / 2), size, time,
+                "truncated");
+  CheckRejected(kCopyPath, image.substr(0, sizeof(bpsymcache::Header) - 1),
+                size, time, "shorter than its header");
+
+  std::string corrupt(image);
+  bpsymcache::Header header;
+  memcpy(&header, corrupt.data(), sizeof(header));
+  ++header.mVersion;
+  memcpy(&corrupt[0], &header, sizeof(header));
+  CheckRejected(kCopyPath, corrupt, size, time, "of another version");
+
+  corrupt = image;
+  memcpy(&header, corrupt.data(), sizeof(header));
+  header.mSections[bpsymcache::eSymbolLines].mSize += sizeof(uint32_t);
+  memcpy(&corrupt[0], &header, sizeof(header));
+  CheckRejected(kCopyPath, corrupt, size, time, "inconsistent");
+
+  corrupt = image;
+  memcpy(&header, corrupt.data(), sizeof(header));
+  header.mSections[bpsymcache::eStrings].mOffset = image.size();
+  memcpy(&corrupt[0], &header, sizeof(header));
+  CheckRejected(kCopyPath, corrupt, size, time, "out of bounds");
+
+  mapped.reset();
+  remove(kSymPath);
+  remove(kCachePath);
+  remove(kCopyPath);
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  BpTestSymOptions options;
+  options.mSize = BpTestArg(aArgc, aArgv, 1, 32) << 20;
+  RoundTrip(options);
+
+  // So does a module without a single symbol
+  options.mSize = 0;
+  options.mSeed = 3;
+  RoundTrip(options);
+
+  return BpTestResult("bpsymcache_test");
+}
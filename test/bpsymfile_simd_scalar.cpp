@@ -0,0 +1,24 @@
+// The scalar half of bpsymfile_simd_test
+#define BPSYMFILE_NO_SIMD
+
+#include "bpsymfile_simd_test.h"
+
+#if defined(BPSYMFILE_SSE2)
+#error "BPSYMFILE_NO_SIMD must disable the SSE2 scanner"
+#endif
+
+RecordDigest
+ParseScalar(const char* aBegin, const char* aEnd)
+{
+  DigestSink sink;
+  ParseBpSymbols(aBegin, aEnd, sink);
+  return sink.Digest();
+}
+
+RecordDigest
+ParseScalarSum(const char* aBegin, const char* aEnd)
+{
+  SumSink sink;
+  ParseBpSymbols(aBegin, aEnd, sink);
+  return sink.Digest();
+}
@@ -0,0 +1,193 @@
+// Checks that the SSE2 line record scanner of ParseBpSymbols reports exactly
+// what the scalar parser does, on generated .sym files and on a large number
+// of malformed and borderline line records, and measures the throughput of
+// both. The scalar parser is built in bpsymfile_simd_scalar.cpp.
+//
+// Usage: bpsymfile_simd_test [<megabytes of .sym text> [<random records>]]
+
+#include "bptest.h"
+#include "bpsymfile_simd_test.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace {
+
+RecordDigest
+ParseDefault(const char* aBegin, const char* aEnd)
+{
+  DigestSink sink;
+  ParseBpSymbols(aBegin, aEnd, sink);
+  return sink.Digest();
+}
+
+RecordDigest
+ParseDefaultSum(const char* aBegin, const char* aEnd)
+{
+  SumSink sink;
+  ParseBpSymbols(aBegin, aEnd, sink);
+  return sink.Digest();
+}
+
+// Compares the two parsers on aText, and on aText followed by enough blank
+// lines for the SSE2 scanner to consider every record in it
+bool
+Agree(const std::string& aText)
+{
+  std::string padded(aText);
+  padded.append(32, '\n');
+  const char* begin = padded.data();
+  return ParseDefault(begin, begin + aText.size()) ==
+           ParseScalar(begin, begin + aText.size()) &&
+         ParseDefault(begin, begin + padded.size()) ==
+           ParseScalar(begin, begin + padded.size());
+}
+
+void
+CheckRecord(const std::string& aRecord)
+{
+  if (!Agree(aRecord)) {
+    fprintf(stderr, "parsers disagree on \"%s\"\n", aRecord.c_str());
+    ++BpTestFailures();
+  }
+}
+
+// A field of up to aMaxLength characters, mostly digits
+std::string
+RandomField(BpTestRandom& aRandom, uint32_t aMaxLength)
+{
+  static const char kChars[] = "0123456789abcdefABCDEF0123456789gx- \t\r";
+  std::string field;
+  const uint32_t length = aRandom.Below(aMaxLength + 1);
+  for (uint32_t i = 0; i < length; ++i) {
+    // Mostly decimal digits, since those are valid in every field
+    field += aRandom.Below(4) ? kChars[aRandom.Below(10)] :
+                                kChars[aRandom.Below(sizeof(kChars) - 1)];
+  }
+  return field;
+}
+
+// Line records of every length around the 32 bytes that the scanner looks
+// at, with every kind of damage that either parser must reject or tolerate
+void
+CheckLineRecords(uint64_t aCount)
+{
+  BpTestRandom random(7);
+  for (uint64_t i = 0; i < aCount; ++i) {
+    std::string record;
+    const uint32_t numFields = 2 + random.Below(4);
+    for (uint32_t field = 0; field < numFields; ++field) {
+      if (field) {
+        record += random.Below(20) ? " " : random.Below(2) ? "  " : "\t";
+      }
+      record += RandomField(random, random.Below(8) ? 6 : 17);
+    }
+    if (!random.Below(8)) {
+      record += random.Below(2) ? "\r" : " ";
+    }
+    CheckRecord(record);
+  }
+
+  // Well-formed records that end exactly at, just before and just after the
+  // end of the 32-byte window, with and without a carriage return
+  for (int length = 24; length <= 40; ++length) {
+    for (int crlf = 0; crlf < 2; ++crlf) {
+      std::string record("1a2b3c4d 10 1234 5");
+      while (int(record.size()) < length - crlf) {
+        record.insert(record.begin(), '0');
+      }
+      if (crlf) {
+        record += '\r';
+      }
+      CheckRecord(record);
+      CheckRecord(record + "\n" + record);
+    }
+  }
+
+  // Values that overflow 64 bits wrap the same way in both parsers
+  CheckRecord("123456789abcdef01 1 2 3");
+  CheckRecord("1 ffffffffffffffffff 99999999999999999999 3");
+  // Upper case hex, and decimal fields that look like hex
+  CheckRecord("ABCDEF 1F 12 3");
+  CheckRecord("abcdef 1f 1a 3");
+  CheckRecord("abcdef 1f 12 3b");
+  // A record at the very end of the text, without a newline
+  std::string text("FUNC 1000 10 0 f\n");
+  text.append(40, '0');
+  text += " 10 1 2";
+  BPTEST_CHECK(ParseDefault(text.data(), text.data() + text.size()) ==
+               ParseScalar(text.data(), text.data() + text.size()));
+}
+
+void
+CheckGeneratedFiles()
+{
+  std::string text;
+  for (uint64_t seed = 1; seed <= 4; ++seed) {
+    BpTestSymOptions options;
+    options.mSize = 0x400000;
+    options.mSeed = seed;
+    options.mCrLf = seed % 2 == 0;
+    options.mNoise = seed != 1;
+    BpGenerateSymFile(options, text);
+    BPTEST_CHECK(Agree(text));
+  }
+}
+
+void
+MeasureThroughput(uint64_t aMegabytes)
+{
+  BpTestSymOptions options;
+  options.mSize = aMegabytes << 20;
+  std::string text;
+  BpGenerateSymFile(options, text);
+  const char* begin = text.data();
+  const char* end = begin + text.size();
+  const double megabytes = text.size() / 1048576.0;
+
+  // Once to fault the text in, then the best of a few runs of each
+  RecordDigest scalar = ParseScalarSum(begin, end);
+  RecordDigest simd = scalar;
+  double scalarSeconds = 0, simdSeconds = 0;
+  for (int run = 0; run < 3; ++run) {
+    BpTestTimer timer;
+    scalar = ParseScalarSum(begin, end);
+    const double scalarRun = timer.Seconds();
+    timer.Restart();
+    simd = ParseDefaultSum(begin, end);
+    const double simdRun = timer.Seconds();
+    if (!run || scalarRun < scalarSeconds) {
+      scalarSeconds = scalarRun;
+    }
+    if (!run || simdRun < simdSeconds) {
+      simdSeconds = simdRun;
+    }
+  }
+  BPTEST_CHECK(simd == scalar);
+
+  printf("%.1f MB, %llu records of which %llu line records\n", megabytes,
+         (unsigned long long)scalar.mNumRecords,
+         (unsigned long long)scalar.mNumLines);
+  printf("scalar: %7.1f MB/s\n", megabytes / scalarSeconds);
+#if defined(BPSYMFILE_SSE2)
+  printf("SSE2:   %7.1f MB/s (%.2fx)\n", megabytes / simdSeconds,
+         scalarSeconds / simdSeconds);
+#else
+  printf("SSE2 is not available to this build; only the scalar parser was "
+         "tested\n");
+#endif
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  const uint64_t megabytes = BpTestArg(aArgc, aArgv, 1, 64);
+  const uint64_t numRecords = BpTestArg(aArgc, aArgv, 2, 200000);
+  CheckLineRecords(numRecords);
+  CheckGeneratedFiles();
+  MeasureThroughput(megabytes);
+  return BpTestResult("bpsymfile_simd_test");
+}
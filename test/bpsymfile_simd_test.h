@@ -0,0 +1,195 @@
+#ifndef __BPSYMFILE_SIMD_TEST_H
+#define __BPSYMFILE_SIMD_TEST_H
+
+// Shared by the two halves of bpsymfile_simd_test, which include bpsymfile.h
+// with and without BPSYMFILE_NO_SIMD. The sink lives in an anonymous
+// namespace so that each half instantiates ParseBpSymbols for a type of its
+// own, rather than two different bodies for the same one.
+
+#include "bpsymfile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Order-sensitive digest of every record that ParseBpSymbols reports.
+ */
+struct RecordDigest
+{
+  uint64_t mHash;
+  uint64_t mNumRecords;
+  uint64_t mNumLines;
+
+  bool operator==(const RecordDigest& aOther) const
+  {
+    return mHash == aOther.mHash && mNumRecords == aOther.mNumRecords &&
+           mNumLines == aOther.mNumLines;
+  }
+};
+
+// Parses [aBegin, aEnd) with the scalar parser only
+RecordDigest
+ParseScalar(const char* aBegin, const char* aEnd);
+
+// The same with SumSink, for timing
+RecordDigest
+ParseScalarSum(const char* aBegin, const char* aEnd);
+
+namespace {
+
+class DigestSink
+{
+public:
+  DigestSink()
+  {
+    mDigest.mHash = 0xCBF29CE484222325ULL;
+    mDigest.mNumRecords = 0;
+    mDigest.mNumLines = 0;
+  }
+
+  const RecordDigest& Digest() const { return mDigest; }
+
+  void Module(const BpToken& aName) { Record('M', aName); }
+  void File(uint64_t aId, const BpToken& aPath)
+  {
+    Record('F', aPath, aId);
+  }
+  void Function(uint64_t aRva, uint64_t aSize, const BpToken& aName,
+                const BpToken& aParams)
+  {
+    Record('f', aName, aRva, aSize);
+    Hash(aParams);
+  }
+  void Public(uint64_t aRva, const BpToken& aName)
+  {
+    Record('P', aName, aRva);
+  }
+  void Line(uint64_t aRva, uint64_t aSize, uint64_t aLine, uint64_t aFileId)
+  {
+    ++mDigest.mNumLines;
+    Record('L', BpToken(), aRva, aSize, aLine, aFileId);
+  }
+  void InlineOrigin(uint64_t aId, const BpToken& aName)
+  {
+    Record('O', aName, aId);
+  }
+  void Inline(uint64_t aDepth, uint64_t aCallLine, uint64_t aCallFileId,
+              uint64_t aOriginId, uint64_t aRva, uint64_t aSize)
+  {
+    Record('I', BpToken(), aDepth, aCallLine, aCallFileId, aOriginId);
+    Hash(&aRva, sizeof(aRva));
+    Hash(&aSize, sizeof(aSize));
+  }
+  void StackCfiInit(uint64_t aRva, uint64_t aSize, const BpToken& aRules)
+  {
+    Record('C', aRules, aRva, aSize);
+  }
+  void StackCfi(uint64_t aRva, const BpToken& aRules)
+  {
+    Record('c', aRules, aRva);
+  }
+  void StackWin(const BpStackWin& aRecord)
+  {
+    const uint64_t fields[] = {
+      aRecord.mType, aRecord.mRva, aRecord.mCodeSize, aRecord.mPrologSize,
+      aRecord.mEpilogSize, aRecord.mParamSize, aRecord.mSavedRegSize,
+      aRecord.mLocalSize, aRecord.mMaxStackSize,
+      aRecord.mProgram.IsEmpty() ? uint64_t(aRecord.mAllocatesBasePointer) :
+                                   2};
+    Record('W', aRecord.mProgram);
+    Hash(fields, sizeof(fields));
+  }
+
+private:
+  void Record(char aKind, const BpToken& aToken, uint64_t aA = 0,
+              uint64_t aB = 0, uint64_t aC = 0, uint64_t aD = 0)
+  {
+    ++mDigest.mNumRecords;
+    const uint64_t values[] = {uint64_t(aKind), aA, aB, aC, aD};
+    Hash(values, sizeof(values));
+    Hash(aToken);
+  }
+
+  void Hash(const BpToken& aToken)
+  {
+    const uint64_t length = aToken.Length();
+    Hash(&length, sizeof(length));
+    Hash(aToken.mBegin, aToken.Length());
+  }
+
+  void Hash(const void* aData, size_t aSize)
+  {
+    const unsigned char* bytes = static_cast<const unsigned char*>(aData);
+    for (size_t i = 0; i < aSize; ++i) {
+      mDigest.mHash = (mDigest.mHash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+  }
+
+  RecordDigest mDigest;
+};
+
+/**
+ * Sums every number and token length that ParseBpSymbols reports, so that
+ * timing a parse measures the parser rather than the hashing in DigestSink.
+ * Only the record counts of its digest are comparable with DigestSink's.
+ */
+class SumSink
+{
+public:
+  SumSink()
+  {
+    mDigest.mHash = 0;
+    mDigest.mNumRecords = 0;
+    mDigest.mNumLines = 0;
+  }
+
+  const RecordDigest& Digest() const { return mDigest; }
+
+  void Module(const BpToken& aName) { Record(aName); }
+  void File(uint64_t aId, const BpToken& aPath) { Record(aPath, aId); }
+  void Function(uint64_t aRva, uint64_t aSize, const BpToken& aName,
+                const BpToken& aParams)
+  {
+    Record(aName, aRva, aSize, aParams.Length());
+  }
+  void Public(uint64_t aRva, const BpToken& aName) { Record(aName, aRva); }
+  void Line(uint64_t aRva, uint64_t aSize, uint64_t aLine, uint64_t aFileId)
+  {
+    ++mDigest.mNumLines;
+    Record(BpToken(), aRva, aSize, aLine, aFileId);
+  }
+  void InlineOrigin(uint64_t aId, const BpToken& aName)
+  {
+    Record(aName, aId);
+  }
+  void Inline(uint64_t aDepth, uint64_t aCallLine, uint64_t aCallFileId,
+              uint64_t aOriginId, uint64_t aRva, uint64_t aSize)
+  {
+    Record(BpToken(), aDepth, aCallLine, aCallFileId, aOriginId);
+    mDigest.mHash += aRva + aSize;
+  }
+  void StackCfiInit(uint64_t aRva, uint64_t aSize, const BpToken& aRules)
+  {
+    Record(aRules, aRva, aSize);
+  }
+  void StackCfi(uint64_t aRva, const BpToken& aRules) { Record(aRules, aRva); }
+  void StackWin(const BpStackWin& aRecord)
+  {
+    Record(aRecord.mProgram, aRecord.mRva, aRecord.mCodeSize,
+           aRecord.mLocalSize);
+  }
+
+private:
+  void Record(const BpToken& aToken, uint64_t aA = 0, uint64_t aB = 0,
+              uint64_t aC = 0, uint64_t aD = 0)
+  {
+    ++mDigest.mNumRecords;
+    mDigest.mHash += aToken.Length() + aA + aB + aC + aD;
+  }
+
+  RecordDigest mDigest;
+};
+
+} // anonymous namespace
+
+#endif // __BPSYMFILE_SIMD_TEST_H
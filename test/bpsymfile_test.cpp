@@ -0,0 +1,338 @@
+// Checks that ParseBpSymbols, reading a mapped .sym file in place, reports
+// exactly the records that the ifstream/getline loader it replaced read from
+// the same file. The old loader is reproduced below, minus its dbgeng
+// callbacks.
+//
+// Usage: bpsymfile_test [<megabytes of .sym text>]
+
+#include "bptest.h"
+#include "bpsymfile.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+/**
+ * Order-sensitive digest of the records that a loader reports, with a count
+ * per kind of record so that a mismatch says where to look.
+ */
+class RecordDigest
+{
+public:
+  enum Kind
+  {
+    eModule,
+    eFile,
+    eFunction,
+    ePublic,
+    eLine,
+    eKindCount
+  };
+
+  RecordDigest()
+    : mHash(0xCBF29CE484222325ULL)
+  {
+    for (uint64_t& count : mCounts) {
+      count = 0;
+    }
+  }
+
+  void Add(Kind aKind, uint64_t aA, uint64_t aB, uint64_t aC, uint64_t aD,
+           const std::string& aName, const std::string& aParams)
+  {
+    ++mCounts[aKind];
+    const uint64_t values[] = {uint64_t(aKind), aA, aB, aC, aD, aName.size(),
+                               aParams.size()};
+    Hash(values, sizeof(values));
+    Hash(aName.data(), aName.size());
+    Hash(aParams.data(), aParams.size());
+  }
+
+  bool operator==(const RecordDigest& aOther) const
+  {
+    for (int i = 0; i < eKindCount; ++i) {
+      if (mCounts[i] != aOther.mCounts[i]) {
+        return false;
+      }
+    }
+    return mHash == aOther.mHash;
+  }
+
+  void Print(const char* aLabel) const
+  {
+    printf("%-10s %llu modules, %llu files, %llu functions, %llu publics, "
+           "%llu lines, digest %016llx\n", aLabel,
+           (unsigned long long)mCounts[eModule],
+           (unsigned long long)mCounts[eFile],
+           (unsigned long long)mCounts[eFunction],
+           (unsigned long long)mCounts[ePublic],
+           (unsigned long long)mCounts[eLine], (unsigned long long)mHash);
+  }
+
+private:
+  void Hash(const void* aData, size_t aSize)
+  {
+    const unsigned char* bytes = static_cast<const unsigned char*>(aData);
+    for (size_t i = 0; i < aSize; ++i) {
+      mHash = (mHash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+  }
+
+  uint64_t mCounts[eKindCount];
+  uint64_t mHash;
+};
+
+// The helpers of the old loader, as they were
+
+std::vector<std::string>
+split(const std::string& aBuf, const char aDelim, size_t aMaxTokens)
+{
+  std::vector<std::string> result;
+
+  std::string::size_type i = 0, j = 0;
+  while (result.size() < aMaxTokens - 1 &&
+         (j = aBuf.find(aDelim, i)) != std::string::npos) {
+    result.push_back(aBuf.substr(i, j - i));
+    i = j + 1;
+  }
+  result.push_back(aBuf.substr(i, aBuf.size()));
+
+  return result;
+}
+
+void
+trim(std::string& aStr)
+{
+  while (!aStr.empty() && isspace(static_cast<unsigned char>(aStr.back()))) {
+    aStr.pop_back();
+  }
+}
+
+bool
+startswith(const std::string& aStr, const char* aLiteral)
+{
+  return aStr.find(aLiteral) == 0;
+}
+
+void
+SanitizeFilePath(std::string& aStr)
+{
+  if (startswith(aStr, "hg:")) {
+    auto tokens = split(aStr, ':', 3);
+    aStr = tokens[2].substr(0, tokens[2].find_last_of(':'));
+  }
+}
+
+// The record loop of the old LoadBpSymbolFile
+bool
+LoadWithGetline(const char* aPath, RecordDigest& aDigest)
+{
+  const size_t kSymBufLen = 0x1000000; // 16MB
+  auto buffer = std::make_unique<char[]>(kSymBufLen);
+  std::ifstream i;
+  i.rdbuf()->pubsetbuf(buffer.get(), kSymBufLen);
+  i.open(aPath);
+  if (!i) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(i, line)) {
+    trim(line);
+    if (line.empty()) {
+      continue;
+    }
+    if (startswith(line, "MODULE ")) {
+      auto tokens = split(line, ' ', 5);
+      std::string moduleName = tokens[4];
+      std::string::size_type pos = moduleName.find_last_of('.');
+      // chop off any extension
+      if (pos != std::string::npos) {
+        moduleName.erase(moduleName.begin() + pos, moduleName.end());
+      }
+      aDigest.Add(RecordDigest::eModule, 0, 0, 0, 0, moduleName,
+                  std::string());
+    } else if (startswith(line, "FUNC ")) {
+      std::vector<std::string> tokens;
+      size_t startIndex;
+
+      if (startswith(line, "FUNC m ")) {
+        tokens = split(line, ' ', 6);
+        startIndex = 2;
+      } else {
+        tokens = split(line, ' ', 5);
+        startIndex = 1;
+      }
+
+      std::istringstream issAddress(tokens[startIndex]);
+      std::istringstream issSize(tokens[startIndex + 1]);
+      uint64_t address, size;
+      issAddress >> std::hex >> address;
+      issSize >> std::hex >> size;
+      // Distinguish between func(params) and operator()(params)
+      const size_t funcNameIndex = startIndex + 3;
+      auto paramPos = tokens[funcNameIndex].find('(');
+      const size_t strOperatorLen = sizeof("operator") - 1;
+      if (paramPos != std::string::npos && paramPos >= strOperatorLen) {
+        auto startPos = paramPos - strOperatorLen;
+        if (tokens[funcNameIndex].find("operator", startPos,
+                                       strOperatorLen) == startPos) {
+          paramPos = tokens[funcNameIndex].find('(', paramPos + 1);
+        }
+      }
+      std::string symName(tokens[funcNameIndex].substr(0, paramPos));
+      std::string params;
+      if (paramPos != std::string::npos) {
+        params = tokens[funcNameIndex].substr(paramPos);
+      }
+      aDigest.Add(RecordDigest::eFunction, address, size, 0, 0, symName,
+                  params);
+    } else if (startswith(line, "PUBLIC ")) {
+      std::vector<std::string> tokens;
+      size_t startIndex;
+
+      if (startswith(line, "PUBLIC m ")) {
+        tokens = split(line, ' ', 5);
+        startIndex = 2;
+      } else {
+        tokens = split(line, ' ', 4);
+        startIndex = 1;
+      }
+
+      std::istringstream issAddress(tokens[startIndex]);
+      uint64_t address;
+      issAddress >> std::hex >> address;
+      aDigest.Add(RecordDigest::ePublic, address, 0, 0, 0,
+                  tokens[startIndex + 2], std::string());
+    } else if (startswith(line, "FILE ")) {
+      auto tokens = split(line, ' ', 3);
+      std::istringstream issFileId(tokens[1]);
+      uint64_t fileId;
+      issFileId >> std::dec >> fileId;
+      SanitizeFilePath(tokens[2]);
+      aDigest.Add(RecordDigest::eFile, fileId, 0, 0, 0, tokens[2],
+                  std::string());
+    } else if (isxdigit(static_cast<unsigned char>(line[0]))) {
+      // line record
+      auto tokens = split(line, ' ', 4);
+      std::istringstream issAddress(tokens[0]);
+      std::istringstream issSize(tokens[1]);
+      std::istringstream issLine(tokens[2]);
+      std::istringstream issFileId(tokens[3]);
+      uint64_t address, size, lineNo, fileId;
+      issAddress >> std::hex >> address;
+      issSize >> std::hex >> size;
+      issLine >> std::dec >> lineNo;
+      issFileId >> std::dec >> fileId;
+      aDigest.Add(RecordDigest::eLine, address, size, lineNo, fileId,
+                  std::string(), std::string());
+    }
+  }
+  return true;
+}
+
+/**
+ * ParseBpSymbols sink that feeds the records the old loader knew about into
+ * a digest.
+ */
+class DigestSink
+{
+public:
+  explicit DigestSink(RecordDigest& aDigest)
+    : mDigest(aDigest)
+  {
+  }
+
+  void Module(const BpToken& aName)
+  {
+    mDigest.Add(RecordDigest::eModule, 0, 0, 0, 0, aName.ToString(),
+                std::string());
+  }
+  void File(uint64_t aId, const BpToken& aPath)
+  {
+    mDigest.Add(RecordDigest::eFile, aId, 0, 0, 0, aPath.ToString(),
+                std::string());
+  }
+  void Function(uint64_t aRva, uint64_t aSize, const BpToken& aName,
+                const BpToken& aParams)
+  {
+    mDigest.Add(RecordDigest::eFunction, aRva, aSize, 0, 0, aName.ToString(),
+                aParams.ToString());
+  }
+  void Public(uint64_t aRva, const BpToken& aName)
+  {
+    mDigest.Add(RecordDigest::ePublic, aRva, 0, 0, 0, aName.ToString(),
+                std::string());
+  }
+  void Line(uint64_t aRva, uint64_t aSize, uint64_t aLine, uint64_t aFileId)
+  {
+    mDigest.Add(RecordDigest::eLine, aRva, aSize, aLine, aFileId,
+                std::string(), std::string());
+  }
+  void InlineOrigin(uint64_t, const BpToken&) {}
+  void Inline(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) {}
+  void StackCfiInit(uint64_t, uint64_t, const BpToken&) {}
+  void StackCfi(uint64_t, const BpToken&) {}
+  void StackWin(const BpStackWin&) {}
+
+private:
+  RecordDigest& mDigest;
+};
+
+void
+CompareLoaders(const char* aPath, const char* aLabel)
+{
+  BpTestTimer timer;
+  RecordDigest expected;
+  BPTEST_CHECK(LoadWithGetline(aPath, expected));
+  const double getlineSeconds = timer.Seconds();
+
+  timer.Restart();
+  BpMappedFile file;
+  BPTEST_CHECK(file.Open(aPath));
+  RecordDigest actual;
+  DigestSink sink(actual);
+  ParseBpSymbols(file.Begin(), file.End(), sink);
+  const double mappedSeconds = timer.Seconds();
+
+  printf("%s: %.1f MB\n", aLabel, file.Size() / 1048576.0);
+  expected.Print("getline:");
+  actual.Print("mapped:");
+  printf("getline %.2f s, mapped %.2f s (%.1fx)\n", getlineSeconds,
+         mappedSeconds, getlineSeconds / mappedSeconds);
+  BPTEST_CHECK(actual == expected);
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  const uint64_t megabytes = BpTestArg(aArgc, aArgv, 1, 64);
+  const char* kPath = "bpsymfile_test.sym";
+
+  // A large file as dump_syms writes it, then a smaller one with Windows
+  // line endings
+  BpTestSymOptions options;
+  options.mSize = megabytes << 20;
+  std::string text;
+  BpGenerateSymFile(options, text);
+  BPTEST_CHECK(BpTestWriteFile(kPath, text));
+  CompareLoaders(kPath, "LF");
+
+  options.mSize = 0x400000;
+  options.mSeed = 2;
+  options.mCrLf = true;
+  BpGenerateSymFile(options, text);
+  BPTEST_CHECK(BpTestWriteFile(kPath, text));
+  CompareLoaders(kPath, "CRLF");
+
+  remove(kPath);
+  return BpTestResult("bpsymfile_test");
+}
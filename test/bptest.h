@@ -0,0 +1,289 @@
+#ifndef __BPTEST_H
+#define __BPTEST_H
+
+// Helpers shared by the tests and benchmarks of the platform-neutral sources:
+// failure reporting, a wall clock timer, and a generator of synthetic
+// Breakpad .sym files. Platform-neutral.
+
+#include "bpsymfile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+#define BPTEST_CHECK(aCondition)                                             \
+  do {                                                                       \
+    if (!(aCondition)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,       \
+              #aCondition);                                                  \
+      ++BpTestFailures();                                                    \
+    }                                                                        \
+  } while (0)
+
+inline int&
+BpTestFailures()
+{
+  static int sFailures;
+  return sFailures;
+}
+
+// Prints a summary line and returns the exit code of the test
+inline int
+BpTestResult(const char* aName)
+{
+  if (BpTestFailures()) {
+    printf("%s: FAILED (%d)\n", aName, BpTestFailures());
+    return 1;
+  }
+  printf("%s: passed\n", aName);
+  return 0;
+}
+
+// Reads argv[aIndex] as a number, or returns aDefault if there is none
+inline uint64_t
+BpTestArg(int aArgc, char** aArgv, int aIndex, uint64_t aDefault)
+{
+  return aIndex < aArgc ? strtoull(aArgv[aIndex], nullptr, 0) : aDefault;
+}
+
+/**
+ * Seconds elapsed since construction or the last Restart().
+ */
+class BpTestTimer
+{
+public:
+  BpTestTimer() { Restart(); }
+
+  void Restart() { mStart = std::chrono::steady_clock::now(); }
+  double Seconds() const
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         mStart).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point mStart;
+};
+
+/**
+ * xorshift64*: fast, and the same sequence on every platform.
+ */
+class BpTestRandom
+{
+public:
+  explicit BpTestRandom(uint64_t aSeed)
+    : mState(aSeed ? aSeed : 1)
+  {
+  }
+
+  uint64_t Next()
+  {
+    mState ^= mState >> 12;
+    mState ^= mState << 25;
+    mState ^= mState >> 27;
+    return mState * 0x2545F4914F6CDD1DULL;
+  }
+
+  // Uniform enough in [0, aBound)
+  uint32_t Below(uint32_t aBound)
+  {
+    return uint32_t((Next() >> 32) % aBound);
+  }
+
+private:
+  uint64_t mState;
+};
+
+struct BpTestSymOptions
+{
+  BpTestSymOptions()
+    : mSize(0x1000000)
+    , mSeed(1)
+    , mCrLf(false)
+    , mNoise(true)
+  {
+  }
+
+  // Approximate size of the text, in bytes
+  uint64_t mSize;
+  uint64_t mSeed;
+  // End every line with "\r\n", as .sym files written on Windows do
+  bool     mCrLf;
+  // Add the occasional blank line, trailing space, unknown record and
+  // record with an "m" flag
+  bool     mNoise;
+};
+
+/**
+ * Writes a synthetic .sym file of about aOptions.mSize bytes to aText, with
+ * the mix of records that dump_syms produces for a large Windows module:
+ * mostly line records, grouped under FUNC records, with some INLINE, PUBLIC
+ * and STACK records in between. The same options always produce the same
+ * text.
+ */
+inline void
+BpGenerateSymFile(const BpTestSymOptions& aOptions, std::string& aText)
+{
+  static const char* const kNamespaces[] = {
+    "mozilla", "mozilla::dom", "mozilla::layers", "js", "js::jit",
+    "nsTArray_Impl<RefPtr<nsIContent>,nsTArrayInfallibleAllocator>",
+    "`anonymous namespace'"
+  };
+  static const char* const kParams[] = {
+    "()", "(int)", "(const nsAString&, unsigned int)", "(void*) const",
+    "(JSContext*, JS::Handle<JSObject*>)", ""
+  };
+  const size_t kNumNamespaces = sizeof(kNamespaces) / sizeof(kNamespaces[0]);
+  const size_t kNumParams = sizeof(kParams) / sizeof(kParams[0]);
+  const uint32_t kNumFiles = 3000;
+  const uint32_t kNumOrigins = 2000;
+
+  BpTestRandom random(aOptions.mSeed);
+  const char* eol = aOptions.mCrLf ? "\r\n" : "\n";
+  char buf[512];
+  aText.clear();
+  aText.reserve(size_t(aOptions.mSize + 0x10000));
+  auto emit = [&](int aLength) {
+    aText.append(buf, size_t(aLength));
+    if (aOptions.mNoise && !random.Below(500)) {
+      aText += random.Below(2) ? " " : "\t ";
+    }
+    aText += eol;
+    if (aOptions.mNoise && !random.Below(2000)) {
+      aText += eol;
+    }
+  };
+
+  emit(snprintf(buf, sizeof(buf), "MODULE windows x86_64 "
+                "%016llX%016llX1 xul.pdb",
+                (unsigned long long)random.Next(),
+                (unsigned long long)random.Next()));
+  emit(snprintf(buf, sizeof(buf), "INFO CODE_ID 5F0A3B2C4E1A000 xul.dll"));
+  for (uint32_t i = 0; i < kNumFiles; ++i) {
+    if (i % 3) {
+      emit(snprintf(buf, sizeof(buf), "FILE %u hg:hg.mozilla.org/"
+                    "mozilla-central:dom/base/File%u.cpp:%012llx", i, i,
+                    (unsigned long long)random.Next() & 0xFFFFFFFFFFFFULL));
+    } else {
+      emit(snprintf(buf, sizeof(buf), "FILE %u c:\\builds\\worker\\"
+                    "workspace\\obj-build\\dist\\include\\Header%u.h", i, i));
+    }
+  }
+  for (uint32_t i = 0; i < kNumOrigins; ++i) {
+    emit(snprintf(buf, sizeof(buf), "INLINE_ORIGIN %u %s::Inlined%u", i,
+                  kNamespaces[i % kNumNamespaces], i));
+  }
+
+  uint64_t rva = 0x1000;
+  uint32_t function = 0;
+  while (aText.size() < aOptions.mSize) {
+    const uint32_t numLines = 1 + random.Below(24);
+    uint64_t lineSizes = 0;
+    uint32_t sizes[24];
+    for (uint32_t i = 0; i < numLines; ++i) {
+      sizes[i] = 1 + random.Below(40);
+      lineSizes += sizes[i];
+    }
+    const uint64_t funcSize = lineSizes + random.Below(4);
+    const char* ns = kNamespaces[random.Below(kNumNamespaces)];
+    const char* params = kParams[random.Below(kNumParams)];
+    const char* multiple =
+      aOptions.mNoise && !random.Below(50) ? "m " : "";
+    const uint32_t kind = random.Below(40);
+    if (kind == 0) {
+      emit(snprintf(buf, sizeof(buf), "FUNC %s%llx %llx %x %s::Functor%u::"
+                    "operator()%s", multiple, (unsigned long long)rva,
+                    (unsigned long long)funcSize, random.Below(5) * 4, ns,
+                    function, params));
+    } else if (kind == 1) {
+      emit(snprintf(buf, sizeof(buf), "FUNC %s%llx %llx %x %s::Cmp%u::"
+                    "operator<(const Cmp%u&) const", multiple,
+                    (unsigned long long)rva, (unsigned long long)funcSize,
+                    random.Below(5) * 4, ns, function, function));
+    } else {
+      emit(snprintf(buf, sizeof(buf), "FUNC %s%llx %llx %x %s::Class%u::"
+                    "Method%u%s", multiple, (unsigned long long)rva,
+                    (unsigned long long)funcSize, random.Below(5) * 4, ns,
+                    function / 8, function, params));
+    }
+
+    if (!random.Below(4)) {
+      const uint64_t inlineSize = lineSizes / 2 + 1;
+      emit(snprintf(buf, sizeof(buf), "INLINE 0 %u %u %u %llx %llx",
+                    1 + random.Below(5000), random.Below(kNumFiles),
+                    random.Below(kNumOrigins), (unsigned long long)rva,
+                    (unsigned long long)inlineSize));
+      if (inlineSize > 2 && random.Below(2)) {
+        emit(snprintf(buf, sizeof(buf), "INLINE 1 %u %u %u %llx %llx",
+                      1 + random.Below(5000), random.Below(kNumFiles),
+                      random.Below(kNumOrigins),
+                      (unsigned long long)rva + 1,
+                      (unsigned long long)inlineSize - 2));
+      }
+    }
+
+    const uint32_t file = random.Below(kNumFiles);
+    uint32_t line = 1 + random.Below(8000);
+    uint64_t lineRva = rva;
+    for (uint32_t i = 0; i < numLines; ++i) {
+      emit(snprintf(buf, sizeof(buf), "%llx %x %u %u",
+                    (unsigned long long)lineRva, sizes[i], line,
+                    random.Below(8) ? file : random.Below(kNumFiles)));
+      lineRva += sizes[i];
+      line = random.Below(6) ? line + random.Below(4) :
+                               1 + random.Below(8000);
+    }
+
+    if (!random.Below(6)) {
+      emit(snprintf(buf, sizeof(buf), "PUBLIC %s%llx %x ?Public%u@@YAXXZ",
+                    multiple, (unsigned long long)rva + funcSize,
+                    random.Below(3) * 4, function));
+    }
+    if (aOptions.mNoise && !random.Below(3000)) {
+      emit(snprintf(buf, sizeof(buf), "UNKNOWN_RECORD %u", function));
+    }
+    rva += funcSize + 0x10 - (funcSize & 0xF);
+    ++function;
+  }
+
+  // dump_syms writes the unwind records after all of the symbols
+  const uint64_t end = rva;
+  rva = 0x1000;
+  while (rva < end && aText.size() < aOptions.mSize + aOptions.mSize / 8) {
+    const uint32_t size = 0x10 + random.Below(0x200);
+    if (random.Below(2)) {
+      emit(snprintf(buf, sizeof(buf), "STACK CFI INIT %llx %x .cfa: $rsp 8 "
+                    "+ .ra: .cfa -8 + ^", (unsigned long long)rva, size));
+      emit(snprintf(buf, sizeof(buf), "STACK CFI %llx .cfa: $rsp 16 +",
+                    (unsigned long long)rva + 1));
+    } else if (random.Below(2)) {
+      emit(snprintf(buf, sizeof(buf), "STACK WIN 4 %llx %x %x 0 %x %x %x 0 "
+                    "1 $T0 .raSearch = $eip $T0 ^ = $esp $T0 4 + =",
+                    (unsigned long long)rva, size, random.Below(8),
+                    random.Below(4) * 4, random.Below(3) * 4,
+                    random.Below(16) * 4));
+    } else {
+      emit(snprintf(buf, sizeof(buf), "STACK WIN 0 %llx %x %x 0 %x %x %x 0 "
+                    "0 %u", (unsigned long long)rva, size, random.Below(8),
+                    random.Below(4) * 4, random.Below(3) * 4,
+                    random.Below(16) * 4, random.Below(2)));
+    }
+    rva += size + random.Below(0x100);
+  }
+}
+
+// Writes aText to aPath, returning false on failure
+inline bool
+BpTestWriteFile(const char* aPath, const std::string& aText)
+{
+  FILE* file = fopen(aPath, "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = fwrite(aText.data(), 1, aText.size(), file) == aText.size();
+  return !fclose(file) && ok;
+}
+
+#endif // __BPTEST_H
@@ -0,0 +1,459 @@
+// Unwinds recorded x86 and x64 register sets over stack memory images with
+// the STACK CFI and STACK WIN records of data/unwind32.sym and
+// data/unwind64.sym, checking the method used for every frame and the exact
+// registers it recovers: CFI with delta records, FrameData programs, FPO
+// with and without a base pointer, the x64 leaf rule and the frame pointer
+// fallback. Also checks that implausible frames, rules the evaluator must
+// refuse and a truncated program in a corrupt cache are all rejected.
+//
+// Usage: bpunwind_test [<data directory>]
+
+#include "bptest.h"
+#include "bpsymcache.h"
+#include "bpsymtable.h"
+#include "bpunwind.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef BpUnwindRegs Regs;
+
+namespace {
+
+const uint64_t kModule32 = 0x10000000;
+const uint64_t kStack32 = 0x00500000;
+const uint64_t kNtdll32 = 0x77001234;
+const uint64_t kModule64 = 0x7FF600000000;
+const uint64_t kStack64 = 0xE0FF7F0000;
+const uint64_t kNtdll64 = 0x7FFB20001234;
+
+struct RegValue
+{
+  int      mSlot;
+  uint64_t mValue;
+};
+
+Regs
+MakeRegs(std::initializer_list<RegValue> aValues)
+{
+  Regs regs;
+  for (auto&& value : aValues) {
+    regs.Set(value.mSlot, value.mValue);
+  }
+  return regs;
+}
+
+/**
+ * An image of the target's stack, little-endian like both architectures.
+ * Reads outside of it fail.
+ */
+class StackMemory : public BpMemoryReader
+{
+public:
+  StackMemory(BpArch aArch, uint64_t aBase, size_t aSize)
+    : mBase(aBase)
+    , mPointerSize(aArch == eBpArchX64 ? 8 : 4)
+    , mBytes(aSize)
+  {
+  }
+
+  void Put(uint64_t aAddress, uint64_t aValue)
+  {
+    for (size_t i = 0; i < mPointerSize; ++i, aValue >>= 8) {
+      mBytes.at(aAddress - mBase + i) = uint8_t(aValue);
+    }
+  }
+
+  bool Read(uint64_t aAddress, void* aBuffer, size_t aSize) override
+  {
+    if (aAddress < mBase || aAddress - mBase > mBytes.size() ||
+        aSize > mBytes.size() - (aAddress - mBase)) {
+      return false;
+    }
+    memcpy(aBuffer, &mBytes[aAddress - mBase], aSize);
+    return true;
+  }
+
+private:
+  uint64_t             mBase;
+  size_t               mPointerSize;
+  std::vector<uint8_t> mBytes;
+};
+
+/**
+ * A module's symbols, parsed from the text of its .sym file.
+ */
+struct Symbols
+{
+  bool Load(const std::string& aPath)
+  {
+    if (!mFile.Open(aPath.c_str())) {
+      return false;
+    }
+    mTable = BpSymbolTable::Parse(mFile.Begin(), mFile.End(), 0);
+    return mTable != nullptr;
+  }
+
+  BpMappedFile                   mFile;
+  std::unique_ptr<BpSymbolTable> mTable;
+};
+
+const char*
+MethodName(BpUnwindMethod aMethod)
+{
+  switch (aMethod) {
+    case eBpUnwindFailed:
+      return "failed";
+    case eBpUnwindCfi:
+      return "CFI";
+    case eBpUnwindWin:
+      return "STACK WIN";
+    case eBpUnwindFramePointer:
+      return "frame pointer";
+    case eBpUnwindLeaf:
+      return "leaf";
+  }
+  return "?";
+}
+
+// Unwinds aCallee and checks the method and every register of the caller:
+// those in aExpected must have exactly those values and all others must be
+// unknown. Returns the caller's registers, for walking on.
+Regs
+CheckUnwind(const char* aLabel, const BpSymbolTable* aTable,
+            uint64_t aModuleBase, BpArch aArch, const Regs& aCallee,
+            bool aIsReturnAddress, BpMemoryReader& aMemory,
+            BpUnwindMethod aMethod, std::initializer_list<RegValue> aExpected)
+{
+  Regs caller;
+  const BpUnwindMethod method =
+    BpUnwindFrame(aTable, aModuleBase, aArch, aCallee, aIsReturnAddress,
+                  aMemory, caller);
+  if (method != aMethod) {
+    fprintf(stderr, "%s: unwound by %s, expected %s\n", aLabel,
+            MethodName(method), MethodName(aMethod));
+    ++BpTestFailures();
+  }
+
+  const Regs expected = MakeRegs(aExpected);
+  for (int slot = 0; slot < Regs::eNumRegisters; ++slot) {
+    if (caller.Has(slot) != expected.Has(slot) ||
+        (caller.Has(slot) && caller.Get(slot) != expected.Get(slot))) {
+      fprintf(stderr, "%s: register %d is %s%llx, expected %s%llx\n", aLabel,
+              slot, caller.Has(slot) ? "" : "unknown ",
+              (unsigned long long)caller.Get(slot),
+              expected.Has(slot) ? "" : "unknown ",
+              (unsigned long long)expected.Get(slot));
+      ++BpTestFailures();
+    }
+  }
+  return caller;
+}
+
+// Four frames of a 32-bit thread, one per unwind method, down to the end of
+// the frame pointer chain
+void
+WalkX86(const BpSymbolTable& aTable)
+{
+  const uint64_t s = kStack32;
+  const uint64_t m = kModule32;
+  StackMemory memory(eBpArchX86, s, 0x200);
+  // CfiFunction after "push ebp; mov ebp, esp"
+  memory.Put(s + 0x10, s + 0x40);
+  memory.Put(s + 0x14, m + 0x2010);
+  // FrameDataFunction, which saved ebx just below its frame
+  memory.Put(s + 0x3C, 0xB1);
+  memory.Put(s + 0x40, s + 0x80);
+  memory.Put(s + 0x44, m + 0x3010);
+  // FpoFunction: 0xC bytes of locals and 4 of saved registers
+  memory.Put(s + 0x58, m + 0x5010);
+  // NoUnwindInfo, then a frame outside any module
+  memory.Put(s + 0x80, s + 0xA0);
+  memory.Put(s + 0x84, kNtdll32);
+
+  Regs regs = MakeRegs({ { Regs::ePc, m + 0x1010 }, { Regs::eSp, s },
+                         { Regs::eBp, s + 0x10 }, { Regs::eBx, 0xB0 },
+                         { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 },
+                         { Regs::eAx, 0xA0 } });
+  regs = CheckUnwind("x86 frame 0", &aTable, m, eBpArchX86, regs, false,
+                     memory, eBpUnwindCfi,
+                     { { Regs::ePc, m + 0x2010 }, { Regs::eSp, s + 0x18 },
+                       { Regs::eBp, s + 0x40 }, { Regs::eBx, 0xB0 },
+                       { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  regs = CheckUnwind("x86 frame 1", &aTable, m, eBpArchX86, regs, true,
+                     memory, eBpUnwindWin,
+                     { { Regs::ePc, m + 0x3010 }, { Regs::eSp, s + 0x48 },
+                       { Regs::eBp, s + 0x80 }, { Regs::eBx, 0xB1 },
+                       { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  regs = CheckUnwind("x86 frame 2", &aTable, m, eBpArchX86, regs, true,
+                     memory, eBpUnwindWin,
+                     { { Regs::ePc, m + 0x5010 }, { Regs::eSp, s + 0x5C },
+                       { Regs::eBp, s + 0x80 }, { Regs::eBx, 0xB1 },
+                       { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  regs = CheckUnwind("x86 frame 3", &aTable, m, eBpArchX86, regs, true,
+                     memory, eBpUnwindFramePointer,
+                     { { Regs::ePc, kNtdll32 }, { Regs::eSp, s + 0x88 },
+                       { Regs::eBp, s + 0xA0 } });
+  // The chain ends with a null return address
+  CheckUnwind("x86 frame 4", nullptr, 0, eBpArchX86, regs, true, memory,
+              eBpUnwindFailed, {});
+}
+
+// Single 32-bit frames that exercise the remaining paths
+void
+CheckX86(const BpSymbolTable& aTable)
+{
+  const uint64_t s = kStack32;
+  const uint64_t m = kModule32;
+  StackMemory memory(eBpArchX86, s, 0x200);
+  memory.Put(s, s + 0x90);
+  memory.Put(s + 4, m + 0x5010);
+  memory.Put(s + 8, 0x5E);
+  memory.Put(s + 0xC, m + 0x5020);
+  memory.Put(s + 0x10, m + 0x5030);
+  memory.Put(s + 0x80, s + 0xA0);
+  memory.Put(s + 0x84, kNtdll32);
+  const Regs callee = MakeRegs({ { Regs::eSp, s }, { Regs::eBp, s + 0x80 },
+                                 { Regs::eBx, 0xB0 }, { Regs::eSi, 0x51 },
+                                 { Regs::eDi, 0xD1 } });
+  auto at = [&](uint64_t aRva) -> Regs {
+    Regs regs(callee);
+    regs.Set(Regs::ePc, m + aRva);
+    return regs;
+  };
+  const std::initializer_list<RegValue> viaFramePointer = {
+    { Regs::ePc, kNtdll32 }, { Regs::eSp, s + 0x88 }, { Regs::eBp, s + 0xA0 }
+  };
+
+  // The STACK CFI INIT rules alone, then with the first delta record
+  Regs entry = at(0x1000);
+  entry.Set(Regs::eSp, s + 4);
+  CheckUnwind("x86 CFI at entry", &aTable, m, eBpArchX86, entry, false,
+              memory, eBpUnwindCfi,
+              { { Regs::ePc, m + 0x5010 }, { Regs::eSp, s + 8 },
+                { Regs::eBp, s + 0x80 }, { Regs::eBx, 0xB0 },
+                { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  CheckUnwind("x86 CFI after push", &aTable, m, eBpArchX86, at(0x1001), false,
+              memory, eBpUnwindCfi,
+              { { Regs::ePc, m + 0x5010 }, { Regs::eSp, s + 8 },
+                { Regs::eBp, s + 0x90 }, { Regs::eBx, 0xB0 },
+                { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  // A return address just past the first delta's range is looked up one
+  // byte earlier, within it, as it follows a call at the end of the range
+  CheckUnwind("x86 CFI return address", &aTable, m, eBpArchX86, at(0x1003),
+              true, memory, eBpUnwindCfi,
+              { { Regs::ePc, m + 0x5010 }, { Regs::eSp, s + 8 },
+                { Regs::eBp, s + 0x90 }, { Regs::eBx, 0xB0 },
+                { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+
+  // .raSearch is past 8 bytes of locals and 4 of saved registers
+  CheckUnwind("x86 FrameData .raSearch", &aTable, m, eBpArchX86, at(0x2110),
+              false, memory, eBpUnwindWin,
+              { { Regs::ePc, m + 0x5020 }, { Regs::eSp, s + 0x10 },
+                { Regs::eBp, s + 0x80 }, { Regs::eBx, 0xB0 },
+                { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  // FPO functions keep the caller's ebp, unless they use it themselves
+  CheckUnwind("x86 FPO", &aTable, m, eBpArchX86, at(0x3010), false, memory,
+              eBpUnwindWin,
+              { { Regs::ePc, m + 0x5030 }, { Regs::eSp, s + 0x14 },
+                { Regs::eBp, s + 0x80 }, { Regs::eBx, 0xB0 },
+                { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 } });
+  CheckUnwind("x86 FPO allocating ebp", &aTable, m, eBpArchX86, at(0x3110),
+              false, memory, eBpUnwindWin,
+              { { Regs::ePc, m + 0x5030 }, { Regs::eSp, s + 0x14 },
+                { Regs::eBx, 0xB0 }, { Regs::eSi, 0x51 },
+                { Regs::eDi, 0xD1 } });
+
+  // CFI that would move the stack pointer down is ignored in favour of the
+  // frame pointer, and so are modules without symbols
+  CheckUnwind("x86 implausible CFI", &aTable, m, eBpArchX86, at(0x4010),
+              false, memory, eBpUnwindFramePointer, viaFramePointer);
+  CheckUnwind("x86 no symbols", nullptr, m, eBpArchX86, at(0x1010), false,
+              memory, eBpUnwindFramePointer, viaFramePointer);
+  // A frame pointer below the stack pointer isn't one
+  Regs stale = at(0x5010);
+  stale.Set(Regs::eBp, s - 0x10);
+  CheckUnwind("x86 stale frame pointer", &aTable, m, eBpArchX86, stale,
+              false, memory, eBpUnwindFailed, {});
+
+  // Rules the evaluator must refuse. Without a frame pointer there is no
+  // other way out, so the unwind fails.
+  auto noFramePointer = [&](uint64_t aRva) -> Regs {
+    Regs regs(callee);
+    regs.Set(Regs::ePc, m + aRva);
+    regs.Set(Regs::eSp, s + 4);
+    regs.Set(Regs::eBp, 0);
+    return regs;
+  };
+  CheckUnwind("x86 divide by zero", &aTable, m, eBpArchX86,
+              noFramePointer(0x6000), false, memory, eBpUnwindFailed, {});
+  CheckUnwind("x86 33 operands", &aTable, m, eBpArchX86,
+              noFramePointer(0x6100), false, memory, eBpUnwindFailed, {});
+  CheckUnwind("x86 32 operands", &aTable, m, eBpArchX86,
+              noFramePointer(0x6200), false, memory, eBpUnwindCfi,
+              { { Regs::ePc, m + 0x5010 }, { Regs::eSp, s + 4 + 31 },
+                { Regs::eBp, 0 }, { Regs::eBx, 0xB0 }, { Regs::eSi, 0x51 },
+                { Regs::eDi, 0xD1 } });
+  CheckUnwind("x86 $xmm0 CFA", &aTable, m, eBpArchX86,
+              noFramePointer(0x6300), false, memory, eBpUnwindFailed, {});
+  // Only the rule that reads $xmm0 is lost; ebx keeps the callee's value
+  CheckUnwind("x86 $xmm0 register", &aTable, m, eBpArchX86,
+              noFramePointer(0x6400), false, memory, eBpUnwindCfi,
+              { { Regs::ePc, m + 0x5010 }, { Regs::eSp, s + 8 },
+                { Regs::eBp, 0 }, { Regs::eBx, 0xB0 }, { Regs::eSi, 0x5E },
+                { Regs::eDi, 0xD1 } });
+}
+
+// A cache whose program for CfiFunction claims more code than the cache
+// holds must not be evaluated past its end
+void
+CheckTruncatedProgram(const BpSymbolTable& aTable)
+{
+  const char* kCachePath = "bpunwind_test.symcache";
+  size_t index = 0;
+  BPTEST_CHECK(aTable.FindCfi(0x1000, index));
+  BPTEST_CHECK(aTable.Save(kCachePath));
+  std::string image;
+  {
+    BpMappedFile file;
+    BPTEST_CHECK(file.Open(kCachePath));
+    image.assign(file.Begin(), file.Size());
+  }
+  bpsymcache::Header header;
+  BPTEST_CHECK(image.size() >= sizeof(header));
+  if (image.size() < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, image.data(), sizeof(header));
+  const bpsymcache::SectionEntry& code =
+    header.mSections[bpsymcache::eUnwindCode];
+  // The program starts with its number of rules, then the first rule's
+  // target and length; make that length 0x3FFF
+  const uint64_t length = code.mOffset + aTable.CfiCode()[index] + 2;
+  BPTEST_CHECK(length + 2 <= code.mOffset + code.mSize);
+  image[length] = char(0xFF);
+  image[length + 1] = char(0x7F);
+  BPTEST_CHECK(BpTestWriteFile(kCachePath, image));
+
+  auto corrupt = BpSymbolTable::Map(kCachePath, 0, 0);
+  BPTEST_CHECK(corrupt != nullptr);
+  if (corrupt) {
+    const uint64_t s = kStack32;
+    StackMemory memory(eBpArchX86, s, 0x100);
+    memory.Put(s + 0x10, s + 0x40);
+    memory.Put(s + 0x14, kModule32 + 0x2010);
+    const Regs callee = MakeRegs({ { Regs::ePc, kModule32 + 0x1010 },
+                                   { Regs::eSp, s },
+                                   { Regs::eBp, s + 0x10 } });
+    CheckUnwind("x86 truncated program", corrupt.get(), kModule32,
+                eBpArchX86, callee, false, memory, eBpUnwindFramePointer,
+                { { Regs::ePc, kModule32 + 0x2010 }, { Regs::eSp, s + 0x18 },
+                  { Regs::eBp, s + 0x40 } });
+  }
+  corrupt.reset();
+  remove(kCachePath);
+}
+
+// Three frames of a 64-bit thread: a leaf function, CFI with delta records
+// and a frame pointer chain
+void
+WalkX64(const BpSymbolTable& aTable)
+{
+  const uint64_t s = kStack64;
+  const uint64_t m = kModule64;
+  StackMemory memory(eBpArchX64, s, 0x200);
+  memory.Put(s, m + 0x1020);
+  // CfiFunction pushed rbx and then allocated 0x20 bytes
+  memory.Put(s + 0x28, 0xB1);
+  memory.Put(s + 0x30, m + 0x3010);
+  memory.Put(s + 0x100, s + 0x140);
+  memory.Put(s + 0x108, kNtdll64);
+
+  Regs regs = MakeRegs({ { Regs::ePc, m + 0x2008 }, { Regs::eSp, s },
+                         { Regs::eBp, s + 0x100 }, { Regs::eBx, 0xB0 },
+                         { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 },
+                         { Regs::eR12, 0x12 }, { Regs::eR13, 0x13 },
+                         { Regs::eR14, 0x14 }, { Regs::eR15, 0x15 },
+                         { Regs::eAx, 0xA0 }, { Regs::eR8, 0x8 } });
+  regs = CheckUnwind("x64 frame 0", &aTable, m, eBpArchX64, regs, false,
+                     memory, eBpUnwindLeaf,
+                     { { Regs::ePc, m + 0x1020 }, { Regs::eSp, s + 8 },
+                       { Regs::eBp, s + 0x100 }, { Regs::eBx, 0xB0 },
+                       { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 },
+                       { Regs::eR12, 0x12 }, { Regs::eR13, 0x13 },
+                       { Regs::eR14, 0x14 }, { Regs::eR15, 0x15 } });
+  regs = CheckUnwind("x64 frame 1", &aTable, m, eBpArchX64, regs, true,
+                     memory, eBpUnwindCfi,
+                     { { Regs::ePc, m + 0x3010 }, { Regs::eSp, s + 0x38 },
+                       { Regs::eBp, s + 0x100 }, { Regs::eBx, 0xB1 },
+                       { Regs::eSi, 0x51 }, { Regs::eDi, 0xD1 },
+                       { Regs::eR12, 0x12 }, { Regs::eR13, 0x13 },
+                       { Regs::eR14, 0x14 }, { Regs::eR15, 0x15 } });
+  regs = CheckUnwind("x64 frame 2", &aTable, m, eBpArchX64, regs, true,
+                     memory, eBpUnwindFramePointer,
+                     { { Regs::ePc, kNtdll64 }, { Regs::eSp, s + 0x110 },
+                       { Regs::eBp, s + 0x140 } });
+  CheckUnwind("x64 frame 3", nullptr, 0, eBpArchX64, regs, true, memory,
+              eBpUnwindFailed, {});
+}
+
+// Single 64-bit frames that exercise the remaining paths
+void
+CheckX64(const BpSymbolTable& aTable)
+{
+  const uint64_t s = kStack64;
+  const uint64_t m = kModule64;
+  StackMemory memory(eBpArchX64, s, 0x200);
+  memory.Put(s, m + 0x3010);
+  memory.Put(s + 0x80, s + 0xC0);
+  memory.Put(s + 0x88, kNtdll64);
+  const Regs callee = MakeRegs({ { Regs::eSp, s }, { Regs::eBp, s + 0x80 },
+                                 { Regs::eBx, 0xB0 } });
+  auto at = [&](uint64_t aRva) -> Regs {
+    Regs regs(callee);
+    regs.Set(Regs::ePc, m + aRva);
+    return regs;
+  };
+  const std::initializer_list<RegValue> viaFramePointer = {
+    { Regs::ePc, kNtdll64 }, { Regs::eSp, s + 0x90 }, { Regs::eBp, s + 0xC0 }
+  };
+
+  CheckUnwind("x64 CFI at entry", &aTable, m, eBpArchX64, at(0x1000), false,
+              memory, eBpUnwindCfi,
+              { { Regs::ePc, m + 0x3010 }, { Regs::eSp, s + 8 },
+                { Regs::eBp, s + 0x80 }, { Regs::eBx, 0xB0 } });
+  // Only the innermost frame can be a leaf; a return address without CFI
+  // falls back to the frame pointer
+  CheckUnwind("x64 not a leaf", &aTable, m, eBpArchX64, at(0x2008), true,
+              memory, eBpUnwindFramePointer, viaFramePointer);
+  // Nor is it a leaf if the top of the stack isn't a return address
+  memory.Put(s, 0);
+  CheckUnwind("x64 implausible leaf", &aTable, m, eBpArchX64, at(0x2008),
+              false, memory, eBpUnwindFramePointer, viaFramePointer);
+}
+
+} // anonymous namespace
+
+int
+main(int aArgc, char** aArgv)
+{
+  const std::string dataDir = aArgc > 1 ? aArgv[1] : "../data";
+  Symbols x86, x64;
+  BPTEST_CHECK(x86.Load(dataDir + "/unwind32.sym"));
+  BPTEST_CHECK(x64.Load(dataDir + "/unwind64.sym"));
+  if (x86.mTable) {
+    WalkX86(*x86.mTable);
+    CheckX86(*x86.mTable);
+    CheckTruncatedProgram(*x86.mTable);
+  }
+  if (x64.mTable) {
+    WalkX64(*x64.mTable);
+    CheckX64(*x64.mTable);
+  }
+  return BpTestResult("bpunwind_test");
+}